@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <string.h>
+#include <math.h>
+#include "golioth_cbor.h"
+
+// Major types
+#define CBOR_UINT 0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+
+// Additional info values
+#define CBOR_INFO_UINT8 24
+#define CBOR_INFO_UINT16 25
+#define CBOR_INFO_UINT32 26
+#define CBOR_INFO_UINT64 27
+
+// Simple values (major type 7)
+#define CBOR_FALSE 20
+#define CBOR_TRUE 21
+#define CBOR_NULL 22
+#define CBOR_UNDEFINED 23
+#define CBOR_HALF CBOR_INFO_UINT16
+#define CBOR_FLOAT CBOR_INFO_UINT32
+#define CBOR_DOUBLE CBOR_INFO_UINT64
+
+static void put_bytes(golioth_cbor_encoder_t* enc, const uint8_t* data, size_t len) {
+    if (enc->overflow || len > enc->size - enc->len) {
+        enc->overflow = true;
+        return;
+    }
+    memcpy(&enc->buf[enc->len], data, len);
+    enc->len += len;
+}
+
+// Encode the initial byte of an item, and its argument, big-endian in the fewest bytes
+static void put_head(golioth_cbor_encoder_t* enc, uint8_t major, uint64_t arg) {
+    uint8_t head[9];
+    size_t nbytes = 0;
+    uint8_t info = 0;
+    if (arg < CBOR_INFO_UINT8) {
+        info = arg;
+    } else if (arg <= UINT8_MAX) {
+        info = CBOR_INFO_UINT8;
+        nbytes = 1;
+    } else if (arg <= UINT16_MAX) {
+        info = CBOR_INFO_UINT16;
+        nbytes = 2;
+    } else if (arg <= UINT32_MAX) {
+        info = CBOR_INFO_UINT32;
+        nbytes = 4;
+    } else {
+        info = CBOR_INFO_UINT64;
+        nbytes = 8;
+    }
+    head[0] = (major << 5) | info;
+    for (size_t i = 0; i < nbytes; i++) {
+        head[nbytes - i] = (arg >> (8 * i)) & 0xff;
+    }
+    put_bytes(enc, head, nbytes + 1);
+}
+
+void golioth_cbor_encoder_init(golioth_cbor_encoder_t* enc, uint8_t* buf, size_t size) {
+    enc->buf = buf;
+    enc->size = size;
+    enc->len = 0;
+    enc->overflow = false;
+}
+
+golioth_status_t golioth_cbor_encoder_finish(golioth_cbor_encoder_t* enc, size_t* len) {
+    if (enc->overflow) {
+        return GOLIOTH_ERR_SERIALIZE;
+    }
+    *len = enc->len;
+    return GOLIOTH_OK;
+}
+
+void golioth_cbor_encode_int(golioth_cbor_encoder_t* enc, int64_t value) {
+    if (value >= 0) {
+        put_head(enc, CBOR_UINT, value);
+    } else {
+        // -1 - value, without overflowing for INT64_MIN
+        put_head(enc, CBOR_NEGINT, ~(uint64_t)value);
+    }
+}
+
+void golioth_cbor_encode_bool(golioth_cbor_encoder_t* enc, bool value) {
+    put_head(enc, CBOR_SIMPLE, value ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void golioth_cbor_encode_float(golioth_cbor_encoder_t* enc, float value) {
+    uint32_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t item[5] = {
+            (CBOR_SIMPLE << 5) | CBOR_FLOAT,
+            bits >> 24,
+            bits >> 16,
+            bits >> 8,
+            bits,
+    };
+    put_bytes(enc, item, sizeof(item));
+}
+
+void golioth_cbor_encode_null(golioth_cbor_encoder_t* enc) {
+    put_head(enc, CBOR_SIMPLE, CBOR_NULL);
+}
+
+void golioth_cbor_encode_text(golioth_cbor_encoder_t* enc, const char* str, size_t len) {
+    put_head(enc, CBOR_TEXT, len);
+    put_bytes(enc, (const uint8_t*)str, len);
+}
+
+void golioth_cbor_encode_bytes(golioth_cbor_encoder_t* enc, const uint8_t* data, size_t len) {
+    put_head(enc, CBOR_BYTES, len);
+    put_bytes(enc, data, len);
+}
+
+void golioth_cbor_encode_map(golioth_cbor_encoder_t* enc, size_t num_pairs) {
+    put_head(enc, CBOR_MAP, num_pairs);
+}
+
+void golioth_cbor_encode_array(golioth_cbor_encoder_t* enc, size_t num_items) {
+    put_head(enc, CBOR_ARRAY, num_items);
+}
+
+void golioth_cbor_decoder_init(golioth_cbor_decoder_t* dec, const uint8_t* buf, size_t size) {
+    dec->buf = buf;
+    dec->size = size;
+    dec->pos = 0;
+}
+
+// Decode the initial byte of the next item and its argument.
+// For major type 7, info tells simple values and floats apart, and arg holds float bits.
+static golioth_status_t get_head(
+        golioth_cbor_decoder_t* dec,
+        uint8_t* major,
+        uint8_t* info,
+        uint64_t* arg) {
+    if (dec->pos >= dec->size) {
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    uint8_t initial = dec->buf[dec->pos];
+    *major = initial >> 5;
+    *info = initial & 0x1f;
+
+    size_t nbytes = 0;
+    if (*info < CBOR_INFO_UINT8) {
+        *arg = *info;
+    } else if (*info <= CBOR_INFO_UINT64) {
+        nbytes = 1 << (*info - CBOR_INFO_UINT8);
+    } else {
+        // Reserved, or indefinite length
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    if (nbytes > dec->size - dec->pos - 1) {
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    if (nbytes > 0) {
+        *arg = 0;
+        for (size_t i = 0; i < nbytes; i++) {
+            *arg = (*arg << 8) | dec->buf[dec->pos + 1 + i];
+        }
+    }
+    dec->pos += 1 + nbytes;
+    return GOLIOTH_OK;
+}
+
+bool golioth_cbor_decode_null(golioth_cbor_decoder_t* dec) {
+    if (dec->pos >= dec->size) {
+        return false;
+    }
+    uint8_t initial = dec->buf[dec->pos];
+    if (initial == ((CBOR_SIMPLE << 5) | CBOR_NULL)
+        || initial == ((CBOR_SIMPLE << 5) | CBOR_UNDEFINED)) {
+        dec->pos++;
+        return true;
+    }
+    return false;
+}
+
+golioth_status_t golioth_cbor_decode_int(golioth_cbor_decoder_t* dec, int64_t* value) {
+    size_t start = dec->pos;
+    uint8_t major = 0;
+    uint8_t info = 0;
+    uint64_t arg = 0;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(get_head(dec, &major, &info, &arg));
+    if ((major != CBOR_UINT && major != CBOR_NEGINT) || arg > INT64_MAX) {
+        dec->pos = start;
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    *value = (major == CBOR_UINT ? (int64_t)arg : -1 - (int64_t)arg);
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_cbor_decode_bool(golioth_cbor_decoder_t* dec, bool* value) {
+    size_t start = dec->pos;
+    uint8_t major = 0;
+    uint8_t info = 0;
+    uint64_t arg = 0;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(get_head(dec, &major, &info, &arg));
+    if (major != CBOR_SIMPLE || (info != CBOR_TRUE && info != CBOR_FALSE)) {
+        dec->pos = start;
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    *value = (info == CBOR_TRUE);
+    return GOLIOTH_OK;
+}
+
+static float half_to_float(uint16_t half) {
+    int exponent = (half >> 10) & 0x1f;
+    int mantissa = half & 0x3ff;
+    float value = 0;
+    if (exponent == 0) {
+        value = ldexpf(mantissa, -24);
+    } else if (exponent != 31) {
+        value = ldexpf(mantissa + 1024, exponent - 25);
+    } else {
+        value = (mantissa == 0 ? INFINITY : NAN);
+    }
+    return (half & 0x8000 ? -value : value);
+}
+
+golioth_status_t golioth_cbor_decode_float(golioth_cbor_decoder_t* dec, float* value) {
+    size_t start = dec->pos;
+    uint8_t major = 0;
+    uint8_t info = 0;
+    uint64_t arg = 0;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(get_head(dec, &major, &info, &arg));
+
+    if (major == CBOR_UINT) {
+        *value = (float)arg;
+    } else if (major == CBOR_NEGINT) {
+        *value = -1.0f - (float)arg;
+    } else if (major == CBOR_SIMPLE && info == CBOR_HALF) {
+        *value = half_to_float(arg);
+    } else if (major == CBOR_SIMPLE && info == CBOR_FLOAT) {
+        uint32_t bits = arg;
+        memcpy(value, &bits, sizeof(bits));
+    } else if (major == CBOR_SIMPLE && info == CBOR_DOUBLE) {
+        double d = 0;
+        memcpy(&d, &arg, sizeof(d));
+        *value = (float)d;
+    } else {
+        dec->pos = start;
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_cbor_decode_text(
+        golioth_cbor_decoder_t* dec,
+        const char** str,
+        size_t* len) {
+    size_t start = dec->pos;
+    uint8_t major = 0;
+    uint8_t info = 0;
+    uint64_t arg = 0;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(get_head(dec, &major, &info, &arg));
+    if (major != CBOR_TEXT || arg > dec->size - dec->pos) {
+        dec->pos = start;
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    *str = (const char*)&dec->buf[dec->pos];
+    *len = arg;
+    dec->pos += arg;
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t decode_container(
+        golioth_cbor_decoder_t* dec,
+        uint8_t expected_major,
+        size_t* count) {
+    size_t start = dec->pos;
+    uint8_t major = 0;
+    uint8_t info = 0;
+    uint64_t arg = 0;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(get_head(dec, &major, &info, &arg));
+    // Each item takes at least one byte, so a larger count can't be valid
+    if (major != expected_major || arg > dec->size - dec->pos) {
+        dec->pos = start;
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    *count = arg;
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_cbor_decode_map(golioth_cbor_decoder_t* dec, size_t* num_pairs) {
+    return decode_container(dec, CBOR_MAP, num_pairs);
+}
+
+golioth_status_t golioth_cbor_decode_array(golioth_cbor_decoder_t* dec, size_t* num_items) {
+    return decode_container(dec, CBOR_ARRAY, num_items);
+}
+
+golioth_status_t golioth_cbor_skip(golioth_cbor_decoder_t* dec) {
+    // Count items left to skip instead of recursing, so nesting can't overflow the stack
+    uint64_t remaining = 1;
+    while (remaining > 0) {
+        uint8_t major = 0;
+        uint8_t info = 0;
+        uint64_t arg = 0;
+        GOLIOTH_STATUS_RETURN_IF_ERROR(get_head(dec, &major, &info, &arg));
+        remaining--;
+
+        switch (major) {
+            case CBOR_BYTES:
+            case CBOR_TEXT:
+                if (arg > dec->size - dec->pos) {
+                    return GOLIOTH_ERR_INVALID_FORMAT;
+                }
+                dec->pos += arg;
+                break;
+            case CBOR_ARRAY:
+            case CBOR_MAP: {
+                uint64_t num_items = (major == CBOR_MAP ? 2 * arg : arg);
+                if (arg > dec->size - dec->pos || num_items > dec->size - dec->pos) {
+                    return GOLIOTH_ERR_INVALID_FORMAT;
+                }
+                remaining += num_items;
+            } break;
+            case CBOR_TAG:
+                // Followed by the tagged item
+                remaining++;
+                break;
+            default:
+                // Integers, simple values and floats are all in the head
+                break;
+        }
+    }
+    return GOLIOTH_OK;
+}
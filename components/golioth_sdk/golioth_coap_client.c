@@ -5,43 +5,218 @@
  */
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <netdb.h>      // struct addrinfo
 #include <sys/param.h>  // MIN
-#include <freertos/event_groups.h>
 #include <esp_log.h>
+#include <esp_vfs_eventfd.h>
+#include <nvs.h>
 #include <coap3/coap.h>
 #include "golioth_client.h"
 #include "golioth_coap_client.h"
+#include "golioth_coap_token_index.h"
 #include "golioth_statistics.h"
 #include "golioth_util.h"
 #include "golioth_time.h"
 #include "golioth_lightdb.h"
+#include "golioth_ota.h"
 
 #define TAG "golioth_coap_client"
 
+// Without a wake fd: while waiting for responses, how often to check the queue
+// for new requests
+#define COAP_IO_PROCESS_SLICE_MS 100
+
+// Payloads larger than this are uploaded in blocks
+#define GOLIOTH_COAP_BLOCK1_SIZE (16 << CONFIG_GOLIOTH_COAP_BLOCK1_SZX)
+
 static bool _initialized;
 
+// A request that has been sent to the server, but has not been responded to yet
+typedef struct {
+    bool in_use;
+    /// Time (since boot) in milliseconds when we stop waiting for the response
+    uint64_t timeout_ms;
+    /// Time (since boot) in milliseconds when the request was sent
+    uint64_t sent_ms;
+    /// The request, owned by this slot until it completes
+    golioth_coap_request_msg_t* req;
+} golioth_coap_pending_req_t;
+
+// A Block2 transfer in progress.
+//
+// All blocks of a transfer are requested with the same token, so the server can
+// relate them to each other. Blocks may be requested concurrently, so responses
+// are matched to requests by token and block number.
+typedef struct {
+    bool in_use;
+    const char* path_prefix;
+    char path[CONFIG_GOLIOTH_COAP_MAX_PATH_LEN + 1];
+    uint8_t token[8];
+    size_t token_len;
+    /// Time (since boot) in milliseconds when a block of this transfer was last requested
+    uint64_t last_used_ms;
+} golioth_coap_block_transfer_t;
+
+// Maximum number of server addresses kept from a DNS lookup
+#define GOLIOTH_COAP_DNS_MAX_ADDRS 4
+
+// After a failed background DNS lookup, try again after this long
+#define GOLIOTH_COAP_DNS_RETRY_MS 60000
+
+#define GOLIOTH_COAP_DNS_REFRESH_STACK_SIZE 3072
+
+// The last server address that worked is saved here, to connect without waiting for DNS
+#define GOLIOTH_COAP_NVS_NAMESPACE "golioth_coap"
+#define GOLIOTH_COAP_NVS_KEY_LAST_ADDR "last_addr"
+
+// Server addresses from DNS.
+//
+// Sessions connect to a cached address, even an expired one, so reconnecting never
+// waits for DNS. Expired addresses are looked up again in the background.
+typedef struct {
+    // Protects the address fields below, which the background lookup shares
+    portMUX_TYPE lock;
+    // Host name and port the addresses are for
+    char hostname[64];
+    uint16_t port;
+    coap_address_t addrs[GOLIOTH_COAP_DNS_MAX_ADDRS];
+    size_t num_addrs;
+    // Index of the address to connect to next. Moves on to the next address
+    // when a session fails to connect.
+    size_t current;
+    // Time (since boot) in milliseconds when the addresses should be looked up again
+    uint64_t expires_ms;
+    // Held by the background lookup while it runs, so only one runs at a time, and
+    // the client isn't destroyed under it
+    SemaphoreHandle_t refresh_sem;
+} golioth_coap_dns_cache_t;
+
+// The last server address that worked, as saved in NVS
+typedef struct {
+    char hostname[64];
+    coap_address_t addr;
+} golioth_coap_saved_addr_t;
+
+// Total number of request objects, across all lanes
+#define GOLIOTH_COAP_NUM_REQUESTS                                                          \
+    (CONFIG_GOLIOTH_COAP_CONTROL_QUEUE_MAX_ITEMS + CONFIG_GOLIOTH_COAP_REQUEST_QUEUE_MAX_ITEMS \
+     + CONFIG_GOLIOTH_COAP_TELEMETRY_QUEUE_MAX_ITEMS + CONFIG_GOLIOTH_COAP_LOG_QUEUE_MAX_ITEMS)
+
+// Capacity of each lane, in golioth_request_lane_t order
+static const uint8_t _lane_capacity[GOLIOTH_REQUEST_LANE_NUM] = {
+        CONFIG_GOLIOTH_COAP_CONTROL_QUEUE_MAX_ITEMS,
+        CONFIG_GOLIOTH_COAP_REQUEST_QUEUE_MAX_ITEMS,
+        CONFIG_GOLIOTH_COAP_TELEMETRY_QUEUE_MAX_ITEMS,
+        CONFIG_GOLIOTH_COAP_LOG_QUEUE_MAX_ITEMS,
+};
+
+// Requests to these paths go in their own lane, all others go in the state lane.
+// Firmware downloads (GET_BLOCK) always go in the state lane.
+static const struct {
+    const char* path_prefix;
+    const char* path;  // NULL to match any path
+    golioth_request_lane_t lane;
+} _lane_paths[] = {
+        {".rpc/", NULL, GOLIOTH_REQUEST_LANE_CONTROL},
+        {".c/", NULL, GOLIOTH_REQUEST_LANE_CONTROL},
+        {".u/", NULL, GOLIOTH_REQUEST_LANE_CONTROL},
+        {".u/c/", NULL, GOLIOTH_REQUEST_LANE_CONTROL},
+        {".s/", NULL, GOLIOTH_REQUEST_LANE_TELEMETRY},
+        {"", ".s", GOLIOTH_REQUEST_LANE_TELEMETRY},
+        {"", "logs", GOLIOTH_REQUEST_LANE_LOG},
+};
+
+// A priority lane of the request queue
+typedef struct {
+    // Indices of requests waiting in this lane
+    QueueHandle_t queue;
+    // Indices of this lane's unused request objects
+    QueueHandle_t free_queue;
+    // Number of times in a row the lane had requests waiting, but wasn't served
+    uint32_t num_skipped;
+    // Statistics, see golioth_request_lane_stats_t
+    uint32_t max_depth;
+    uint32_t num_sent;
+    uint32_t num_dropped;
+    uint32_t num_superseded;
+    uint32_t num_rate_limited;
+    // If true, asynchronous POSTs are sent as NON messages
+    bool non_confirmable;
+} golioth_coap_request_lane_t;
+
 // This is the struct hidden by the opaque type golioth_client_t
 // TODO - document these
 typedef struct {
-    QueueHandle_t request_queue;
+    // Request objects, for requests waiting in a lane and requests in flight.
+    // Each lane owns a contiguous range of objects, so a burst of requests in one
+    // lane can't use up the capacity of another. Only indices into this array go
+    // through the lane queues, so queueing a request doesn't copy it.
+    golioth_coap_request_msg_t requests[GOLIOTH_COAP_NUM_REQUESTS];
+    golioth_coap_request_lane_t lanes[GOLIOTH_REQUEST_LANE_NUM];
+    // Protects lane statistics updated by user tasks, is_queued of request objects,
+    // connection statistics, lightdb_encoding and ota_max_block_size
+    portMUX_TYPE lanes_lock;
+    // Payload encoding of the typed LightDB functions
+    golioth_lightdb_encoding_t lightdb_encoding;
+    // Block size OTA downloads start at, see golioth_ota_set_max_block_size
+    size_t ota_max_block_size;
+    // If true, queued LightDB state writes are replaced by newer writes to the same path
+    bool coalesce_state_writes;
+    // Token bucket of NON messages, in thousandths of a message, as of non_credit_ms
+    uint64_t non_credit;
+    uint64_t non_credit_ms;
+    // Counts requests waiting in all lanes, so the CoAP task can wait on all of them
+    SemaphoreHandle_t request_count_sem;
+    // eventfd written when a request is queued (or the client is stopped), so the CoAP
+    // task can wait on the socket and new requests at the same time. -1 if unavailable,
+    // in which case the CoAP task polls.
+    int wake_fd;
+    // Completion objects for synchronous requests, reused from one request to the next.
+    // Indices of unused objects are kept in free_sync_completion_queue.
+    golioth_coap_sync_completion_t sync_completions[CONFIG_GOLIOTH_COAP_MAX_SYNC_REQUESTS];
+    QueueHandle_t free_sync_completion_queue;
     TaskHandle_t coap_task_handle;
     SemaphoreHandle_t run_sem;
     TimerHandle_t keepalive_timer;
     bool is_running;
     bool end_session;
     bool session_connected;
+    // Time (since boot) in milliseconds when the current session, and its handshake, started
+    uint64_t session_start_ms;
+    // Server address of the current session
+    coap_address_t session_addr;
+    golioth_coap_dns_cache_t dns_cache;
+    golioth_client_connection_stats_t conn_stats;
     golioth_client_config_t config;
     const char* psk;
     size_t psk_len;
-    golioth_coap_request_msg_t* pending_req;
-    golioth_coap_observe_info_t observations[CONFIG_GOLIOTH_MAX_NUM_OBSERVATIONS];
-    // token to use for block GETs (must use same token for all blocks)
-    uint8_t block_token[8];
-    size_t block_token_len;
+    // Requests in flight, matched to responses by token
+    golioth_coap_pending_req_t pending_reqs[CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS];
+    size_t num_pending_reqs;
+    // golioth_coap_pending_req_t* of pending_reqs, by token
+    golioth_coap_token_index_t pending_index;
+    // golioth_coap_observe_info_t*, allocated as observations are added, by token
+    golioth_coap_token_index_t observations;
+    // Observations of the current session waiting to be registered again, and
+    // registrations waiting for a response. The latter count against the window of
+    // requests in flight.
+    size_t num_observations_to_register;
+    size_t num_observations_registering;
+    // True from the start of a session with observations, until all are registered
+    bool restoring_observations;
+    // tokens to use for block GETs (must use same token for all blocks of a transfer)
+    golioth_coap_block_transfer_t block_transfers[CONFIG_GOLIOTH_COAP_MAX_BLOCK_TRANSFERS];
     golioth_client_event_cb_fn event_callback;
     void* event_callback_arg;
+    // Stream and log requests made while not connected go here, if set
+    golioth_offline_store_t offline_store;
+    // Payload buffers (CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS of them, back to back),
+    // and a queue of pointers to the ones that are free
+    uint8_t* payload_pool;
+    QueueHandle_t payload_pool_free;
 } golioth_coap_client_t;
 
 static bool token_matches_request(
@@ -52,25 +227,142 @@ static bool token_matches_request(
     return (len_matches && (0 == memcmp(rcvd_token.s, req->token, req->token_len)));
 }
 
-static void notify_observers(
+// Byte offset of the block in a Block2 option
+static size_t block2_offset(const coap_opt_t* block_opt) {
+    return (size_t)coap_opt_block_num(block_opt) << (COAP_OPT_BLOCK_SZX(block_opt) + 4);
+}
+
+static bool response_matches_request(
+        const golioth_coap_request_msg_t* req,
+        const coap_pdu_t* received) {
+    if (!token_matches_request(req, received)) {
+        return false;
+    }
+    if (req->type == GOLIOTH_COAP_REQUEST_UNOBSERVE) {
+        // The deregistration uses the token of the observation, so a notification
+        // sent before the server got it has the same token. Only the response to the
+        // deregistration itself comes without an Observe option.
+        coap_opt_iterator_t opt_iter;
+        return !coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter);
+    }
+    if (req->type != GOLIOTH_COAP_REQUEST_GET_BLOCK) {
+        return true;
+    }
+
+    // Blocks of the same transfer share a token, so use the block offset to
+    // tell them apart. The server may answer with a smaller block size than
+    // requested, so compare offsets rather than block numbers. Error responses
+    // may not have a Block2 option, in which case the token is all we have to go on.
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t* block_opt = coap_check_option(received, COAP_OPTION_BLOCK2, &opt_iter);
+    if (!block_opt) {
+        return true;
+    }
+    size_t req_offset = req->get_block.block_index * req->get_block.block_size;
+    return (block2_offset(block_opt) == req_offset);
+}
+
+// Notifications may be reordered in the network. RFC 7641 section 3.4: a notification
+// is fresher than the last one if its Observe option is greater (modulo 2^24), or if
+// enough time has passed that the option may have wrapped around.
+#define OBSERVE_SEQ_HALF_RANGE (1UL << 23)
+#define OBSERVE_SEQ_MAX_AGE_MS 128000
+
+static bool observe_seq_is_fresh(
+        const golioth_coap_observe_info_t* obs_info,
+        uint32_t seq,
+        uint64_t now_ms) {
+    if (!obs_info->has_seq) {
+        return true;
+    }
+    uint32_t v1 = obs_info->last_seq;
+    return (v1 < seq && seq - v1 < OBSERVE_SEQ_HALF_RANGE)
+            || (v1 > seq && v1 - seq > OBSERVE_SEQ_HALF_RANGE)
+            || (now_ms > obs_info->last_seq_ms + OBSERVE_SEQ_MAX_AGE_MS);
+}
+
+// Once all observations of a new session are registered, report how long it took
+static void finish_observation_restore(golioth_coap_client_t* client) {
+    if (!client->restoring_observations || client->num_observations_to_register > 0
+        || client->num_observations_registering > 0) {
+        return;
+    }
+    client->restoring_observations = false;
+
+    uint32_t restore_ms = golioth_time_millis() - client->session_start_ms;
+    ESP_LOGI(
+            TAG,
+            "Re-established %u observations in %u ms",
+            client->observations.count,
+            restore_ms);
+    portENTER_CRITICAL(&client->lanes_lock);
+    client->conn_stats.last_observe_restore_ms = restore_ms;
+    client->conn_stats.num_observations_restored = client->observations.count;
+    portEXIT_CRITICAL(&client->lanes_lock);
+}
+
+// Returns the number of observations with the token of received,
+// including those for which the notification was stale
+static size_t notify_observers(
         const coap_pdu_t* received,
         golioth_coap_client_t* client,
         const uint8_t* data,
         size_t data_len,
         const golioth_response_t* response) {
-    // scan observations, check for token match
-    for (int i = 0; i < CONFIG_GOLIOTH_MAX_NUM_OBSERVATIONS; i++) {
-        const golioth_coap_observe_info_t* obs_info = &client->observations[i];
-        golioth_get_cb_fn callback = obs_info->req.observe.callback;
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t* observe_opt = coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter);
+    uint32_t seq = 0;
+    if (observe_opt) {
+        seq = coap_decode_var_bytes(coap_opt_value(observe_opt), coap_opt_length(observe_opt));
+    }
+    coap_opt_t* etag_opt = coap_check_option(received, COAP_OPTION_ETAG, &opt_iter);
+    coap_pdu_code_t rcvd_code = coap_pdu_get_code(received);
+    uint64_t now_ms = golioth_time_millis();
+
+    coap_bin_const_t rcvd_token = coap_pdu_get_token(received);
+    size_t cursor = 0;
+    size_t num_observations = 0;
+    golioth_coap_observe_info_t* obs_info = NULL;
+    while ((obs_info = golioth_coap_token_index_find_next(
+                    &client->observations, rcvd_token.s, rcvd_token.length, &cursor))) {
+        num_observations++;
+        if (obs_info->state == GOLIOTH_COAP_OBSERVE_REGISTERING) {
+            // Any response, even an error, completes the registration
+            obs_info->state = GOLIOTH_COAP_OBSERVE_ACTIVE;
+            client->num_observations_registering--;
+            finish_observation_restore(client);
+        }
+        if (observe_opt) {
+            if (!observe_seq_is_fresh(obs_info, seq, now_ms)) {
+                ESP_LOGD(
+                        TAG,
+                        "Dropping stale notification %u (last %u), path %s",
+                        seq,
+                        obs_info->last_seq,
+                        obs_info->req.path);
+                continue;
+            }
+            obs_info->has_seq = true;
+            obs_info->last_seq = seq;
+            obs_info->last_seq_ms = now_ms;
+        }
 
-        if (!obs_info->in_use || !callback) {
+        if (rcvd_code == COAP_RESPONSE_CODE(203)) {
+            // 2.03 Valid: the resource still matches the ETag sent with the registration,
+            // so the callback already has the current representation.
+            ESP_LOGD(TAG, "Observed path %s unchanged", obs_info->req.path);
             continue;
         }
+        if (rcvd_code == COAP_RESPONSE_CODE(205)) {
+            obs_info->etag_len = 0;
+            if (etag_opt && coap_opt_length(etag_opt) <= sizeof(obs_info->etag)) {
+                obs_info->etag_len = coap_opt_length(etag_opt);
+                memcpy(obs_info->etag, coap_opt_value(etag_opt), obs_info->etag_len);
+            }
+        }
 
-        coap_bin_const_t rcvd_token = coap_pdu_get_token(received);
-        bool len_matches = (rcvd_token.length == obs_info->req.token_len);
-        if (len_matches
-            && (0 == memcmp(rcvd_token.s, obs_info->req.token, obs_info->req.token_len))) {
+        golioth_get_cb_fn callback = obs_info->req.observe.callback;
+        if (callback) {
             callback(
                     client,
                     response,
@@ -80,8 +372,650 @@ static void notify_observers(
                     obs_info->req.observe.arg);
         }
     }
+    return num_observations;
+}
+
+static golioth_request_lane_t request_lane(const golioth_coap_request_msg_t* req) {
+    if (req->type == GOLIOTH_COAP_REQUEST_EMPTY) {
+        // Keepalive
+        return GOLIOTH_REQUEST_LANE_CONTROL;
+    }
+    if (req->type == GOLIOTH_COAP_REQUEST_GET_BLOCK) {
+        return GOLIOTH_REQUEST_LANE_STATE;
+    }
+    const char* path_prefix = (req->path_prefix ? req->path_prefix : "");
+    for (size_t i = 0; i < sizeof(_lane_paths) / sizeof(_lane_paths[0]); i++) {
+        bool prefix_matches = (0 == strcmp(path_prefix, _lane_paths[i].path_prefix));
+        bool path_matches = (!_lane_paths[i].path || 0 == strcmp(req->path, _lane_paths[i].path));
+        if (prefix_matches && path_matches) {
+            return _lane_paths[i].lane;
+        }
+    }
+    return GOLIOTH_REQUEST_LANE_STATE;
+}
+
+// Wake the CoAP task if it's waiting for I/O
+static void wake_coap_task(golioth_coap_client_t* client) {
+    if (client->wake_fd >= 0) {
+        uint64_t one = 1;
+        write(client->wake_fd, &one, sizeof(one));
+    }
+}
+
+// Copy a request into a free request object of its lane, and queue the object's index
+// for the CoAP task.
+//
+// Returns false if all of the lane's request objects are in use.
+static bool enqueue_request(golioth_coap_client_t* client, const golioth_coap_request_msg_t* req) {
+    golioth_request_lane_t lane_id = request_lane(req);
+    golioth_coap_request_lane_t* lane = &client->lanes[lane_id];
+    uint8_t index = 0;
+    if (!xQueueReceive(lane->free_queue, &index, 0)) {
+        portENTER_CRITICAL(&client->lanes_lock);
+        lane->num_dropped++;
+        portEXIT_CRITICAL(&client->lanes_lock);
+        return false;
+    }
+    client->requests[index] = *req;
+    client->requests[index].lane = lane_id;
+    client->requests[index].was_rate_limited = false;
+    portENTER_CRITICAL(&client->lanes_lock);
+    client->requests[index].is_queued = true;
+    portEXIT_CRITICAL(&client->lanes_lock);
+    // Can't fail, the queue has room for every request object of the lane
+    xQueueSend(lane->queue, &index, 0);
+    xSemaphoreGive(client->request_count_sem);
+    wake_coap_task(client);
+
+    uint32_t depth = uxQueueMessagesWaiting(lane->queue);
+    portENTER_CRITICAL(&client->lanes_lock);
+    lane->max_depth = max(lane->max_depth, depth);
+    portEXIT_CRITICAL(&client->lanes_lock);
+    return true;
+}
+
+// Whether req is sent as a NON message, without waiting for a response
+static bool is_non_confirmable(
+        const golioth_coap_client_t* client,
+        const golioth_coap_request_msg_t* req) {
+    return req->type == GOLIOTH_COAP_REQUEST_POST && !req->sync_completion
+            && !req->post.require_ack && client->lanes[req->lane].non_confirmable;
+}
+
+// NON messages aren't acknowledged, so nothing slows them down when the network is
+// congested. Instead, they're sent at a limited rate (RFC 7252 section 4.7), with a
+// token bucket of CONFIG_GOLIOTH_COAP_NON_BURST messages, refilled at
+// CONFIG_GOLIOTH_COAP_NON_RATE_PER_S messages per second.
+//
+// Returns the time in milliseconds until a NON message can be sent, 0 if one can be
+// sent now.
+static int32_t time_till_non_credit_ms(golioth_coap_client_t* client) {
+    uint64_t now_ms = golioth_time_millis();
+    uint64_t credit = client->non_credit
+            + (now_ms - client->non_credit_ms) * CONFIG_GOLIOTH_COAP_NON_RATE_PER_S;
+    client->non_credit = min(credit, (uint64_t)CONFIG_GOLIOTH_COAP_NON_BURST * 1000);
+    client->non_credit_ms = now_ms;
+    if (client->non_credit >= 1000) {
+        return 0;
+    }
+    return (1000 - client->non_credit + CONFIG_GOLIOTH_COAP_NON_RATE_PER_S - 1)
+            / CONFIG_GOLIOTH_COAP_NON_RATE_PER_S;
+}
+
+// Whether the request at the head of a lane is a NON request over the rate. It waits
+// at the head of its lane until there is credit for it (non_ready).
+static bool head_waits_for_non_credit(
+        golioth_coap_client_t* client,
+        golioth_coap_request_lane_t* lane,
+        bool non_ready) {
+    uint8_t index = 0;
+    if (non_ready || !xQueuePeek(lane->queue, &index, 0)) {
+        return false;
+    }
+    golioth_coap_request_msg_t* req = &client->requests[index];
+    if (!is_non_confirmable(client, req)) {
+        return false;
+    }
+    if (!req->was_rate_limited) {
+        req->was_rate_limited = true;
+        portENTER_CRITICAL(&client->lanes_lock);
+        lane->num_rate_limited++;
+        portEXIT_CRITICAL(&client->lanes_lock);
+    }
+    return true;
+}
+
+// Take the next request to send, after taking request_count_sem.
+//
+// Lanes are served in priority order, except that a lane that has been passed over
+// CONFIG_GOLIOTH_COAP_LANE_STARVATION_LIMIT times in a row is served next, so lower
+// priority lanes still make progress during a flood of higher priority requests.
+//
+// If pace_non is true, lanes whose next request is a NON request over the rate are
+// passed over. Returns NULL if no lane has a request that can be sent now.
+static golioth_coap_request_msg_t* dequeue_request(
+        golioth_coap_client_t* client,
+        bool pace_non) {
+    bool non_ready = !pace_non || time_till_non_credit_ms(client) == 0;
+    bool ready[GOLIOTH_REQUEST_LANE_NUM] = {};
+    int chosen = -1;
+    for (int i = 0; i < GOLIOTH_REQUEST_LANE_NUM; i++) {
+        golioth_coap_request_lane_t* lane = &client->lanes[i];
+        if (uxQueueMessagesWaiting(lane->queue) == 0) {
+            lane->num_skipped = 0;
+            continue;
+        }
+        if (head_waits_for_non_credit(client, lane, non_ready)) {
+            continue;
+        }
+        ready[i] = true;
+        if (chosen < 0) {
+            chosen = i;
+        } else if (
+                lane->num_skipped >= CONFIG_GOLIOTH_COAP_LANE_STARVATION_LIMIT
+                && client->lanes[chosen].num_skipped
+                           < CONFIG_GOLIOTH_COAP_LANE_STARVATION_LIMIT) {
+            chosen = i;
+        }
+    }
+    if (chosen < 0) {
+        return NULL;
+    }
+
+    for (int i = 0; i < GOLIOTH_REQUEST_LANE_NUM; i++) {
+        if (i != chosen && ready[i]) {
+            client->lanes[i].num_skipped++;
+        }
+    }
+
+    golioth_coap_request_lane_t* lane = &client->lanes[chosen];
+    uint8_t index = 0;
+    if (!xQueueReceive(lane->queue, &index, 0)) {
+        return NULL;
+    }
+    lane->num_skipped = 0;
+    // From here on, the request can't be superseded
+    portENTER_CRITICAL(&client->lanes_lock);
+    client->requests[index].is_queued = false;
+    portEXIT_CRITICAL(&client->lanes_lock);
+    return &client->requests[index];
+}
+
+// Return a request object, after the request has completed or been dropped
+static void free_request(golioth_coap_client_t* client, golioth_coap_request_msg_t* req) {
+    uint8_t index = req - client->requests;
+    assert(index < GOLIOTH_COAP_NUM_REQUESTS);
+    xQueueSend(client->lanes[req->lane].free_queue, &index, 0);
+}
+
+static golioth_coap_pending_req_t* find_pending_req(
+        golioth_coap_client_t* client,
+        const coap_pdu_t* received) {
+    coap_bin_const_t rcvd_token = coap_pdu_get_token(received);
+    size_t cursor = 0;
+    golioth_coap_pending_req_t* pending = NULL;
+    while ((pending = golioth_coap_token_index_find_next(
+                    &client->pending_index, rcvd_token.s, rcvd_token.length, &cursor))) {
+        if (response_matches_request(pending->req, received)) {
+            return pending;
+        }
+    }
+    return NULL;
+}
+
+// Call the user's callback for a request, for both responses and timeouts.
+static void invoke_request_callback(
+        golioth_coap_client_t* client,
+        const golioth_coap_request_msg_t* req,
+        const golioth_response_t* response,
+        const uint8_t* data,
+        size_t data_len) {
+    if (req->type == GOLIOTH_COAP_REQUEST_GET) {
+        if (req->get.callback) {
+            req->get.callback(client, response, req->path, data, data_len, req->get.arg);
+        }
+    } else if (req->type == GOLIOTH_COAP_REQUEST_GET_BLOCK) {
+        if (req->get_block.callback) {
+            req->get_block.callback(
+                    client, response, req->path, data, data_len, req->get_block.arg);
+        }
+    } else if (req->type == GOLIOTH_COAP_REQUEST_POST) {
+        if (req->post.callback) {
+            req->post.callback(client, response, req->path, req->post.arg);
+        }
+    } else if (req->type == GOLIOTH_COAP_REQUEST_POST_BLOCK) {
+        if (req->post_block.callback) {
+            req->post_block.callback(client, response, req->path, req->post_block.arg);
+        }
+    } else if (req->type == GOLIOTH_COAP_REQUEST_DELETE) {
+        if (req->delete.callback) {
+            req->delete.callback(client, response, req->path, req->delete.arg);
+        }
+    }
+}
+
+// Hand the request's payload (if any) back to its owner.
+//
+// POST payloads are released as soon as the PDU is built. Block uploads keep
+// their payload until the upload completes.
+static void release_request_payload(golioth_coap_request_msg_t* req) {
+    if (req->type == GOLIOTH_COAP_REQUEST_POST && req->post.payload) {
+        if (req->post.release) {
+            req->post.release(req->post.payload, req->post.release_arg);
+        }
+        req->post.payload = NULL;
+    } else if (req->type == GOLIOTH_COAP_REQUEST_POST_BLOCK && req->post_block.owned_payload) {
+        if (req->post_block.release) {
+            req->post_block.release(req->post_block.owned_payload, req->post_block.release_arg);
+        }
+        req->post_block.owned_payload = NULL;
+    }
+}
+
+// Claim a completion object for a synchronous request, or NULL if all are in use
+static golioth_coap_sync_completion_t* claim_sync_completion(golioth_coap_client_t* client) {
+    uint8_t index = 0;
+    if (!xQueueReceive(client->free_sync_completion_queue, &index, 0)) {
+        return NULL;
+    }
+    golioth_coap_sync_completion_t* completion = &client->sync_completions[index];
+    // Completions of requests from the object's previous users are ignored from here on
+    completion->seq++;
+    return completion;
+}
+
+static void release_sync_completion(
+        golioth_coap_client_t* client,
+        golioth_coap_sync_completion_t* completion) {
+    uint8_t index = completion - client->sync_completions;
+    xQueueSend(client->free_sync_completion_queue, &index, 0);
+}
+
+// Wait for the CoAP task to complete a synchronous request
+static golioth_status_t wait_for_sync_completion(
+        golioth_coap_client_t* client,
+        golioth_coap_sync_completion_t* completion,
+        uint32_t seq,
+        int32_t timeout_s) {
+    TickType_t timeout_ticks =
+            (timeout_s == GOLIOTH_WAIT_FOREVER ? portMAX_DELAY
+                                               : (timeout_s * 1000) / portTICK_PERIOD_MS);
+    TickType_t start_ticks = xTaskGetTickCount();
+    golioth_status_t status = GOLIOTH_ERR_TIMEOUT;
+    while (true) {
+        TickType_t wait_ticks = portMAX_DELAY;
+        if (timeout_ticks != portMAX_DELAY) {
+            TickType_t elapsed_ticks = xTaskGetTickCount() - start_ticks;
+            if (elapsed_ticks >= timeout_ticks) {
+                break;
+            }
+            wait_ticks = timeout_ticks - elapsed_ticks;
+        }
+        if (!xSemaphoreTake(completion->sem, wait_ticks)) {
+            break;
+        }
+        // A late completion of an earlier request that timed out, keep waiting
+        if (completion->done_seq != seq) {
+            continue;
+        }
+        status = (completion->got_response ? GOLIOTH_OK : GOLIOTH_ERR_TIMEOUT);
+        break;
+    }
+    release_sync_completion(client, completion);
+    return status;
+}
+
+// Whether req is an asynchronous LightDB state (".d/") write that can be coalesced
+static bool is_coalescible(const golioth_coap_request_msg_t* req) {
+    return req->type == GOLIOTH_COAP_REQUEST_POST && !req->sync_completion && req->path_prefix
+            && 0 == strcmp(req->path_prefix, ".d/");
+}
+
+// If a coalescible write to the same path as req is waiting to be sent, replace it with req.
+// The replaced request's callback is called with GOLIOTH_ERR_SUPERSEDED, and its payload
+// is released.
+//
+// Returns true if req replaced a waiting request, false if req still needs to be queued.
+static bool coalesce_request(golioth_coap_client_t* client, golioth_coap_request_msg_t* req) {
+    if (!client->coalesce_state_writes || !is_coalescible(req)) {
+        return false;
+    }
+
+    golioth_coap_request_msg_t superseded = {};
+    bool found = false;
+    portENTER_CRITICAL(&client->lanes_lock);
+    for (int i = 0; i < GOLIOTH_COAP_NUM_REQUESTS; i++) {
+        golioth_coap_request_msg_t* queued = &client->requests[i];
+        if (queued->is_queued && is_coalescible(queued) && 0 == strcmp(queued->path, req->path)) {
+            superseded = *queued;
+            queued->post = req->post;
+            queued->ageout_ms = req->ageout_ms;
+            client->lanes[queued->lane].num_superseded++;
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&client->lanes_lock);
+
+    if (!found) {
+        return false;
+    }
+    ESP_LOGD(TAG, "Superseded queued write to %s", req->path);
+    golioth_response_t response = {
+            .status = GOLIOTH_ERR_SUPERSEDED,
+    };
+    invoke_request_callback(client, &superseded, &response, NULL, 0);
+    release_request_payload(&superseded);
+    return true;
+}
+
+// Hand a request over to the CoAP task. Synchronous requests wait for the request
+// to complete. The request's payload (if any) is released if it can't be enqueued.
+static golioth_status_t submit_request(
+        golioth_coap_client_t* client,
+        golioth_coap_request_msg_t* req,
+        bool is_synchronous,
+        int32_t timeout_s) {
+    golioth_coap_sync_completion_t* completion = NULL;
+    if (is_synchronous) {
+        completion = claim_sync_completion(client);
+        if (!completion) {
+            ESP_LOGW(TAG, "Failed to enqueue request, too many sync requests");
+            release_request_payload(req);
+            return GOLIOTH_ERR_QUEUE_FULL;
+        }
+        req->sync_completion = completion;
+        req->sync_seq = completion->seq;
+    }
+
+    if (!completion && coalesce_request(client, req)) {
+        return GOLIOTH_OK;
+    }
+
+    if (!enqueue_request(client, req)) {
+        ESP_LOGW(TAG, "Failed to enqueue request, queue full");
+        release_request_payload(req);
+        if (completion) {
+            release_sync_completion(client, completion);
+        }
+        return GOLIOTH_ERR_QUEUE_FULL;
+    }
+
+    if (completion) {
+        return wait_for_sync_completion(client, completion, req->sync_seq, timeout_s);
+    }
+    return GOLIOTH_OK;
+}
+
+// Let the user sync function (if any) know the request is complete. Doesn't block.
+static void notify_sync_completion(golioth_coap_request_msg_t* req, bool got_response) {
+    golioth_coap_sync_completion_t* completion = req->sync_completion;
+    if (!completion) {
+        return;
+    }
+    // The user sync function may have timed out and returned already, in which case
+    // the completion object may be waiting on a newer request
+    if (completion->seq == req->sync_seq) {
+        completion->got_response = got_response;
+        completion->done_seq = req->sync_seq;
+        xSemaphoreGive(completion->sem);
+    }
+    req->sync_completion = NULL;
+}
+
+// Notify the user sync function (if any) and release the pending request slot
+static void complete_pending_req(
+        golioth_coap_client_t* client,
+        golioth_coap_pending_req_t* pending,
+        bool got_response) {
+    golioth_coap_request_msg_t* req = pending->req;
+    golioth_coap_token_index_remove(&client->pending_index, req->token, req->token_len, pending);
+    notify_sync_completion(req, got_response);
+    release_request_payload(req);
+    free_request(client, req);
+    pending->req = NULL;
+    pending->in_use = false;
+    assert(client->num_pending_reqs > 0);
+    client->num_pending_reqs--;
+}
+
+// Call the user's callback with GOLIOTH_ERR_TIMEOUT and release the pending request slot
+static void timeout_pending_req(
+        golioth_coap_client_t* client,
+        golioth_coap_pending_req_t* pending) {
+    golioth_response_t response = {
+            .status = GOLIOTH_ERR_TIMEOUT,
+    };
+    invoke_request_callback(client, pending->req, &response, NULL, 0);
+    complete_pending_req(client, pending, false);
+}
+
+// Look up all addresses of hostname, up to GOLIOTH_COAP_DNS_MAX_ADDRS. Blocks.
+static golioth_status_t dns_lookup(
+        const char* hostname,
+        uint16_t port,
+        coap_address_t* addrs,
+        size_t* num_addrs) {
+    struct addrinfo hints = {
+            .ai_socktype = SOCK_DGRAM,
+            .ai_family = AF_UNSPEC,
+    };
+    struct addrinfo* ainfo = NULL;
+    int error = getaddrinfo(hostname, NULL, &hints, &ainfo);
+    if (error != 0) {
+        ESP_LOGE(TAG, "DNS lookup failed for destination ainfo %s. error: %d", hostname, error);
+        return GOLIOTH_ERR_DNS_LOOKUP;
+    }
+    if (!ainfo) {
+        ESP_LOGE(TAG, "DNS lookup %s did not return any addresses", hostname);
+        return GOLIOTH_ERR_DNS_LOOKUP;
+    }
+    GSTATS_INC_ALLOC("ainfo");
+
+    *num_addrs = 0;
+    for (struct addrinfo* ai = ainfo; ai && *num_addrs < GOLIOTH_COAP_DNS_MAX_ADDRS;
+         ai = ai->ai_next) {
+        coap_address_t* dst_addr = &addrs[*num_addrs];
+        coap_address_init(dst_addr);
+        switch (ai->ai_family) {
+            case AF_INET:
+                memcpy(&dst_addr->addr.sin, ai->ai_addr, sizeof(dst_addr->addr.sin));
+                dst_addr->addr.sin.sin_port = htons(port);
+                break;
+            case AF_INET6:
+                memcpy(&dst_addr->addr.sin6, ai->ai_addr, sizeof(dst_addr->addr.sin6));
+                dst_addr->addr.sin6.sin6_port = htons(port);
+                break;
+            default:
+                continue;
+        }
+        (*num_addrs)++;
+    }
+    freeaddrinfo(ainfo);
+    GSTATS_INC_FREE("ainfo");
+
+    if (*num_addrs == 0) {
+        ESP_LOGE(TAG, "DNS lookup response failed");
+        return GOLIOTH_ERR_DNS_LOOKUP;
+    }
+    return GOLIOTH_OK;
+}
+
+// Replace the cached addresses. If the address in use is still among them, keep using it.
+static void dns_cache_update(
+        golioth_coap_client_t* client,
+        const coap_address_t* addrs,
+        size_t num_addrs) {
+    golioth_coap_dns_cache_t* cache = &client->dns_cache;
+    portENTER_CRITICAL(&cache->lock);
+    coap_address_t current = cache->addrs[cache->current];
+    bool had_addrs = (cache->num_addrs > 0);
+    memcpy(cache->addrs, addrs, num_addrs * sizeof(addrs[0]));
+    cache->num_addrs = num_addrs;
+    cache->current = 0;
+    for (size_t i = 0; had_addrs && i < num_addrs; i++) {
+        if (coap_address_equals(&addrs[i], &current)) {
+            cache->current = i;
+            break;
+        }
+    }
+    cache->expires_ms = golioth_time_millis() + 1000ULL * CONFIG_GOLIOTH_COAP_DNS_CACHE_TTL_S;
+    portEXIT_CRITICAL(&cache->lock);
+    ESP_LOGD(TAG, "DNS cache updated, %zu addresses", num_addrs);
+}
+
+static void dns_refresh_task(void* arg) {
+    golioth_coap_client_t* client = (golioth_coap_client_t*)arg;
+    golioth_coap_dns_cache_t* cache = &client->dns_cache;
+    char hostname[sizeof(cache->hostname)];
+    portENTER_CRITICAL(&cache->lock);
+    memcpy(hostname, cache->hostname, sizeof(hostname));
+    uint16_t port = cache->port;
+    portEXIT_CRITICAL(&cache->lock);
+
+    coap_address_t addrs[GOLIOTH_COAP_DNS_MAX_ADDRS];
+    size_t num_addrs = 0;
+    if (dns_lookup(hostname, port, addrs, &num_addrs) == GOLIOTH_OK) {
+        dns_cache_update(client, addrs, num_addrs);
+    } else {
+        portENTER_CRITICAL(&cache->lock);
+        cache->expires_ms = golioth_time_millis() + GOLIOTH_COAP_DNS_RETRY_MS;
+        portEXIT_CRITICAL(&cache->lock);
+    }
+    // The client may be destroyed as soon as this is given
+    xSemaphoreGive(cache->refresh_sem);
+    vTaskDelete(NULL);
+}
+
+// Look up the addresses again in the background, unless that's already under way
+static void dns_cache_refresh(golioth_coap_client_t* client) {
+    golioth_coap_dns_cache_t* cache = &client->dns_cache;
+    if (!xSemaphoreTake(cache->refresh_sem, 0)) {
+        return;
+    }
+    bool task_created = xTaskCreate(
+            dns_refresh_task,
+            "dns_refresh",
+            GOLIOTH_COAP_DNS_REFRESH_STACK_SIZE,
+            client,  // task arg
+            CONFIG_GOLIOTH_COAP_TASK_PRIORITY,
+            NULL);
+    if (!task_created) {
+        ESP_LOGW(TAG, "Failed to create DNS refresh task");
+        xSemaphoreGive(cache->refresh_sem);
+    }
+}
+
+// A session to the current address failed to connect, so try the next address next time.
+// Once all addresses have failed, look them up again.
+static void dns_cache_next(golioth_coap_client_t* client) {
+    golioth_coap_dns_cache_t* cache = &client->dns_cache;
+    portENTER_CRITICAL(&cache->lock);
+    if (cache->num_addrs > 0) {
+        cache->current = (cache->current + 1) % cache->num_addrs;
+        if (cache->current == 0) {
+            cache->expires_ms = 0;
+        }
+    }
+    portEXIT_CRITICAL(&cache->lock);
+}
+
+static bool load_last_good_addr(const char* hostname, coap_address_t* addr) {
+    nvs_handle_t handle;
+    if (nvs_open(GOLIOTH_COAP_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    golioth_coap_saved_addr_t saved = {};
+    size_t len = sizeof(saved);
+    esp_err_t err = nvs_get_blob(handle, GOLIOTH_COAP_NVS_KEY_LAST_ADDR, &saved, &len);
+    nvs_close(handle);
+    if (err != ESP_OK || len != sizeof(saved)
+        || 0 != strncmp(saved.hostname, hostname, sizeof(saved.hostname))) {
+        return false;
+    }
+    *addr = saved.addr;
+    return true;
+}
+
+// Save the address of a session that connected, if it's not the one saved already
+static void save_last_good_addr(const char* hostname, const coap_address_t* addr) {
+    coap_address_t saved_addr;
+    if (load_last_good_addr(hostname, &saved_addr) && coap_address_equals(&saved_addr, addr)) {
+        return;
+    }
+    golioth_coap_saved_addr_t saved = {
+            .addr = *addr,
+    };
+    strncpy(saved.hostname, hostname, sizeof(saved.hostname) - 1);
+
+    nvs_handle_t handle;
+    if (nvs_open(GOLIOTH_COAP_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    esp_err_t err = nvs_set_blob(handle, GOLIOTH_COAP_NVS_KEY_LAST_ADDR, &saved, sizeof(saved));
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save server address: %d", err);
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+// Get the address to start a session with. Only waits for DNS if there is no cached
+// address, and no address saved from a previous boot.
+static golioth_status_t get_coap_dst_address(
+        golioth_coap_client_t* client,
+        const char* hostname,
+        uint16_t port,
+        coap_address_t* dst_addr) {
+    golioth_coap_dns_cache_t* cache = &client->dns_cache;
+    portENTER_CRITICAL(&cache->lock);
+    bool first_session =
+            (0 != strncmp(cache->hostname, hostname, sizeof(cache->hostname) - 1)
+             || cache->port != port);
+    if (first_session) {
+        // Hostname and port don't change after that
+        strncpy(cache->hostname, hostname, sizeof(cache->hostname) - 1);
+        cache->port = port;
+    }
+    portEXIT_CRITICAL(&cache->lock);
+
+    coap_address_t saved_addr;
+    if (first_session && load_last_good_addr(hostname, &saved_addr)) {
+        ESP_LOGI(TAG, "Using saved server address, looking up %s in background", hostname);
+        dns_cache_update(client, &saved_addr, 1);
+        portENTER_CRITICAL(&cache->lock);
+        cache->expires_ms = 0;
+        portEXIT_CRITICAL(&cache->lock);
+    }
+
+    portENTER_CRITICAL(&cache->lock);
+    bool have_addr = (cache->num_addrs > 0);
+    if (have_addr) {
+        *dst_addr = cache->addrs[cache->current];
+    }
+    bool expired = (golioth_time_millis() >= cache->expires_ms);
+    portEXIT_CRITICAL(&cache->lock);
+
+    if (have_addr) {
+        if (expired) {
+            dns_cache_refresh(client);
+        }
+        return GOLIOTH_OK;
+    }
+
+    coap_address_t addrs[GOLIOTH_COAP_DNS_MAX_ADDRS];
+    size_t num_addrs = 0;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(dns_lookup(hostname, port, addrs, &num_addrs));
+    dns_cache_update(client, addrs, num_addrs);
+    *dst_addr = addrs[0];
+    return GOLIOTH_OK;
 }
 
+static golioth_status_t golioth_coap_post_next_block(
+        golioth_coap_pending_req_t* pending,
+        const coap_pdu_t* received,
+        coap_session_t* session);
+
 static coap_response_t coap_response_handler(
         coap_session_t* session,
         const coap_pdu_t* sent,
@@ -113,8 +1047,9 @@ static coap_response_t coap_response_handler(
     size_t data_len = 0;
     coap_get_data(received, &data_len, &data);
 
-    // Get the original/pending request info
-    golioth_coap_request_msg_t* req = client->pending_req;
+    // Find the original request this is a response to (if any)
+    golioth_coap_pending_req_t* pending = find_pending_req(client, received);
+    golioth_coap_request_msg_t* req = (pending ? pending->req : NULL);
 
     if (req) {
         if (req->type == GOLIOTH_COAP_REQUEST_EMPTY) {
@@ -144,8 +1079,11 @@ static coap_response_t coap_response_handler(
         ESP_LOGD(TAG, "%d.%02d (unsolicited), len %zu", class, code, data_len);
     }
 
-    if (req && token_matches_request(req, received)) {
-        req->got_response = true;
+    if (req) {
+        ESP_LOGD(
+                TAG,
+                "Received response in %d ms",
+                (int32_t)(golioth_time_millis() - pending->sent_ms));
 
         if (CONFIG_GOLIOTH_COAP_KEEPALIVE_INTERVAL_S > 0) {
             if (!xTimerReset(client->keepalive_timer, 0)) {
@@ -153,50 +1091,101 @@ static coap_response_t coap_response_handler(
             }
         }
 
+        bool upload_continues = false;
         if (golioth_time_millis() > req->ageout_ms) {
             ESP_LOGW(TAG, "Ignoring response from old request, type %d", req->type);
-        } else {
-            if (req->type == GOLIOTH_COAP_REQUEST_GET) {
-                if (req->get.callback) {
-                    req->get.callback(client, &response, req->path, data, data_len, req->get.arg);
-                }
-            } else if (req->type == GOLIOTH_COAP_REQUEST_GET_BLOCK) {
+            if (!req->sync_completion) {
+                golioth_response_t timeout_response = {
+                        .status = GOLIOTH_ERR_TIMEOUT,
+                };
+                invoke_request_callback(client, req, &timeout_response, NULL, 0);
+            }
+        } else if (req->type == GOLIOTH_COAP_REQUEST_POST_BLOCK
+                   && rcvd_code == COAP_RESPONSE_CODE(231)) {
+            // 2.31 Continue, the server wants the next block
+            golioth_status_t status = golioth_coap_post_next_block(pending, received, session);
+            if (status == GOLIOTH_OK) {
+                upload_continues = true;
+            } else {
+                response.status = status;
+                invoke_request_callback(client, req, &response, NULL, 0);
+            }
+        } else {
+            if (req->type == GOLIOTH_COAP_REQUEST_GET_BLOCK) {
                 coap_opt_iterator_t opt_iter;
                 coap_opt_t* block_opt = coap_check_option(received, COAP_OPTION_BLOCK2, &opt_iter);
-                assert(block_opt);
-                uint32_t opt_block_index = coap_opt_block_num(block_opt);
+                size_t opt_offset = (block_opt ? block2_offset(block_opt) : 0);
 
                 ESP_LOGD(
                         TAG,
-                        "Request block index = %u, response block index = %u, offset 0x%08X",
+                        "Request block index = %u, size = %u, response offset 0x%08X",
                         req->get_block.block_index,
-                        opt_block_index,
-                        opt_block_index * 1024);
+                        req->get_block.block_size,
+                        opt_offset);
                 ESP_LOG_BUFFER_HEXDUMP(TAG, data, min(32, data_len), ESP_LOG_DEBUG);
-
-                if (req->get_block.callback) {
-                    req->get_block.callback(
-                            client, &response, req->path, data, data_len, req->get_block.arg);
-                }
-            } else if (req->type == GOLIOTH_COAP_REQUEST_POST) {
-                if (req->post.callback) {
-                    req->post.callback(client, &response, req->path, req->post.arg);
-                }
-            } else if (req->type == GOLIOTH_COAP_REQUEST_DELETE) {
-                if (req->delete.callback) {
-                    req->delete.callback(client, &response, req->path, req->delete.arg);
-                }
             }
+            invoke_request_callback(client, req, &response, data, data_len);
+        }
+
+        if (!upload_continues) {
+            complete_pending_req(client, pending, true);
+        }
+
+        bool was_connected = client->session_connected;
+        if (client->event_callback && !was_connected) {
+            client->event_callback(
+                    client, GOLIOTH_CLIENT_EVENT_CONNECTED, client->event_callback_arg);
+        }
+        client->session_connected = true;
+        if (!was_connected) {
+            uint32_t connect_ms = golioth_time_millis() - client->session_start_ms;
+            portENTER_CRITICAL(&client->lanes_lock);
+            client->conn_stats.last_connect_ms = connect_ms;
+            portEXIT_CRITICAL(&client->lanes_lock);
+            char hostname[sizeof(client->dns_cache.hostname)];
+            portENTER_CRITICAL(&client->dns_cache.lock);
+            memcpy(hostname, client->dns_cache.hostname, sizeof(hostname));
+            portEXIT_CRITICAL(&client->dns_cache.lock);
+            save_last_good_addr(hostname, &client->session_addr);
+        }
+        if (!was_connected && client->offline_store) {
+            golioth_offline_store_wake(client->offline_store);
         }
     }
 
-    notify_observers(received, client, data, data_len, &response);
+    size_t num_observations = notify_observers(received, client, data, data_len, &response);
+
+    coap_opt_iterator_t opt_iter;
+    if (!req && num_observations == 0
+        && coap_check_option(received, COAP_OPTION_OBSERVE, &opt_iter)) {
+        // Notification for an observation we no longer have (e.g. one deregistered while
+        // the deregistration was lost). Reject it, so the server stops sending them.
+        ESP_LOGD(TAG, "Rejecting notification for unknown observation");
+        return COAP_RESPONSE_FAIL;
+    }
 
     return COAP_RESPONSE_OK;
 }
 
 static int event_handler(coap_session_t* session, const coap_event_t event) {
     ESP_LOGD(TAG, "event: 0x%04X", event);
+    if (event == COAP_EVENT_DTLS_CONNECTED) {
+        coap_context_t* coap_context = coap_session_get_context(session);
+        golioth_coap_client_t* client = (golioth_coap_client_t*)coap_get_app_data(coap_context);
+        uint32_t handshake_ms = golioth_time_millis() - client->session_start_ms;
+        ESP_LOGI(TAG, "DTLS handshake took %u ms", handshake_ms);
+
+        golioth_client_connection_stats_t* stats = &client->conn_stats;
+        portENTER_CRITICAL(&client->lanes_lock);
+        if (stats->num_handshakes == 0 || handshake_ms < stats->min_handshake_ms) {
+            stats->min_handshake_ms = handshake_ms;
+        }
+        stats->max_handshake_ms = max(stats->max_handshake_ms, handshake_ms);
+        stats->last_handshake_ms = handshake_ms;
+        stats->total_handshake_ms += handshake_ms;
+        stats->num_handshakes++;
+        portEXIT_CRITICAL(&client->lanes_lock);
+    }
     return 0;
 }
 
@@ -234,48 +1223,6 @@ static void coap_log_handler(coap_log_t level, const char* message) {
     }
 }
 
-// DNS lookup of host_uri
-static golioth_status_t get_coap_dst_address(const coap_uri_t* host_uri, coap_address_t* dst_addr) {
-    struct addrinfo hints = {
-            .ai_socktype = SOCK_DGRAM,
-            .ai_family = AF_UNSPEC,
-    };
-    struct addrinfo* ainfo = NULL;
-    const char* hostname = (const char*)host_uri->host.s;
-    int error = getaddrinfo(hostname, NULL, &hints, &ainfo);
-    if (error != 0) {
-        ESP_LOGE(TAG, "DNS lookup failed for destination ainfo %s. error: %d", hostname, error);
-        return GOLIOTH_ERR_DNS_LOOKUP;
-    }
-    if (!ainfo) {
-        ESP_LOGE(TAG, "DNS lookup %s did not return any addresses", hostname);
-        return GOLIOTH_ERR_DNS_LOOKUP;
-    }
-    GSTATS_INC_ALLOC("ainfo");
-
-    coap_address_init(dst_addr);
-
-    switch (ainfo->ai_family) {
-        case AF_INET:
-            memcpy(&dst_addr->addr.sin, ainfo->ai_addr, sizeof(dst_addr->addr.sin));
-            dst_addr->addr.sin.sin_port = htons(host_uri->port);
-            break;
-        case AF_INET6:
-            memcpy(&dst_addr->addr.sin6, ainfo->ai_addr, sizeof(dst_addr->addr.sin6));
-            dst_addr->addr.sin6.sin6_port = htons(host_uri->port);
-            break;
-        default:
-            ESP_LOGE(TAG, "DNS lookup response failed");
-            freeaddrinfo(ainfo);
-            GSTATS_INC_FREE("ainfo");
-            return GOLIOTH_ERR_DNS_LOOKUP;
-    }
-    freeaddrinfo(ainfo);
-    GSTATS_INC_FREE("ainfo");
-
-    return GOLIOTH_OK;
-}
-
 static void golioth_coap_add_token(
         coap_pdu_t* req_pdu,
         golioth_coap_request_msg_t* req,
@@ -313,18 +1260,28 @@ static void golioth_coap_add_content_type(coap_pdu_t* request, uint32_t content_
             typebuf);
 }
 
-static void golioth_coap_add_block2(coap_pdu_t* request, size_t block_index, size_t block_size) {
-    size_t szx = 6;  // 1024 bytes
+// Add a Block1 or Block2 option
+static void golioth_coap_add_block(
+        coap_pdu_t* request,
+        coap_option_num_t option,
+        size_t block_index,
+        bool more,
+        size_t block_size) {
+    // Block size is 2^(szx + 4) bytes, 16 to 1024
+    size_t szx = 0;
+    while (szx < 6 && (16u << szx) < block_size) {
+        szx++;
+    }
     coap_block_t block = {
             .num = block_index,
-            .m = 0,
+            .m = more,
             .szx = szx,
     };
 
     unsigned char buf[4];
     unsigned int opt_length =
             coap_encode_var_safe(buf, sizeof(buf), (block.num << 4 | block.m << 3 | block.szx));
-    coap_add_option(request, COAP_OPTION_BLOCK2, opt_length, buf);
+    coap_add_option(request, option, opt_length, buf);
 }
 
 static void golioth_coap_empty(golioth_coap_request_msg_t* req, coap_session_t* session) {
@@ -362,6 +1319,43 @@ static void golioth_coap_get(golioth_coap_request_msg_t* req, coap_session_t* se
     GSTATS_INC_FREE("get_pdu");
 }
 
+static bool path_prefix_equal(const char* a, const char* b) {
+    return (0 == strcmp(a ? a : "", b ? b : ""));
+}
+
+// Find the block transfer for the request's path, or start a new one.
+//
+// A new transfer (and token) is started when block 0 is requested. If all transfer
+// slots are in use, the least recently used one is recycled.
+static golioth_coap_block_transfer_t* get_block_transfer(
+        golioth_coap_client_t* client,
+        const golioth_coap_request_msg_t* req) {
+    golioth_coap_block_transfer_t* found = NULL;
+    golioth_coap_block_transfer_t* lru = &client->block_transfers[0];
+    for (int i = 0; i < CONFIG_GOLIOTH_COAP_MAX_BLOCK_TRANSFERS; i++) {
+        golioth_coap_block_transfer_t* xfer = &client->block_transfers[i];
+        if (xfer->in_use && path_prefix_equal(xfer->path_prefix, req->path_prefix)
+            && (0 == strcmp(xfer->path, req->path))) {
+            found = xfer;
+            break;
+        }
+        if (!xfer->in_use || (lru->in_use && xfer->last_used_ms < lru->last_used_ms)) {
+            lru = xfer;
+        }
+    }
+
+    if (found && req->get_block.block_index != 0) {
+        return found;
+    }
+
+    golioth_coap_block_transfer_t* xfer = (found ? found : lru);
+    xfer->in_use = true;
+    xfer->path_prefix = req->path_prefix;
+    memcpy(xfer->path, req->path, sizeof(xfer->path));
+    xfer->token_len = 0;
+    return xfer;
+}
+
 static void golioth_coap_get_block(
         golioth_coap_request_msg_t* req,
         golioth_coap_client_t* client,
@@ -373,40 +1367,155 @@ static void golioth_coap_get_block(
     }
     GSTATS_INC_ALLOC("get_block_pdu");
 
-    if (req->get_block.block_index == 0) {
+    golioth_coap_block_transfer_t* xfer = get_block_transfer(client, req);
+    xfer->last_used_ms = golioth_time_millis();
+    if (xfer->token_len == 0) {
         // Save this token for further blocks
         golioth_coap_add_token(req_pdu, req, session);
-        memcpy(client->block_token, req->token, req->token_len);
-        client->block_token_len = req->token_len;
+        memcpy(xfer->token, req->token, req->token_len);
+        xfer->token_len = req->token_len;
     } else {
-        coap_add_token(req_pdu, client->block_token_len, client->block_token);
+        coap_add_token(req_pdu, xfer->token_len, xfer->token);
 
         // Copy block token into the current req_pdu token, since this is what
         // is checked in coap_response_handler to verify the response has been received.
-        memcpy(req->token, client->block_token, client->block_token_len);
-        req->token_len = client->block_token_len;
+        memcpy(req->token, xfer->token, xfer->token_len);
+        req->token_len = xfer->token_len;
     }
 
     golioth_coap_add_path(req_pdu, req->path_prefix, req->path);
-    golioth_coap_add_block2(req_pdu, req->get_block.block_index, req->get_block.block_size);
+    golioth_coap_add_block(
+            req_pdu,
+            COAP_OPTION_BLOCK2,
+            req->get_block.block_index,
+            false,
+            req->get_block.block_size);
     coap_send(session, req_pdu);
     GSTATS_INC_FREE("get_block_pdu");
 }
 
-static void golioth_coap_post(golioth_coap_request_msg_t* req, coap_session_t* session) {
-    coap_pdu_t* req_pdu = coap_new_pdu(COAP_MESSAGE_CON, COAP_REQUEST_POST, session);
+static golioth_status_t golioth_coap_post(
+        golioth_coap_request_msg_t* req,
+        coap_session_t* session,
+        coap_pdu_type_t type) {
+    coap_pdu_t* req_pdu = coap_new_pdu(type, COAP_REQUEST_POST, session);
     if (!req_pdu) {
         ESP_LOGE(TAG, "coap_new_pdu() post failed");
-        return;
+        return GOLIOTH_ERR_MEM_ALLOC;
     }
     GSTATS_INC_ALLOC("post_pdu");
 
     golioth_coap_add_token(req_pdu, req, session);
     golioth_coap_add_path(req_pdu, req->path_prefix, req->path);
     golioth_coap_add_content_type(req_pdu, req->post.content_type);
-    coap_add_data(req_pdu, req->post.payload_size, (unsigned char*)req->post.payload);
-    coap_send(session, req_pdu);
+    if (!coap_add_data(req_pdu, req->post.payload_size, (unsigned char*)req->post.payload)) {
+        ESP_LOGE(TAG, "Failed to add %zu bytes of data to PDU", req->post.payload_size);
+        coap_delete_pdu(req_pdu);
+        GSTATS_INC_FREE("post_pdu");
+        return GOLIOTH_ERR_MEM_ALLOC;
+    }
+    // coap_send() takes the PDU, even if it fails
+    coap_mid_t mid = coap_send(session, req_pdu);
     GSTATS_INC_FREE("post_pdu");
+    if (mid == COAP_INVALID_MID) {
+        ESP_LOGE(TAG, "coap_send() post failed");
+        return GOLIOTH_ERR_IO;
+    }
+    return GOLIOTH_OK;
+}
+
+// Send the current block of a block upload, reading it straight into the PDU
+static golioth_status_t golioth_coap_post_block(
+        golioth_coap_request_msg_t* req,
+        coap_session_t* session) {
+    golioth_coap_post_block_params_t* params = &req->post_block;
+    size_t offset = params->block_index * params->block_size;
+    size_t len = min(params->block_size, params->payload_size - offset);
+    bool more = (offset + len < params->payload_size);
+
+    coap_pdu_t* req_pdu = coap_new_pdu(COAP_MESSAGE_CON, COAP_REQUEST_POST, session);
+    if (!req_pdu) {
+        ESP_LOGE(TAG, "coap_new_pdu() post block failed");
+        return GOLIOTH_ERR_MEM_ALLOC;
+    }
+    GSTATS_INC_ALLOC("post_block_pdu");
+
+    // All blocks of an upload use the same token
+    if (params->block_index == 0) {
+        golioth_coap_add_token(req_pdu, req, session);
+    } else {
+        coap_add_token(req_pdu, req->token_len, req->token);
+    }
+    golioth_coap_add_path(req_pdu, req->path_prefix, req->path);
+    golioth_coap_add_content_type(req_pdu, params->content_type);
+
+    // Payloads that fit in one block are sent without Block1
+    if (params->payload_size > params->block_size) {
+        golioth_coap_add_block(
+                req_pdu, COAP_OPTION_BLOCK1, params->block_index, more, params->block_size);
+        if (params->block_index == 0) {
+            unsigned char buf[4];
+            coap_add_option(
+                    req_pdu,
+                    COAP_OPTION_SIZE1,
+                    coap_encode_var_safe(buf, sizeof(buf), params->payload_size),
+                    buf);
+        }
+    }
+
+    golioth_status_t status = GOLIOTH_OK;
+    uint8_t* data = (len > 0 ? coap_add_data_after(req_pdu, len) : NULL);
+    if (len > 0 && !data) {
+        ESP_LOGE(TAG, "Failed to add %zu bytes of data to PDU", len);
+        status = GOLIOTH_ERR_MEM_ALLOC;
+    } else if (len > 0) {
+        status = params->reader(offset, data, len, params->reader_arg);
+    }
+    if (status != GOLIOTH_OK) {
+        coap_delete_pdu(req_pdu);
+        GSTATS_INC_FREE("post_block_pdu");
+        return status;
+    }
+
+    ESP_LOGD(TAG, "Sending block %zu (%zu bytes at offset %zu)", params->block_index, len, offset);
+    coap_send(session, req_pdu);
+    GSTATS_INC_FREE("post_block_pdu");
+    return GOLIOTH_OK;
+}
+
+// Send the next block of an upload, after the server acknowledged the previous one
+// with 2.31 Continue. The server may ask for smaller blocks in its Block1 option.
+static golioth_status_t golioth_coap_post_next_block(
+        golioth_coap_pending_req_t* pending,
+        const coap_pdu_t* received,
+        coap_session_t* session) {
+    golioth_coap_post_block_params_t* params = &pending->req->post_block;
+    size_t acked_end = (params->block_index + 1) * params->block_size;
+    if (acked_end >= params->payload_size) {
+        ESP_LOGE(TAG, "Server asked to continue after the last block");
+        return GOLIOTH_ERR_FAIL;
+    }
+
+    coap_opt_iterator_t opt_iter;
+    coap_opt_t* block_opt = coap_check_option(received, COAP_OPTION_BLOCK1, &opt_iter);
+    if (block_opt) {
+        size_t server_block_size = (size_t)16 << COAP_OPT_BLOCK_SZX(block_opt);
+        if (server_block_size < params->block_size) {
+            ESP_LOGI(TAG, "Server block size is %zu", server_block_size);
+            params->block_size = server_block_size;
+        }
+    }
+    params->block_index = acked_end / params->block_size;
+
+    GOLIOTH_STATUS_RETURN_IF_ERROR(golioth_coap_post_block(pending->req, session));
+
+    uint64_t now_ms = golioth_time_millis();
+    pending->sent_ms = now_ms;
+    pending->timeout_ms = now_ms + CONFIG_GOLIOTH_COAP_RESPONSE_TIMEOUT_S * 1000;
+    if (pending->req->ageout_ms != GOLIOTH_WAIT_FOREVER) {
+        pending->timeout_ms = min(pending->timeout_ms, pending->req->ageout_ms);
+    }
+    return GOLIOTH_OK;
 }
 
 static void golioth_coap_delete(golioth_coap_request_msg_t* req, coap_session_t* session) {
@@ -424,30 +1533,52 @@ static void golioth_coap_delete(golioth_coap_request_msg_t* req, coap_session_t*
 }
 
 static void add_observation(golioth_coap_request_msg_t* req, golioth_coap_client_t* client) {
-    // scan for available (not used) observation slot
-    golioth_coap_observe_info_t* obs_info = NULL;
-    bool found_slot = false;
-    for (int i = 0; i < CONFIG_GOLIOTH_MAX_NUM_OBSERVATIONS; i++) {
-        obs_info = &client->observations[i];
-        if (!obs_info->in_use) {
-            found_slot = true;
-            break;
-        }
-    }
-
-    if (!found_slot) {
+    if (client->observations.count >= CONFIG_GOLIOTH_MAX_NUM_OBSERVATIONS) {
         ESP_LOGE(TAG, "Unable to observe path %s, no slots available", req->path);
         return;
     }
 
-    obs_info->in_use = true;
+    golioth_coap_observe_info_t* obs_info = malloc(sizeof(golioth_coap_observe_info_t));
+    if (!obs_info) {
+        ESP_LOGE(TAG, "Unable to observe path %s, out of memory", req->path);
+        return;
+    }
+    GSTATS_INC_ALLOC("observation");
     memcpy(&obs_info->req, req, sizeof(obs_info->req));
+    obs_info->state = GOLIOTH_COAP_OBSERVE_ACTIVE;
+    obs_info->has_seq = false;
+    obs_info->etag_len = 0;
+
+    golioth_status_t status = golioth_coap_token_index_insert(
+            &client->observations, req->token, req->token_len, obs_info);
+    if (status != GOLIOTH_OK) {
+        ESP_LOGE(TAG, "Unable to observe path %s, out of memory", req->path);
+        free(obs_info);
+        GSTATS_INC_FREE("observation");
+    }
+}
+
+// Free all observations, and their index
+static void free_observations(golioth_coap_client_t* client) {
+    golioth_coap_token_index_t* index = &client->observations;
+    for (size_t i = 0; i < index->capacity; i++) {
+        if (index->entries[i].in_use) {
+            free(index->entries[i].value);
+            GSTATS_INC_FREE("observation");
+        }
+    }
+    golioth_coap_token_index_deinit(index);
 }
 
+// Send the registration of an observation, with a new token or the one in req.
+// If etag_len > 0, the server only sends the representation if it no longer matches etag.
 static void golioth_coap_observe(
         golioth_coap_request_msg_t* req,
         golioth_coap_client_t* client,
-        coap_session_t* session) {
+        coap_session_t* session,
+        bool new_token,
+        const uint8_t* etag,
+        size_t etag_len) {
     // GET with an OBSERVE option
     coap_pdu_t* req_pdu = coap_new_pdu(COAP_MESSAGE_CON, COAP_REQUEST_GET, session);
     if (!req_pdu) {
@@ -456,7 +1587,11 @@ static void golioth_coap_observe(
     }
     GSTATS_INC_ALLOC("observe_pdu");
 
-    golioth_coap_add_token(req_pdu, req, session);
+    if (new_token) {
+        golioth_coap_add_token(req_pdu, req, session);
+    } else {
+        coap_add_token(req_pdu, req->token_len, req->token);
+    }
 
     unsigned char optbuf[4] = {};
     coap_add_option(
@@ -465,6 +1600,10 @@ static void golioth_coap_observe(
             coap_encode_var_safe(optbuf, sizeof(optbuf), COAP_OBSERVE_ESTABLISH),
             optbuf);
 
+    if (etag_len > 0) {
+        coap_add_option(req_pdu, COAP_OPTION_ETAG, etag_len, etag);
+    }
+
     golioth_coap_add_path(req_pdu, req->path_prefix, req->path);
     golioth_coap_add_content_type(req_pdu, req->observe.content_type);
 
@@ -472,14 +1611,180 @@ static void golioth_coap_observe(
     GSTATS_INC_FREE("observe_pdu");
 }
 
+// Observations are registered again on a new session through the window of requests
+// in flight (see register_observations), instead of all at once, which would be a
+// burst of CON messages on a fresh session.
+//
+// Here they get new tokens, and wait to be registered.
 static void reestablish_observations(golioth_coap_client_t* client, coap_session_t* session) {
+    client->num_observations_to_register = 0;
+    client->num_observations_registering = 0;
+    client->restoring_observations = false;
+    if (client->observations.count == 0) {
+        return;
+    }
+
+    // Index the observations again, with their new tokens
+    golioth_coap_token_index_t old_index = client->observations;
+    if (golioth_coap_token_index_init(&client->observations, old_index.count) != GOLIOTH_OK) {
+        ESP_LOGE(TAG, "Unable to re-establish observations, out of memory");
+        client->observations = old_index;
+        return;
+    }
+    for (size_t i = 0; i < old_index.capacity; i++) {
+        if (!old_index.entries[i].in_use) {
+            continue;
+        }
+        golioth_coap_observe_info_t* obs_info = old_index.entries[i].value;
+        coap_session_new_token(session, &obs_info->req.token_len, obs_info->req.token);
+        obs_info->state = GOLIOTH_COAP_OBSERVE_PENDING_REGISTER;
+        // The server numbers the notifications of the new registration from scratch
+        obs_info->has_seq = false;
+        // Can't fail, the new index has room for all of them
+        golioth_coap_token_index_insert(
+                &client->observations, obs_info->req.token, obs_info->req.token_len, obs_info);
+    }
+    golioth_coap_token_index_deinit(&old_index);
+
+    client->num_observations_to_register = client->observations.count;
+    client->restoring_observations = true;
+}
+
+static size_t num_in_flight(const golioth_coap_client_t* client) {
+    return client->num_pending_reqs + client->num_observations_registering;
+}
+
+// Send registrations of observations waiting for one, while there is room in the window
+// of requests in flight.
+//
+// Returns the number of registrations that got no response in time. next_timeout_ms
+// is set to the time until the next registration times out, or INT32_MAX if none.
+static size_t register_observations(
+        golioth_coap_client_t* client,
+        coap_session_t* session,
+        int32_t* next_timeout_ms) {
+    *next_timeout_ms = INT32_MAX;
+    if (!client->restoring_observations) {
+        return 0;
+    }
+
+    uint64_t now_ms = golioth_time_millis();
+    size_t num_timeouts = 0;
+    const golioth_coap_token_index_t* index = &client->observations;
+    for (size_t i = 0; i < index->capacity; i++) {
+        if (!index->entries[i].in_use) {
+            continue;
+        }
+        golioth_coap_observe_info_t* obs_info = index->entries[i].value;
+
+        if (obs_info->state == GOLIOTH_COAP_OBSERVE_PENDING_REGISTER
+            && num_in_flight(client) < CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS) {
+            ESP_LOGD(TAG, "Re-establish OBSERVE %s", obs_info->req.path);
+            golioth_coap_observe(
+                    &obs_info->req,
+                    client,
+                    session,
+                    false,
+                    obs_info->etag,
+                    obs_info->etag_len);
+            obs_info->state = GOLIOTH_COAP_OBSERVE_REGISTERING;
+            obs_info->register_timeout_ms = now_ms + CONFIG_GOLIOTH_COAP_RESPONSE_TIMEOUT_S * 1000;
+            client->num_observations_to_register--;
+            client->num_observations_registering++;
+        }
+
+        if (obs_info->state != GOLIOTH_COAP_OBSERVE_REGISTERING) {
+            continue;
+        }
+        if (now_ms >= obs_info->register_timeout_ms) {
+            ESP_LOGE(
+                    TAG,
+                    "Timeout: never got a response from the server (observe, path %s)",
+                    obs_info->req.path);
+            // Registered again on the next session
+            obs_info->state = GOLIOTH_COAP_OBSERVE_PENDING_REGISTER;
+            client->num_observations_registering--;
+            client->num_observations_to_register++;
+            num_timeouts++;
+        } else {
+            *next_timeout_ms = min(*next_timeout_ms, obs_info->register_timeout_ms - now_ms);
+        }
+    }
+    return num_timeouts;
+}
+
+static golioth_coap_observe_info_t* find_observation(
+        golioth_coap_client_t* client,
+        const char* path_prefix,
+        const char* path) {
+    const golioth_coap_token_index_t* index = &client->observations;
+    for (size_t i = 0; i < index->capacity; i++) {
+        if (!index->entries[i].in_use) {
+            continue;
+        }
+        golioth_coap_observe_info_t* obs_info = index->entries[i].value;
+        if (0 == strcmp(obs_info->req.path_prefix, path_prefix)
+            && 0 == strcmp(obs_info->req.path, path)) {
+            return obs_info;
+        }
+    }
+    return NULL;
+}
+
+// Deregister and free all observations of the request's path.
+//
+// RFC 7641 section 3.6: the deregistration is a GET with Observe=1 and the token of
+// the observation. The request takes the token of the last one, so its response
+// completes the request. Responses to the others are ignored.
+//
+// Returns the number of deregistrations sent
+static size_t golioth_coap_unobserve(
+        golioth_coap_request_msg_t* req,
+        golioth_coap_client_t* client,
+        coap_session_t* session) {
     golioth_coap_observe_info_t* obs_info = NULL;
-    for (int i = 0; i < CONFIG_GOLIOTH_MAX_NUM_OBSERVATIONS; i++) {
-        obs_info = &client->observations[i];
-        if (obs_info->in_use) {
-            golioth_coap_observe(&obs_info->req, client, session);
+    size_t num_deregistered = 0;
+    while ((obs_info = find_observation(client, req->path_prefix, req->path))) {
+        golioth_coap_token_index_remove(
+                &client->observations, obs_info->req.token, obs_info->req.token_len, obs_info);
+        if (obs_info->state == GOLIOTH_COAP_OBSERVE_PENDING_REGISTER) {
+            client->num_observations_to_register--;
+        } else if (obs_info->state == GOLIOTH_COAP_OBSERVE_REGISTERING) {
+            client->num_observations_registering--;
+        }
+
+        coap_pdu_t* req_pdu = coap_new_pdu(COAP_MESSAGE_CON, COAP_REQUEST_GET, session);
+        if (req_pdu) {
+            GSTATS_INC_ALLOC("unobserve_pdu");
+            coap_add_token(req_pdu, obs_info->req.token_len, obs_info->req.token);
+
+            unsigned char optbuf[4] = {};
+            coap_add_option(
+                    req_pdu,
+                    COAP_OPTION_OBSERVE,
+                    coap_encode_var_safe(optbuf, sizeof(optbuf), COAP_OBSERVE_CANCEL),
+                    optbuf);
+
+            golioth_coap_add_path(req_pdu, obs_info->req.path_prefix, obs_info->req.path);
+            golioth_coap_add_content_type(req_pdu, obs_info->req.observe.content_type);
+
+            coap_send(session, req_pdu);
+            GSTATS_INC_FREE("unobserve_pdu");
+
+            memcpy(req->token, obs_info->req.token, obs_info->req.token_len);
+            req->token_len = obs_info->req.token_len;
+            num_deregistered++;
+        } else {
+            // Notifications that still arrive are rejected, which also deregisters
+            ESP_LOGE(TAG, "coap_new_pdu() unobserve failed");
         }
+
+        free(obs_info);
+        GSTATS_INC_FREE("observation");
     }
+    finish_observation_restore(client);
+
+    return num_deregistered;
 }
 
 static golioth_status_t create_context(golioth_coap_client_t* client, coap_context_t** context) {
@@ -529,17 +1834,25 @@ static golioth_status_t create_session(
         return GOLIOTH_ERR_INVALID_FORMAT;
     }
 
+    char client_sni[256] = {};
+    memcpy(client_sni, host_uri.host.s, MIN(host_uri.host.length, sizeof(client_sni) - 1));
+
     // Get destination address of host
     coap_address_t dst_addr = {};
-    GOLIOTH_STATUS_RETURN_IF_ERROR(get_coap_dst_address(&host_uri, &dst_addr));
+    GOLIOTH_STATUS_RETURN_IF_ERROR(
+            get_coap_dst_address(client, client_sni, host_uri.port, &dst_addr));
+    client->session_addr = dst_addr;
 
     ESP_LOGI(TAG, "Start CoAP session with host: %s", CONFIG_GOLIOTH_COAP_HOST_URI);
 
-    char client_sni[256] = {};
-    memcpy(client_sni, host_uri.host.s, MIN(host_uri.host.length, sizeof(client_sni) - 1));
-
     golioth_tls_auth_type_t auth_type = client->config.credentials.auth_type;
 
+    // The handshake starts as soon as the session is created
+    client->session_start_ms = golioth_time_millis();
+    portENTER_CRITICAL(&client->lanes_lock);
+    client->conn_stats.num_sessions++;
+    portEXIT_CRITICAL(&client->lanes_lock);
+
     if (auth_type == GOLIOTH_TLS_AUTH_TYPE_PSK) {
         golioth_psk_credentials_t psk_creds = client->config.credentials.psk;
 
@@ -598,187 +1911,330 @@ static golioth_status_t create_session(
     return GOLIOTH_OK;
 }
 
-static golioth_status_t coap_io_loop_once(
+static golioth_coap_pending_req_t* alloc_pending_req(golioth_coap_client_t* client) {
+    for (int i = 0; i < CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS; i++) {
+        golioth_coap_pending_req_t* pending = &client->pending_reqs[i];
+        if (!pending->in_use) {
+            pending->in_use = true;
+            client->num_pending_reqs++;
+            return pending;
+        }
+    }
+    return NULL;
+}
+
+// Send a request as a NON message. There is no response to wait for, so the request
+// completes once it's sent. dequeue_request made sure it's within the NON rate.
+static void send_non_request(
         golioth_coap_client_t* client,
-        coap_context_t* context,
-        coap_session_t* session) {
-    golioth_coap_request_msg_t request_msg = {};
+        coap_session_t* session,
+        golioth_coap_request_msg_t* request_msg) {
+    // The lane may have been made non-confirmable after the request was dequeued,
+    // so the credit may not be there
+    client->non_credit -= min(client->non_credit, (uint64_t)1000);
 
-    // Wait for request message, with timeout
-    bool got_request_msg = xQueueReceive(
-            client->request_queue,
-            &request_msg,
-            CONFIG_GOLIOTH_COAP_REQUEST_QUEUE_TIMEOUT_MS / portTICK_PERIOD_MS);
-    if (!got_request_msg) {
-        // No requests, so process other pending IO (e.g. observations)
-        ESP_LOGV(TAG, "Idle io process start");
-        coap_io_process(context, COAP_IO_NO_WAIT);
-        ESP_LOGV(TAG, "Idle io process end");
-        return GOLIOTH_OK;
+    ESP_LOGD(TAG, "Handle NON POST %s", request_msg->path);
+    golioth_response_t response = {
+            .status = golioth_coap_post(request_msg, session, COAP_MESSAGE_NON),
+    };
+    if (response.status != GOLIOTH_OK) {
+        ESP_LOGE(
+                TAG,
+                "Failed to send NON request, path %s (%s)",
+                request_msg->path,
+                golioth_status_to_str(response.status));
     }
+    release_request_payload(request_msg);
+    invoke_request_callback(client, request_msg, &response, NULL, 0);
+    free_request(client, request_msg);
+}
 
+// Send a request to the server and track it in the pending request table.
+static void send_request(
+        golioth_coap_client_t* client,
+        coap_session_t* session,
+        golioth_coap_request_msg_t* request_msg) {
     // Make sure the request isn't too old
-    if (golioth_time_millis() > request_msg.ageout_ms) {
+    if (golioth_time_millis() > request_msg->ageout_ms) {
         ESP_LOGW(
                 TAG,
                 "Ignoring request that has aged out, type %d, path %s",
-                request_msg.type,
-                (request_msg.path ? request_msg.path : "N/A"));
+                request_msg->type,
+                (request_msg->path ? request_msg->path : "N/A"));
 
-        if (request_msg.type == GOLIOTH_COAP_REQUEST_POST && request_msg.post.payload_size > 0) {
-            free(request_msg.post.payload);
-            GSTATS_INC_FREE("request_payload");
-        }
+        release_request_payload(request_msg);
 
-        if (request_msg.request_complete_event) {
-            assert(request_msg.request_complete_ack_sem);
-            vEventGroupDelete(request_msg.request_complete_event);
-            GSTATS_INC_FREE("request_complete_event");
-            vSemaphoreDelete(request_msg.request_complete_ack_sem);
-            GSTATS_INC_FREE("request_complete_ack_sem");
+        if (request_msg->sync_completion) {
+            notify_sync_completion(request_msg, false);
+        } else {
+            // Let async callers know the request will never complete, so they
+            // can retry it or release resources tied to it.
+            golioth_response_t response = {
+                    .status = GOLIOTH_ERR_TIMEOUT,
+            };
+            invoke_request_callback(client, request_msg, &response, NULL, 0);
         }
-        return GOLIOTH_OK;
+        free_request(client, request_msg);
+        return;
+    }
+
+    if (is_non_confirmable(client, request_msg)) {
+        send_non_request(client, session, request_msg);
+        return;
     }
 
     // Handle message and send request to server
     bool request_is_valid = true;
-    switch (request_msg.type) {
+    golioth_status_t send_status = GOLIOTH_OK;
+    switch (request_msg->type) {
         case GOLIOTH_COAP_REQUEST_EMPTY:
             ESP_LOGD(TAG, "Handle EMPTY");
-            golioth_coap_empty(&request_msg, session);
+            golioth_coap_empty(request_msg, session);
             break;
         case GOLIOTH_COAP_REQUEST_GET:
-            ESP_LOGD(TAG, "Handle GET %s", request_msg.path);
-            golioth_coap_get(&request_msg, session);
+            ESP_LOGD(TAG, "Handle GET %s", request_msg->path);
+            golioth_coap_get(request_msg, session);
             break;
         case GOLIOTH_COAP_REQUEST_GET_BLOCK:
-            ESP_LOGD(TAG, "Handle GET_BLOCK %s", request_msg.path);
-            golioth_coap_get_block(&request_msg, client, session);
+            ESP_LOGD(TAG, "Handle GET_BLOCK %s", request_msg->path);
+            golioth_coap_get_block(request_msg, client, session);
             break;
         case GOLIOTH_COAP_REQUEST_POST:
-            ESP_LOGD(TAG, "Handle POST %s", request_msg.path);
-            golioth_coap_post(&request_msg, session);
-            assert(request_msg.post.payload);
-            free(request_msg.post.payload);
-            GSTATS_INC_FREE("request_payload");
+            ESP_LOGD(TAG, "Handle POST %s", request_msg->path);
+            send_status = golioth_coap_post(request_msg, session, COAP_MESSAGE_CON);
+            release_request_payload(request_msg);
+            break;
+        case GOLIOTH_COAP_REQUEST_POST_BLOCK:
+            ESP_LOGD(TAG, "Handle POST_BLOCK %s", request_msg->path);
+            send_status = golioth_coap_post_block(request_msg, session);
             break;
         case GOLIOTH_COAP_REQUEST_DELETE:
-            ESP_LOGD(TAG, "Handle DELETE %s", request_msg.path);
-            golioth_coap_delete(&request_msg, session);
+            ESP_LOGD(TAG, "Handle DELETE %s", request_msg->path);
+            golioth_coap_delete(request_msg, session);
             break;
         case GOLIOTH_COAP_REQUEST_OBSERVE:
-            ESP_LOGD(TAG, "Handle OBSERVE %s", request_msg.path);
-            golioth_coap_observe(&request_msg, client, session);
-            add_observation(&request_msg, client);
+            ESP_LOGD(TAG, "Handle OBSERVE %s", request_msg->path);
+            golioth_coap_observe(request_msg, client, session, true, NULL, 0);
+            add_observation(request_msg, client);
+            break;
+        case GOLIOTH_COAP_REQUEST_UNOBSERVE:
+            ESP_LOGD(TAG, "Handle UNOBSERVE %s", request_msg->path);
+            if (golioth_coap_unobserve(request_msg, client, session) == 0) {
+                // Nothing was sent, so there is no response to wait for. Nothing is
+                // left to deregister either, so a sync caller is done.
+                ESP_LOGD(TAG, "No observation of %s", request_msg->path);
+                notify_sync_completion(request_msg, true);
+                request_is_valid = false;
+            }
             break;
         default:
-            ESP_LOGW(TAG, "Unknown request_msg type: %u", request_msg.type);
+            ESP_LOGW(TAG, "Unknown request_msg type: %u", request_msg->type);
             request_is_valid = false;
             break;
     }
 
     if (!request_is_valid) {
-        return GOLIOTH_OK;
+        notify_sync_completion(request_msg, false);
+        free_request(client, request_msg);
+        return;
     }
 
     // If we get here, then a confirmable request has been sent to the server,
     // and we should wait for a response.
-    client->pending_req = &request_msg;
-    request_msg.got_response = false;
-    int32_t time_spent_waiting_ms = 0;
-    int32_t timeout_ms = CONFIG_GOLIOTH_COAP_RESPONSE_TIMEOUT_S * 1000;
-
-    if (request_msg.ageout_ms != GOLIOTH_WAIT_FOREVER) {
-        int32_t time_till_ageout_ms = (int32_t)(request_msg.ageout_ms - golioth_time_millis());
-        timeout_ms = min(timeout_ms, time_till_ageout_ms);
-    }
-
-    bool io_error = false;
-    while (time_spent_waiting_ms < timeout_ms) {
-        int32_t remaining_ms = timeout_ms - time_spent_waiting_ms;
-        int32_t wait_ms = min(1000, remaining_ms);
-        int32_t num_ms = coap_io_process(context, wait_ms);
-        if (num_ms < 0) {
-            io_error = true;
-            break;
-        } else {
-            time_spent_waiting_ms += num_ms;
-            if (request_msg.got_response) {
-                ESP_LOGD(TAG, "Received response in %d ms", time_spent_waiting_ms);
-                break;
-            } else {
-                // During normal operation, there will be other kinds of IO to process,
-                // in which case we will get here.
-                // Since we haven't received the response yet, just keep waiting.
-            }
-        }
+    golioth_coap_pending_req_t* pending = alloc_pending_req(client);
+    assert(pending);  // caller ensures there is a free slot
+
+    uint64_t now_ms = golioth_time_millis();
+    pending->req = request_msg;
+    if (golioth_coap_token_index_insert(
+                &client->pending_index, request_msg->token, request_msg->token_len, pending)
+        != GOLIOTH_OK) {
+        // Can't happen, the index has room for all pending requests
+        ESP_LOGE(TAG, "Failed to index request, path %s", request_msg->path);
+    }
+    pending->sent_ms = now_ms;
+    pending->timeout_ms = now_ms + CONFIG_GOLIOTH_COAP_RESPONSE_TIMEOUT_S * 1000;
+    if (request_msg->ageout_ms != GOLIOTH_WAIT_FOREVER) {
+        pending->timeout_ms = min(pending->timeout_ms, request_msg->ageout_ms);
+    }
+
+    if (send_status != GOLIOTH_OK) {
+        // Nothing was sent, so fail the request right away
+        ESP_LOGE(
+                TAG,
+                "Failed to send request, path %s (%s)",
+                request_msg->path,
+                golioth_status_to_str(send_status));
+        golioth_response_t response = {
+                .status = send_status,
+        };
+        invoke_request_callback(client, pending->req, &response, NULL, 0);
+        complete_pending_req(client, pending, false);
     }
-    client->pending_req = NULL;
-
-    if (request_msg.request_complete_event) {
-        assert(request_msg.request_complete_ack_sem);
+}
 
-        if (request_msg.got_response) {
-            xEventGroupSetBits(request_msg.request_complete_event, RESPONSE_RECEIVED_EVENT_BIT);
-        } else {
-            xEventGroupSetBits(request_msg.request_complete_event, RESPONSE_TIMEOUT_EVENT_BIT);
+// Time, in milliseconds, until the earliest pending request times out
+static int32_t time_till_next_pending_timeout_ms(golioth_coap_client_t* client) {
+    uint64_t now_ms = golioth_time_millis();
+    int32_t min_ms = INT32_MAX;
+    for (int i = 0; i < CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS; i++) {
+        const golioth_coap_pending_req_t* pending = &client->pending_reqs[i];
+        if (!pending->in_use) {
+            continue;
         }
+        int32_t remaining_ms =
+                (pending->timeout_ms > now_ms ? (int32_t)(pending->timeout_ms - now_ms) : 0);
+        min_ms = min(min_ms, remaining_ms);
+    }
+    return min_ms;
+}
 
-        // Wait for user task to receive the event.
-        xSemaphoreTake(request_msg.request_complete_ack_sem, portMAX_DELAY);
+// Returns the number of pending requests that timed out
+static size_t timeout_expired_pending_reqs(golioth_coap_client_t* client) {
+    uint64_t now_ms = golioth_time_millis();
+    size_t num_timeouts = 0;
+    for (int i = 0; i < CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS; i++) {
+        golioth_coap_pending_req_t* pending = &client->pending_reqs[i];
+        if (pending->in_use && now_ms >= pending->timeout_ms) {
+            ESP_LOGE(
+                    TAG,
+                    "Timeout: never got a response from the server (type %d, path %s)",
+                    pending->req->type,
+                    pending->req->path);
+            timeout_pending_req(client, pending);
+            num_timeouts++;
+        }
+    }
+    return num_timeouts;
+}
 
-        // Now it's safe to delete the event and semaphore.
-        vEventGroupDelete(request_msg.request_complete_event);
-        GSTATS_INC_FREE("request_complete_event");
-        vSemaphoreDelete(request_msg.request_complete_ack_sem);
-        GSTATS_INC_FREE("request_complete_ack_sem");
+// Fail every request in flight (e.g. because the session is ending)
+static void timeout_all_pending_reqs(golioth_coap_client_t* client) {
+    for (int i = 0; i < CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS; i++) {
+        golioth_coap_pending_req_t* pending = &client->pending_reqs[i];
+        if (pending->in_use) {
+            timeout_pending_req(client, pending);
+        }
     }
+}
 
-    if (io_error) {
-        ESP_LOGE(TAG, "Error in coap_io_process");
-        return GOLIOTH_ERR_IO;
+// Fail every request still waiting to be sent (e.g. because the client is stopped),
+// so nothing waits forever on a callback or sync completion that would never come.
+// They don't count as sent in the lane statistics.
+static void fail_queued_requests(golioth_coap_client_t* client) {
+    golioth_response_t response = {
+            .status = GOLIOTH_ERR_INVALID_STATE,
+    };
+    while (xSemaphoreTake(client->request_count_sem, 0)) {
+        golioth_coap_request_msg_t* req = dequeue_request(client, false);
+        if (!req) {
+            continue;
+        }
+        invoke_request_callback(client, req, &response, NULL, 0);
+        notify_sync_completion(req, false);
+        release_request_payload(req);
+        free_request(client, req);
     }
+}
 
-    if (time_spent_waiting_ms >= timeout_ms) {
-        ESP_LOGE(TAG, "Timeout: never got a response from the server");
+static golioth_status_t coap_io_loop_once(
+        golioth_coap_client_t* client,
+        coap_context_t* context,
+        coap_session_t* session,
+        bool accept_new_requests) {
+    // Observations to re-establish go first
+    int32_t register_timeout_ms = INT32_MAX;
+    size_t num_register_timeouts = register_observations(client, session, &register_timeout_ms);
 
-        // Call user's callback with GOLIOTH_ERR_TIMEOUT
-        // TODO - simplify, put callback directly in request which removes if/else branches
-        golioth_response_t response = {};
-        response.status = GOLIOTH_ERR_TIMEOUT;
-        if (request_msg.type == GOLIOTH_COAP_REQUEST_GET && request_msg.get.callback) {
-            request_msg.get.callback(
-                    client, &response, request_msg.path, NULL, 0, request_msg.get.arg);
-        } else if (
-                request_msg.type == GOLIOTH_COAP_REQUEST_GET_BLOCK
-                && request_msg.get_block.callback) {
-            request_msg.get_block.callback(
-                    client, &response, request_msg.path, NULL, 0, request_msg.get_block.arg);
-        } else if (request_msg.type == GOLIOTH_COAP_REQUEST_POST && request_msg.post.callback) {
-            request_msg.post.callback(client, &response, request_msg.path, request_msg.post.arg);
-        } else if (request_msg.type == GOLIOTH_COAP_REQUEST_DELETE && request_msg.delete.callback) {
-            request_msg.delete.callback(
-                    client, &response, request_msg.path, request_msg.delete.arg);
+    // Fill the window of requests in flight.
+    //
+    // Without a wake fd, block waiting on the queue if there's nothing in flight,
+    // then poll the socket. Otherwise, the socket and the queue are waited on together
+    // in coap_io_process below.
+    int32_t non_wait_ms = INT32_MAX;
+    while (accept_new_requests
+           && num_in_flight(client) < CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS) {
+        TickType_t wait_ticks = 0;
+        if (client->wake_fd < 0 && num_in_flight(client) == 0) {
+            wait_ticks = CONFIG_GOLIOTH_COAP_REQUEST_QUEUE_TIMEOUT_MS / portTICK_PERIOD_MS;
         }
 
-        if (client->event_callback && client->session_connected) {
-            client->event_callback(
-                    client, GOLIOTH_CLIENT_EVENT_DISCONNECTED, client->event_callback_arg);
+        if (!xSemaphoreTake(client->request_count_sem, wait_ticks)) {
+            break;
         }
-        client->session_connected = false;
-        return GOLIOTH_ERR_TIMEOUT;
+        golioth_coap_request_msg_t* request_msg = dequeue_request(client, true);
+        if (!request_msg) {
+            // Only NON requests over the rate are waiting. Leave them in their lanes,
+            // and wake up when the next one can be sent.
+            xSemaphoreGive(client->request_count_sem);
+            non_wait_ms = max(1, time_till_non_credit_ms(client));
+            break;
+        }
+        client->lanes[request_msg->lane].num_sent++;
+        send_request(client, session, request_msg);
+    }
+
+    if (client->wake_fd < 0 && num_in_flight(client) == 0) {
+        // Nothing in flight, so process other pending IO (e.g. observations). If NON
+        // requests are waiting for credit, wait for it here rather than spin.
+        ESP_LOGV(TAG, "Idle io process start");
+        coap_io_process(context, (non_wait_ms < INT32_MAX ? non_wait_ms : COAP_IO_NO_WAIT));
+        ESP_LOGV(TAG, "Idle io process end");
+        return GOLIOTH_OK;
+    }
+
+    int32_t num_ms = 0;
+    if (client->wake_fd >= 0) {
+        // Wait for responses, observations or new requests. With nothing in flight,
+        // and no NON requests waiting for credit, there's nothing to time out, so wait
+        // until one of them arrives.
+        uint32_t wait_ms = COAP_IO_WAIT;
+        if (num_in_flight(client) > 0 || non_wait_ms < INT32_MAX) {
+            int32_t timeout_ms = min(time_till_next_pending_timeout_ms(client), non_wait_ms);
+            wait_ms = max(1, min(timeout_ms, register_timeout_ms));
+        }
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(client->wake_fd, &readfds);
+        num_ms = coap_io_process_with_fds(
+                context, wait_ms, client->wake_fd + 1, &readfds, NULL, NULL);
+        if (num_ms >= 0 && FD_ISSET(client->wake_fd, &readfds)) {
+            uint64_t num_wakes = 0;
+            read(client->wake_fd, &num_wakes, sizeof(num_wakes));
+        }
+    } else {
+        // Wait for responses. If there's room in the window, don't wait too long,
+        // so that new requests can be sent while others are in flight.
+        int32_t wait_ms = min(1000, time_till_next_pending_timeout_ms(client));
+        wait_ms = min(wait_ms, min(register_timeout_ms, non_wait_ms));
+        if (num_in_flight(client) < CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS) {
+            wait_ms = min(COAP_IO_PROCESS_SLICE_MS, wait_ms);
+        }
+        // Note: a timeout of 0 means "wait forever" to coap_io_process
+        num_ms = coap_io_process(context, max(1, wait_ms));
+    }
+    if (num_ms < 0) {
+        ESP_LOGE(TAG, "Error in coap_io_process");
+        timeout_all_pending_reqs(client);
+        return GOLIOTH_ERR_IO;
+    }
+
+    if (timeout_expired_pending_reqs(client) + num_register_timeouts > 0) {
+        if (client->event_callback && client->session_connected) {
+            client->event_callback(
+                    client, GOLIOTH_CLIENT_EVENT_DISCONNECTED, client->event_callback_arg);
+        }
+        client->session_connected = false;
+        return GOLIOTH_ERR_TIMEOUT;
     }
 
-    if (client->event_callback && !client->session_connected) {
-        client->event_callback(client, GOLIOTH_CLIENT_EVENT_CONNECTED, client->event_callback_arg);
-    }
-    client->session_connected = true;
     return GOLIOTH_OK;
 }
 
 static void on_keepalive(TimerHandle_t timer) {
     golioth_coap_client_t* c = (golioth_coap_client_t*)pvTimerGetTimerID(timer);
-    if (c->is_running && golioth_client_num_items_in_request_queue(c) == 0 && !c->pending_req) {
+    if (c->is_running && golioth_client_num_items_in_request_queue(c) == 0
+        && c->num_pending_reqs == 0) {
         ESP_LOGD(TAG, "keepalive");
         golioth_coap_client_empty(c, false, GOLIOTH_WAIT_FOREVER);
     }
@@ -798,8 +2254,11 @@ static void golioth_coap_client_task(void* arg) {
     golioth_coap_client_t* client = (golioth_coap_client_t*)arg;
     assert(client);
 
+    // Kept from one session to the next while the client runs, only sessions are
+    // created anew on reconnect
+    coap_context_t* coap_context = NULL;
+
     while (1) {
-        coap_context_t* coap_context = NULL;
         coap_session_t* coap_session = NULL;
 
         client->end_session = false;
@@ -812,7 +2271,7 @@ static void golioth_coap_client_task(void* arg) {
         ESP_LOGD(TAG, "Received \"run\" signal");
         client->is_running = true;
 
-        if (create_context(client, &coap_context) != GOLIOTH_OK) {
+        if (!coap_context && create_context(client, &coap_context) != GOLIOTH_OK) {
             goto cleanup;
         }
 
@@ -820,6 +2279,10 @@ static void golioth_coap_client_task(void* arg) {
             goto cleanup;
         }
 
+        // Allow libcoap to have as many confirmable requests
+        // outstanding as we have pending request slots.
+        coap_session_set_nstart(coap_session, CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS);
+
         // Seed the session token generator
         uint8_t seed_token[8];
         size_t seed_token_len;
@@ -836,21 +2299,30 @@ static void golioth_coap_client_task(void* arg) {
             golioth_coap_client_empty(client, false, GOLIOTH_WAIT_FOREVER);
         }
 
-        // If we are re-connecting and had prior observations, set
-        // them up again now (tokens will be updated).
+        // If we are re-connecting and had prior observations, queue them to be
+        // set up again (tokens will be updated).
         reestablish_observations(client, coap_session);
 
         ESP_LOGI(TAG, "Entering CoAP I/O loop");
         int iteration = 0;
+        bool stopping = false;
         while (!client->end_session) {
             // Check if we should still run (non-blocking)
-            if (!xSemaphoreTake(client->run_sem, 0)) {
-                ESP_LOGI(TAG, "Stopping");
+            if (!stopping) {
+                if (xSemaphoreTake(client->run_sem, 0)) {
+                    xSemaphoreGive(client->run_sem);
+                } else {
+                    ESP_LOGI(TAG, "Stopping");
+                    stopping = true;
+                }
+            }
+
+            // When stopping, finish the requests in flight, but don't send new ones
+            if (stopping && client->num_pending_reqs == 0) {
                 break;
             }
-            xSemaphoreGive(client->run_sem);
 
-            if (coap_io_loop_once(client, coap_context, coap_session) != GOLIOTH_OK) {
+            if (coap_io_loop_once(client, coap_context, coap_session, !stopping) != GOLIOTH_OK) {
                 client->end_session = true;
             }
             iteration++;
@@ -859,7 +2331,11 @@ static void golioth_coap_client_task(void* arg) {
     cleanup:
         ESP_LOGI(TAG, "Ending session");
 
-        if (client->event_callback && client->session_connected) {
+        // Requests in flight will never get a response now
+        timeout_all_pending_reqs(client);
+
+        bool was_connected = client->session_connected;
+        if (client->event_callback && was_connected) {
             client->event_callback(
                     client, GOLIOTH_CLIENT_EVENT_DISCONNECTED, client->event_callback_arg);
         }
@@ -868,14 +2344,28 @@ static void golioth_coap_client_task(void* arg) {
         if (coap_session) {
             coap_session_release(coap_session);
             GSTATS_INC_FREE("session");
+            if (!was_connected) {
+                // Try another address of the server next time
+                dns_cache_next(client);
+            }
         }
-        if (coap_context) {
+
+        bool keep_running = xSemaphoreTake(client->run_sem, 0);
+        if (keep_running) {
+            xSemaphoreGive(client->run_sem);
+        }
+        if (!keep_running) {
+            fail_queued_requests(client);
+        }
+        if (coap_context && !keep_running) {
             coap_free_context(coap_context);
             GSTATS_INC_FREE("context");
+            coap_context = NULL;
+            coap_cleanup();
         }
-        coap_cleanup();
 
-        // Small delay before starting a new session
+        // Small delay before starting a new session, also after a session that was up,
+        // so a server that accepts and then drops sessions doesn't cause a tight loop
         vTaskDelay(1000 / portTICK_PERIOD_MS);
     }
     vTaskDelete(NULL);
@@ -892,6 +2382,13 @@ golioth_client_t golioth_client_create(const golioth_client_config_t* config) {
         time_t t;
         srand(time(&t));
 
+        // For the wake fd of each client. Fine if the application registered it already.
+        esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+        esp_err_t err = esp_vfs_eventfd_register(&eventfd_config);
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+            ESP_LOGW(TAG, "Failed to register eventfd: %d", err);
+        }
+
         _initialized = true;
     }
 
@@ -903,6 +2400,22 @@ golioth_client_t golioth_client_create(const golioth_client_config_t* config) {
     GSTATS_INC_ALLOC("client");
 
     new_client->config = *config;
+    new_client->ota_max_block_size = GOLIOTH_OTA_BLOCKSIZE;
+
+    new_client->wake_fd = eventfd(0, 0);
+    if (new_client->wake_fd < 0) {
+        ESP_LOGW(TAG, "Failed to create wake fd, CoAP task will poll");
+    } else {
+        GSTATS_INC_ALLOC("wake_fd");
+    }
+
+    if (golioth_coap_token_index_init(
+                &new_client->pending_index, CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS)
+                != GOLIOTH_OK
+        || golioth_coap_token_index_init(&new_client->observations, 0) != GOLIOTH_OK) {
+        ESP_LOGE(TAG, "Failed to allocate token indexes");
+        goto error;
+    }
 
     new_client->run_sem = xSemaphoreCreateBinary();
     if (!new_client->run_sem) {
@@ -912,13 +2425,94 @@ golioth_client_t golioth_client_create(const golioth_client_config_t* config) {
     GSTATS_INC_ALLOC("run_sem");
     xSemaphoreGive(new_client->run_sem);
 
-    new_client->request_queue = xQueueCreate(
-            CONFIG_GOLIOTH_COAP_REQUEST_QUEUE_MAX_ITEMS, sizeof(golioth_coap_request_msg_t));
-    if (!new_client->request_queue) {
-        ESP_LOGE(TAG, "Failed to create request queue");
+    new_client->request_count_sem = xSemaphoreCreateCounting(GOLIOTH_COAP_NUM_REQUESTS, 0);
+    if (!new_client->request_count_sem) {
+        ESP_LOGE(TAG, "Failed to create request count semaphore");
         goto error;
     }
-    GSTATS_INC_ALLOC("request_queue");
+    GSTATS_INC_ALLOC("request_count_sem");
+
+    new_client->dns_cache.refresh_sem = xSemaphoreCreateBinary();
+    if (!new_client->dns_cache.refresh_sem) {
+        ESP_LOGE(TAG, "Failed to create DNS refresh semaphore");
+        goto error;
+    }
+    GSTATS_INC_ALLOC("dns_refresh_sem");
+    xSemaphoreGive(new_client->dns_cache.refresh_sem);
+
+    portMUX_TYPE lanes_lock = portMUX_INITIALIZER_UNLOCKED;
+    new_client->lanes_lock = lanes_lock;
+    portMUX_TYPE dns_lock = portMUX_INITIALIZER_UNLOCKED;
+    new_client->dns_cache.lock = dns_lock;
+    uint8_t first_index = 0;
+    for (int i = 0; i < GOLIOTH_REQUEST_LANE_NUM; i++) {
+        golioth_coap_request_lane_t* lane = &new_client->lanes[i];
+        lane->queue = xQueueCreate(_lane_capacity[i], sizeof(uint8_t));
+        if (!lane->queue) {
+            ESP_LOGE(TAG, "Failed to create request queue");
+            goto error;
+        }
+        GSTATS_INC_ALLOC("request_queue");
+
+        lane->free_queue = xQueueCreate(_lane_capacity[i], sizeof(uint8_t));
+        if (!lane->free_queue) {
+            ESP_LOGE(TAG, "Failed to create free request queue");
+            goto error;
+        }
+        GSTATS_INC_ALLOC("free_request_queue");
+        for (uint8_t j = 0; j < _lane_capacity[i]; j++) {
+            uint8_t index = first_index + j;
+            xQueueSend(lane->free_queue, &index, 0);
+        }
+        first_index += _lane_capacity[i];
+    }
+
+    new_client->free_sync_completion_queue =
+            xQueueCreate(CONFIG_GOLIOTH_COAP_MAX_SYNC_REQUESTS, sizeof(uint8_t));
+    if (!new_client->free_sync_completion_queue) {
+        ESP_LOGE(TAG, "Failed to create free sync completion queue");
+        goto error;
+    }
+    GSTATS_INC_ALLOC("free_sync_completion_queue");
+    for (uint8_t i = 0; i < CONFIG_GOLIOTH_COAP_MAX_SYNC_REQUESTS; i++) {
+        golioth_coap_sync_completion_t* completion = &new_client->sync_completions[i];
+        completion->sem = xSemaphoreCreateBinary();
+        if (!completion->sem) {
+            ESP_LOGE(TAG, "Failed to create sync completion semaphore");
+            goto error;
+        }
+        GSTATS_INC_ALLOC("sync_completion_sem");
+        xQueueSend(new_client->free_sync_completion_queue, &i, 0);
+    }
+
+    ESP_LOGI(
+            TAG,
+            "%d request objects, %zu bytes",
+            GOLIOTH_COAP_NUM_REQUESTS,
+            sizeof(new_client->requests));
+
+    if (CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS > 0) {
+        new_client->payload_pool = malloc(
+                CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS * CONFIG_GOLIOTH_PAYLOAD_POOL_BUF_SIZE);
+        if (!new_client->payload_pool) {
+            ESP_LOGE(TAG, "Failed to allocate payload pool");
+            goto error;
+        }
+        GSTATS_INC_ALLOC("payload_pool");
+
+        new_client->payload_pool_free =
+                xQueueCreate(CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS, sizeof(uint8_t*));
+        if (!new_client->payload_pool_free) {
+            ESP_LOGE(TAG, "Failed to create payload pool queue");
+            goto error;
+        }
+        GSTATS_INC_ALLOC("payload_pool_free");
+
+        for (size_t i = 0; i < CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS; i++) {
+            uint8_t* buf = &new_client->payload_pool[i * CONFIG_GOLIOTH_PAYLOAD_POOL_BUF_SIZE];
+            xQueueSend(new_client->payload_pool_free, &buf, 0);
+        }
+    }
 
     bool task_created = xTaskCreate(
             golioth_coap_client_task,
@@ -931,154 +2525,504 @@ golioth_client_t golioth_client_create(const golioth_client_config_t* config) {
         ESP_LOGE(TAG, "Failed to create client task");
         goto error;
     }
-    GSTATS_INC_ALLOC("coap_task_handle");
+    GSTATS_INC_ALLOC("coap_task_handle");
+
+    new_client->keepalive_timer = xTimerCreate(
+            "keepalive",
+            max(1000, 1000 * CONFIG_GOLIOTH_COAP_KEEPALIVE_INTERVAL_S) / portTICK_PERIOD_MS,
+            pdTRUE,      // auto-reload
+            new_client,  // pvTimerID
+            on_keepalive);
+    if (!new_client->keepalive_timer) {
+        ESP_LOGE(TAG, "Failed to create keepalive timer");
+        goto error;
+    }
+    GSTATS_INC_ALLOC("keepalive_timer");
+
+    if (CONFIG_GOLIOTH_COAP_KEEPALIVE_INTERVAL_S > 0) {
+        if (!xTimerStart(new_client->keepalive_timer, 0)) {
+            ESP_LOGE(TAG, "Failed to start keepalive timer");
+            goto error;
+        }
+    }
+
+    new_client->is_running = true;
+
+    return (golioth_client_t)new_client;
+
+error:
+    golioth_client_destroy(new_client);
+    return NULL;
+}
+
+golioth_status_t golioth_client_start(golioth_client_t client) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c) {
+        return GOLIOTH_ERR_NULL;
+    }
+    xSemaphoreGive(c->run_sem);
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_client_stop(golioth_client_t client) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c) {
+        return GOLIOTH_ERR_NULL;
+    }
+    if (!xSemaphoreTake(c->run_sem, 100 / portTICK_PERIOD_MS)) {
+        ESP_LOGE(TAG, "stop: failed to take run_sem");
+        return GOLIOTH_ERR_TIMEOUT;
+    }
+    // The CoAP task may be waiting for I/O, let it see the stop
+    wake_coap_task(c);
+    return GOLIOTH_OK;
+}
+
+void golioth_client_destroy(golioth_client_t client) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c) {
+        return;
+    }
+    if (c->keepalive_timer) {
+        xTimerDelete(c->keepalive_timer, 0);
+        GSTATS_INC_FREE("keepalive_timer");
+    }
+    // Wait for a background DNS lookup, which references the client. Holding the
+    // semaphore keeps the CoAP task from starting another one.
+    if (c->dns_cache.refresh_sem) {
+        xSemaphoreTake(c->dns_cache.refresh_sem, portMAX_DELAY);
+    }
+    if (c->coap_task_handle) {
+        vTaskDelete(c->coap_task_handle);
+        GSTATS_INC_FREE("coap_task_handle");
+    }
+    // Complete whatever the task left behind, so payloads are released and no one
+    // waits on these requests
+    if (c->request_count_sem) {
+        timeout_all_pending_reqs(c);
+        fail_queued_requests(c);
+    }
+    for (int i = 0; i < GOLIOTH_REQUEST_LANE_NUM; i++) {
+        if (c->lanes[i].queue) {
+            vQueueDelete(c->lanes[i].queue);
+            GSTATS_INC_FREE("request_queue");
+        }
+        if (c->lanes[i].free_queue) {
+            vQueueDelete(c->lanes[i].free_queue);
+            GSTATS_INC_FREE("free_request_queue");
+        }
+    }
+    if (c->request_count_sem) {
+        vSemaphoreDelete(c->request_count_sem);
+        GSTATS_INC_FREE("request_count_sem");
+    }
+    if (c->dns_cache.refresh_sem) {
+        vSemaphoreDelete(c->dns_cache.refresh_sem);
+        GSTATS_INC_FREE("dns_refresh_sem");
+    }
+    if (c->free_sync_completion_queue) {
+        vQueueDelete(c->free_sync_completion_queue);
+        GSTATS_INC_FREE("free_sync_completion_queue");
+    }
+    for (int i = 0; i < CONFIG_GOLIOTH_COAP_MAX_SYNC_REQUESTS; i++) {
+        if (c->sync_completions[i].sem) {
+            vSemaphoreDelete(c->sync_completions[i].sem);
+            GSTATS_INC_FREE("sync_completion_sem");
+        }
+    }
+    if (c->run_sem) {
+        vSemaphoreDelete(c->run_sem);
+        GSTATS_INC_FREE("run_sem");
+    }
+    if (c->payload_pool_free) {
+        vQueueDelete(c->payload_pool_free);
+        GSTATS_INC_FREE("payload_pool_free");
+    }
+    if (c->payload_pool) {
+        free(c->payload_pool);
+        GSTATS_INC_FREE("payload_pool");
+    }
+    if (c->wake_fd >= 0) {
+        close(c->wake_fd);
+        GSTATS_INC_FREE("wake_fd");
+    }
+    golioth_coap_token_index_deinit(&c->pending_index);
+    free_observations(c);
+    free(c);
+    GSTATS_INC_FREE("client");
+}
+
+bool golioth_client_is_connected(golioth_client_t client) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c) {
+        return false;
+    }
+    return c->session_connected;
+}
+
+void* golioth_client_payload_alloc(golioth_client_t client) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c || !c->payload_pool_free) {
+        return NULL;
+    }
+    uint8_t* buf = NULL;
+    if (!xQueueReceive(c->payload_pool_free, &buf, 0)) {
+        return NULL;
+    }
+    return buf;
+}
+
+void golioth_client_payload_release(void* payload, void* client) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c || !c->payload_pool_free || !payload) {
+        return;
+    }
+    uint8_t* buf = (uint8_t*)payload;
+    size_t pool_size = CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS * CONFIG_GOLIOTH_PAYLOAD_POOL_BUF_SIZE;
+    bool in_pool = (buf >= c->payload_pool && buf < c->payload_pool + pool_size);
+    if (!in_pool || ((buf - c->payload_pool) % CONFIG_GOLIOTH_PAYLOAD_POOL_BUF_SIZE) != 0) {
+        ESP_LOGE(TAG, "Released payload %p is not from the pool", payload);
+        return;
+    }
+    xQueueSend(c->payload_pool_free, &buf, 0);
+}
+
+golioth_status_t golioth_coap_client_empty(
+        golioth_client_t client,
+        bool is_synchronous,
+        int32_t timeout_s) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c) {
+        return GOLIOTH_ERR_NULL;
+    }
+
+    if (!c->is_running) {
+        ESP_LOGW(TAG, "Client not running, dropping request");
+        return GOLIOTH_ERR_INVALID_STATE;
+    }
+
+    uint64_t ageout_ms = GOLIOTH_WAIT_FOREVER;
+    if (timeout_s != GOLIOTH_WAIT_FOREVER) {
+        ageout_ms = golioth_time_millis() + (1000 * timeout_s);
+    }
+
+    golioth_coap_request_msg_t request_msg = {
+            .type = GOLIOTH_COAP_REQUEST_EMPTY,
+            .ageout_ms = ageout_ms,
+    };
+
+    return submit_request(c, &request_msg, is_synchronous, timeout_s);
+}
+
+// Reader for payloads handed over to a request
+static golioth_status_t read_owned_payload(size_t offset, uint8_t* buf, size_t len, void* arg) {
+    memcpy(buf, (const uint8_t*)arg + offset, len);
+    return GOLIOTH_OK;
+}
+
+// Release function for payloads copied into a heap allocation
+static void free_request_payload(void* payload, void* arg) {
+    free(payload);
+    GSTATS_INC_FREE("request_payload");
+}
+
+// Enqueue a block upload. owned_payload (if not NULL) is released when the request
+// completes, or here if it can't be enqueued.
+static golioth_status_t golioth_coap_client_set_block_internal(
+        golioth_coap_client_t* c,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        void* owned_payload,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        size_t payload_size,
+        golioth_set_cb_fn callback,
+        void* callback_arg,
+        bool is_synchronous,
+        int32_t timeout_s) {
+    uint64_t ageout_ms = GOLIOTH_WAIT_FOREVER;
+    if (timeout_s != GOLIOTH_WAIT_FOREVER) {
+        ageout_ms = golioth_time_millis() + (1000 * timeout_s);
+    }
+
+    golioth_coap_request_msg_t request_msg = {
+            .type = GOLIOTH_COAP_REQUEST_POST_BLOCK,
+            .path_prefix = path_prefix,
+            .post_block =
+                    {
+                            .content_type = content_type,
+                            .reader = reader,
+                            .reader_arg = reader_arg,
+                            .owned_payload = owned_payload,
+                            .release = release,
+                            .release_arg = release_arg,
+                            .payload_size = payload_size,
+                            .block_size = GOLIOTH_COAP_BLOCK1_SIZE,
+                            .block_index = 0,
+                            .callback = callback,
+                            .arg = callback_arg,
+                    },
+            .ageout_ms = ageout_ms,
+    };
+    strncpy(request_msg.path, path, sizeof(request_msg.path) - 1);
+
+    return submit_request(c, &request_msg, is_synchronous, timeout_s);
+}
+
+golioth_status_t golioth_coap_client_set_from_reader(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t payload_size,
+        golioth_set_cb_fn callback,
+        void* callback_arg,
+        bool is_synchronous,
+        int32_t timeout_s) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c || !reader) {
+        return GOLIOTH_ERR_NULL;
+    }
+
+    if (!c->is_running) {
+        ESP_LOGW(TAG, "Client not running, dropping request for path %s", path);
+        return GOLIOTH_ERR_INVALID_STATE;
+    }
+
+    return golioth_coap_client_set_block_internal(
+            c,
+            path_prefix,
+            path,
+            content_type,
+            reader,
+            reader_arg,
+            NULL,
+            NULL,
+            NULL,
+            payload_size,
+            callback,
+            callback_arg,
+            is_synchronous,
+            timeout_s);
+}
+
+// Whether requests to this path can be appended to an offline store
+static bool is_offline_path(const char* path_prefix, const char* path) {
+    if (!path_prefix) {
+        return false;
+    }
+    if (0 == strcmp(path_prefix, ".s/")) {
+        return true;
+    }
+    return 0 == strcmp(path_prefix, "") && (0 == strcmp(path, ".s") || 0 == strcmp(path, "logs"));
+}
+
+static golioth_status_t golioth_coap_client_set_owned_internal(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        uint8_t* payload,
+        size_t payload_size,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        golioth_set_cb_fn callback,
+        void* callback_arg,
+        bool is_synchronous,
+        int32_t timeout_s,
+        bool may_divert) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+
+    golioth_coap_request_msg_t request_msg = {
+            .type = GOLIOTH_COAP_REQUEST_POST,
+            .path_prefix = path_prefix,
+            .post =
+                    {
+                            .content_type = content_type,
+                            .payload = payload,
+                            .payload_size = payload_size,
+                            .release = release,
+                            .release_arg = release_arg,
+                            .callback = callback,
+                            .arg = callback_arg,
+                            // Replayed records are only removed from the store once
+                            // the server acknowledges them
+                            .require_ack = !may_divert,
+                    },
+    };
+
+    if (!c) {
+        release_request_payload(&request_msg);
+        return GOLIOTH_ERR_NULL;
+    }
+
+    // Stored even while the client is stopped, to be sent once it's started and connected
+    golioth_offline_store_t store = c->offline_store;
+    if (may_divert && store && !is_synchronous && !c->session_connected
+        && is_offline_path(path_prefix, path)) {
+        golioth_status_t status = golioth_offline_store_divert(
+                store, path_prefix, path, content_type, payload, payload_size);
+        // Records too large for the store are queued as usual
+        if (status != GOLIOTH_ERR_MEM_ALLOC) {
+            release_request_payload(&request_msg);
+            return status;
+        }
+    }
+
+    if (!c->is_running) {
+        ESP_LOGW(TAG, "Client not running, dropping request for path %s", path);
+        release_request_payload(&request_msg);
+        return GOLIOTH_ERR_INVALID_STATE;
+    }
 
-    new_client->keepalive_timer = xTimerCreate(
-            "keepalive",
-            max(1000, 1000 * CONFIG_GOLIOTH_COAP_KEEPALIVE_INTERVAL_S) / portTICK_PERIOD_MS,
-            pdTRUE,      // auto-reload
-            new_client,  // pvTimerID
-            on_keepalive);
-    if (!new_client->keepalive_timer) {
-        ESP_LOGE(TAG, "Failed to create keepalive timer");
-        goto error;
+    // Too large for one request, so upload it in blocks
+    if (payload_size > GOLIOTH_COAP_BLOCK1_SIZE) {
+        return golioth_coap_client_set_block_internal(
+                c,
+                path_prefix,
+                path,
+                content_type,
+                read_owned_payload,
+                payload,
+                payload,
+                release,
+                release_arg,
+                payload_size,
+                callback,
+                callback_arg,
+                is_synchronous,
+                timeout_s);
     }
-    GSTATS_INC_ALLOC("keepalive_timer");
 
-    if (CONFIG_GOLIOTH_COAP_KEEPALIVE_INTERVAL_S > 0) {
-        if (!xTimerStart(new_client->keepalive_timer, 0)) {
-            ESP_LOGE(TAG, "Failed to start keepalive timer");
-            goto error;
-        }
+    uint64_t ageout_ms = GOLIOTH_WAIT_FOREVER;
+    if (timeout_s != GOLIOTH_WAIT_FOREVER) {
+        ageout_ms = golioth_time_millis() + (1000 * timeout_s);
     }
+    request_msg.ageout_ms = ageout_ms;
+    strncpy(request_msg.path, path, sizeof(request_msg.path) - 1);
 
-    new_client->is_running = true;
+    return submit_request(c, &request_msg, is_synchronous, timeout_s);
+}
 
-    return (golioth_client_t)new_client;
+golioth_status_t golioth_coap_client_set_owned(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        uint8_t* payload,
+        size_t payload_size,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        golioth_set_cb_fn callback,
+        void* callback_arg,
+        bool is_synchronous,
+        int32_t timeout_s) {
+    return golioth_coap_client_set_owned_internal(
+            client,
+            path_prefix,
+            path,
+            content_type,
+            payload,
+            payload_size,
+            release,
+            release_arg,
+            callback,
+            callback_arg,
+            is_synchronous,
+            timeout_s,
+            true);
+}
 
-error:
-    golioth_client_destroy(new_client);
-    return NULL;
+golioth_status_t golioth_coap_client_replay(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        uint8_t* payload,
+        size_t payload_size,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        golioth_set_cb_fn callback,
+        void* callback_arg) {
+    return golioth_coap_client_set_owned_internal(
+            client,
+            path_prefix,
+            path,
+            content_type,
+            payload,
+            payload_size,
+            release,
+            release_arg,
+            callback,
+            callback_arg,
+            false,
+            GOLIOTH_WAIT_FOREVER,
+            false);
 }
 
-golioth_status_t golioth_client_start(golioth_client_t client) {
+void golioth_coap_client_set_offline_store(golioth_client_t client, golioth_offline_store_t store) {
     golioth_coap_client_t* c = (golioth_coap_client_t*)client;
-    if (!c) {
-        return GOLIOTH_ERR_NULL;
+    if (c) {
+        c->offline_store = store;
     }
-    xSemaphoreGive(c->run_sem);
-    return GOLIOTH_OK;
 }
 
-golioth_status_t golioth_client_stop(golioth_client_t client) {
+void golioth_coap_client_detach_offline_store(
+        golioth_client_t client,
+        golioth_offline_store_t store) {
     golioth_coap_client_t* c = (golioth_coap_client_t*)client;
-    if (!c) {
-        return GOLIOTH_ERR_NULL;
-    }
-    if (!xSemaphoreTake(c->run_sem, 100 / portTICK_PERIOD_MS)) {
-        ESP_LOGE(TAG, "stop: failed to take run_sem");
-        return GOLIOTH_ERR_TIMEOUT;
+    if (c && c->offline_store == store) {
+        c->offline_store = NULL;
     }
-    return GOLIOTH_OK;
 }
 
-void golioth_client_destroy(golioth_client_t client) {
+void golioth_coap_client_set_lightdb_encoding(
+        golioth_client_t client,
+        golioth_lightdb_encoding_t encoding) {
     golioth_coap_client_t* c = (golioth_coap_client_t*)client;
     if (!c) {
         return;
     }
-    if (c->keepalive_timer) {
-        xTimerDelete(c->keepalive_timer, 0);
-        GSTATS_INC_FREE("keepalive_timer");
-    }
-    if (c->coap_task_handle) {
-        vTaskDelete(c->coap_task_handle);
-        GSTATS_INC_FREE("coap_task_handle");
-    }
-    // TODO: purge queue, free dyn mem for requests that have it
-    if (c->request_queue) {
-        vQueueDelete(c->request_queue);
-        GSTATS_INC_FREE("request_queue");
-    }
-    if (c->run_sem) {
-        vSemaphoreDelete(c->run_sem);
-        GSTATS_INC_FREE("run_sem");
-    }
-    free(c);
-    GSTATS_INC_FREE("client");
+    portENTER_CRITICAL(&c->lanes_lock);
+    c->lightdb_encoding = encoding;
+    portEXIT_CRITICAL(&c->lanes_lock);
 }
 
-bool golioth_client_is_connected(golioth_client_t client) {
+golioth_lightdb_encoding_t golioth_coap_client_lightdb_encoding(golioth_client_t client) {
     golioth_coap_client_t* c = (golioth_coap_client_t*)client;
     if (!c) {
-        return false;
+        return GOLIOTH_LIGHTDB_ENCODING_JSON;
     }
-    return c->session_connected;
+    portENTER_CRITICAL(&c->lanes_lock);
+    golioth_lightdb_encoding_t encoding = c->lightdb_encoding;
+    portEXIT_CRITICAL(&c->lanes_lock);
+    return encoding;
 }
 
-golioth_status_t golioth_coap_client_empty(
-        golioth_client_t client,
-        bool is_synchronous,
-        int32_t timeout_s) {
+void golioth_coap_client_set_ota_max_block_size(golioth_client_t client, size_t block_size) {
     golioth_coap_client_t* c = (golioth_coap_client_t*)client;
     if (!c) {
-        return GOLIOTH_ERR_NULL;
-    }
-
-    if (!c->is_running) {
-        ESP_LOGW(TAG, "Client not running, dropping request");
-        return GOLIOTH_ERR_INVALID_STATE;
-    }
-
-    uint64_t ageout_ms = GOLIOTH_WAIT_FOREVER;
-    if (timeout_s != GOLIOTH_WAIT_FOREVER) {
-        ageout_ms = golioth_time_millis() + (1000 * timeout_s);
-    }
-
-    golioth_coap_request_msg_t request_msg = {
-            .type = GOLIOTH_COAP_REQUEST_EMPTY,
-            .ageout_ms = ageout_ms,
-    };
-
-    if (is_synchronous) {
-        // Created here, deleted by coap task (or here if fail to enqueue
-        request_msg.request_complete_event = xEventGroupCreate();
-        GSTATS_INC_ALLOC("request_complete_event");
-        request_msg.request_complete_ack_sem = xSemaphoreCreateBinary();
-        GSTATS_INC_ALLOC("request_complete_ack_sem");
-    }
-
-    BaseType_t sent = xQueueSend(c->request_queue, &request_msg, 0);
-    if (!sent) {
-        ESP_LOGW(TAG, "Failed to enqueue request, queue full");
-        if (is_synchronous) {
-            vEventGroupDelete(request_msg.request_complete_event);
-            GSTATS_INC_FREE("request_complete_event");
-            vSemaphoreDelete(request_msg.request_complete_ack_sem);
-            GSTATS_INC_FREE("request_complete_ack_sem");
-        }
-        return GOLIOTH_ERR_QUEUE_FULL;
+        return;
     }
+    portENTER_CRITICAL(&c->lanes_lock);
+    c->ota_max_block_size = block_size;
+    portEXIT_CRITICAL(&c->lanes_lock);
+}
 
-    if (is_synchronous) {
-        uint64_t tmo_ticks =
-                (timeout_s == GOLIOTH_WAIT_FOREVER ? portMAX_DELAY
-                                                   : (timeout_s * 1000) / portTICK_PERIOD_MS);
-        EventBits_t bits = xEventGroupWaitBits(
-                request_msg.request_complete_event,
-                RESPONSE_RECEIVED_EVENT_BIT | RESPONSE_TIMEOUT_EVENT_BIT,
-                pdTRUE,   // clear bits after waiting
-                pdFALSE,  // either bit can trigger
-                tmo_ticks);
-
-        // Notify CoAP task that we received the event
-        xSemaphoreGive(request_msg.request_complete_ack_sem);
-
-        if ((bits == 0) || (bits & RESPONSE_TIMEOUT_EVENT_BIT)) {
-            return GOLIOTH_ERR_TIMEOUT;
-        }
+size_t golioth_coap_client_ota_max_block_size(golioth_client_t client) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c) {
+        return GOLIOTH_OTA_BLOCKSIZE;
     }
-    return GOLIOTH_OK;
+    portENTER_CRITICAL(&c->lanes_lock);
+    size_t block_size = c->ota_max_block_size;
+    portEXIT_CRITICAL(&c->lanes_lock);
+    return block_size;
 }
 
 golioth_status_t golioth_coap_client_set(
@@ -1097,91 +3041,54 @@ golioth_status_t golioth_coap_client_set(
         return GOLIOTH_ERR_NULL;
     }
 
-    uint8_t* request_payload = NULL;
-
-    if (!c->is_running) {
+    // With an offline store, golioth_coap_client_set_owned decides
+    if (!c->is_running && !c->offline_store) {
         ESP_LOGW(TAG, "Client not running, dropping request for path %s", path);
         return GOLIOTH_ERR_INVALID_STATE;
     }
 
+    uint8_t* request_payload = NULL;
+    golioth_payload_release_fn release = NULL;
+    void* release_arg = NULL;
+
     if (payload_size > 0) {
-        // We will allocate memory and copy the payload
-        // to avoid payload lifetime and thread-safety issues.
+        // We will copy the payload to avoid payload lifetime and thread-safety issues.
+        // Small payloads go in a pool buffer, larger ones (or if the pool is empty)
+        // in a heap allocation.
         //
-        // This memory will be free'd by the CoAP task after handling the request,
-        // or in this function if we fail to enqueue the request.
-        request_payload = (uint8_t*)calloc(1, payload_size);
+        // This memory will be released by the CoAP task after handling the request,
+        // or by golioth_coap_client_set_owned if we fail to enqueue the request.
+        if (payload_size <= CONFIG_GOLIOTH_PAYLOAD_POOL_BUF_SIZE) {
+            request_payload = golioth_client_payload_alloc(client);
+            release = golioth_client_payload_release;
+            release_arg = client;
+        }
         if (!request_payload) {
-            ESP_LOGE(TAG, "Payload alloc failure");
-            return GOLIOTH_ERR_MEM_ALLOC;
+            request_payload = (uint8_t*)calloc(1, payload_size);
+            if (!request_payload) {
+                ESP_LOGE(TAG, "Payload alloc failure");
+                return GOLIOTH_ERR_MEM_ALLOC;
+            }
+            GSTATS_INC_ALLOC("request_payload");
+            release = free_request_payload;
+            release_arg = NULL;
         }
-        GSTATS_INC_ALLOC("request_payload");
         memcpy(request_payload, payload, payload_size);
     }
 
-    uint64_t ageout_ms = GOLIOTH_WAIT_FOREVER;
-    if (timeout_s != GOLIOTH_WAIT_FOREVER) {
-        ageout_ms = golioth_time_millis() + (1000 * timeout_s);
-    }
-
-    golioth_coap_request_msg_t request_msg = {
-            .type = GOLIOTH_COAP_REQUEST_POST,
-            .path_prefix = path_prefix,
-            .post =
-                    {
-                            .content_type = content_type,
-                            .payload = request_payload,
-                            .payload_size = payload_size,
-                            .callback = callback,
-                            .arg = callback_arg,
-                    },
-            .ageout_ms = ageout_ms,
-    };
-    strncpy(request_msg.path, path, sizeof(request_msg.path) - 1);
-
-    if (is_synchronous) {
-        // Created here, deleted by coap task (or here if fail to enqueue
-        request_msg.request_complete_event = xEventGroupCreate();
-        GSTATS_INC_ALLOC("request_complete_event");
-        request_msg.request_complete_ack_sem = xSemaphoreCreateBinary();
-        GSTATS_INC_ALLOC("request_complete_ack_sem");
-    }
-
-    BaseType_t sent = xQueueSend(c->request_queue, &request_msg, 0);
-    if (!sent) {
-        ESP_LOGW(TAG, "Failed to enqueue request, queue full");
-        if (payload_size > 0) {
-            free(request_payload);
-            GSTATS_INC_FREE("request_payload");
-        }
-        if (is_synchronous) {
-            vEventGroupDelete(request_msg.request_complete_event);
-            GSTATS_INC_FREE("request_complete_event");
-            vSemaphoreDelete(request_msg.request_complete_ack_sem);
-            GSTATS_INC_FREE("request_complete_ack_sem");
-        }
-        return GOLIOTH_ERR_QUEUE_FULL;
-    }
-
-    if (is_synchronous) {
-        uint64_t tmo_ticks =
-                (timeout_s == GOLIOTH_WAIT_FOREVER ? portMAX_DELAY
-                                                   : (timeout_s * 1000) / portTICK_PERIOD_MS);
-        EventBits_t bits = xEventGroupWaitBits(
-                request_msg.request_complete_event,
-                RESPONSE_RECEIVED_EVENT_BIT | RESPONSE_TIMEOUT_EVENT_BIT,
-                pdTRUE,   // clear bits after waiting
-                pdFALSE,  // either bit can trigger
-                tmo_ticks);
-
-        // Notify CoAP task that we received the event
-        xSemaphoreGive(request_msg.request_complete_ack_sem);
-
-        if ((bits == 0) || (bits & RESPONSE_TIMEOUT_EVENT_BIT)) {
-            return GOLIOTH_ERR_TIMEOUT;
-        }
-    }
-    return GOLIOTH_OK;
+    return golioth_coap_client_set_owned(
+            client,
+            path_prefix,
+            path,
+            content_type,
+            request_payload,
+            payload_size,
+            release,
+            release_arg,
+            callback,
+            callback_arg,
+            is_synchronous,
+            timeout_s);
 }
 
 golioth_status_t golioth_coap_client_delete(
@@ -1219,45 +3126,7 @@ golioth_status_t golioth_coap_client_delete(
     };
     strncpy(request_msg.path, path, sizeof(request_msg.path) - 1);
 
-    if (is_synchronous) {
-        // Created here, deleted by coap task (or here if fail to enqueue
-        request_msg.request_complete_event = xEventGroupCreate();
-        GSTATS_INC_ALLOC("request_complete_event");
-        request_msg.request_complete_ack_sem = xSemaphoreCreateBinary();
-        GSTATS_INC_ALLOC("request_complete_ack_sem");
-    }
-
-    BaseType_t sent = xQueueSend(c->request_queue, &request_msg, 0);
-    if (!sent) {
-        ESP_LOGW(TAG, "Failed to enqueue request, queue full");
-        if (is_synchronous) {
-            vEventGroupDelete(request_msg.request_complete_event);
-            GSTATS_INC_FREE("request_complete_event");
-            vSemaphoreDelete(request_msg.request_complete_ack_sem);
-            GSTATS_INC_FREE("request_complete_ack_sem");
-        }
-        return GOLIOTH_ERR_QUEUE_FULL;
-    }
-
-    if (is_synchronous) {
-        uint64_t tmo_ticks =
-                (timeout_s == GOLIOTH_WAIT_FOREVER ? portMAX_DELAY
-                                                   : (timeout_s * 1000) / portTICK_PERIOD_MS);
-        EventBits_t bits = xEventGroupWaitBits(
-                request_msg.request_complete_event,
-                RESPONSE_RECEIVED_EVENT_BIT | RESPONSE_TIMEOUT_EVENT_BIT,
-                pdTRUE,   // clear bits after waiting
-                pdFALSE,  // either bit can trigger
-                tmo_ticks);
-
-        // Notify CoAP task that we received the event
-        xSemaphoreGive(request_msg.request_complete_ack_sem);
-
-        if ((bits == 0) || (bits & RESPONSE_TIMEOUT_EVENT_BIT)) {
-            return GOLIOTH_ERR_TIMEOUT;
-        }
-    }
-    return GOLIOTH_OK;
+    return submit_request(c, &request_msg, is_synchronous, timeout_s);
 }
 
 static golioth_status_t golioth_coap_client_get_internal(
@@ -1287,13 +3156,6 @@ static golioth_status_t golioth_coap_client_get_internal(
     request_msg.type = type;
     request_msg.path_prefix = path_prefix;
     strncpy(request_msg.path, path, sizeof(request_msg.path) - 1);
-    if (is_synchronous) {
-        // Created here, deleted by coap task (or here if fail to enqueue
-        request_msg.request_complete_event = xEventGroupCreate();
-        GSTATS_INC_ALLOC("request_complete_event");
-        request_msg.request_complete_ack_sem = xSemaphoreCreateBinary();
-        GSTATS_INC_ALLOC("request_complete_ack_sem");
-    }
     request_msg.ageout_ms = ageout_ms;
     if (type == GOLIOTH_COAP_REQUEST_GET_BLOCK) {
         request_msg.get_block = *(golioth_coap_get_block_params_t*)request_params;
@@ -1302,37 +3164,7 @@ static golioth_status_t golioth_coap_client_get_internal(
         request_msg.get = *(golioth_coap_get_params_t*)request_params;
     }
 
-    BaseType_t sent = xQueueSend(c->request_queue, &request_msg, 0);
-    if (!sent) {
-        ESP_LOGE(TAG, "Failed to enqueue request, queue full");
-        if (is_synchronous) {
-            vEventGroupDelete(request_msg.request_complete_event);
-            GSTATS_INC_FREE("request_complete_event");
-            vSemaphoreDelete(request_msg.request_complete_ack_sem);
-            GSTATS_INC_FREE("request_complete_ack_sem");
-        }
-        return GOLIOTH_ERR_QUEUE_FULL;
-    }
-
-    if (is_synchronous) {
-        uint64_t tmo_ticks =
-                (timeout_s == GOLIOTH_WAIT_FOREVER ? portMAX_DELAY
-                                                   : (timeout_s * 1000) / portTICK_PERIOD_MS);
-        EventBits_t bits = xEventGroupWaitBits(
-                request_msg.request_complete_event,
-                RESPONSE_RECEIVED_EVENT_BIT | RESPONSE_TIMEOUT_EVENT_BIT,
-                pdTRUE,   // clear bits after waiting
-                pdFALSE,  // either bit can trigger
-                tmo_ticks);
-
-        // Notify CoAP task that we received the event
-        xSemaphoreGive(request_msg.request_complete_ack_sem);
-
-        if ((bits == 0) || (bits & RESPONSE_TIMEOUT_EVENT_BIT)) {
-            return GOLIOTH_ERR_TIMEOUT;
-        }
-    }
-    return GOLIOTH_OK;
+    return submit_request(c, &request_msg, is_synchronous, timeout_s);
 }
 
 golioth_status_t golioth_coap_client_get(
@@ -1417,13 +3249,38 @@ golioth_status_t golioth_coap_client_observe_async(
     };
     strncpy(request_msg.path, path, sizeof(request_msg.path) - 1);
 
-    BaseType_t sent = xQueueSend(c->request_queue, &request_msg, 0);
-    if (!sent) {
-        ESP_LOGW(TAG, "Failed to enqueue request, queue full");
-        return GOLIOTH_ERR_QUEUE_FULL;
+    return submit_request(c, &request_msg, false, GOLIOTH_WAIT_FOREVER);
+}
+
+golioth_status_t golioth_coap_client_unobserve(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        bool is_synchronous,
+        int32_t timeout_s) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c) {
+        return GOLIOTH_ERR_NULL;
     }
 
-    return GOLIOTH_OK;
+    if (!c->is_running) {
+        ESP_LOGW(TAG, "Client not running, dropping request for path %s", path);
+        return GOLIOTH_ERR_INVALID_STATE;
+    }
+
+    uint64_t ageout_ms = GOLIOTH_WAIT_FOREVER;
+    if (timeout_s != GOLIOTH_WAIT_FOREVER) {
+        ageout_ms = golioth_time_millis() + (1000 * timeout_s);
+    }
+
+    golioth_coap_request_msg_t request_msg = {
+            .type = GOLIOTH_COAP_REQUEST_UNOBSERVE,
+            .path_prefix = path_prefix,
+            .ageout_ms = ageout_ms,
+    };
+    strncpy(request_msg.path, path, sizeof(request_msg.path) - 1);
+
+    return submit_request(c, &request_msg, is_synchronous, timeout_s);
 }
 
 void golioth_client_register_event_callback(
@@ -1457,12 +3314,76 @@ void golioth_client_set_packet_loss_percent(uint8_t percent) {
     coap_debug_set_packet_loss(buf);
 }
 
+void golioth_client_set_coalesce_state_writes(golioth_client_t client, bool enable) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c) {
+        return;
+    }
+    c->coalesce_state_writes = enable;
+}
+
 uint32_t golioth_client_num_items_in_request_queue(golioth_client_t client) {
     golioth_coap_client_t* c = (golioth_coap_client_t*)client;
     if (!c) {
         return 0;
     }
-    return uxQueueMessagesWaiting(c->request_queue);
+    uint32_t num_items = 0;
+    for (int i = 0; i < GOLIOTH_REQUEST_LANE_NUM; i++) {
+        num_items += uxQueueMessagesWaiting(c->lanes[i].queue);
+    }
+    return num_items;
+}
+
+golioth_status_t golioth_client_set_lane_non_confirmable(
+        golioth_client_t client,
+        golioth_request_lane_t lane,
+        bool enable) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c) {
+        return GOLIOTH_ERR_NULL;
+    }
+    if (lane != GOLIOTH_REQUEST_LANE_TELEMETRY && lane != GOLIOTH_REQUEST_LANE_LOG) {
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    c->lanes[lane].non_confirmable = enable;
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_client_get_request_lane_stats(
+        golioth_client_t client,
+        golioth_request_lane_t lane,
+        golioth_request_lane_stats_t* stats) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c || !stats) {
+        return GOLIOTH_ERR_NULL;
+    }
+    if (lane >= GOLIOTH_REQUEST_LANE_NUM) {
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    golioth_coap_request_lane_t* l = &c->lanes[lane];
+    stats->depth = uxQueueMessagesWaiting(l->queue);
+    stats->capacity = _lane_capacity[lane];
+    portENTER_CRITICAL(&c->lanes_lock);
+    stats->max_depth = l->max_depth;
+    stats->num_sent = l->num_sent;
+    stats->num_dropped = l->num_dropped;
+    stats->num_superseded = l->num_superseded;
+    stats->num_rate_limited = l->num_rate_limited;
+    portEXIT_CRITICAL(&c->lanes_lock);
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_client_get_connection_stats(
+        golioth_client_t client,
+        golioth_client_connection_stats_t* stats) {
+    golioth_coap_client_t* c = (golioth_coap_client_t*)client;
+    if (!c || !stats) {
+        return GOLIOTH_ERR_NULL;
+    }
+    portENTER_CRITICAL(&c->lanes_lock);
+    *stats = c->conn_stats;
+    portEXIT_CRITICAL(&c->lanes_lock);
+    return GOLIOTH_OK;
 }
 
 bool golioth_client_has_allocation_leaks(void) {
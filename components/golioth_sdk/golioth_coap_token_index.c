@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "golioth_statistics.h"
+#include "golioth_coap_token_index.h"
+
+#define MIN_CAPACITY 4
+
+// FNV-1a. Tokens from libcoap are a counter, so the hash needs to spread
+// consecutive values over the table.
+static uint32_t token_hash(const uint8_t* token, size_t token_len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < token_len; i++) {
+        hash ^= token[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool entry_matches(
+        const golioth_coap_token_entry_t* entry,
+        uint32_t hash,
+        const uint8_t* token,
+        size_t token_len) {
+    return entry->in_use && entry->hash == hash && entry->token_len == token_len
+            && (0 == memcmp(entry->token, token, token_len));
+}
+
+static golioth_status_t alloc_entries(golioth_coap_token_index_t* index, size_t capacity) {
+    index->entries = calloc(capacity, sizeof(golioth_coap_token_entry_t));
+    if (!index->entries) {
+        return GOLIOTH_ERR_MEM_ALLOC;
+    }
+    GSTATS_INC_ALLOC("token_index");
+    index->capacity = capacity;
+    index->count = 0;
+    return GOLIOTH_OK;
+}
+
+// Add an entry that is known not to be in the table, with room to spare
+static void place_entry(golioth_coap_token_index_t* index, const golioth_coap_token_entry_t* e) {
+    size_t mask = index->capacity - 1;
+    size_t pos = e->hash & mask;
+    while (index->entries[pos].in_use) {
+        pos = (pos + 1) & mask;
+    }
+    index->entries[pos] = *e;
+    index->count++;
+}
+
+static golioth_status_t grow(golioth_coap_token_index_t* index) {
+    golioth_coap_token_entry_t* old_entries = index->entries;
+    size_t old_capacity = index->capacity;
+
+    golioth_status_t status = alloc_entries(index, 2 * old_capacity);
+    if (status != GOLIOTH_OK) {
+        index->entries = old_entries;
+        return status;
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].in_use) {
+            place_entry(index, &old_entries[i]);
+        }
+    }
+    free(old_entries);
+    GSTATS_INC_FREE("token_index");
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_coap_token_index_init(
+        golioth_coap_token_index_t* index,
+        size_t num_values) {
+    // Keep the table at most half full
+    size_t capacity = MIN_CAPACITY;
+    while (capacity < 2 * num_values) {
+        capacity *= 2;
+    }
+    return alloc_entries(index, capacity);
+}
+
+void golioth_coap_token_index_deinit(golioth_coap_token_index_t* index) {
+    if (index->entries) {
+        free(index->entries);
+        GSTATS_INC_FREE("token_index");
+    }
+    index->entries = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+golioth_status_t golioth_coap_token_index_insert(
+        golioth_coap_token_index_t* index,
+        const uint8_t* token,
+        size_t token_len,
+        void* value) {
+    if (token_len > GOLIOTH_COAP_TOKEN_MAX_LEN) {
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    if (2 * (index->count + 1) > index->capacity) {
+        golioth_status_t status = grow(index);
+        if (status != GOLIOTH_OK) {
+            return status;
+        }
+    }
+
+    golioth_coap_token_entry_t entry = {
+            .value = value,
+            .hash = token_hash(token, token_len),
+            .token_len = token_len,
+            .in_use = true,
+    };
+    memcpy(entry.token, token, token_len);
+    place_entry(index, &entry);
+    return GOLIOTH_OK;
+}
+
+bool golioth_coap_token_index_remove(
+        golioth_coap_token_index_t* index,
+        const uint8_t* token,
+        size_t token_len,
+        const void* value) {
+    if (!index->entries || token_len > GOLIOTH_COAP_TOKEN_MAX_LEN) {
+        return false;
+    }
+
+    size_t mask = index->capacity - 1;
+    uint32_t hash = token_hash(token, token_len);
+    size_t pos = hash & mask;
+    while (index->entries[pos].in_use) {
+        golioth_coap_token_entry_t* entry = &index->entries[pos];
+        if (entry->value == value && entry_matches(entry, hash, token, token_len)) {
+            break;
+        }
+        pos = (pos + 1) & mask;
+    }
+    if (!index->entries[pos].in_use) {
+        return false;
+    }
+
+    // Shift back the entries that follow in the same run, if the hole is between
+    // their home position and where they are now, so no lookup stops short at the hole.
+    size_t hole = pos;
+    size_t next = pos;
+    while (true) {
+        next = (next + 1) & mask;
+        if (!index->entries[next].in_use) {
+            break;
+        }
+        size_t home = index->entries[next].hash & mask;
+        // Distance from home to where the entry is, vs. from home to the hole
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            index->entries[hole] = index->entries[next];
+            hole = next;
+        }
+    }
+    index->entries[hole].in_use = false;
+    index->count--;
+    return true;
+}
+
+void* golioth_coap_token_index_find_next(
+        const golioth_coap_token_index_t* index,
+        const uint8_t* token,
+        size_t token_len,
+        size_t* cursor) {
+    if (!index->entries || token_len > GOLIOTH_COAP_TOKEN_MAX_LEN) {
+        return NULL;
+    }
+
+    // The cursor is the number of slots already probed
+    size_t mask = index->capacity - 1;
+    uint32_t hash = token_hash(token, token_len);
+    while (*cursor < index->capacity) {
+        const golioth_coap_token_entry_t* entry = &index->entries[(hash + *cursor) & mask];
+        if (!entry->in_use) {
+            break;
+        }
+        (*cursor)++;
+        if (entry_matches(entry, hash, token, token_len)) {
+            return entry->value;
+        }
+    }
+    return NULL;
+}
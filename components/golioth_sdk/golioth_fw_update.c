@@ -4,30 +4,119 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 #include <string.h>
+#include <stdlib.h>
 #include "esp_log.h"
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
 #include "esp_flash_partitions.h"
+#include "esp_image_format.h"
+#include "esp_spi_flash.h"
+#include "nvs.h"
+#include "mbedtls/sha256.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "golioth_fw_update.h"
+#include "golioth_ota_delta.h"
+#include "golioth_ota_heatshrink.h"
 #include "golioth_statistics.h"
+#include "golioth_time.h"
+#include "golioth_util.h"
 
 #define TAG "golioth_fw_update"
 
+// Number of block buffers between the download and the flash writer task.
+// While the writer is busy with flash, this many blocks can be downloaded ahead.
+#define FW_UPDATE_NUM_WRITE_BUFFERS 4
+#define FW_UPDATE_WRITER_TASK_STACK_SIZE 3072
+#define FW_UPDATE_WRITER_TASK_PRIORITY 3
+
+// Download progress is saved to NVS every time this many bytes have been written.
+// Must be a multiple of the flash sector size, so a resumed download starts on a
+// sector boundary.
+#define FW_UPDATE_PROGRESS_SAVE_INTERVAL (16 * SPI_FLASH_SEC_SIZE)
+#define FW_UPDATE_NVS_NAMESPACE "golioth_fw"
+#define FW_UPDATE_NVS_KEY_PROGRESS "progress"
+
+// Progress of an interrupted download, saved in NVS
+typedef struct {
+    char package[CONFIG_GOLIOTH_OTA_MAX_PACKAGE_NAME_LEN + 1];
+    char version[CONFIG_GOLIOTH_OTA_MAX_VERSION_LEN + 1];
+    /// Address of the partition being written, in case the next update partition changes
+    uint32_t partition_address;
+    /// Number of image bytes written to the partition and verified
+    uint32_t bytes_written;
+    /// SHA-256 of the first bytes_written bytes of the image (which is also the artifact)
+    uint8_t sha256[32];
+} fw_update_progress_t;
+
+// A downloaded block, passed to the writer task
+typedef struct {
+    /// Offset of the block in the artifact
+    size_t offset;
+    /// NULL if the download was aborted
+    uint8_t* buf;
+    size_t nbytes;
+    bool is_last;
+} fw_update_write_msg_t;
+
+// Where the time goes during a download, to see how well network and flash overlap
+typedef struct {
+    uint64_t start_ms;
+    /// Time the writer task spent waiting for blocks from the network
+    uint64_t network_wait_ms;
+    /// Time the writer task spent erasing and writing flash
+    uint64_t flash_write_ms;
+    /// Time the download was stalled, waiting for the writer to free a buffer
+    uint64_t flash_stall_ms;
+    /// Bytes of the artifact handled by the writer task, including resumed bytes
+    size_t bytes_downloaded;
+    /// Bytes of the image written to flash, including resumed bytes
+    size_t bytes_written;
+} fw_update_stats_t;
+
 static golioth_client_t _client;
 static const char* _current_version;
 static SemaphoreHandle_t _manifest_rcvd;
 static golioth_ota_manifest_t _ota_manifest;
-static uint8_t _ota_block_buffer[GOLIOTH_OTA_BLOCKSIZE + 1];
 static const golioth_ota_component_t* _main_component;
-static esp_ota_handle_t _update_handle;
 static const esp_partition_t* _update_partition;
-
-static bool header_valid(const uint8_t* bytes, size_t nbytes) {
-    size_t header_size = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)
-            + sizeof(esp_app_desc_t);
-    assert(nbytes >= header_size);
+// Partition offset up to which flash has been erased for this download
+static size_t _erased_size;
+// Running SHA-256 of the artifact bytes downloaded so far
+static mbedtls_sha256_context _sha256;
+// Reason reported to the server if the download fails
+static golioth_ota_reason_t _download_failure_reason;
+// Patch being applied, if the artifact is a delta
+static golioth_ota_delta_t* _delta;
+// Decompressor, if the artifact is compressed
+static golioth_ota_heatshrink_t* _heatshrink;
+
+// Downloaded blocks, waiting to be written to flash
+static QueueHandle_t _write_queue;
+// Buffers that are free to receive downloaded blocks
+static QueueHandle_t _free_buffer_queue;
+// Given by the writer task when it's finished
+static SemaphoreHandle_t _writer_done;
+// Set by the writer task if writing to flash fails
+static volatile golioth_status_t _writer_status;
+static fw_update_stats_t _stats;
+
+#define IMAGE_HEADER_SIZE \
+    (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
+
+// The start of the image, held back until all of the header has arrived, so it can be
+// validated before anything is written. Blocks (and decompressed or patched chunks)
+// can be smaller than the header.
+static uint8_t _header_buf[IMAGE_HEADER_SIZE];
+static size_t _header_len;
+
+// bytes is IMAGE_HEADER_SIZE bytes long
+static bool header_valid(const uint8_t* bytes) {
+    if (bytes[0] != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(TAG, "Invalid image magic byte 0x%02X", bytes[0]);
+        return false;
+    }
 
     esp_app_desc_t new_app_info;
     memcpy(&new_app_info,
@@ -101,11 +190,485 @@ static bool fw_update_manifest_version_is_different(const golioth_ota_manifest_t
     return false;
 }
 
-static golioth_status_t fw_update_download_and_write_flash(void) {
-    assert(_main_component);
+static void fw_update_save_progress(size_t bytes_written) {
+    fw_update_progress_t progress = {
+            .partition_address = _update_partition->address,
+            .bytes_written = bytes_written,
+    };
+    strncpy(progress.package, _main_component->package, sizeof(progress.package) - 1);
+    strncpy(progress.version, _main_component->version, sizeof(progress.version) - 1);
+
+    // Digest of the bytes so far, without disturbing the running hash
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_clone(&sha256, &_sha256);
+    mbedtls_sha256_finish_ret(&sha256, progress.sha256);
+    mbedtls_sha256_free(&sha256);
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(FW_UPDATE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_open failed");
+        return;
+    }
+    err = nvs_set_blob(handle, FW_UPDATE_NVS_KEY_PROGRESS, &progress, sizeof(progress));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_set_blob err: %d", err);
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+    ESP_LOGD(TAG, "Saved progress at offset 0x%08X", bytes_written);
+}
+
+static bool fw_update_load_progress(fw_update_progress_t* progress) {
+    nvs_handle_t handle;
+    if (nvs_open(FW_UPDATE_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    size_t len = sizeof(*progress);
+    esp_err_t err = nvs_get_blob(handle, FW_UPDATE_NVS_KEY_PROGRESS, progress, &len);
+    nvs_close(handle);
+    return (err == ESP_OK && len == sizeof(*progress));
+}
+
+static void fw_update_clear_progress(void) {
+    nvs_handle_t handle;
+    if (nvs_open(FW_UPDATE_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    nvs_erase_key(handle, FW_UPDATE_NVS_KEY_PROGRESS);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+// Check for saved progress of a previous download of the same image, and whether
+// the bytes written to the partition back then are still intact.
+//
+// If so, the running hash is primed with those bytes, and the number of bytes
+// the download can resume from is returned. Otherwise returns 0.
+static size_t fw_update_resume_offset(void) {
+    // Patch and compressed bytes don't map to image offsets, so those always start over
+    if (_main_component->type != GOLIOTH_OTA_COMPONENT_TYPE_FULL
+        || _main_component->compression != GOLIOTH_OTA_COMPRESSION_NONE) {
+        return 0;
+    }
+
+    fw_update_progress_t progress = {};
+    if (!fw_update_load_progress(&progress)) {
+        return 0;
+    }
+
+    bool same_image = (0 == strcmp(progress.package, _main_component->package))
+            && (0 == strcmp(progress.version, _main_component->version))
+            && (progress.partition_address == _update_partition->address);
+    bool offset_valid = (progress.bytes_written < _main_component->size)
+            && (progress.bytes_written % FW_UPDATE_PROGRESS_SAVE_INTERVAL == 0);
+    if (!same_image || !offset_valid) {
+        ESP_LOGI(TAG, "Discarding saved progress of %s@%s", progress.package, progress.version);
+        fw_update_clear_progress();
+        return 0;
+    }
+
+    uint8_t* buf = malloc(GOLIOTH_OTA_BLOCKSIZE);
+    if (!buf) {
+        return 0;
+    }
+    GSTATS_INC_ALLOC("fw_update_resume_buf");
+
+    // Hash what's already in flash, and compare with the saved digest
+    esp_err_t err = ESP_OK;
+    for (size_t offset = 0; offset < progress.bytes_written; offset += GOLIOTH_OTA_BLOCKSIZE) {
+        err = esp_partition_read(_update_partition, offset, buf, GOLIOTH_OTA_BLOCKSIZE);
+        if (err != ESP_OK) {
+            break;
+        }
+        mbedtls_sha256_update_ret(&_sha256, buf, GOLIOTH_OTA_BLOCKSIZE);
+    }
+    free(buf);
+    GSTATS_INC_FREE("fw_update_resume_buf");
+
+    uint8_t digest[sizeof(progress.sha256)];
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_clone(&sha256, &_sha256);
+    mbedtls_sha256_finish_ret(&sha256, digest);
+    mbedtls_sha256_free(&sha256);
+
+    if (err != ESP_OK || 0 != memcmp(digest, progress.sha256, sizeof(digest))) {
+        ESP_LOGW(TAG, "Partially written image does not match saved progress, starting over");
+        mbedtls_sha256_starts_ret(&_sha256, 0);
+        fw_update_clear_progress();
+        return 0;
+    }
+
+    ESP_LOGI(TAG, "Resuming download at offset 0x%08X", progress.bytes_written);
+    return progress.bytes_written;
+}
 
+// Write image bytes to the update partition at offset.
+// Only the last write of an image may have a length that isn't a multiple of 16.
+static golioth_status_t fw_update_write_flash(size_t offset, const uint8_t* data, size_t len) {
     esp_err_t err = ESP_OK;
 
+    // Erase flash sectors just before they are first written, rather than all
+    // up front, so erasing overlaps with the download too. Sectors written before
+    // a resumed download are not erased again.
+    while (_erased_size < offset + len) {
+        err = esp_partition_erase_range(_update_partition, _erased_size, SPI_FLASH_SEC_SIZE);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "esp_partition_erase_range failed (%s)", esp_err_to_name(err));
+            return GOLIOTH_ERR_FAIL;
+        }
+        _erased_size += SPI_FLASH_SEC_SIZE;
+    }
+
+    // Encrypted flash is written in 16 byte chunks, so pad the end of the image
+    size_t aligned_len = len;
+    if (_update_partition->encrypted) {
+        aligned_len = len & ~15;
+    }
+
+    err = esp_partition_write(_update_partition, offset, data, aligned_len);
+    if (err == ESP_OK && aligned_len < len) {
+        uint8_t tail[16];
+        memset(tail, 0xFF, sizeof(tail));
+        memcpy(tail, &data[aligned_len], len - aligned_len);
+        err = esp_partition_write(_update_partition, offset + aligned_len, tail, sizeof(tail));
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_partition_write failed (%s)", esp_err_to_name(err));
+        return GOLIOTH_ERR_FAIL;
+    }
+    _stats.bytes_written = offset + len;
+    return GOLIOTH_OK;
+}
+
+// Write image bytes, which arrive in order, validating the header first
+static golioth_status_t fw_update_write_image(size_t offset, const uint8_t* data, size_t len) {
+    if (offset < IMAGE_HEADER_SIZE) {
+        assert(offset == _header_len);
+        size_t num_header_bytes = min(len, IMAGE_HEADER_SIZE - offset);
+        memcpy(&_header_buf[offset], data, num_header_bytes);
+        _header_len += num_header_bytes;
+        offset += num_header_bytes;
+        data += num_header_bytes;
+        len -= num_header_bytes;
+
+        if (_header_len < IMAGE_HEADER_SIZE) {
+            return GOLIOTH_OK;
+        }
+        if (!header_valid(_header_buf)) {
+            return GOLIOTH_ERR_FAIL;
+        }
+        // The header is a multiple of 16 bytes, so this isn't the last write
+        golioth_status_t status = fw_update_write_flash(0, _header_buf, IMAGE_HEADER_SIZE);
+        if (status != GOLIOTH_OK || len == 0) {
+            return status;
+        }
+    }
+    return fw_update_write_flash(offset, data, len);
+}
+
+// Patches are applied against the running image
+static golioth_status_t fw_update_delta_read(size_t offset, uint8_t* buf, size_t len, void* arg) {
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    if (offset + len > running->size) {
+        ESP_LOGE(TAG, "Patch reads past end of running partition: 0x%08X", offset + len);
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    esp_err_t err = esp_partition_read(running, offset, buf, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_partition_read failed (%s)", esp_err_to_name(err));
+        return GOLIOTH_ERR_IO;
+    }
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t fw_update_delta_write(
+        size_t offset,
+        const uint8_t* buf,
+        size_t len,
+        void* arg) {
+    return fw_update_write_image(offset, buf, len);
+}
+
+// Handle decompressed artifact bytes, which are either a patch or the image itself
+static golioth_status_t fw_update_write_decompressed(
+        size_t offset,
+        const uint8_t* buf,
+        size_t len,
+        void* arg) {
+    if (_delta) {
+        return golioth_ota_delta_apply(_delta, buf, len);
+    }
+    return fw_update_write_image(offset, buf, len);
+}
+
+static golioth_status_t fw_update_check_hash(void) {
+    if (!_main_component->has_hash) {
+        return GOLIOTH_OK;
+    }
+
+    uint8_t digest[GOLIOTH_OTA_COMPONENT_HASH_LEN];
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_clone(&sha256, &_sha256);
+    mbedtls_sha256_finish_ret(&sha256, digest);
+    mbedtls_sha256_free(&sha256);
+
+    if (0 != memcmp(digest, _main_component->hash, sizeof(digest))) {
+        ESP_LOGE(TAG, "Artifact SHA-256 does not match manifest");
+        _download_failure_reason = GOLIOTH_OTA_REASON_INTEGRITY_CHECK_FAILURE;
+        return GOLIOTH_ERR_FAIL;
+    }
+    ESP_LOGI(TAG, "Artifact SHA-256 matches manifest");
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t fw_update_write_block(
+        size_t offset,
+        const uint8_t* block_buffer,
+        size_t block_buffer_len,
+        bool is_last) {
+    ESP_LOGD(
+            TAG,
+            "Writing block at offset %zu (%zu bytes of %zu)",
+            offset,
+            offset + block_buffer_len,
+            (size_t)_main_component->size);
+    _stats.bytes_downloaded += block_buffer_len;
+
+    // Check the artifact against the manifest before its last bytes are used
+    mbedtls_sha256_update_ret(&_sha256, block_buffer, block_buffer_len);
+    if (is_last) {
+        GOLIOTH_STATUS_RETURN_IF_ERROR(fw_update_check_hash());
+    }
+
+    if (_heatshrink) {
+        GOLIOTH_STATUS_RETURN_IF_ERROR(
+                golioth_ota_heatshrink_decode(_heatshrink, block_buffer, block_buffer_len));
+        if (is_last) {
+            GOLIOTH_STATUS_RETURN_IF_ERROR(golioth_ota_heatshrink_finish(_heatshrink));
+        }
+    } else {
+        GOLIOTH_STATUS_RETURN_IF_ERROR(fw_update_write_decompressed(
+                offset, block_buffer, block_buffer_len, NULL));
+    }
+
+    if (_delta) {
+        return (is_last ? golioth_ota_delta_finish(_delta) : GOLIOTH_OK);
+    }
+
+    if (!_heatshrink && !is_last
+        && (_stats.bytes_written % FW_UPDATE_PROGRESS_SAVE_INTERVAL) == 0) {
+        fw_update_save_progress(_stats.bytes_written);
+    }
+    return GOLIOTH_OK;
+}
+
+// Writes downloaded blocks to flash, so the download can continue while flash
+// is being erased and written.
+static void fw_update_writer_task(void* arg) {
+    bool done = false;
+    while (!done) {
+        fw_update_write_msg_t msg = {};
+        uint64_t wait_start_ms = golioth_time_millis();
+        xQueueReceive(_write_queue, &msg, portMAX_DELAY);
+        uint64_t write_start_ms = golioth_time_millis();
+        _stats.network_wait_ms += write_start_ms - wait_start_ms;
+
+        done = msg.is_last;
+        if (!msg.buf) {
+            continue;
+        }
+
+        // After a failure, keep draining blocks until the download notices
+        if (_writer_status == GOLIOTH_OK) {
+            _writer_status =
+                    fw_update_write_block(msg.offset, msg.buf, msg.nbytes, msg.is_last);
+            _stats.flash_write_ms += golioth_time_millis() - write_start_ms;
+        }
+        xQueueSend(_free_buffer_queue, &msg.buf, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(_writer_done);
+    vTaskDelete(NULL);
+}
+
+// Sink for golioth_ota_download_component. Copies the block into a free buffer
+// and passes it on to the writer task.
+static golioth_status_t fw_update_queue_block(
+        size_t offset,
+        const uint8_t* block_buffer,
+        size_t block_buffer_len,
+        bool is_last,
+        void* arg) {
+    if (_writer_status != GOLIOTH_OK) {
+        return _writer_status;
+    }
+
+    uint8_t* buf = NULL;
+    uint64_t stall_start_ms = golioth_time_millis();
+    xQueueReceive(_free_buffer_queue, &buf, portMAX_DELAY);
+    _stats.flash_stall_ms += golioth_time_millis() - stall_start_ms;
+
+    memcpy(buf, block_buffer, block_buffer_len);
+    fw_update_write_msg_t msg = {
+            .offset = offset,
+            .buf = buf,
+            .nbytes = block_buffer_len,
+            .is_last = is_last,
+    };
+    xQueueSend(_write_queue, &msg, portMAX_DELAY);
+    return GOLIOTH_OK;
+}
+
+// Download the main component, starting at resume_offset, and write it to flash,
+// in two tasks
+static golioth_status_t fw_update_download_pipelined(size_t resume_offset) {
+    golioth_status_t status = GOLIOTH_OK;
+    uint8_t* bufs = NULL;
+    bool writer_started = false;
+
+    memset(&_stats, 0, sizeof(_stats));
+    _stats.start_ms = golioth_time_millis();
+    _stats.bytes_written = resume_offset;
+    _stats.bytes_downloaded = resume_offset;
+    _writer_status = GOLIOTH_OK;
+    _erased_size = resume_offset;
+    // Saved progress is always past the header, see fw_update_write_image
+    _header_len = (resume_offset > 0 ? IMAGE_HEADER_SIZE : 0);
+
+    bufs = malloc(FW_UPDATE_NUM_WRITE_BUFFERS * GOLIOTH_OTA_BLOCKSIZE);
+    if (!bufs) {
+        ESP_LOGE(TAG, "Failed to allocate write buffers");
+        status = GOLIOTH_ERR_MEM_ALLOC;
+        goto cleanup;
+    }
+    GSTATS_INC_ALLOC("fw_update_write_bufs");
+
+    _write_queue = xQueueCreate(FW_UPDATE_NUM_WRITE_BUFFERS, sizeof(fw_update_write_msg_t));
+    _free_buffer_queue = xQueueCreate(FW_UPDATE_NUM_WRITE_BUFFERS, sizeof(uint8_t*));
+    _writer_done = xSemaphoreCreateBinary();
+    if (!_write_queue || !_free_buffer_queue || !_writer_done) {
+        ESP_LOGE(TAG, "Failed to create writer queues");
+        status = GOLIOTH_ERR_MEM_ALLOC;
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < FW_UPDATE_NUM_WRITE_BUFFERS; i++) {
+        uint8_t* buf = &bufs[i * GOLIOTH_OTA_BLOCKSIZE];
+        xQueueSend(_free_buffer_queue, &buf, 0);
+    }
+
+    writer_started = xTaskCreate(
+            fw_update_writer_task,
+            "fw_update_writer",
+            FW_UPDATE_WRITER_TASK_STACK_SIZE,
+            NULL,  // task arg
+            FW_UPDATE_WRITER_TASK_PRIORITY,
+            NULL);
+    if (!writer_started) {
+        ESP_LOGE(TAG, "Failed to create writer task");
+        status = GOLIOTH_ERR_MEM_ALLOC;
+        goto cleanup;
+    }
+
+    status = golioth_ota_download_component(
+            _client,
+            _main_component,
+            resume_offset,
+            fw_update_queue_block,
+            NULL);
+    if (status != GOLIOTH_OK) {
+        ESP_LOGE(TAG, "Failed to download image (%s)", golioth_status_to_str(status));
+
+        // Tell the writer there are no more blocks coming
+        fw_update_write_msg_t abort_msg = {
+                .is_last = true,
+        };
+        xQueueSend(_write_queue, &abort_msg, portMAX_DELAY);
+    }
+
+    // Wait for the writer to finish the blocks it has
+    xSemaphoreTake(_writer_done, portMAX_DELAY);
+    if (_writer_status != GOLIOTH_OK) {
+        // What's in flash can't be trusted, don't resume from it
+        fw_update_clear_progress();
+        status = _writer_status;
+    }
+
+    ESP_LOGI(
+            TAG,
+            "Download took %u ms: writer waited %u ms for network, %u ms writing flash; "
+            "download stalled %u ms waiting for flash",
+            (uint32_t)(golioth_time_millis() - _stats.start_ms),
+            (uint32_t)_stats.network_wait_ms,
+            (uint32_t)_stats.flash_write_ms,
+            (uint32_t)_stats.flash_stall_ms);
+
+cleanup:
+    if (_writer_done) {
+        vSemaphoreDelete(_writer_done);
+        _writer_done = NULL;
+    }
+    if (_free_buffer_queue) {
+        vQueueDelete(_free_buffer_queue);
+        _free_buffer_queue = NULL;
+    }
+    if (_write_queue) {
+        vQueueDelete(_write_queue);
+        _write_queue = NULL;
+    }
+    if (bufs) {
+        free(bufs);
+        GSTATS_INC_FREE("fw_update_write_bufs");
+    }
+    return status;
+}
+
+// Set up the stages artifact bytes pass through on their way to flash
+static golioth_status_t fw_update_create_stages(void) {
+    if (_main_component->compression == GOLIOTH_OTA_COMPRESSION_HEATSHRINK) {
+        _heatshrink = malloc(sizeof(golioth_ota_heatshrink_t));
+        if (!_heatshrink) {
+            ESP_LOGE(TAG, "Failed to allocate decompressor");
+            return GOLIOTH_ERR_MEM_ALLOC;
+        }
+        GSTATS_INC_ALLOC("fw_update_heatshrink");
+        golioth_ota_heatshrink_init(_heatshrink, fw_update_write_decompressed, NULL);
+        ESP_LOGI(TAG, "Decompressing artifact");
+    }
+
+    if (_main_component->type == GOLIOTH_OTA_COMPONENT_TYPE_DELTA) {
+        _delta = malloc(sizeof(golioth_ota_delta_t));
+        if (!_delta) {
+            ESP_LOGE(TAG, "Failed to allocate patch state");
+            return GOLIOTH_ERR_MEM_ALLOC;
+        }
+        GSTATS_INC_ALLOC("fw_update_delta");
+        golioth_ota_delta_init(_delta, fw_update_delta_read, fw_update_delta_write, NULL);
+        ESP_LOGI(TAG, "Applying patch to running image");
+    }
+    return GOLIOTH_OK;
+}
+
+static void fw_update_destroy_stages(void) {
+    if (_heatshrink) {
+        free(_heatshrink);
+        GSTATS_INC_FREE("fw_update_heatshrink");
+        _heatshrink = NULL;
+    }
+    if (_delta) {
+        free(_delta);
+        GSTATS_INC_FREE("fw_update_delta");
+        _delta = NULL;
+    }
+}
+
+static golioth_status_t fw_update_download_and_write_flash(void) {
+    assert(_main_component);
+
     ESP_LOGI(TAG, "State = Downloading");
     golioth_ota_report_state_sync(
             _client,
@@ -124,83 +687,102 @@ static golioth_status_t fw_update_download_and_write_flash(void) {
             _update_partition->subtype,
             _update_partition->address);
 
-    // Handle blocks one at a time
     ESP_LOGI(TAG, "Image size = %zu", _main_component->size);
-    size_t nblocks = golioth_ota_size_to_nblocks(_main_component->size);
-    size_t bytes_written = 0;
-    for (size_t i = 0; i < nblocks; i++) {
-        size_t block_nbytes = 0;
-
-        ESP_LOGI(TAG, "Getting block index %d (%d/%d)", i, i + 1, nblocks);
-
-        golioth_status_t status = golioth_ota_get_block_sync(
+    if (_main_component->compression == GOLIOTH_OTA_COMPRESSION_UNKNOWN) {
+        ESP_LOGE(TAG, "Artifact compression not supported");
+        ESP_LOGI(TAG, "State = Idle");
+        golioth_ota_report_state_sync(
                 _client,
-                _main_component->package,
+                GOLIOTH_OTA_STATE_IDLE,
+                GOLIOTH_OTA_REASON_UNSUPPORTED_PACKAGE_TYPE,
+                "main",
+                _current_version,
                 _main_component->version,
-                i,
-                _ota_block_buffer,
-                &block_nbytes,
                 GOLIOTH_WAIT_FOREVER);
-        if (status != GOLIOTH_OK) {
-            ESP_LOGE(TAG, "Failed to get block index %d (%s)", i, golioth_status_to_str(status));
-            break;
-        }
+        return GOLIOTH_ERR_FAIL;
+    }
 
-        assert(block_nbytes <= GOLIOTH_OTA_BLOCKSIZE);
+    // Only the size of a plain image is known up front
+    bool is_delta = (_main_component->type == GOLIOTH_OTA_COMPONENT_TYPE_DELTA);
+    bool is_compressed = (_main_component->compression != GOLIOTH_OTA_COMPRESSION_NONE);
+    if (!is_delta && !is_compressed && _main_component->size > _update_partition->size) {
+        ESP_LOGE(TAG, "Image does not fit in partition of size %u", _update_partition->size);
+        ESP_LOGI(TAG, "State = Idle");
+        golioth_ota_report_state_sync(
+                _client,
+                GOLIOTH_OTA_STATE_IDLE,
+                GOLIOTH_OTA_REASON_NOT_ENOUGH_FLASH_MEMORY,
+                "main",
+                _current_version,
+                _main_component->version,
+                GOLIOTH_WAIT_FOREVER);
+        return GOLIOTH_ERR_FAIL;
+    }
 
-        if (i == 0) {
-            if (!header_valid(_ota_block_buffer, block_nbytes)) {
-                break;
-            }
-            ESP_LOGI(TAG, "Erasing flash");
-            err = esp_ota_begin(_update_partition, _main_component->size, &_update_handle);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-                esp_ota_abort(_update_handle);
-                break;
-            }
-        }
+    if (fw_update_create_stages() != GOLIOTH_OK) {
+        fw_update_destroy_stages();
+        return GOLIOTH_ERR_MEM_ALLOC;
+    }
 
-        err = esp_ota_write(_update_handle, (const void*)_ota_block_buffer, block_nbytes);
-        if (err != ESP_OK) {
-            esp_ota_abort(_update_handle);
-            break;
-        }
+    mbedtls_sha256_init(&_sha256);
+    mbedtls_sha256_starts_ret(&_sha256, 0);
+    _download_failure_reason = GOLIOTH_OTA_REASON_FIRMWARE_UPDATE_FAILED;
 
-        bytes_written += block_nbytes;
+    size_t resume_offset = fw_update_resume_offset();
+    if (resume_offset > 0) {
+        ESP_LOGI(TAG, "Resuming download at offset %zu", resume_offset);
     }
+    golioth_status_t status = fw_update_download_pipelined(resume_offset);
+    mbedtls_sha256_free(&_sha256);
+
+    fw_update_destroy_stages();
 
+    size_t bytes_written = _stats.bytes_written;
     ESP_LOGI(TAG, "Total bytes written: %zu", bytes_written);
-    if (bytes_written != _main_component->size) {
+    if (status == GOLIOTH_OK && _stats.bytes_downloaded != _main_component->size) {
         ESP_LOGE(
                 TAG,
                 "Download failed, downloaded size %zu does not match manifest size %zu",
-                bytes_written,
+                _stats.bytes_downloaded,
                 _main_component->size);
+        status = GOLIOTH_ERR_FAIL;
+    }
+    if (status == GOLIOTH_OK && _header_len < IMAGE_HEADER_SIZE) {
+        ESP_LOGE(TAG, "Download failed, image is smaller than its header");
+        status = GOLIOTH_ERR_FAIL;
+    }
+    if (status != GOLIOTH_OK) {
+        ESP_LOGE(TAG, "Download failed (%s)", golioth_status_to_str(status));
         ESP_LOGI(TAG, "State = Idle");
         golioth_ota_report_state_sync(
                 _client,
                 GOLIOTH_OTA_STATE_IDLE,
-                GOLIOTH_OTA_REASON_FIRMWARE_UPDATE_FAILED,
+                _download_failure_reason,
                 "main",
                 _current_version,
                 _main_component->version,
                 GOLIOTH_WAIT_FOREVER);
-        esp_ota_abort(_update_handle);
         return GOLIOTH_ERR_FAIL;
     }
+
+    // The whole image is in flash, nothing left to resume
+    fw_update_clear_progress();
     return GOLIOTH_OK;
 }
 
 static golioth_status_t fw_update_validate(void) {
-    assert(_update_handle);
-    esp_err_t err = esp_ota_end(_update_handle);
+    assert(_update_partition);
+
+    // The image is written with esp_partition_write (so downloads can be resumed),
+    // so verify it the same way esp_ota_end would.
+    const esp_partition_pos_t part_pos = {
+            .offset = _update_partition->address,
+            .size = _update_partition->size,
+    };
+    esp_image_metadata_t data = {};
+    esp_err_t err = esp_image_verify(ESP_IMAGE_VERIFY, &part_pos, &data);
     if (err != ESP_OK) {
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-            ESP_LOGE(TAG, "Image validation failed, image is corrupted");
-        } else {
-            ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
-        }
+        ESP_LOGE(TAG, "Image validation failed, image is corrupted (%s)", esp_err_to_name(err));
 
         ESP_LOGI(TAG, "State = Idle");
         golioth_ota_report_state_sync(
@@ -276,12 +858,6 @@ static void on_ota_manifest(
     xSemaphoreGive(_manifest_rcvd);
 }
 
-static void fw_update_end(void) {
-    if (_update_handle) {
-        esp_ota_end(_update_handle);
-    }
-}
-
 static void fw_update_task(void* arg) {
     // If it's the first time booting a new OTA image,
     // wait for successful connection to Golioth.
@@ -334,19 +910,16 @@ static void fw_update_task(void* arg) {
 
         if (fw_update_download_and_write_flash() != GOLIOTH_OK) {
             ESP_LOGE(TAG, "Firmware download failed");
-            fw_update_end();
             continue;
         }
 
         if (fw_update_validate() != GOLIOTH_OK) {
             ESP_LOGE(TAG, "Firmware validate failed");
-            fw_update_end();
             continue;
         }
 
         if (fw_update_change_boot_image() != GOLIOTH_OK) {
             ESP_LOGE(TAG, "Firmware change boot image failed");
-            fw_update_end();
             continue;
         }
 
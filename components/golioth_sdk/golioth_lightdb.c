@@ -6,6 +6,7 @@
 #include <esp_log.h>
 #include "golioth_coap_client.h"
 #include "golioth_lightdb.h"
+#include "golioth_cbor.h"
 #include "golioth_util.h"
 #include "golioth_time.h"
 #include "golioth_statistics.h"
@@ -24,6 +25,7 @@ typedef enum {
 
 typedef struct {
     lightdb_get_type_t type;
+    golioth_lightdb_encoding_t encoding;
     union {
         int32_t* i;
         float* f;
@@ -32,8 +34,115 @@ typedef struct {
     };
     size_t strbuf_size;  // only applicable for string type
     bool is_null;
+    bool is_invalid;
 } lightdb_get_response_t;
 
+// A typed value to set, for encoding as CBOR
+typedef struct {
+    lightdb_get_type_t type;
+    union {
+        int32_t i;
+        float f;
+        bool b;
+        struct {
+            const char* str;
+            size_t str_len;
+        };
+    };
+} lightdb_value_t;
+
+// Largest CBOR head (initial byte and 8-byte argument), and so largest
+// encoded int, bool or float
+#define LIGHTDB_CBOR_MAX_HEAD_SIZE 9
+
+static uint32_t content_type_of(golioth_lightdb_encoding_t encoding) {
+    return (encoding == GOLIOTH_LIGHTDB_ENCODING_CBOR ? COAP_MEDIATYPE_APPLICATION_CBOR
+                                                      : COAP_MEDIATYPE_APPLICATION_JSON);
+}
+
+void golioth_lightdb_set_encoding(golioth_client_t client, golioth_lightdb_encoding_t encoding) {
+    golioth_coap_client_set_lightdb_encoding(client, encoding);
+}
+
+static void free_payload_buf(void* payload, void* arg) {
+    free(payload);
+    GSTATS_INC_FREE("buf");
+}
+
+// Encode value as CBOR straight into a payload buffer, and hand the buffer over to
+// the client, so the value is never formatted into an intermediate buffer.
+static golioth_status_t golioth_lightdb_set_cbor_value(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        const lightdb_value_t* value,
+        bool is_synchronous,
+        int32_t timeout_s,
+        golioth_set_cb_fn callback,
+        void* callback_arg) {
+    size_t bufsize = LIGHTDB_CBOR_MAX_HEAD_SIZE;
+    if (value->type == LIGHTDB_GET_TYPE_STRING) {
+        bufsize += value->str_len;
+    }
+
+    golioth_payload_release_fn release = NULL;
+    void* release_arg = NULL;
+    uint8_t* buf = NULL;
+    if (bufsize <= CONFIG_GOLIOTH_PAYLOAD_POOL_BUF_SIZE) {
+        buf = golioth_client_payload_alloc(client);
+        release = golioth_client_payload_release;
+        release_arg = client;
+    }
+    if (!buf) {
+        buf = malloc(bufsize);
+        if (!buf) {
+            return GOLIOTH_ERR_MEM_ALLOC;
+        }
+        GSTATS_INC_ALLOC("buf");
+        release = free_payload_buf;
+        release_arg = NULL;
+    }
+
+    golioth_cbor_encoder_t enc;
+    golioth_cbor_encoder_init(&enc, buf, bufsize);
+    switch (value->type) {
+        case LIGHTDB_GET_TYPE_INT:
+            golioth_cbor_encode_int(&enc, value->i);
+            break;
+        case LIGHTDB_GET_TYPE_FLOAT:
+            golioth_cbor_encode_float(&enc, value->f);
+            break;
+        case LIGHTDB_GET_TYPE_BOOL:
+            golioth_cbor_encode_bool(&enc, value->b);
+            break;
+        case LIGHTDB_GET_TYPE_STRING:
+            golioth_cbor_encode_text(&enc, value->str, value->str_len);
+            break;
+        default:
+            assert(false);
+    }
+    size_t payload_size = 0;
+    golioth_status_t status = golioth_cbor_encoder_finish(&enc, &payload_size);
+    if (status != GOLIOTH_OK) {
+        release(buf, release_arg);
+        return status;
+    }
+
+    return golioth_coap_client_set_owned(
+            client,
+            path_prefix,
+            path,
+            COAP_MEDIATYPE_APPLICATION_CBOR,
+            buf,
+            payload_size,
+            release,
+            release_arg,
+            callback,
+            callback_arg,
+            is_synchronous,
+            timeout_s);
+}
+
 static golioth_status_t golioth_lightdb_set_int_internal(
         golioth_client_t client,
         const char* path_prefix,
@@ -43,6 +152,19 @@ static golioth_status_t golioth_lightdb_set_int_internal(
         int32_t timeout_s,
         golioth_set_cb_fn callback,
         void* callback_arg) {
+    if (golioth_coap_client_lightdb_encoding(client) == GOLIOTH_LIGHTDB_ENCODING_CBOR) {
+        lightdb_value_t cbor_value = {.type = LIGHTDB_GET_TYPE_INT, .i = value};
+        return golioth_lightdb_set_cbor_value(
+                client,
+                path_prefix,
+                path,
+                &cbor_value,
+                is_synchronous,
+                timeout_s,
+                callback,
+                callback_arg);
+    }
+
     char buf[16] = {};
     snprintf(buf, sizeof(buf), "%d", value);
     return golioth_coap_client_set(
@@ -67,6 +189,19 @@ static golioth_status_t golioth_lightdb_set_bool_internal(
         int32_t timeout_s,
         golioth_set_cb_fn callback,
         void* callback_arg) {
+    if (golioth_coap_client_lightdb_encoding(client) == GOLIOTH_LIGHTDB_ENCODING_CBOR) {
+        lightdb_value_t cbor_value = {.type = LIGHTDB_GET_TYPE_BOOL, .b = value};
+        return golioth_lightdb_set_cbor_value(
+                client,
+                path_prefix,
+                path,
+                &cbor_value,
+                is_synchronous,
+                timeout_s,
+                callback,
+                callback_arg);
+    }
+
     const char* valuestr = (value ? "true" : "false");
     return golioth_coap_client_set(
             client,
@@ -90,6 +225,19 @@ static golioth_status_t golioth_lightdb_set_float_internal(
         int32_t timeout_s,
         golioth_set_cb_fn callback,
         void* callback_arg) {
+    if (golioth_coap_client_lightdb_encoding(client) == GOLIOTH_LIGHTDB_ENCODING_CBOR) {
+        lightdb_value_t cbor_value = {.type = LIGHTDB_GET_TYPE_FLOAT, .f = value};
+        return golioth_lightdb_set_cbor_value(
+                client,
+                path_prefix,
+                path,
+                &cbor_value,
+                is_synchronous,
+                timeout_s,
+                callback,
+                callback_arg);
+    }
+
     char buf[32] = {};
     snprintf(buf, sizeof(buf), "%f", value);
     return golioth_coap_client_set(
@@ -115,36 +263,61 @@ static golioth_status_t golioth_lightdb_set_string_internal(
         int32_t timeout_s,
         golioth_set_cb_fn callback,
         void* callback_arg) {
+    if (golioth_coap_client_lightdb_encoding(client) == GOLIOTH_LIGHTDB_ENCODING_CBOR) {
+        lightdb_value_t cbor_value = {
+                .type = LIGHTDB_GET_TYPE_STRING,
+                .str = str,
+                .str_len = str_len,
+        };
+        return golioth_lightdb_set_cbor_value(
+                client,
+                path_prefix,
+                path,
+                &cbor_value,
+                is_synchronous,
+                timeout_s,
+                callback,
+                callback_arg);
+    }
+
     // Server requires that non-JSON-formatted strings
     // be surrounded with literal ".
     //
-    // It's inefficient, but we're going to copy the string
-    // so we can surround it in quotes.
-    //
-    // TODO - is there a better way to handle this?
+    // The quoted string is built straight into the request payload, which is
+    // handed over to the client, so the string is only copied once.
     size_t bufsize = str_len + 3;  // two " and a NULL
-    char* buf = calloc(1, bufsize);
+    golioth_payload_release_fn release = NULL;
+    void* release_arg = NULL;
+    char* buf = NULL;
+    if (bufsize <= CONFIG_GOLIOTH_PAYLOAD_POOL_BUF_SIZE) {
+        buf = golioth_client_payload_alloc(client);
+        release = golioth_client_payload_release;
+        release_arg = client;
+    }
     if (!buf) {
-        return GOLIOTH_ERR_MEM_ALLOC;
+        buf = malloc(bufsize);
+        if (!buf) {
+            return GOLIOTH_ERR_MEM_ALLOC;
+        }
+        GSTATS_INC_ALLOC("buf");
+        release = free_payload_buf;
+        release_arg = NULL;
     }
-    GSTATS_INC_ALLOC("buf");
     snprintf(buf, bufsize, "\"%s\"", str);
 
-    golioth_status_t status = golioth_coap_client_set(
+    return golioth_coap_client_set_owned(
             client,
             path_prefix,
             path,
             COAP_MEDIATYPE_APPLICATION_JSON,
-            (const uint8_t*)buf,
+            (uint8_t*)buf,
             bufsize - 1,  // excluding NULL
+            release,
+            release_arg,
             callback,
             callback_arg,
             is_synchronous,
             timeout_s);
-
-    free(buf);
-    GSTATS_INC_FREE("buf");
-    return status;
 }
 
 static golioth_status_t golioth_lightdb_delete_internal(
@@ -163,6 +336,7 @@ static golioth_status_t golioth_lightdb_get_internal(
         golioth_client_t client,
         const char* path_prefix,
         const char* path,
+        uint32_t content_type,
         golioth_get_cb_fn callback,
         void* arg,
         bool is_synchronous,
@@ -171,7 +345,7 @@ static golioth_status_t golioth_lightdb_get_internal(
             client,
             path_prefix,
             path,
-            COAP_MEDIATYPE_APPLICATION_JSON,
+            content_type,
             callback,
             arg,
             is_synchronous,
@@ -201,6 +375,29 @@ static golioth_status_t golioth_lightdb_set_json_internal(
             timeout_s);
 }
 
+static golioth_status_t golioth_lightdb_set_cbor_internal(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        const uint8_t* cbor,
+        size_t cbor_len,
+        bool is_synchronous,
+        int32_t timeout_s,
+        golioth_set_cb_fn callback,
+        void* callback_arg) {
+    return golioth_coap_client_set(
+            client,
+            path_prefix,
+            path,
+            COAP_MEDIATYPE_APPLICATION_CBOR,
+            cbor,
+            cbor_len,
+            callback,
+            callback_arg,
+            is_synchronous,
+            timeout_s);
+}
+
 int32_t golioth_payload_as_int(const uint8_t* payload, size_t payload_size) {
     // Copy payload to a NULL-terminated string
     char value[12] = {};
@@ -327,6 +524,52 @@ golioth_status_t golioth_lightdb_set_json_async(
             callback_arg);
 }
 
+golioth_status_t golioth_lightdb_set_json_reader_async(
+        golioth_client_t client,
+        const char* path,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t json_size,
+        golioth_set_cb_fn callback,
+        void* callback_arg) {
+    return golioth_coap_client_set_from_reader(
+            client,
+            GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
+            path,
+            COAP_MEDIATYPE_APPLICATION_JSON,
+            reader,
+            reader_arg,
+            json_size,
+            callback,
+            callback_arg,
+            false,
+            GOLIOTH_WAIT_FOREVER);
+}
+
+golioth_status_t golioth_lightdb_set_json_owned_async(
+        golioth_client_t client,
+        const char* path,
+        char* json_str,
+        size_t json_str_len,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        golioth_set_cb_fn callback,
+        void* callback_arg) {
+    return golioth_coap_client_set_owned(
+            client,
+            GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
+            path,
+            COAP_MEDIATYPE_APPLICATION_JSON,
+            (uint8_t*)json_str,
+            json_str_len,
+            release,
+            release_arg,
+            callback,
+            callback_arg,
+            false,
+            GOLIOTH_WAIT_FOREVER);
+}
+
 golioth_status_t golioth_lightdb_get_async(
         golioth_client_t client,
         const char* path,
@@ -336,6 +579,7 @@ golioth_status_t golioth_lightdb_get_async(
             client,
             GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
             path,
+            COAP_MEDIATYPE_APPLICATION_JSON,
             callback,
             arg,
             false,
@@ -371,6 +615,18 @@ golioth_status_t golioth_lightdb_observe_async(
             arg);
 }
 
+golioth_status_t golioth_lightdb_unobserve_async(golioth_client_t client, const char* path) {
+    return golioth_coap_client_unobserve(
+            client, GOLIOTH_LIGHTDB_STATE_PATH_PREFIX, path, false, GOLIOTH_WAIT_FOREVER);
+}
+
+golioth_status_t golioth_lightdb_unobserve_sync(
+        golioth_client_t client,
+        const char* path,
+        int32_t timeout_s) {
+    return golioth_coap_client_unobserve(
+            client, GOLIOTH_LIGHTDB_STATE_PATH_PREFIX, path, true, timeout_s);
+}
 
 golioth_status_t golioth_lightdb_set_int_sync(
         golioth_client_t client,
@@ -435,6 +691,108 @@ golioth_status_t golioth_lightdb_set_json_sync(
             NULL);
 }
 
+golioth_status_t golioth_lightdb_set_cbor_async(
+        golioth_client_t client,
+        const char* path,
+        const uint8_t* cbor,
+        size_t cbor_len,
+        golioth_set_cb_fn callback,
+        void* callback_arg) {
+    return golioth_lightdb_set_cbor_internal(
+            client,
+            GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
+            path,
+            cbor,
+            cbor_len,
+            false,
+            GOLIOTH_WAIT_FOREVER,
+            callback,
+            callback_arg);
+}
+
+golioth_status_t golioth_lightdb_set_cbor_sync(
+        golioth_client_t client,
+        const char* path,
+        const uint8_t* cbor,
+        size_t cbor_len,
+        int32_t timeout_s) {
+    return golioth_lightdb_set_cbor_internal(
+            client,
+            GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
+            path,
+            cbor,
+            cbor_len,
+            true,
+            timeout_s,
+            NULL,
+            NULL);
+}
+
+golioth_status_t golioth_lightdb_set_json_reader_sync(
+        golioth_client_t client,
+        const char* path,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t json_size,
+        int32_t timeout_s) {
+    return golioth_coap_client_set_from_reader(
+            client,
+            GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
+            path,
+            COAP_MEDIATYPE_APPLICATION_JSON,
+            reader,
+            reader_arg,
+            json_size,
+            NULL,
+            NULL,
+            true,
+            timeout_s);
+}
+
+// Decode a CBOR payload into ldb_response
+static void decode_cbor_payload(
+        lightdb_get_response_t* ldb_response,
+        const uint8_t* payload,
+        size_t payload_size) {
+    golioth_cbor_decoder_t dec;
+    golioth_cbor_decoder_init(&dec, payload, payload_size);
+    if (payload_size == 0 || golioth_cbor_decode_null(&dec)) {
+        ldb_response->is_null = true;
+        return;
+    }
+
+    golioth_status_t status = GOLIOTH_OK;
+    switch (ldb_response->type) {
+        case LIGHTDB_GET_TYPE_INT: {
+            int64_t value = 0;
+            status = golioth_cbor_decode_int(&dec, &value);
+            if (status == GOLIOTH_OK && (value < INT32_MIN || value > INT32_MAX)) {
+                status = GOLIOTH_ERR_INVALID_FORMAT;
+            }
+            *ldb_response->i = value;
+        } break;
+        case LIGHTDB_GET_TYPE_FLOAT:
+            status = golioth_cbor_decode_float(&dec, ldb_response->f);
+            break;
+        case LIGHTDB_GET_TYPE_BOOL:
+            status = golioth_cbor_decode_bool(&dec, ldb_response->b);
+            break;
+        case LIGHTDB_GET_TYPE_STRING: {
+            const char* str = NULL;
+            size_t str_len = 0;
+            status = golioth_cbor_decode_text(&dec, &str, &str_len);
+            if (status == GOLIOTH_OK) {
+                size_t nbytes = min(ldb_response->strbuf_size - 1, str_len);
+                memcpy(ldb_response->strbuf, str, nbytes);
+                ldb_response->strbuf[nbytes] = 0;
+            }
+        } break;
+        default:
+            assert(false);
+    }
+    ldb_response->is_invalid = (status != GOLIOTH_OK);
+}
+
 static void on_payload(
         golioth_client_t client,
         const golioth_response_t* response,
@@ -449,6 +807,11 @@ static void on_payload(
         return;
     }
 
+    if (ldb_response->encoding == GOLIOTH_LIGHTDB_ENCODING_CBOR) {
+        decode_cbor_payload(ldb_response, payload, payload_size);
+        return;
+    }
+
     if (golioth_payload_is_null(payload, payload_size)) {
         ldb_response->is_null = true;
         return;
@@ -475,29 +838,43 @@ static void on_payload(
     }
 }
 
-golioth_status_t golioth_lightdb_get_int_sync(
+// Get a typed value, in the encoding set in response
+static golioth_status_t golioth_lightdb_get_typed_sync(
         golioth_client_t client,
         const char* path,
-        int32_t* value,
+        lightdb_get_response_t* response,
         int32_t timeout_s) {
-    lightdb_get_response_t response = {
-            .type = LIGHTDB_GET_TYPE_INT,
-            .i = value,
-    };
     golioth_status_t status = golioth_lightdb_get_internal(
             client,
             GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
             path,
+            content_type_of(response->encoding),
             on_payload,
-            &response,
+            response,
             true,
             timeout_s);
-    if (status == GOLIOTH_OK && response.is_null) {
+    if (status == GOLIOTH_OK && response->is_null) {
         return GOLIOTH_ERR_NULL;
     }
+    if (status == GOLIOTH_OK && response->is_invalid) {
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
     return status;
 }
 
+golioth_status_t golioth_lightdb_get_int_sync(
+        golioth_client_t client,
+        const char* path,
+        int32_t* value,
+        int32_t timeout_s) {
+    lightdb_get_response_t response = {
+            .type = LIGHTDB_GET_TYPE_INT,
+            .encoding = golioth_coap_client_lightdb_encoding(client),
+            .i = value,
+    };
+    return golioth_lightdb_get_typed_sync(client, path, &response, timeout_s);
+}
+
 golioth_status_t golioth_lightdb_get_bool_sync(
         golioth_client_t client,
         const char* path,
@@ -505,20 +882,10 @@ golioth_status_t golioth_lightdb_get_bool_sync(
         int32_t timeout_s) {
     lightdb_get_response_t response = {
             .type = LIGHTDB_GET_TYPE_BOOL,
+            .encoding = golioth_coap_client_lightdb_encoding(client),
             .b = value,
     };
-    golioth_status_t status = golioth_lightdb_get_internal(
-            client,
-            GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
-            path,
-            on_payload,
-            &response,
-            true,
-            timeout_s);
-    if (status == GOLIOTH_OK && response.is_null) {
-        return GOLIOTH_ERR_NULL;
-    }
-    return status;
+    return golioth_lightdb_get_typed_sync(client, path, &response, timeout_s);
 }
 
 golioth_status_t golioth_lightdb_get_float_sync(
@@ -528,20 +895,10 @@ golioth_status_t golioth_lightdb_get_float_sync(
         int32_t timeout_s) {
     lightdb_get_response_t response = {
             .type = LIGHTDB_GET_TYPE_FLOAT,
+            .encoding = golioth_coap_client_lightdb_encoding(client),
             .f = value,
     };
-    golioth_status_t status = golioth_lightdb_get_internal(
-            client,
-            GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
-            path,
-            on_payload,
-            &response,
-            true,
-            timeout_s);
-    if (status == GOLIOTH_OK && response.is_null) {
-        return GOLIOTH_ERR_NULL;
-    }
-    return status;
+    return golioth_lightdb_get_typed_sync(client, path, &response, timeout_s);
 }
 
 golioth_status_t golioth_lightdb_get_string_sync(
@@ -552,21 +909,11 @@ golioth_status_t golioth_lightdb_get_string_sync(
         int32_t timeout_s) {
     lightdb_get_response_t response = {
             .type = LIGHTDB_GET_TYPE_STRING,
+            .encoding = golioth_coap_client_lightdb_encoding(client),
             .strbuf = strbuf,
             .strbuf_size = strbuf_size,
     };
-    golioth_status_t status = golioth_lightdb_get_internal(
-            client,
-            GOLIOTH_LIGHTDB_STATE_PATH_PREFIX,
-            path,
-            on_payload,
-            &response,
-            true,
-            timeout_s);
-    if (status == GOLIOTH_OK && response.is_null) {
-        return GOLIOTH_ERR_NULL;
-    }
-    return status;
+    return golioth_lightdb_get_typed_sync(client, path, &response, timeout_s);
 }
 
 golioth_status_t golioth_lightdb_get_json_sync(
@@ -575,7 +922,14 @@ golioth_status_t golioth_lightdb_get_json_sync(
         char* strbuf,
         size_t strbuf_size,
         int32_t timeout_s) {
-    return golioth_lightdb_get_string_sync(client, path, strbuf, strbuf_size, timeout_s);
+    // Always JSON, regardless of the encoding of typed values
+    lightdb_get_response_t response = {
+            .type = LIGHTDB_GET_TYPE_STRING,
+            .encoding = GOLIOTH_LIGHTDB_ENCODING_JSON,
+            .strbuf = strbuf,
+            .strbuf_size = strbuf_size,
+    };
+    return golioth_lightdb_get_typed_sync(client, path, &response, timeout_s);
 }
 
 golioth_status_t golioth_lightdb_delete_sync(
@@ -675,6 +1029,52 @@ golioth_status_t golioth_lightdb_stream_set_json_async(
             callback_arg);
 }
 
+golioth_status_t golioth_lightdb_stream_set_json_reader_async(
+        golioth_client_t client,
+        const char* path,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t json_size,
+        golioth_set_cb_fn callback,
+        void* callback_arg) {
+    return golioth_coap_client_set_from_reader(
+            client,
+            GOLIOTH_LIGHTDB_STREAM_PATH_PREFIX,
+            path,
+            COAP_MEDIATYPE_APPLICATION_JSON,
+            reader,
+            reader_arg,
+            json_size,
+            callback,
+            callback_arg,
+            false,
+            GOLIOTH_WAIT_FOREVER);
+}
+
+golioth_status_t golioth_lightdb_stream_set_json_owned_async(
+        golioth_client_t client,
+        const char* path,
+        char* json_str,
+        size_t json_str_len,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        golioth_set_cb_fn callback,
+        void* callback_arg) {
+    return golioth_coap_client_set_owned(
+            client,
+            GOLIOTH_LIGHTDB_STREAM_PATH_PREFIX,
+            path,
+            COAP_MEDIATYPE_APPLICATION_JSON,
+            (uint8_t*)json_str,
+            json_str_len,
+            release,
+            release_arg,
+            callback,
+            callback_arg,
+            false,
+            GOLIOTH_WAIT_FOREVER);
+}
+
 golioth_status_t golioth_lightdb_stream_set_int_sync(
         golioth_client_t client,
         const char* path,
@@ -737,3 +1137,61 @@ golioth_status_t golioth_lightdb_stream_set_json_sync(
             NULL,
             NULL);
 }
+
+golioth_status_t golioth_lightdb_stream_set_cbor_async(
+        golioth_client_t client,
+        const char* path,
+        const uint8_t* cbor,
+        size_t cbor_len,
+        golioth_set_cb_fn callback,
+        void* callback_arg) {
+    return golioth_lightdb_set_cbor_internal(
+            client,
+            GOLIOTH_LIGHTDB_STREAM_PATH_PREFIX,
+            path,
+            cbor,
+            cbor_len,
+            false,
+            GOLIOTH_WAIT_FOREVER,
+            callback,
+            callback_arg);
+}
+
+golioth_status_t golioth_lightdb_stream_set_cbor_sync(
+        golioth_client_t client,
+        const char* path,
+        const uint8_t* cbor,
+        size_t cbor_len,
+        int32_t timeout_s) {
+    return golioth_lightdb_set_cbor_internal(
+            client,
+            GOLIOTH_LIGHTDB_STREAM_PATH_PREFIX,
+            path,
+            cbor,
+            cbor_len,
+            true,
+            timeout_s,
+            NULL,
+            NULL);
+}
+
+golioth_status_t golioth_lightdb_stream_set_json_reader_sync(
+        golioth_client_t client,
+        const char* path,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t json_size,
+        int32_t timeout_s) {
+    return golioth_coap_client_set_from_reader(
+            client,
+            GOLIOTH_LIGHTDB_STREAM_PATH_PREFIX,
+            path,
+            COAP_MEDIATYPE_APPLICATION_JSON,
+            reader,
+            reader_arg,
+            json_size,
+            NULL,
+            NULL,
+            true,
+            timeout_s);
+}
@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <string.h>
+#include "golioth_offline_log.h"
+
+#define RECORD_MAGIC 0x60A1
+#define RECORD_STATE_VALID 0xFF
+#define RECORD_STATE_CONSUMED 0x00
+
+// The magic is written last, so a record interrupted by a power loss is never
+// mistaken for a complete one.
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t state;
+    uint8_t kind;
+    uint16_t content_type;
+    uint16_t payload_size;
+    uint32_t seq;
+    uint32_t timestamp_s;
+    uint8_t path_len;
+    uint8_t reserved;
+    // CRC-16 of the header from kind up to here, the path and the payload
+    uint16_t crc;
+} record_header_t;
+
+#define RECORD_CRC_START offsetof(record_header_t, kind)
+#define RECORD_CRC_END offsetof(record_header_t, crc)
+
+typedef enum {
+    SLOT_RECORD,
+    // Nothing was written here, and so nothing after it in the sector either
+    SLOT_ERASED,
+    // Partly written, the rest of the sector is unusable until erased
+    SLOT_DIRTY,
+} slot_t;
+
+// CRC-16/CCITT-FALSE
+static uint16_t crc16(uint16_t crc, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+static size_t record_size(const record_header_t* hdr) {
+    return sizeof(record_header_t) + hdr->path_len + hdr->payload_size;
+}
+
+// Offset following the record at pos
+static size_t record_end(
+        const golioth_offline_log_t* log,
+        size_t pos,
+        const record_header_t* hdr) {
+    return (pos + record_size(hdr)) % log->storage.size;
+}
+
+static size_t sector_offset(const golioth_offline_log_t* log, size_t pos) {
+    return pos % log->storage.sector_size;
+}
+
+static size_t sector_start(const golioth_offline_log_t* log, size_t pos) {
+    return pos - sector_offset(log, pos);
+}
+
+static size_t next_sector(const golioth_offline_log_t* log, size_t pos) {
+    return (sector_start(log, pos) + log->storage.sector_size) % log->storage.size;
+}
+
+static size_t num_sectors(const golioth_offline_log_t* log) {
+    return log->storage.size / log->storage.sector_size;
+}
+
+static golioth_status_t storage_read(
+        const golioth_offline_log_t* log,
+        size_t offset,
+        void* buf,
+        size_t len) {
+    return log->storage.read(log->storage.ctx, offset, buf, len);
+}
+
+static golioth_status_t storage_write(
+        const golioth_offline_log_t* log,
+        size_t offset,
+        const void* buf,
+        size_t len) {
+    return log->storage.write(log->storage.ctx, offset, buf, len);
+}
+
+// Classify what's at pos, and read its header if it's a record
+static golioth_status_t read_slot(
+        const golioth_offline_log_t* log,
+        size_t pos,
+        record_header_t* hdr,
+        slot_t* slot) {
+    if (log->storage.sector_size - sector_offset(log, pos) < sizeof(record_header_t)) {
+        *slot = SLOT_ERASED;
+        return GOLIOTH_OK;
+    }
+    GOLIOTH_STATUS_RETURN_IF_ERROR(storage_read(log, pos, hdr, sizeof(*hdr)));
+
+    if (hdr->magic == RECORD_MAGIC
+        && sector_offset(log, pos) + record_size(hdr) <= log->storage.sector_size) {
+        *slot = SLOT_RECORD;
+        return GOLIOTH_OK;
+    }
+
+    const uint8_t* bytes = (const uint8_t*)hdr;
+    *slot = SLOT_ERASED;
+    for (size_t i = 0; i < sizeof(*hdr); i++) {
+        if (bytes[i] != 0xFF) {
+            *slot = SLOT_DIRTY;
+            break;
+        }
+    }
+    return GOLIOTH_OK;
+}
+
+// Starting at *pos, find the next record before head.
+// Returns GOLIOTH_ERR_NULL if there is none.
+//
+// When the log is full, head is at the start of the tail's sector, so *pos == head
+// is ambiguous. If records_ahead is true, the caller knows there are records between
+// *pos and head, so a start at head means the whole log is ahead rather than none of it.
+static golioth_status_t seek_record(
+        const golioth_offline_log_t* log,
+        size_t* pos,
+        record_header_t* hdr,
+        bool records_ahead) {
+    // Every sector can be skipped at most once on the way to head
+    for (size_t i = 0; i <= num_sectors(log); i++) {
+        if (*pos == log->head && !(i == 0 && records_ahead)) {
+            return GOLIOTH_ERR_NULL;
+        }
+        slot_t slot = SLOT_ERASED;
+        GOLIOTH_STATUS_RETURN_IF_ERROR(read_slot(log, *pos, hdr, &slot));
+        if (slot == SLOT_RECORD) {
+            return GOLIOTH_OK;
+        }
+        *pos = next_sector(log, *pos);
+    }
+    return GOLIOTH_ERR_NULL;
+}
+
+// Distance from the record at pos forward to head. A record at head (the log is full)
+// is the oldest one, so it's the whole log away.
+static size_t distance_to_head(const golioth_offline_log_t* log, size_t pos) {
+    size_t distance = (log->head + log->storage.size - pos) % log->storage.size;
+    return (distance == 0 ? log->storage.size : distance);
+}
+
+// Whether the record at pos is still to be returned by golioth_offline_log_read_next
+static bool is_unread(const golioth_offline_log_t* log, size_t pos) {
+    if (log->num_unread == 0) {
+        return false;
+    }
+    if (log->read_pos == log->head) {
+        // Full log, and nothing read since the start
+        return true;
+    }
+    return distance_to_head(log, pos) <= distance_to_head(log, log->read_pos);
+}
+
+// Move tail to the oldest record not yet consumed, starting at pos
+static golioth_status_t update_tail(golioth_offline_log_t* log, size_t pos) {
+    if (log->num_records == 0) {
+        log->tail = log->head;
+        return GOLIOTH_OK;
+    }
+    record_header_t hdr;
+    while (true) {
+        // There's at least one record not yet consumed between pos and head
+        golioth_status_t status = seek_record(log, &pos, &hdr, true);
+        if (status == GOLIOTH_ERR_NULL) {
+            // Shouldn't happen, the count is off
+            log->num_records = 0;
+            log->num_unread = 0;
+            log->tail = log->head;
+            return GOLIOTH_OK;
+        }
+        if (status != GOLIOTH_OK) {
+            return status;
+        }
+        if (hdr.state == RECORD_STATE_VALID) {
+            log->tail = pos;
+            return GOLIOTH_OK;
+        }
+        pos = record_end(log, pos, &hdr);
+    }
+}
+
+golioth_status_t golioth_offline_log_open(
+        golioth_offline_log_t* log,
+        const golioth_offline_storage_t* storage,
+        golioth_offline_overflow_t overflow) {
+    if (storage->sector_size == 0 || storage->size < 2 * storage->sector_size
+        || storage->size % storage->sector_size != 0) {
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+
+    memset(log, 0, sizeof(*log));
+    log->storage = *storage;
+    log->overflow = overflow;
+
+    // Find the newest record (the head follows it) and the oldest record not yet consumed
+    bool found = false;
+    uint32_t max_seq = 0;
+    uint32_t min_valid_seq = UINT32_MAX;
+    size_t head = 0;
+    for (size_t s = 0; s < num_sectors(log); s++) {
+        size_t pos = s * storage->sector_size;
+        while (pos < (s + 1) * storage->sector_size) {
+            record_header_t hdr;
+            slot_t slot = SLOT_ERASED;
+            GOLIOTH_STATUS_RETURN_IF_ERROR(read_slot(log, pos, &hdr, &slot));
+            if (slot != SLOT_RECORD) {
+                break;
+            }
+            if (!found || hdr.seq > max_seq) {
+                found = true;
+                max_seq = hdr.seq;
+                head = record_end(log, pos, &hdr);
+            }
+            if (hdr.state == RECORD_STATE_VALID) {
+                log->num_records++;
+                if (hdr.seq < min_valid_seq) {
+                    min_valid_seq = hdr.seq;
+                    log->tail = pos;
+                }
+            }
+            pos += record_size(&hdr);
+        }
+    }
+
+    log->next_seq = max_seq + 1;
+    log->head = head;
+    log->head_sector_ready = false;
+    if (found && sector_offset(log, log->head) != 0) {
+        // Carry on writing in the same sector, unless it was left partly written
+        record_header_t hdr;
+        slot_t slot = SLOT_ERASED;
+        GOLIOTH_STATUS_RETURN_IF_ERROR(read_slot(log, log->head, &hdr, &slot));
+        if (slot == SLOT_ERASED) {
+            log->head_sector_ready = true;
+        } else {
+            log->head = next_sector(log, log->head);
+        }
+    }
+
+    if (log->num_records == 0) {
+        log->tail = log->head;
+    }
+    log->read_pos = log->tail;
+    log->num_unread = log->num_records;
+    return GOLIOTH_OK;
+}
+
+// Erase the sector at head, so it can be written. If it still holds records not
+// yet consumed, the log is full, and the overflow policy applies.
+static golioth_status_t prepare_head_sector(golioth_offline_log_t* log) {
+    size_t sector = sector_start(log, log->head);
+
+    if (log->num_records > 0 && sector_start(log, log->tail) == sector) {
+        if (log->overflow == GOLIOTH_OFFLINE_OVERFLOW_DROP_NEWEST) {
+            return GOLIOTH_ERR_QUEUE_FULL;
+        }
+
+        // Drop the records still in the sector
+        size_t pos = sector;
+        while (pos < sector + log->storage.sector_size) {
+            record_header_t hdr;
+            slot_t slot = SLOT_ERASED;
+            GOLIOTH_STATUS_RETURN_IF_ERROR(read_slot(log, pos, &hdr, &slot));
+            if (slot != SLOT_RECORD) {
+                break;
+            }
+            if (hdr.state == RECORD_STATE_VALID) {
+                if (is_unread(log, pos)) {
+                    log->num_unread--;
+                }
+                log->num_records--;
+                log->num_dropped++;
+            }
+            pos += record_size(&hdr);
+        }
+        GOLIOTH_STATUS_RETURN_IF_ERROR(update_tail(log, next_sector(log, sector)));
+        if (sector_start(log, log->read_pos) == sector) {
+            log->read_pos = log->tail;
+        }
+    }
+
+    GOLIOTH_STATUS_RETURN_IF_ERROR(
+            log->storage.erase(log->storage.ctx, sector, log->storage.sector_size));
+    log->head_sector_ready = true;
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_offline_log_append(
+        golioth_offline_log_t* log,
+        golioth_offline_record_kind_t kind,
+        uint32_t content_type,
+        uint32_t timestamp_s,
+        const char* path,
+        const uint8_t* payload,
+        size_t payload_size) {
+    size_t path_len = strlen(path);
+    size_t size = sizeof(record_header_t) + path_len + payload_size;
+    if (path_len > CONFIG_GOLIOTH_COAP_MAX_PATH_LEN || payload_size > UINT16_MAX
+        || size > log->storage.sector_size) {
+        return GOLIOTH_ERR_MEM_ALLOC;
+    }
+
+    if (log->head_sector_ready
+        && sector_offset(log, log->head) + size > log->storage.sector_size) {
+        log->head = next_sector(log, log->head);
+        log->head_sector_ready = false;
+    }
+    if (!log->head_sector_ready) {
+        golioth_status_t status = prepare_head_sector(log);
+        if (status == GOLIOTH_ERR_QUEUE_FULL) {
+            log->num_dropped++;
+        }
+        if (status != GOLIOTH_OK) {
+            return status;
+        }
+    }
+
+    record_header_t hdr = {
+            .magic = 0xFFFF,  // written last
+            .state = RECORD_STATE_VALID,
+            .kind = kind,
+            .content_type = content_type,
+            .payload_size = payload_size,
+            .seq = log->next_seq,
+            .timestamp_s = timestamp_s,
+            .path_len = path_len,
+            .reserved = 0xFF,
+    };
+    uint16_t crc = crc16(
+            0xFFFF, (const uint8_t*)&hdr + RECORD_CRC_START, RECORD_CRC_END - RECORD_CRC_START);
+    crc = crc16(crc, (const uint8_t*)path, path_len);
+    hdr.crc = crc16(crc, payload, payload_size);
+
+    size_t pos = log->head;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(storage_write(log, pos, &hdr, sizeof(hdr)));
+    GOLIOTH_STATUS_RETURN_IF_ERROR(storage_write(log, pos + sizeof(hdr), path, path_len));
+    GOLIOTH_STATUS_RETURN_IF_ERROR(
+            storage_write(log, pos + sizeof(hdr) + path_len, payload, payload_size));
+    uint16_t magic = RECORD_MAGIC;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(
+            storage_write(log, pos + offsetof(record_header_t, magic), &magic, sizeof(magic)));
+
+    if (log->num_records == 0) {
+        log->tail = pos;
+    }
+    if (log->num_unread == 0) {
+        // Everything before was read, so reading carries on with this record
+        log->read_pos = pos;
+    }
+    log->head = (pos + size) % log->storage.size;
+    if (sector_offset(log, log->head) == 0) {
+        // Filled the sector exactly, the next one needs an erase
+        log->head_sector_ready = false;
+    }
+    log->next_seq++;
+    log->num_records++;
+    log->num_unread++;
+    return GOLIOTH_OK;
+}
+
+void golioth_offline_log_rewind(golioth_offline_log_t* log) {
+    log->read_pos = log->tail;
+    log->num_unread = log->num_records;
+}
+
+golioth_status_t golioth_offline_log_read_next(
+        golioth_offline_log_t* log,
+        golioth_offline_record_t* record,
+        uint8_t* payload,
+        size_t payload_buf_size) {
+    while (true) {
+        size_t pos = log->read_pos;
+        record_header_t hdr;
+        golioth_status_t status = GOLIOTH_ERR_NULL;
+        if (log->num_unread > 0) {
+            status = seek_record(log, &pos, &hdr, true);
+        }
+        if (status == GOLIOTH_ERR_NULL) {
+            log->read_pos = log->head;
+            log->num_unread = 0;
+        }
+        if (status != GOLIOTH_OK) {
+            return status;
+        }
+        log->read_pos = record_end(log, pos, &hdr);
+
+        if (hdr.state != RECORD_STATE_VALID) {
+            continue;
+        }
+
+        bool ok = (hdr.path_len <= CONFIG_GOLIOTH_COAP_MAX_PATH_LEN
+                   && hdr.payload_size <= payload_buf_size);
+        if (ok) {
+            GOLIOTH_STATUS_RETURN_IF_ERROR(
+                    storage_read(log, pos + sizeof(hdr), record->path, hdr.path_len));
+            GOLIOTH_STATUS_RETURN_IF_ERROR(storage_read(
+                    log, pos + sizeof(hdr) + hdr.path_len, payload, hdr.payload_size));
+            uint16_t crc = crc16(
+                    0xFFFF,
+                    (const uint8_t*)&hdr + RECORD_CRC_START,
+                    RECORD_CRC_END - RECORD_CRC_START);
+            crc = crc16(crc, (const uint8_t*)record->path, hdr.path_len);
+            crc = crc16(crc, payload, hdr.payload_size);
+            ok = (crc == hdr.crc);
+        }
+        log->num_unread--;
+        if (!ok) {
+            // Can't be sent, so don't keep it around
+            log->num_dropped++;
+            GOLIOTH_STATUS_RETURN_IF_ERROR(golioth_offline_log_consume(log, pos, hdr.seq));
+            continue;
+        }
+
+        record->offset = pos;
+        record->seq = hdr.seq;
+        record->kind = hdr.kind;
+        record->content_type = hdr.content_type;
+        record->timestamp_s = hdr.timestamp_s;
+        record->path[hdr.path_len] = '\0';
+        record->payload_size = hdr.payload_size;
+        return GOLIOTH_OK;
+    }
+}
+
+golioth_status_t golioth_offline_log_consume(
+        golioth_offline_log_t* log,
+        size_t offset,
+        uint32_t seq) {
+    record_header_t hdr;
+    slot_t slot = SLOT_ERASED;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(read_slot(log, offset, &hdr, &slot));
+    // The sector may have been erased and reused since the record was read
+    if (slot != SLOT_RECORD || hdr.seq != seq || hdr.state != RECORD_STATE_VALID) {
+        return GOLIOTH_OK;
+    }
+
+    uint8_t state = RECORD_STATE_CONSUMED;
+    GOLIOTH_STATUS_RETURN_IF_ERROR(
+            storage_write(log, offset + offsetof(record_header_t, state), &state, 1));
+    if (is_unread(log, offset)) {
+        // e.g. a record still in flight when the log was rewound
+        log->num_unread--;
+    }
+    log->num_records--;
+    if (offset == log->tail || log->num_records == 0) {
+        GOLIOTH_STATUS_RETURN_IF_ERROR(update_tail(log, log->tail));
+    }
+    return GOLIOTH_OK;
+}
@@ -0,0 +1,519 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "golioth_coap_client.h"
+#include "golioth_offline_store.h"
+#include "golioth_offline_log.h"
+#include "golioth_util.h"
+#include "golioth_time.h"
+#include "golioth_statistics.h"
+
+#define TAG "golioth_offline_store"
+
+// After a failed send, wait this long before sending records again
+#define GOLIOTH_OFFLINE_STORE_RETRY_DELAY_MS 5000
+
+// How long destroy waits for the responses of records in flight
+#define GOLIOTH_OFFLINE_STORE_DESTROY_TIMEOUT_MS (2000 * CONFIG_GOLIOTH_COAP_RESPONSE_TIMEOUT_S)
+
+typedef enum {
+    DRAIN_SLOT_IDLE,
+    DRAIN_SLOT_IN_FLIGHT,
+    // Response received (or timed out), waiting for the drain task
+    DRAIN_SLOT_DONE,
+} drain_slot_state_t;
+
+struct golioth_offline_store_impl;
+
+// A record being sent
+typedef struct {
+    struct golioth_offline_store_impl* store;
+    volatile drain_slot_state_t state;
+    size_t offset;
+    uint32_t seq;
+    golioth_response_t response;
+    uint8_t* buf;
+} drain_slot_t;
+
+// This is the struct hidden by the opaque type golioth_offline_store_t
+typedef struct golioth_offline_store_impl {
+    golioth_client_t client;
+    golioth_offline_store_config_t config;
+    golioth_offline_log_t log;
+    // Protects log and stats, records are appended from user tasks and
+    // sent from the drain task
+    SemaphoreHandle_t mutex;
+    // Records sent, appended, and dropped for being too old or rejected by the server
+    golioth_offline_store_stats_t stats;
+    // Sends stored records while the client is connected. Notified when the client
+    // connects, and when a record's response is received.
+    TaskHandle_t drain_task;
+    volatile bool stop;
+    volatile bool stopped;
+    // CONFIG_GOLIOTH_OFFLINE_STORE_DRAIN_WINDOW slots, and their buffers in one allocation
+    drain_slot_t slots[CONFIG_GOLIOTH_OFFLINE_STORE_DRAIN_WINDOW];
+    uint8_t* bufs;
+    size_t num_in_flight;
+    // A send failed, so records are sent again from the oldest one, once all
+    // records in flight have completed
+    bool retry;
+} golioth_offline_store_impl_t;
+
+static uint32_t now_s(void) {
+    struct timeval now = {};
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < GOLIOTH_MIN_VALID_TIME_S) {
+        return 0;
+    }
+    return now.tv_sec;
+}
+
+// Partition storage
+
+static golioth_status_t partition_read(void* ctx, size_t offset, void* buf, size_t len) {
+    esp_err_t err = esp_partition_read((const esp_partition_t*)ctx, offset, buf, len);
+    return (err == ESP_OK ? GOLIOTH_OK : GOLIOTH_ERR_IO);
+}
+
+static golioth_status_t partition_write(void* ctx, size_t offset, const void* buf, size_t len) {
+    esp_err_t err = esp_partition_write((const esp_partition_t*)ctx, offset, buf, len);
+    return (err == ESP_OK ? GOLIOTH_OK : GOLIOTH_ERR_IO);
+}
+
+static golioth_status_t partition_erase(void* ctx, size_t offset, size_t len) {
+    esp_err_t err = esp_partition_erase_range((const esp_partition_t*)ctx, offset, len);
+    return (err == ESP_OK ? GOLIOTH_OK : GOLIOTH_ERR_IO);
+}
+
+golioth_status_t golioth_offline_storage_partition(
+        const char* label,
+        golioth_offline_storage_t* storage) {
+    if (!label || !storage) {
+        return GOLIOTH_ERR_NULL;
+    }
+    const esp_partition_t* partition =
+            esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!partition) {
+        ESP_LOGE(TAG, "Partition %s not found", label);
+        return GOLIOTH_ERR_NULL;
+    }
+    *storage = (golioth_offline_storage_t){
+            .read = partition_read,
+            .write = partition_write,
+            .erase = partition_erase,
+            .size = partition->size - (partition->size % SPI_FLASH_SEC_SIZE),
+            .sector_size = SPI_FLASH_SEC_SIZE,
+            .ctx = (void*)partition,
+    };
+    return GOLIOTH_OK;
+}
+
+// File storage
+
+static golioth_status_t file_read(void* ctx, size_t offset, void* buf, size_t len) {
+    FILE* f = (FILE*)ctx;
+    if (fseek(f, offset, SEEK_SET) != 0 || fread(buf, 1, len, f) != len) {
+        return GOLIOTH_ERR_IO;
+    }
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t file_write(void* ctx, size_t offset, const void* buf, size_t len) {
+    FILE* f = (FILE*)ctx;
+    if (fseek(f, offset, SEEK_SET) != 0 || fwrite(buf, 1, len, f) != len || fflush(f) != 0) {
+        return GOLIOTH_ERR_IO;
+    }
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t file_erase(void* ctx, size_t offset, size_t len) {
+    FILE* f = (FILE*)ctx;
+    uint8_t erased[64];
+    memset(erased, 0xFF, sizeof(erased));
+    if (fseek(f, offset, SEEK_SET) != 0) {
+        return GOLIOTH_ERR_IO;
+    }
+    while (len > 0) {
+        size_t n = min(len, sizeof(erased));
+        if (fwrite(erased, 1, n, f) != n) {
+            return GOLIOTH_ERR_IO;
+        }
+        len -= n;
+    }
+    return (fflush(f) == 0 ? GOLIOTH_OK : GOLIOTH_ERR_IO);
+}
+
+golioth_status_t golioth_offline_storage_file(
+        const char* path,
+        size_t size,
+        size_t sector_size,
+        golioth_offline_storage_t* storage) {
+    if (!path || !storage) {
+        return GOLIOTH_ERR_NULL;
+    }
+    if (sector_size == 0 || size % sector_size != 0) {
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+
+    FILE* f = fopen(path, "r+b");
+    if (!f) {
+        f = fopen(path, "w+b");
+    }
+    if (!f) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return GOLIOTH_ERR_IO;
+    }
+
+    // A new (or shorter) file is extended with erased bytes
+    if (fseek(f, 0, SEEK_END) != 0) {
+        fclose(f);
+        return GOLIOTH_ERR_IO;
+    }
+    long file_size = ftell(f);
+    if (file_size >= 0 && (size_t)file_size < size) {
+        if (file_erase(f, file_size, size - file_size) != GOLIOTH_OK) {
+            ESP_LOGE(TAG, "Failed to size %s", path);
+            fclose(f);
+            return GOLIOTH_ERR_IO;
+        }
+    }
+
+    *storage = (golioth_offline_storage_t){
+            .read = file_read,
+            .write = file_write,
+            .erase = file_erase,
+            .size = size,
+            .sector_size = sector_size,
+            .ctx = f,
+    };
+    return GOLIOTH_OK;
+}
+
+void golioth_offline_storage_file_close(golioth_offline_storage_t* storage) {
+    if (!storage || !storage->ctx) {
+        return;
+    }
+    fclose((FILE*)storage->ctx);
+    storage->ctx = NULL;
+}
+
+// Draining
+
+static void on_record_sent(
+        golioth_client_t client,
+        const golioth_response_t* response,
+        const char* path,
+        void* arg) {
+    drain_slot_t* slot = (drain_slot_t*)arg;
+    slot->response = *response;
+    slot->state = DRAIN_SLOT_DONE;
+    xTaskNotifyGive(slot->store->drain_task);
+}
+
+// The slot's buffer is kept until the response, so there's nothing to do when
+// the client is done with the payload
+static void release_record_payload(void* payload, void* arg) {}
+
+// Remove the record of a completed slot, or schedule a retry. Caller holds the mutex.
+static void handle_completed(golioth_offline_store_impl_t* s, drain_slot_t* slot) {
+    const golioth_response_t* response = &slot->response;
+    if (response->status == GOLIOTH_OK) {
+        golioth_offline_log_consume(&s->log, slot->offset, slot->seq);
+        s->stats.num_sent++;
+    } else if (response->status == GOLIOTH_ERR_FAIL && response->class == 4) {
+        // Rejected by the server, so sending it again won't help
+        ESP_LOGW(
+                TAG,
+                "Record rejected by server (%u.%02u), dropping",
+                response->class,
+                response->code);
+        golioth_offline_log_consume(&s->log, slot->offset, slot->seq);
+        s->stats.num_dropped++;
+    } else {
+        s->retry = true;
+    }
+    slot->state = DRAIN_SLOT_IDLE;
+    assert(s->num_in_flight > 0);
+    s->num_in_flight--;
+}
+
+// Send the next record into an idle slot.
+// Returns false if there is nothing more to send for now.
+static bool send_next(golioth_offline_store_impl_t* s, drain_slot_t* slot) {
+    golioth_offline_record_t record;
+    while (true) {
+        xSemaphoreTake(s->mutex, portMAX_DELAY);
+        golioth_status_t status = golioth_offline_log_read_next(
+                &s->log, &record, slot->buf, CONFIG_GOLIOTH_OFFLINE_STORE_MAX_RECORD_SIZE);
+        if (status != GOLIOTH_OK) {
+            xSemaphoreGive(s->mutex);
+            return false;
+        }
+
+        uint32_t now = now_s();
+        bool expired =
+                (s->config.retention_s > 0 && record.timestamp_s > 0 && now > 0
+                 && now - record.timestamp_s > s->config.retention_s);
+        if (!expired) {
+            break;
+        }
+        golioth_offline_log_consume(&s->log, record.offset, record.seq);
+        s->stats.num_dropped++;
+        xSemaphoreGive(s->mutex);
+    }
+
+    // Claim the slot under the mutex, so destroy either sees it in flight or has
+    // already stopped sends
+    if (s->stop) {
+        xSemaphoreGive(s->mutex);
+        return false;
+    }
+    slot->offset = record.offset;
+    slot->seq = record.seq;
+    slot->state = DRAIN_SLOT_IN_FLIGHT;
+    s->num_in_flight++;
+    xSemaphoreGive(s->mutex);
+
+    golioth_status_t status = golioth_coap_client_replay(
+            s->client,
+            (record.kind == GOLIOTH_OFFLINE_RECORD_STREAM ? ".s/" : ""),
+            record.path,
+            record.content_type,
+            slot->buf,
+            record.payload_size,
+            release_record_payload,
+            NULL,
+            on_record_sent,
+            slot);
+    if (status != GOLIOTH_OK) {
+        // No callback is coming, so complete the slot now
+        slot->response = (golioth_response_t){
+                .status = status,
+        };
+        xSemaphoreTake(s->mutex, portMAX_DELAY);
+        handle_completed(s, slot);
+        xSemaphoreGive(s->mutex);
+        return false;
+    }
+    return true;
+}
+
+static void drain_task(void* arg) {
+    golioth_offline_store_impl_t* s = (golioth_offline_store_impl_t*)arg;
+    // Once stopped, keep handling responses until no record is in flight, since
+    // their callbacks reference the slots and notify this task
+    bool done = false;
+    while (!done) {
+        ulTaskNotifyTake(
+                pdTRUE,
+                (s->retry ? GOLIOTH_OFFLINE_STORE_RETRY_DELAY_MS / portTICK_PERIOD_MS
+                          : portMAX_DELAY));
+
+        xSemaphoreTake(s->mutex, portMAX_DELAY);
+        for (size_t i = 0; i < CONFIG_GOLIOTH_OFFLINE_STORE_DRAIN_WINDOW; i++) {
+            if (s->slots[i].state == DRAIN_SLOT_DONE) {
+                handle_completed(s, &s->slots[i]);
+            }
+        }
+        // Wait for all records in flight before sending from the oldest one again,
+        // so no record is in flight twice
+        bool can_send = !s->retry || s->num_in_flight == 0;
+        if (s->retry && s->num_in_flight == 0) {
+            golioth_offline_log_rewind(&s->log);
+            s->retry = false;
+        }
+        done = (s->stop && s->num_in_flight == 0);
+        xSemaphoreGive(s->mutex);
+
+        if (s->stop || !can_send || !golioth_client_is_connected(s->client)) {
+            continue;
+        }
+        for (size_t i = 0; i < CONFIG_GOLIOTH_OFFLINE_STORE_DRAIN_WINDOW; i++) {
+            if (s->slots[i].state == DRAIN_SLOT_IDLE && !send_next(s, &s->slots[i])) {
+                break;
+            }
+        }
+        if (s->num_in_flight == 0) {
+            ESP_LOGD(TAG, "Nothing more to send");
+        }
+    }
+
+    // Let golioth_offline_store_destroy know the task is done with the store
+    s->stopped = true;
+    vTaskDelete(NULL);
+}
+
+// Called by the client
+
+golioth_status_t golioth_offline_store_divert(
+        golioth_offline_store_t store,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        const uint8_t* payload,
+        size_t payload_size) {
+    golioth_offline_store_impl_t* s = (golioth_offline_store_impl_t*)store;
+    if (payload_size > CONFIG_GOLIOTH_OFFLINE_STORE_MAX_RECORD_SIZE) {
+        return GOLIOTH_ERR_MEM_ALLOC;
+    }
+    golioth_offline_record_kind_t kind = GOLIOTH_OFFLINE_RECORD_ROOT;
+    if (0 == strcmp(path_prefix, ".s/")) {
+        kind = GOLIOTH_OFFLINE_RECORD_STREAM;
+    }
+
+    xSemaphoreTake(s->mutex, portMAX_DELAY);
+    golioth_status_t status = golioth_offline_log_append(
+            &s->log, kind, content_type, now_s(), path, payload, payload_size);
+    if (status == GOLIOTH_OK) {
+        s->stats.num_appended++;
+    }
+    xSemaphoreGive(s->mutex);
+
+    if (status == GOLIOTH_ERR_QUEUE_FULL) {
+        ESP_LOGW(TAG, "Store full, dropping record for path %s", path);
+    } else if (status != GOLIOTH_OK && status != GOLIOTH_ERR_MEM_ALLOC) {
+        ESP_LOGE(TAG, "Failed to store record: %s", golioth_status_to_str(status));
+    }
+    return status;
+}
+
+void golioth_offline_store_wake(golioth_offline_store_t store) {
+    golioth_offline_store_impl_t* s = (golioth_offline_store_impl_t*)store;
+    if (s->drain_task) {
+        xTaskNotifyGive(s->drain_task);
+    }
+}
+
+golioth_offline_store_t golioth_offline_store_create(
+        golioth_client_t client,
+        const golioth_offline_store_config_t* config) {
+    if (!client || !config) {
+        return NULL;
+    }
+
+    golioth_offline_store_impl_t* s = calloc(1, sizeof(golioth_offline_store_impl_t));
+    if (!s) {
+        ESP_LOGE(TAG, "Failed to allocate memory for store");
+        return NULL;
+    }
+    GSTATS_INC_ALLOC("offline_store");
+    s->client = client;
+    s->config = *config;
+
+    golioth_status_t status =
+            golioth_offline_log_open(&s->log, &config->storage, config->overflow);
+    if (status != GOLIOTH_OK) {
+        ESP_LOGE(TAG, "Failed to open store: %s", golioth_status_to_str(status));
+        goto error;
+    }
+    ESP_LOGI(
+            TAG,
+            "%u records stored, %zu bytes of storage",
+            s->log.num_records,
+            config->storage.size);
+
+    s->bufs = malloc(
+            CONFIG_GOLIOTH_OFFLINE_STORE_DRAIN_WINDOW
+            * CONFIG_GOLIOTH_OFFLINE_STORE_MAX_RECORD_SIZE);
+    if (!s->bufs) {
+        ESP_LOGE(TAG, "Failed to allocate drain buffers");
+        goto error;
+    }
+    GSTATS_INC_ALLOC("offline_store_bufs");
+    for (size_t i = 0; i < CONFIG_GOLIOTH_OFFLINE_STORE_DRAIN_WINDOW; i++) {
+        s->slots[i].store = s;
+        s->slots[i].buf = &s->bufs[i * CONFIG_GOLIOTH_OFFLINE_STORE_MAX_RECORD_SIZE];
+    }
+
+    s->mutex = xSemaphoreCreateMutex();
+    if (!s->mutex) {
+        ESP_LOGE(TAG, "Failed to create store mutex");
+        goto error;
+    }
+    GSTATS_INC_ALLOC("offline_store_mutex");
+
+    bool task_created = xTaskCreate(
+            drain_task,
+            "offline_store",
+            CONFIG_GOLIOTH_OFFLINE_STORE_TASK_STACK_SIZE_BYTES,
+            s,  // task arg
+            CONFIG_GOLIOTH_COAP_TASK_PRIORITY,
+            &s->drain_task);
+    if (!task_created) {
+        ESP_LOGE(TAG, "Failed to create store task");
+        goto error;
+    }
+
+    golioth_coap_client_set_offline_store(client, s);
+    // Records from before a reboot are sent right away if the client is already connected
+    golioth_offline_store_wake(s);
+
+    return (golioth_offline_store_t)s;
+
+error:
+    golioth_offline_store_destroy(s);
+    return NULL;
+}
+
+void golioth_offline_store_destroy(golioth_offline_store_t store) {
+    golioth_offline_store_impl_t* s = (golioth_offline_store_impl_t*)store;
+    if (!s) {
+        return;
+    }
+    // Leave alone a store attached to the client after this one, or instead of it when
+    // called from a failed create
+    golioth_coap_client_detach_offline_store(s->client, s);
+    if (s->drain_task) {
+        xSemaphoreTake(s->mutex, portMAX_DELAY);
+        s->stop = true;
+        xSemaphoreGive(s->mutex);
+        xTaskNotifyGive(s->drain_task);
+
+        // The task exits once the records in flight have their responses
+        uint64_t deadline_ms = golioth_time_millis() + GOLIOTH_OFFLINE_STORE_DESTROY_TIMEOUT_MS;
+        while (!s->stopped) {
+            if (golioth_time_millis() >= deadline_ms) {
+                // The task and the client's callbacks still use the store
+                ESP_LOGE(TAG, "Records still in flight, leaking store");
+                return;
+            }
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+        }
+    }
+    if (s->mutex) {
+        vSemaphoreDelete(s->mutex);
+        GSTATS_INC_FREE("offline_store_mutex");
+    }
+    if (s->bufs) {
+        free(s->bufs);
+        GSTATS_INC_FREE("offline_store_bufs");
+    }
+    free(s);
+    GSTATS_INC_FREE("offline_store");
+}
+
+golioth_status_t golioth_offline_store_get_stats(
+        golioth_offline_store_t store,
+        golioth_offline_store_stats_t* stats) {
+    golioth_offline_store_impl_t* s = (golioth_offline_store_impl_t*)store;
+    if (!s || !stats) {
+        return GOLIOTH_ERR_NULL;
+    }
+    xSemaphoreTake(s->mutex, portMAX_DELAY);
+    *stats = s->stats;
+    stats->num_stored = s->log.num_records;
+    // Plus records lost to a full or corrupted log
+    stats->num_dropped += s->log.num_dropped;
+    xSemaphoreGive(s->mutex);
+    return GOLIOTH_OK;
+}
@@ -6,20 +6,90 @@
 #include <string.h>
 #include <esp_log.h>
 #include <cJSON.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 #include "golioth_ota.h"
 #include "golioth_coap_client.h"
 #include "golioth_statistics.h"
+#include "golioth_time.h"
+#include "golioth_util.h"
 
 #define TAG "golioth_ota"
 
 #define GOLIOTH_OTA_MANIFEST_PATH ".u/desired"
 #define GOLIOTH_OTA_COMPONENT_PATH_PREFIX ".u/c/"
 
+// Timeout for each block request of a download, including time spent in the request queue
+#define GOLIOTH_OTA_BLOCK_TIMEOUT_S (2 * CONFIG_GOLIOTH_COAP_RESPONSE_TIMEOUT_S)
+// A block request that hasn't completed this long after it was sent means the client
+// isn't completing requests at all
+#define GOLIOTH_OTA_BLOCK_DEADLINE_MS \
+    (1000 * (GOLIOTH_OTA_BLOCK_TIMEOUT_S + CONFIG_GOLIOTH_COAP_RESPONSE_TIMEOUT_S))
+// Number of times a failed block is requested again, before giving up on the download
+#define GOLIOTH_OTA_BLOCK_MAX_RETRIES 3
+// Delay before requesting a failed block again
+#define GOLIOTH_OTA_BLOCK_RETRY_DELAY_MS 1000
+// Smallest block size a download shrinks to when blocks are lost
+#define GOLIOTH_OTA_MIN_BLOCKSIZE 64
+// Number of blocks received in a row, without loss, before the block size is doubled
+#define GOLIOTH_OTA_BLOCK_GROW_STREAK 16
+
 typedef struct {
     uint8_t* buf;
     size_t* block_nbytes;
 } block_get_output_params_t;
 
+typedef enum {
+    /// Block needs to be requested (at or after retry_at_ms)
+    DOWNLOAD_SLOT_IDLE,
+    /// Block has been requested, waiting for the response
+    DOWNLOAD_SLOT_IN_FLIGHT,
+    /// Block has been received, waiting to be handed to the sink
+    DOWNLOAD_SLOT_RECEIVED,
+} download_slot_state_t;
+
+// One range of the download window.
+//
+// A range is normally fetched with a single block request. If the server answers
+// with smaller blocks than requested, the rest of the range is requested after the
+// received part has been handed to the sink.
+typedef struct {
+    download_slot_state_t state;
+    /// Artifact offset of the next byte of the range to request
+    size_t offset;
+    /// Artifact offset of the end of the range
+    size_t end;
+    /// Size of the range when it was created, a power of two
+    size_t range_size;
+    /// Block size of the request in flight
+    size_t request_size;
+    uint8_t* buf;
+    size_t nbytes;
+    golioth_status_t status;
+    int retries;
+    uint64_t retry_at_ms;
+    uint64_t sent_ms;
+    /// Slots are posted here (by the CoAP task) when their request completes
+    QueueHandle_t completed_queue;
+} download_slot_t;
+
+typedef struct {
+    golioth_client_t client;
+    char path[CONFIG_GOLIOTH_OTA_MAX_PACKAGE_NAME_LEN + CONFIG_GOLIOTH_OTA_MAX_VERSION_LEN + 2];
+    size_t size;
+    size_t window;
+    size_t num_in_flight;
+    /// Block size for new requests, adapted to loss and round trip time
+    size_t block_size;
+    /// Largest block size allowed, lowered if the server uses smaller blocks
+    size_t max_block_size;
+    /// Smoothed round trip time of block requests, in milliseconds
+    uint32_t srtt_ms;
+    /// Blocks received in a row without loss or a slow round trip
+    uint32_t good_streak;
+    download_slot_t slots[CONFIG_GOLIOTH_OTA_DOWNLOAD_WINDOW];
+} download_t;
+
 static golioth_ota_state_t _state = GOLIOTH_OTA_STATE_IDLE;
 
 size_t golioth_ota_size_to_nblocks(size_t component_size) {
@@ -93,6 +163,35 @@ golioth_status_t golioth_ota_report_state_sync(
             timeout_s);
 }
 
+static int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Decode a hex string of exactly 2 * len characters into len bytes
+static bool hex_to_bytes(const char* hex, uint8_t* bytes, size_t len) {
+    if (strlen(hex) != 2 * len) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        int hi = hex_digit_value(hex[2 * i]);
+        int lo = hex_digit_value(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        bytes[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return true;
+}
+
 golioth_status_t golioth_ota_payload_as_manifest(
         const uint8_t* payload,
         size_t payload_size,
@@ -144,6 +243,34 @@ golioth_status_t golioth_ota_payload_as_manifest(
             goto cleanup;
         }
         c->size = size->valueint;
+
+        // Optional, defaults to a full image
+        const cJSON* type = cJSON_GetObjectItemCaseSensitive(component, "type");
+        if (type && cJSON_IsString(type) && (0 == strcmp(type->valuestring, "delta"))) {
+            c->type = GOLIOTH_OTA_COMPONENT_TYPE_DELTA;
+        }
+
+        // Optional, SHA-256 of the artifact as a hex string
+        const cJSON* hash = cJSON_GetObjectItemCaseSensitive(component, "hash");
+        if (hash && cJSON_IsString(hash)) {
+            if (!hex_to_bytes(hash->valuestring, c->hash, sizeof(c->hash))) {
+                ESP_LOGE(TAG, "Invalid hash: %s", hash->valuestring);
+                ret = GOLIOTH_ERR_INVALID_FORMAT;
+                goto cleanup;
+            }
+            c->has_hash = true;
+        }
+
+        // Optional, defaults to uncompressed
+        const cJSON* compression = cJSON_GetObjectItemCaseSensitive(component, "compression");
+        if (compression && cJSON_IsString(compression)) {
+            if (0 == strcmp(compression->valuestring, "heatshrink")) {
+                c->compression = GOLIOTH_OTA_COMPRESSION_HEATSHRINK;
+            } else if (0 != strcmp(compression->valuestring, "none")) {
+                ESP_LOGW(TAG, "Unknown compression: %s", compression->valuestring);
+                c->compression = GOLIOTH_OTA_COMPRESSION_UNKNOWN;
+            }
+        }
     }
 
 cleanup:
@@ -207,6 +334,427 @@ golioth_status_t golioth_ota_get_block_sync(
     return status;
 }
 
+static void on_download_block_rcvd(
+        golioth_client_t client,
+        const golioth_response_t* response,
+        const char* path,
+        const uint8_t* payload,
+        size_t payload_size,
+        void* arg) {
+    download_slot_t* slot = (download_slot_t*)arg;
+    assert(slot);
+
+    slot->status = response->status;
+    if (response->status == GOLIOTH_OK) {
+        if (payload_size > slot->request_size) {
+            ESP_LOGE(TAG, "Block at offset %zu too large: %zu", slot->offset, payload_size);
+            slot->status = GOLIOTH_ERR_INVALID_FORMAT;
+        } else {
+            memcpy(slot->buf, payload, payload_size);
+            slot->nbytes = payload_size;
+        }
+    }
+
+    // Hand the slot back to the downloading task.
+    // The queue has room for every slot, so this can't fail.
+    xQueueSend(slot->completed_queue, &slot, 0);
+}
+
+// Block sizes allowed by CoAP (RFC 7959), up to the size of our buffers
+static bool is_valid_block_size(size_t block_size) {
+    bool is_power_of_two = ((block_size & (block_size - 1)) == 0);
+    return (is_power_of_two && block_size >= 16 && block_size <= GOLIOTH_OTA_BLOCKSIZE);
+}
+
+golioth_status_t golioth_ota_set_max_block_size(golioth_client_t client, size_t block_size) {
+    if (!client) {
+        return GOLIOTH_ERR_NULL;
+    }
+    if (!is_valid_block_size(block_size)) {
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    golioth_coap_client_set_ota_max_block_size(client, block_size);
+    return GOLIOTH_OK;
+}
+
+// Largest power of two block size, up to max_size, that offset is aligned to.
+// Block requests can only start at multiples of their block size.
+static size_t aligned_block_size(size_t offset, size_t max_size) {
+    size_t size = max_size;
+    while (size > 16 && (offset % size) != 0) {
+        size /= 2;
+    }
+    return size;
+}
+
+static void download_set_block_size(download_t* download, size_t block_size) {
+    size_t min_block_size = min(GOLIOTH_OTA_MIN_BLOCKSIZE, download->max_block_size);
+    block_size = max(min_block_size, min(block_size, download->max_block_size));
+    if (block_size != download->block_size) {
+        ESP_LOGI(
+                TAG,
+                "Block size %zu -> %zu (srtt %u ms)",
+                download->block_size,
+                block_size,
+                download->srtt_ms);
+        download->block_size = block_size;
+    }
+    download->good_streak = 0;
+}
+
+// Shrink blocks when they get lost, and grow them again after a run of blocks
+// arrive without loss and without a round trip much slower than usual.
+static void download_adapt_block_size(download_t* download, download_slot_t* slot) {
+    if (slot->status != GOLIOTH_OK) {
+        download_set_block_size(download, download->block_size / 2);
+        return;
+    }
+
+    uint32_t rtt_ms = (uint32_t)(golioth_time_millis() - slot->sent_ms);
+    bool slow = (download->srtt_ms > 0 && rtt_ms > 2 * download->srtt_ms);
+    if (download->srtt_ms == 0) {
+        download->srtt_ms = rtt_ms;
+    } else {
+        download->srtt_ms = (7 * download->srtt_ms + rtt_ms) / 8;
+    }
+
+    if (slow) {
+        download->good_streak = 0;
+        return;
+    }
+    download->good_streak++;
+    if (download->good_streak >= GOLIOTH_OTA_BLOCK_GROW_STREAK
+        && download->block_size < download->max_block_size) {
+        download_set_block_size(download, download->block_size * 2);
+    }
+}
+
+// Request every range in the window that needs it.
+//
+// wait_ticks is set to the time until the next retry is due (or portMAX_DELAY if none).
+static golioth_status_t download_request_blocks(
+        download_t* download,
+        size_t first_range,
+        size_t end_range,
+        TickType_t* wait_ticks) {
+    uint64_t now_ms = golioth_time_millis();
+    uint64_t next_retry_ms = UINT64_MAX;
+
+    for (size_t i = first_range; i < end_range; i++) {
+        download_slot_t* slot = &download->slots[i % download->window];
+        if (slot->state != DOWNLOAD_SLOT_IDLE) {
+            continue;
+        }
+        if (now_ms < slot->retry_at_ms) {
+            next_retry_ms = min(next_retry_ms, slot->retry_at_ms);
+            continue;
+        }
+
+        slot->request_size = aligned_block_size(
+                slot->offset, min(download->block_size, slot->range_size));
+        slot->nbytes = 0;
+        slot->sent_ms = now_ms;
+
+        ESP_LOGD(TAG, "Requesting %zu bytes at offset %zu", slot->request_size, slot->offset);
+        golioth_status_t status = golioth_coap_client_get_block(
+                download->client,
+                GOLIOTH_OTA_COMPONENT_PATH_PREFIX,
+                download->path,
+                COAP_MEDIATYPE_APPLICATION_JSON,
+                slot->offset / slot->request_size,
+                slot->request_size,
+                on_download_block_rcvd,
+                slot,
+                false,
+                GOLIOTH_OTA_BLOCK_TIMEOUT_S);
+        if (status == GOLIOTH_OK) {
+            slot->state = DOWNLOAD_SLOT_IN_FLIGHT;
+            download->num_in_flight++;
+            continue;
+        }
+
+        // Couldn't even enqueue the request (e.g. request queue full), try again later
+        if (slot->retries >= GOLIOTH_OTA_BLOCK_MAX_RETRIES) {
+            ESP_LOGE(
+                    TAG,
+                    "Failed to request block at offset %zu (%s)",
+                    slot->offset,
+                    golioth_status_to_str(status));
+            return status;
+        }
+        slot->retries++;
+        slot->retry_at_ms = now_ms + GOLIOTH_OTA_BLOCK_RETRY_DELAY_MS;
+        next_retry_ms = min(next_retry_ms, slot->retry_at_ms);
+    }
+
+    *wait_ticks = portMAX_DELAY;
+    if (next_retry_ms != UINT64_MAX) {
+        *wait_ticks = max(1, (next_retry_ms - now_ms) / portTICK_PERIOD_MS);
+    }
+    return GOLIOTH_OK;
+}
+
+// Handle a completed block request. Failed blocks are scheduled to be requested again.
+static golioth_status_t download_handle_completed(download_t* download, download_slot_t* slot) {
+    assert(download->num_in_flight > 0);
+    download->num_in_flight--;
+
+    download_adapt_block_size(download, slot);
+
+    if (slot->status == GOLIOTH_OK) {
+        bool is_end = (slot->offset + slot->nbytes >= download->size);
+        if (!is_end && slot->nbytes == 0) {
+            // Nothing to hand to the sink, asking again would loop forever
+            ESP_LOGE(TAG, "Empty block at offset %zu", slot->offset);
+            return GOLIOTH_ERR_INVALID_FORMAT;
+        }
+        // A short block that isn't the end of the artifact means the server
+        // uses smaller blocks than we asked for, so stick to its size.
+        if (!is_end && slot->nbytes < slot->request_size) {
+            if (!is_valid_block_size(slot->nbytes)) {
+                ESP_LOGE(TAG, "Invalid block size from server: %zu", slot->nbytes);
+                return GOLIOTH_ERR_INVALID_FORMAT;
+            }
+            ESP_LOGI(TAG, "Server block size is %zu", slot->nbytes);
+            download->max_block_size = slot->nbytes;
+            download_set_block_size(download, slot->nbytes);
+        }
+        slot->state = DOWNLOAD_SLOT_RECEIVED;
+        return GOLIOTH_OK;
+    }
+
+    if (slot->retries >= GOLIOTH_OTA_BLOCK_MAX_RETRIES) {
+        ESP_LOGE(
+                TAG,
+                "Failed to get block at offset %zu (%s)",
+                slot->offset,
+                golioth_status_to_str(slot->status));
+        return slot->status;
+    }
+
+    slot->retries++;
+    ESP_LOGW(
+            TAG,
+            "Failed to get block at offset %zu (%s), retry %d",
+            slot->offset,
+            golioth_status_to_str(slot->status),
+            slot->retries);
+    slot->state = DOWNLOAD_SLOT_IDLE;
+    slot->retry_at_ms = golioth_time_millis() + GOLIOTH_OTA_BLOCK_RETRY_DELAY_MS;
+    return GOLIOTH_OK;
+}
+
+// Earliest deadline of the block requests in flight, or UINT64_MAX if there are none
+static uint64_t download_deadline_ms(const download_t* download) {
+    uint64_t deadline_ms = UINT64_MAX;
+    for (size_t i = 0; i < download->window; i++) {
+        const download_slot_t* slot = &download->slots[i];
+        if (slot->state == DOWNLOAD_SLOT_IN_FLIGHT) {
+            deadline_ms = min(deadline_ms, slot->sent_ms + GOLIOTH_OTA_BLOCK_DEADLINE_MS);
+        }
+    }
+    return deadline_ms;
+}
+
+// Wait for a completed block request, for at most wait_ticks and never past the
+// deadline of the requests in flight.
+//
+// @return GOLIOTH_ERR_TIMEOUT if a request in flight is past its deadline
+static golioth_status_t download_wait_completed(
+        download_t* download,
+        QueueHandle_t completed_queue,
+        TickType_t wait_ticks,
+        download_slot_t** completed) {
+    uint64_t now_ms = golioth_time_millis();
+    uint64_t deadline_ms = download_deadline_ms(download);
+    if (deadline_ms <= now_ms) {
+        wait_ticks = 0;
+    } else if (deadline_ms != UINT64_MAX) {
+        wait_ticks = min(wait_ticks, max(1, (deadline_ms - now_ms) / portTICK_PERIOD_MS));
+    }
+    *completed = NULL;
+    if (xQueueReceive(completed_queue, completed, wait_ticks)) {
+        return GOLIOTH_OK;
+    }
+    if (golioth_time_millis() >= deadline_ms) {
+        ESP_LOGE(TAG, "Block request did not complete, is the client stopped?");
+        return GOLIOTH_ERR_TIMEOUT;
+    }
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_ota_download_component(
+        golioth_client_t client,
+        const golioth_ota_component_t* component,
+        size_t start_offset,
+        golioth_ota_block_sink_fn sink,
+        void* sink_arg) {
+    if (!client || !component || !sink) {
+        return GOLIOTH_ERR_NULL;
+    }
+    // The sink must get a last block, so there must be something left to download
+    if (component->size <= 0 || start_offset >= (size_t)component->size
+        || start_offset % GOLIOTH_OTA_BLOCKSIZE != 0) {
+        ESP_LOGE(
+                TAG,
+                "Invalid start offset %zu of %s, size %d",
+                start_offset,
+                component->package,
+                component->size);
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+
+    golioth_status_t status = GOLIOTH_OK;
+    uint8_t* bufs = NULL;
+    QueueHandle_t completed_queue = NULL;
+
+    // On the heap, so it can be left behind if requests in flight never complete
+    download_t* download = calloc(1, sizeof(download_t));
+    if (!download) {
+        ESP_LOGE(TAG, "Failed to allocate download");
+        return GOLIOTH_ERR_MEM_ALLOC;
+    }
+    GSTATS_INC_ALLOC("download");
+    download->client = client;
+    download->size = component->size;
+    download->block_size = golioth_coap_client_ota_max_block_size(client);
+    download->max_block_size = download->block_size;
+    snprintf(
+            download->path,
+            sizeof(download->path),
+            "%s@%s",
+            component->package,
+            component->version);
+
+    // No point in having more blocks in flight than the client will send at a time
+    download->window =
+            min(CONFIG_GOLIOTH_OTA_DOWNLOAD_WINDOW, CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS);
+    download->window = max(1, min(download->window, golioth_ota_size_to_nblocks(download->size)));
+
+    bufs = malloc(download->window * GOLIOTH_OTA_BLOCKSIZE);
+    if (!bufs) {
+        ESP_LOGE(TAG, "Failed to allocate download window");
+        status = GOLIOTH_ERR_MEM_ALLOC;
+        goto cleanup;
+    }
+    GSTATS_INC_ALLOC("download_bufs");
+
+    completed_queue = xQueueCreate(download->window, sizeof(download_slot_t*));
+    if (!completed_queue) {
+        ESP_LOGE(TAG, "Failed to create download queue");
+        status = GOLIOTH_ERR_MEM_ALLOC;
+        goto cleanup;
+    }
+    GSTATS_INC_ALLOC("download_queue");
+
+    for (size_t i = 0; i < download->window; i++) {
+        download->slots[i].buf = &bufs[i * GOLIOTH_OTA_BLOCKSIZE];
+        download->slots[i].completed_queue = completed_queue;
+    }
+
+    ESP_LOGI(
+            TAG,
+            "Downloading %s from offset %zu of %zu, window %zu, block size %zu",
+            download->path,
+            start_offset,
+            download->size,
+            download->window,
+            download->block_size);
+
+    // Ranges [first_range, end_range) are in the window. The artifact is handed
+    // to the sink up to sink_offset, and split into ranges up to next_offset.
+    size_t first_range = 0;
+    size_t end_range = 0;
+    size_t sink_offset = start_offset;
+    size_t next_offset = start_offset;
+    while (sink_offset < download->size) {
+        // Slide the window forward
+        while (next_offset < download->size && end_range < first_range + download->window) {
+            download_slot_t* slot = &download->slots[end_range % download->window];
+            slot->state = DOWNLOAD_SLOT_IDLE;
+            slot->offset = next_offset;
+            slot->range_size = aligned_block_size(next_offset, download->block_size);
+            slot->end = min(next_offset + slot->range_size, download->size);
+            slot->retries = 0;
+            slot->retry_at_ms = 0;
+            next_offset = slot->end;
+            end_range++;
+        }
+
+        TickType_t wait_ticks = portMAX_DELAY;
+        status = download_request_blocks(download, first_range, end_range, &wait_ticks);
+        if (status != GOLIOTH_OK) {
+            break;
+        }
+
+        download_slot_t* completed = NULL;
+        status = download_wait_completed(download, completed_queue, wait_ticks, &completed);
+        if (status != GOLIOTH_OK) {
+            break;
+        }
+        if (completed) {
+            status = download_handle_completed(download, completed);
+            if (status != GOLIOTH_OK) {
+                break;
+            }
+        }
+
+        // Hand contiguous blocks at the start of the window to the sink
+        while (first_range < end_range) {
+            download_slot_t* slot = &download->slots[first_range % download->window];
+            if (slot->state != DOWNLOAD_SLOT_RECEIVED) {
+                break;
+            }
+            bool is_last = (slot->offset + slot->nbytes >= download->size);
+            status = sink(slot->offset, slot->buf, slot->nbytes, is_last, sink_arg);
+            if (status != GOLIOTH_OK) {
+                break;
+            }
+            sink_offset += slot->nbytes;
+            slot->offset += slot->nbytes;
+            if (slot->offset < slot->end) {
+                // Only part of the range was received, request the rest
+                slot->state = DOWNLOAD_SLOT_IDLE;
+                slot->retries = 0;
+                slot->retry_at_ms = 0;
+                break;
+            }
+            first_range++;
+        }
+        if (status != GOLIOTH_OK) {
+            break;
+        }
+    }
+
+    // Wait for requests still in flight, since they reference the slots
+    while (download->num_in_flight > 0) {
+        download_slot_t* completed = NULL;
+        if (download_wait_completed(download, completed_queue, portMAX_DELAY, &completed)
+            != GOLIOTH_OK) {
+            // The callbacks may still run, so leave the slots and buffers to them
+            ESP_LOGE(TAG, "Leaking download of %s", download->path);
+            return (status == GOLIOTH_OK ? GOLIOTH_ERR_TIMEOUT : status);
+        }
+        if (completed) {
+            completed->state = DOWNLOAD_SLOT_IDLE;
+            download->num_in_flight--;
+        }
+    }
+
+cleanup:
+    if (completed_queue) {
+        vQueueDelete(completed_queue);
+        GSTATS_INC_FREE("download_queue");
+    }
+    if (bufs) {
+        free(bufs);
+        GSTATS_INC_FREE("download_bufs");
+    }
+    free(download);
+    GSTATS_INC_FREE("download");
+    return status;
+}
+
 golioth_ota_state_t golioth_ota_get_state(void) {
     return _state;
 }
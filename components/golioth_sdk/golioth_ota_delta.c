@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <string.h>
+#include <esp_log.h>
+#include "golioth_ota_delta.h"
+#include "golioth_util.h"
+
+#define TAG "golioth_ota_delta"
+
+static const uint8_t _magic[] = {'G', 'D', 'F', '1'};
+
+void golioth_ota_delta_init(
+        golioth_ota_delta_t* delta,
+        golioth_ota_delta_read_fn read,
+        golioth_ota_delta_write_fn write,
+        void* arg) {
+    memset(delta, 0, sizeof(*delta));
+    delta->state = GOLIOTH_OTA_DELTA_STATE_MAGIC;
+    delta->read = read;
+    delta->write = write;
+    delta->arg = arg;
+}
+
+static size_t produced(const golioth_ota_delta_t* delta) {
+    return delta->to_written + delta->to_buf_len;
+}
+
+static golioth_status_t flush(golioth_ota_delta_t* delta) {
+    if (delta->to_buf_len == 0) {
+        return GOLIOTH_OK;
+    }
+    GOLIOTH_STATUS_RETURN_IF_ERROR(
+            delta->write(delta->to_written, delta->to_buf, delta->to_buf_len, delta->arg));
+    delta->to_written += delta->to_buf_len;
+    delta->to_buf_len = 0;
+    return GOLIOTH_OK;
+}
+
+// Feed one byte into the varint being decoded. Returns true when the varint is complete.
+static bool varint_feed(golioth_ota_delta_t* delta, uint8_t byte, golioth_status_t* status) {
+    if (delta->varint_shift >= 64) {
+        ESP_LOGE(TAG, "Varint too long");
+        *status = GOLIOTH_ERR_INVALID_FORMAT;
+        return false;
+    }
+    delta->varint |= (uint64_t)(byte & 0x7F) << delta->varint_shift;
+    delta->varint_shift += 7;
+    return ((byte & 0x80) == 0);
+}
+
+static uint64_t varint_take(golioth_ota_delta_t* delta) {
+    uint64_t value = delta->varint;
+    delta->varint = 0;
+    delta->varint_shift = 0;
+    return value;
+}
+
+// Start a diff or extra record, making sure it doesn't overrun the new image
+static golioth_status_t start_record(
+        golioth_ota_delta_t* delta,
+        uint64_t len,
+        golioth_ota_delta_state_t data_state,
+        golioth_ota_delta_state_t next_state) {
+    if (len > delta->to_size - produced(delta)) {
+        ESP_LOGE(TAG, "Record of %llu bytes overruns new image", len);
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    delta->record_remaining = (size_t)len;
+    delta->state = (len > 0 ? data_state : next_state);
+    return GOLIOTH_OK;
+}
+
+// Apply up to len bytes of diff data. Returns the number of bytes consumed.
+static size_t apply_diff(
+        golioth_ota_delta_t* delta,
+        const uint8_t* patch,
+        size_t len,
+        golioth_status_t* status) {
+    size_t n = min(len, delta->record_remaining);
+    n = min(n, GOLIOTH_OTA_DELTA_BUF_SIZE - delta->to_buf_len);
+
+    if (delta->from_offset < 0) {
+        ESP_LOGE(TAG, "Negative old image offset %lld", delta->from_offset);
+        *status = GOLIOTH_ERR_INVALID_FORMAT;
+        return 0;
+    }
+    *status = delta->read((size_t)delta->from_offset, delta->from_buf, n, delta->arg);
+    if (*status != GOLIOTH_OK) {
+        return 0;
+    }
+
+    uint8_t* to = &delta->to_buf[delta->to_buf_len];
+    for (size_t i = 0; i < n; i++) {
+        to[i] = delta->from_buf[i] + patch[i];
+    }
+    delta->to_buf_len += n;
+    delta->from_offset += n;
+    delta->record_remaining -= n;
+    return n;
+}
+
+// Copy up to len bytes of extra data. Returns the number of bytes consumed.
+static size_t apply_extra(golioth_ota_delta_t* delta, const uint8_t* patch, size_t len) {
+    size_t n = min(len, delta->record_remaining);
+    n = min(n, GOLIOTH_OTA_DELTA_BUF_SIZE - delta->to_buf_len);
+    memcpy(&delta->to_buf[delta->to_buf_len], patch, n);
+    delta->to_buf_len += n;
+    delta->record_remaining -= n;
+    return n;
+}
+
+golioth_status_t golioth_ota_delta_apply(
+        golioth_ota_delta_t* delta,
+        const uint8_t* patch,
+        size_t len) {
+    golioth_status_t status = GOLIOTH_OK;
+    size_t i = 0;
+
+    while (i < len && status == GOLIOTH_OK) {
+        if (delta->to_buf_len == GOLIOTH_OTA_DELTA_BUF_SIZE) {
+            GOLIOTH_STATUS_RETURN_IF_ERROR(flush(delta));
+        }
+
+        switch (delta->state) {
+            case GOLIOTH_OTA_DELTA_STATE_MAGIC:
+                if (patch[i++] != _magic[delta->magic_len++]) {
+                    ESP_LOGE(TAG, "Invalid patch magic");
+                    return GOLIOTH_ERR_INVALID_FORMAT;
+                }
+                if (delta->magic_len == sizeof(_magic)) {
+                    delta->state = GOLIOTH_OTA_DELTA_STATE_TO_SIZE;
+                }
+                break;
+            case GOLIOTH_OTA_DELTA_STATE_TO_SIZE:
+                if (varint_feed(delta, patch[i++], &status)) {
+                    delta->to_size = (size_t)varint_take(delta);
+                    ESP_LOGI(TAG, "Patch produces %zu byte image", delta->to_size);
+                    delta->state =
+                            (delta->to_size > 0 ? GOLIOTH_OTA_DELTA_STATE_DIFF_LEN
+                                                : GOLIOTH_OTA_DELTA_STATE_DONE);
+                }
+                break;
+            case GOLIOTH_OTA_DELTA_STATE_DIFF_LEN:
+                if (varint_feed(delta, patch[i++], &status)) {
+                    status = start_record(
+                            delta,
+                            varint_take(delta),
+                            GOLIOTH_OTA_DELTA_STATE_DIFF,
+                            GOLIOTH_OTA_DELTA_STATE_EXTRA_LEN);
+                }
+                break;
+            case GOLIOTH_OTA_DELTA_STATE_DIFF:
+                i += apply_diff(delta, &patch[i], len - i, &status);
+                if (delta->record_remaining == 0) {
+                    delta->state = GOLIOTH_OTA_DELTA_STATE_EXTRA_LEN;
+                }
+                break;
+            case GOLIOTH_OTA_DELTA_STATE_EXTRA_LEN:
+                if (varint_feed(delta, patch[i++], &status)) {
+                    status = start_record(
+                            delta,
+                            varint_take(delta),
+                            GOLIOTH_OTA_DELTA_STATE_EXTRA,
+                            GOLIOTH_OTA_DELTA_STATE_ADJUST);
+                }
+                break;
+            case GOLIOTH_OTA_DELTA_STATE_EXTRA:
+                i += apply_extra(delta, &patch[i], len - i);
+                if (delta->record_remaining == 0) {
+                    delta->state = GOLIOTH_OTA_DELTA_STATE_ADJUST;
+                }
+                break;
+            case GOLIOTH_OTA_DELTA_STATE_ADJUST:
+                if (varint_feed(delta, patch[i++], &status)) {
+                    uint64_t zigzag = varint_take(delta);
+                    int64_t adjust = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+                    delta->from_offset += adjust;
+                    delta->state =
+                            (produced(delta) == delta->to_size ? GOLIOTH_OTA_DELTA_STATE_DONE
+                                                               : GOLIOTH_OTA_DELTA_STATE_DIFF_LEN);
+                }
+                break;
+            case GOLIOTH_OTA_DELTA_STATE_DONE:
+            default:
+                ESP_LOGE(TAG, "Unexpected data after end of patch");
+                return GOLIOTH_ERR_INVALID_FORMAT;
+        }
+    }
+
+    return status;
+}
+
+golioth_status_t golioth_ota_delta_finish(golioth_ota_delta_t* delta) {
+    GOLIOTH_STATUS_RETURN_IF_ERROR(flush(delta));
+    if (delta->state != GOLIOTH_OTA_DELTA_STATE_DONE) {
+        ESP_LOGE(
+                TAG,
+                "Patch ended early, produced %zu of %zu bytes",
+                delta->to_written,
+                delta->to_size);
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+    return GOLIOTH_OK;
+}
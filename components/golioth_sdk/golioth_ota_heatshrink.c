@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <string.h>
+#include "golioth_ota_heatshrink.h"
+
+#define WINDOW_MASK (GOLIOTH_OTA_HEATSHRINK_WINDOW_SIZE - 1)
+
+void golioth_ota_heatshrink_init(
+        golioth_ota_heatshrink_t* hs,
+        golioth_ota_heatshrink_write_fn write,
+        void* arg) {
+    memset(hs, 0, sizeof(*hs));
+    hs->state = GOLIOTH_OTA_HEATSHRINK_STATE_TAG;
+    hs->bits_needed = 1;
+    hs->write = write;
+    hs->arg = arg;
+}
+
+static golioth_status_t flush(golioth_ota_heatshrink_t* hs) {
+    if (hs->out_buf_len == 0) {
+        return GOLIOTH_OK;
+    }
+    GOLIOTH_STATUS_RETURN_IF_ERROR(
+            hs->write(hs->out_written, hs->out_buf, hs->out_buf_len, hs->arg));
+    hs->out_written += hs->out_buf_len;
+    hs->out_buf_len = 0;
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t emit(golioth_ota_heatshrink_t* hs, uint8_t byte) {
+    hs->window[hs->out_total & WINDOW_MASK] = byte;
+    hs->out_total++;
+    hs->out_buf[hs->out_buf_len++] = byte;
+    if (hs->out_buf_len == GOLIOTH_OTA_HEATSHRINK_BUF_SIZE) {
+        return flush(hs);
+    }
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t emit_backref(golioth_ota_heatshrink_t* hs, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t byte = hs->window[(hs->out_total - hs->backref_offset) & WINDOW_MASK];
+        GOLIOTH_STATUS_RETURN_IF_ERROR(emit(hs, byte));
+    }
+    return GOLIOTH_OK;
+}
+
+static void expect(
+        golioth_ota_heatshrink_t* hs,
+        golioth_ota_heatshrink_state_t state,
+        uint32_t bits_needed) {
+    hs->state = state;
+    hs->bits = 0;
+    hs->bits_needed = bits_needed;
+}
+
+// Called when all bits of the current field have been read
+static golioth_status_t field_complete(golioth_ota_heatshrink_t* hs) {
+    switch (hs->state) {
+        case GOLIOTH_OTA_HEATSHRINK_STATE_TAG:
+            if (hs->bits) {
+                expect(hs, GOLIOTH_OTA_HEATSHRINK_STATE_LITERAL, 8);
+            } else {
+                expect(hs,
+                       GOLIOTH_OTA_HEATSHRINK_STATE_INDEX,
+                       CONFIG_GOLIOTH_OTA_HEATSHRINK_WINDOW_SZ2);
+            }
+            return GOLIOTH_OK;
+        case GOLIOTH_OTA_HEATSHRINK_STATE_LITERAL: {
+            uint8_t literal = (uint8_t)hs->bits;
+            expect(hs, GOLIOTH_OTA_HEATSHRINK_STATE_TAG, 1);
+            return emit(hs, literal);
+        }
+        case GOLIOTH_OTA_HEATSHRINK_STATE_INDEX:
+            hs->backref_offset = hs->bits + 1;
+            expect(hs,
+                   GOLIOTH_OTA_HEATSHRINK_STATE_COUNT,
+                   CONFIG_GOLIOTH_OTA_HEATSHRINK_LOOKAHEAD_SZ2);
+            return GOLIOTH_OK;
+        case GOLIOTH_OTA_HEATSHRINK_STATE_COUNT:
+        default: {
+            uint32_t count = hs->bits + 1;
+            expect(hs, GOLIOTH_OTA_HEATSHRINK_STATE_TAG, 1);
+            return emit_backref(hs, count);
+        }
+    }
+}
+
+golioth_status_t golioth_ota_heatshrink_decode(
+        golioth_ota_heatshrink_t* hs,
+        const uint8_t* data,
+        size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t byte = data[i];
+        for (int bit = 7; bit >= 0; bit--) {
+            hs->bits = (hs->bits << 1) | ((byte >> bit) & 1);
+            if (--hs->bits_needed == 0) {
+                GOLIOTH_STATUS_RETURN_IF_ERROR(field_complete(hs));
+            }
+        }
+    }
+    return GOLIOTH_OK;
+}
+
+golioth_status_t golioth_ota_heatshrink_finish(golioth_ota_heatshrink_t* hs) {
+    return flush(hs);
+}
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
+#include "golioth_coap_client.h"
+#include "golioth_stream_batch.h"
+#include "golioth_util.h"
+#include "golioth_time.h"
+#include "golioth_statistics.h"
+
+#define TAG "golioth_stream_batch"
+
+// Batches are posted to the root of LightDB stream, as an array of records:
+//
+// [
+//      {"ts": 1664000000, "sensor": {"temp": 21.5}},
+//      {"ts": 1664000001, "sensor": {"temp": 21.6}},
+//      ...
+// ]
+#define GOLIOTH_STREAM_BATCH_PATH ".s"
+
+// How long destroy waits for the client to be done with the batch buffers
+#define GOLIOTH_STREAM_BATCH_DESTROY_TIMEOUT_MS (2000 * CONFIG_GOLIOTH_COAP_RESPONSE_TIMEOUT_S)
+
+// This is the struct hidden by the opaque type golioth_stream_batch_t
+typedef struct {
+    golioth_client_t client;
+    golioth_stream_batch_config_t config;
+    // CONFIG_GOLIOTH_STREAM_BATCH_NUM_BUFS buffers, in one allocation
+    char* bufs;
+    // Indices of buffers that aren't waiting to be sent
+    QueueHandle_t free_buf_queue;
+    // Buffer records are added to, or NULL if no records were added since the last send.
+    // Starts with '[', and each record is followed by ','.
+    char* buf;
+    size_t len;
+    // Number of records in buf
+    size_t buf_num_records;
+    // Sends the batch when its oldest record reaches config.max_age_ms
+    TimerHandle_t age_timer;
+    // Protects everything above, records are added from user tasks and
+    // the batch is sent from the timer task
+    SemaphoreHandle_t mutex;
+    golioth_stream_batch_stats_t stats;
+} golioth_stream_batch_impl_t;
+
+// Payload release function for batch requests, called by the client once the
+// request is built (or dropped)
+static void release_batch_buf(void* payload, void* arg) {
+    golioth_stream_batch_impl_t* b = (golioth_stream_batch_impl_t*)arg;
+    uint8_t index = ((char*)payload - b->bufs) / CONFIG_GOLIOTH_STREAM_BATCH_BUF_SIZE;
+    xQueueSend(b->free_buf_queue, &index, 0);
+}
+
+static bool claim_buf(golioth_stream_batch_impl_t* b) {
+    uint8_t index = 0;
+    if (!xQueueReceive(b->free_buf_queue, &index, 0)) {
+        return false;
+    }
+    b->buf = &b->bufs[index * CONFIG_GOLIOTH_STREAM_BATCH_BUF_SIZE];
+    b->buf[0] = '[';
+    b->len = 1;
+    b->buf_num_records = 0;
+    return true;
+}
+
+// Hand the current buffer (if any) over to the client. Caller holds the mutex.
+static golioth_status_t send_buf(golioth_stream_batch_impl_t* b) {
+    if (b->age_timer) {
+        xTimerStop(b->age_timer, 0);
+    }
+    if (!b->buf) {
+        return GOLIOTH_OK;
+    }
+
+    // Replace the ',' after the last record
+    b->buf[b->len - 1] = ']';
+    char* payload = b->buf;
+    size_t payload_size = b->len;
+    b->buf = NULL;
+    b->len = 0;
+
+    ESP_LOGD(TAG, "Sending batch of %zu bytes", payload_size);
+    golioth_status_t status = golioth_coap_client_set_owned(
+            b->client,
+            "",  // path-prefix unused
+            GOLIOTH_STREAM_BATCH_PATH,
+            COAP_MEDIATYPE_APPLICATION_JSON,
+            (uint8_t*)payload,
+            payload_size,
+            release_batch_buf,
+            b,
+            b->config.callback,
+            b->config.callback_arg,
+            false,
+            GOLIOTH_WAIT_FOREVER);
+    if (status != GOLIOTH_OK) {
+        ESP_LOGW(TAG, "Failed to send batch, records dropped (%s)", golioth_status_to_str(status));
+        b->stats.num_dropped += b->buf_num_records;
+        return status;
+    }
+    b->stats.num_batches++;
+    b->stats.num_bytes += payload_size;
+    return GOLIOTH_OK;
+}
+
+static void on_age_timer(TimerHandle_t timer) {
+    golioth_stream_batch_impl_t* b = (golioth_stream_batch_impl_t*)pvTimerGetTimerID(timer);
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+    send_buf(b);
+    xSemaphoreGive(b->mutex);
+}
+
+static void give_flushed(void* arg, uint32_t unused) {
+    xSemaphoreGive((SemaphoreHandle_t)arg);
+}
+
+// Wait until the timer task has processed every command queued so far. Timer callbacks
+// run in the timer task, so after a timer is deleted this means its callback is done.
+static void wait_for_timer_task(void) {
+    StaticSemaphore_t flushed_buf;
+    SemaphoreHandle_t flushed = xSemaphoreCreateBinaryStatic(&flushed_buf);
+    if (xTimerPendFunctionCall(give_flushed, flushed, 0, portMAX_DELAY)) {
+        xSemaphoreTake(flushed, portMAX_DELAY);
+    }
+    vSemaphoreDelete(flushed);
+}
+
+// Write a record into dst, as an object with the value nested according to path:
+//
+//      path "sensor/temp", value 21.5 => {"sensor":{"temp":21.5}},
+//
+// Returns the number of bytes written, or 0 if the record doesn't fit in dst_size bytes.
+static size_t write_record(
+        const golioth_stream_batch_impl_t* b,
+        char* dst,
+        size_t dst_size,
+        const char* path,
+        const char* value,
+        size_t value_len,
+        bool quote_value) {
+    size_t pos = 0;
+    int depth = 0;
+
+#define APPEND(...)                                                          \
+    do {                                                                     \
+        int n = snprintf(&dst[pos], dst_size - pos, __VA_ARGS__);            \
+        if (n < 0 || (size_t)n >= dst_size - pos) {                          \
+            return 0;                                                        \
+        }                                                                    \
+        pos += n;                                                            \
+    } while (0)
+
+    APPEND("{");
+    if (b->config.add_timestamp) {
+        struct timeval now = {};
+        gettimeofday(&now, NULL);
+        if (now.tv_sec > GOLIOTH_MIN_VALID_TIME_S) {
+            APPEND("\"ts\":%lld,", (long long)now.tv_sec);
+        }
+    }
+
+    const char* segment = path;
+    while (true) {
+        const char* end = strchr(segment, '/');
+        size_t segment_len = (end ? (size_t)(end - segment) : strlen(segment));
+        if (segment_len > 0) {
+            if (depth > 0) {
+                APPEND("{");
+            }
+            APPEND("\"%.*s\":", (int)segment_len, segment);
+            depth++;
+        }
+        if (!end) {
+            break;
+        }
+        segment = end + 1;
+    }
+
+    if (quote_value) {
+        APPEND("\"%.*s\"", (int)value_len, value);
+    } else {
+        APPEND("%.*s", (int)value_len, value);
+    }
+    for (int i = 0; i < depth; i++) {
+        APPEND("}");
+    }
+    APPEND(",");
+
+#undef APPEND
+
+    return pos;
+}
+
+static golioth_status_t add_record(
+        golioth_stream_batch_t batch,
+        const char* path,
+        const char* value,
+        size_t value_len,
+        bool quote_value) {
+    golioth_stream_batch_impl_t* b = (golioth_stream_batch_impl_t*)batch;
+    if (!b || !path || !value) {
+        return GOLIOTH_ERR_NULL;
+    }
+    if (strspn(path, "/") == strlen(path)) {
+        // Records need at least one key to put the value in
+        return GOLIOTH_ERR_INVALID_FORMAT;
+    }
+
+    golioth_status_t status = GOLIOTH_OK;
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+
+    if (!b->buf && !claim_buf(b)) {
+        b->stats.num_dropped++;
+        status = GOLIOTH_ERR_QUEUE_FULL;
+        goto done;
+    }
+
+    size_t n = write_record(
+            b,
+            &b->buf[b->len],
+            CONFIG_GOLIOTH_STREAM_BATCH_BUF_SIZE - b->len,
+            path,
+            value,
+            value_len,
+            quote_value);
+    if (n == 0 && b->len > 1) {
+        // Buffer is full, send it and start the next one
+        send_buf(b);
+        if (!claim_buf(b)) {
+            b->stats.num_dropped++;
+            status = GOLIOTH_ERR_QUEUE_FULL;
+            goto done;
+        }
+        n = write_record(
+                b,
+                &b->buf[b->len],
+                CONFIG_GOLIOTH_STREAM_BATCH_BUF_SIZE - b->len,
+                path,
+                value,
+                value_len,
+                quote_value);
+    }
+    if (n == 0) {
+        ESP_LOGE(TAG, "Record for %s doesn't fit in a batch buffer", path);
+        status = GOLIOTH_ERR_MEM_ALLOC;
+        goto done;
+    }
+
+    bool is_first_record = (b->len == 1);
+    b->len += n;
+    b->buf_num_records++;
+    b->stats.num_records++;
+    if (is_first_record && b->age_timer) {
+        xTimerReset(b->age_timer, 0);
+    }
+
+done:
+    xSemaphoreGive(b->mutex);
+    return status;
+}
+
+golioth_stream_batch_t golioth_stream_batch_create(
+        golioth_client_t client,
+        const golioth_stream_batch_config_t* config) {
+    if (!client || !config) {
+        return NULL;
+    }
+
+    golioth_stream_batch_impl_t* b = calloc(1, sizeof(golioth_stream_batch_impl_t));
+    if (!b) {
+        ESP_LOGE(TAG, "Failed to allocate memory for batch");
+        return NULL;
+    }
+    GSTATS_INC_ALLOC("stream_batch");
+    b->client = client;
+    b->config = *config;
+
+    b->bufs = malloc(CONFIG_GOLIOTH_STREAM_BATCH_NUM_BUFS * CONFIG_GOLIOTH_STREAM_BATCH_BUF_SIZE);
+    if (!b->bufs) {
+        ESP_LOGE(TAG, "Failed to allocate batch buffers");
+        goto error;
+    }
+    GSTATS_INC_ALLOC("stream_batch_bufs");
+
+    b->free_buf_queue = xQueueCreate(CONFIG_GOLIOTH_STREAM_BATCH_NUM_BUFS, sizeof(uint8_t));
+    if (!b->free_buf_queue) {
+        ESP_LOGE(TAG, "Failed to create free buffer queue");
+        goto error;
+    }
+    GSTATS_INC_ALLOC("stream_batch_free_buf_queue");
+    for (uint8_t i = 0; i < CONFIG_GOLIOTH_STREAM_BATCH_NUM_BUFS; i++) {
+        xQueueSend(b->free_buf_queue, &i, 0);
+    }
+
+    b->mutex = xSemaphoreCreateMutex();
+    if (!b->mutex) {
+        ESP_LOGE(TAG, "Failed to create batch mutex");
+        goto error;
+    }
+    GSTATS_INC_ALLOC("stream_batch_mutex");
+
+    if (config->max_age_ms > 0) {
+        b->age_timer = xTimerCreate(
+                "stream_batch",
+                max(1, config->max_age_ms / portTICK_PERIOD_MS),
+                pdFALSE,  // oneshot
+                b,        // timer ID
+                on_age_timer);
+        if (!b->age_timer) {
+            ESP_LOGE(TAG, "Failed to create batch age timer");
+            goto error;
+        }
+        GSTATS_INC_ALLOC("stream_batch_age_timer");
+    }
+
+    return (golioth_stream_batch_t)b;
+
+error:
+    golioth_stream_batch_destroy(b);
+    return NULL;
+}
+
+void golioth_stream_batch_destroy(golioth_stream_batch_t batch) {
+    golioth_stream_batch_impl_t* b = (golioth_stream_batch_impl_t*)batch;
+    if (!b) {
+        return;
+    }
+    if (b->mutex) {
+        // Send what's left, and wait until the client is done with all buffers
+        xSemaphoreTake(b->mutex, portMAX_DELAY);
+        send_buf(b);
+        TimerHandle_t age_timer = b->age_timer;
+        b->age_timer = NULL;
+        xSemaphoreGive(b->mutex);
+        if (age_timer) {
+            // The timer callback may be running, or waiting for the mutex
+            xTimerDelete(age_timer, portMAX_DELAY);
+            wait_for_timer_task();
+            GSTATS_INC_FREE("stream_batch_age_timer");
+        }
+        uint64_t deadline_ms = golioth_time_millis() + GOLIOTH_STREAM_BATCH_DESTROY_TIMEOUT_MS;
+        while (uxQueueMessagesWaiting(b->free_buf_queue) < CONFIG_GOLIOTH_STREAM_BATCH_NUM_BUFS) {
+            if (golioth_time_millis() >= deadline_ms) {
+                // The client still holds buffers, and will release them into the batch
+                ESP_LOGE(TAG, "Batches still queued, leaking batch");
+                return;
+            }
+            vTaskDelay(100 / portTICK_PERIOD_MS);
+        }
+        vSemaphoreDelete(b->mutex);
+        GSTATS_INC_FREE("stream_batch_mutex");
+    }
+    if (b->free_buf_queue) {
+        vQueueDelete(b->free_buf_queue);
+        GSTATS_INC_FREE("stream_batch_free_buf_queue");
+    }
+    if (b->bufs) {
+        free(b->bufs);
+        GSTATS_INC_FREE("stream_batch_bufs");
+    }
+    free(b);
+    GSTATS_INC_FREE("stream_batch");
+}
+
+golioth_status_t golioth_stream_batch_add_int(
+        golioth_stream_batch_t batch,
+        const char* path,
+        int32_t value) {
+    char buf[16] = {};
+    snprintf(buf, sizeof(buf), "%d", value);
+    return add_record(batch, path, buf, strlen(buf), false);
+}
+
+golioth_status_t golioth_stream_batch_add_bool(
+        golioth_stream_batch_t batch,
+        const char* path,
+        bool value) {
+    const char* str = (value ? "true" : "false");
+    return add_record(batch, path, str, strlen(str), false);
+}
+
+golioth_status_t golioth_stream_batch_add_float(
+        golioth_stream_batch_t batch,
+        const char* path,
+        float value) {
+    char buf[32] = {};
+    snprintf(buf, sizeof(buf), "%f", value);
+    return add_record(batch, path, buf, strlen(buf), false);
+}
+
+golioth_status_t golioth_stream_batch_add_string(
+        golioth_stream_batch_t batch,
+        const char* path,
+        const char* str,
+        size_t str_len) {
+    return add_record(batch, path, str, str_len, true);
+}
+
+golioth_status_t golioth_stream_batch_add_json(
+        golioth_stream_batch_t batch,
+        const char* path,
+        const char* json_str,
+        size_t json_str_len) {
+    return add_record(batch, path, json_str, json_str_len, false);
+}
+
+golioth_status_t golioth_stream_batch_flush(golioth_stream_batch_t batch) {
+    golioth_stream_batch_impl_t* b = (golioth_stream_batch_impl_t*)batch;
+    if (!b) {
+        return GOLIOTH_ERR_NULL;
+    }
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+    golioth_status_t status = send_buf(b);
+    xSemaphoreGive(b->mutex);
+    return status;
+}
+
+golioth_status_t golioth_stream_batch_get_stats(
+        golioth_stream_batch_t batch,
+        golioth_stream_batch_stats_t* stats) {
+    golioth_stream_batch_impl_t* b = (golioth_stream_batch_impl_t*)batch;
+    if (!b || !stats) {
+        return GOLIOTH_ERR_NULL;
+    }
+    xSemaphoreTake(b->mutex, portMAX_DELAY);
+    *stats = b->stats;
+    xSemaphoreGive(b->mutex);
+    return GOLIOTH_OK;
+}
@@ -8,7 +8,10 @@
 #include "golioth_status.h"
 #include "golioth_client.h"
 #include "golioth_log.h"
+#include "golioth_cbor.h"
 #include "golioth_lightdb.h"
+#include "golioth_stream_batch.h"
+#include "golioth_offline_store.h"
 #include "golioth_rpc.h"
 #include "golioth_ota.h"
 #include "golioth_time.h"
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "golioth_status.h"
+
+/// @defgroup golioth_cbor golioth_cbor
+/// Minimal CBOR (RFC 8949) encoder and decoder
+///
+/// Both work in place on a caller-provided buffer and never allocate memory.
+/// Only definite-length items are supported.
+///
+/// The encoder doesn't check for errors after each item. Instead, an item that doesn't
+/// fit marks the encoder as overflowed, and @ref golioth_cbor_encoder_finish reports it:
+///
+/// @code
+/// uint8_t buf[32];
+/// golioth_cbor_encoder_t enc;
+/// golioth_cbor_encoder_init(&enc, buf, sizeof(buf));
+/// golioth_cbor_encode_map(&enc, 1);
+/// golioth_cbor_encode_text(&enc, "temp", 4);
+/// golioth_cbor_encode_float(&enc, 21.5f);
+/// size_t len = 0;
+/// golioth_status_t status = golioth_cbor_encoder_finish(&enc, &len);
+/// @endcode
+/// @{
+
+/// CBOR encoder state
+typedef struct {
+    uint8_t* buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} golioth_cbor_encoder_t;
+
+/// CBOR decoder state
+typedef struct {
+    const uint8_t* buf;
+    size_t size;
+    size_t pos;
+} golioth_cbor_decoder_t;
+
+/// Start encoding into buf
+void golioth_cbor_encoder_init(golioth_cbor_encoder_t* enc, uint8_t* buf, size_t size);
+
+/// Get the size of the encoded data
+///
+/// @param enc The encoder
+/// @param len Output param, populated with the number of bytes encoded
+///
+/// @return GOLIOTH_OK - all items were encoded
+/// @return GOLIOTH_ERR_SERIALIZE - an item didn't fit in the buffer
+golioth_status_t golioth_cbor_encoder_finish(golioth_cbor_encoder_t* enc, size_t* len);
+
+/// Encode an integer, in the smallest form that holds it
+void golioth_cbor_encode_int(golioth_cbor_encoder_t* enc, int64_t value);
+
+/// Encode a bool
+void golioth_cbor_encode_bool(golioth_cbor_encoder_t* enc, bool value);
+
+/// Encode a float, as a single-precision float
+void golioth_cbor_encode_float(golioth_cbor_encoder_t* enc, float value);
+
+/// Encode null
+void golioth_cbor_encode_null(golioth_cbor_encoder_t* enc);
+
+/// Encode a UTF-8 text string. str doesn't need to be NULL-terminated.
+void golioth_cbor_encode_text(golioth_cbor_encoder_t* enc, const char* str, size_t len);
+
+/// Encode a byte string
+void golioth_cbor_encode_bytes(golioth_cbor_encoder_t* enc, const uint8_t* data, size_t len);
+
+/// Start a map of num_pairs key/value pairs. The keys and values are encoded next.
+void golioth_cbor_encode_map(golioth_cbor_encoder_t* enc, size_t num_pairs);
+
+/// Start an array of num_items items. The items are encoded next.
+void golioth_cbor_encode_array(golioth_cbor_encoder_t* enc, size_t num_items);
+
+/// Start decoding buf
+void golioth_cbor_decoder_init(golioth_cbor_decoder_t* dec, const uint8_t* buf, size_t size);
+
+/// Returns true if the next item is null (or undefined), and skips it if so
+bool golioth_cbor_decode_null(golioth_cbor_decoder_t* dec);
+
+/// Decode an integer
+///
+/// @return GOLIOTH_OK - value decoded
+/// @return GOLIOTH_ERR_INVALID_FORMAT - next item isn't an integer, or is truncated
+golioth_status_t golioth_cbor_decode_int(golioth_cbor_decoder_t* dec, int64_t* value);
+
+/// Decode a bool
+///
+/// @return GOLIOTH_OK - value decoded
+/// @return GOLIOTH_ERR_INVALID_FORMAT - next item isn't a bool
+golioth_status_t golioth_cbor_decode_bool(golioth_cbor_decoder_t* dec, bool* value);
+
+/// Decode a float. Half, single and double precision floats, and integers, are accepted.
+///
+/// @return GOLIOTH_OK - value decoded
+/// @return GOLIOTH_ERR_INVALID_FORMAT - next item isn't a number, or is truncated
+golioth_status_t golioth_cbor_decode_float(golioth_cbor_decoder_t* dec, float* value);
+
+/// Decode a text string, without copying it
+///
+/// @param dec The decoder
+/// @param str Output param, populated with a pointer to the string in the decoder's buffer.
+///         Not NULL-terminated.
+/// @param len Output param, populated with the length of the string, in bytes
+///
+/// @return GOLIOTH_OK - value decoded
+/// @return GOLIOTH_ERR_INVALID_FORMAT - next item isn't a text string, or is truncated
+golioth_status_t golioth_cbor_decode_text(
+        golioth_cbor_decoder_t* dec,
+        const char** str,
+        size_t* len);
+
+/// Decode the start of a map. The keys and values are decoded next.
+///
+/// @return GOLIOTH_OK - num_pairs populated
+/// @return GOLIOTH_ERR_INVALID_FORMAT - next item isn't a map
+golioth_status_t golioth_cbor_decode_map(golioth_cbor_decoder_t* dec, size_t* num_pairs);
+
+/// Decode the start of an array. The items are decoded next.
+///
+/// @return GOLIOTH_OK - num_items populated
+/// @return GOLIOTH_ERR_INVALID_FORMAT - next item isn't an array
+golioth_status_t golioth_cbor_decode_array(golioth_cbor_decoder_t* dec, size_t* num_items);
+
+/// Skip the next item, including everything in it if it's a map or array
+///
+/// @return GOLIOTH_OK - item skipped
+/// @return GOLIOTH_ERR_INVALID_FORMAT - item is truncated, or has an indefinite length
+golioth_status_t golioth_cbor_skip(golioth_cbor_decoder_t* dec);
+
+/// @}
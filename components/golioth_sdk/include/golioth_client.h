@@ -99,6 +99,63 @@ typedef struct {
     };
 } golioth_tls_credentials_t;
 
+/// Priority lanes of the client task request queue, highest priority first
+///
+/// Each lane has its own capacity, set in Kconfig. The lane of a request is
+/// derived from the service it's for.
+typedef enum {
+    /// RPC, settings, OTA manifest and state, and keepalive requests
+    GOLIOTH_REQUEST_LANE_CONTROL,
+    /// LightDB state, OTA download, and any other requests
+    GOLIOTH_REQUEST_LANE_STATE,
+    /// LightDB stream requests
+    GOLIOTH_REQUEST_LANE_TELEMETRY,
+    /// Log requests
+    GOLIOTH_REQUEST_LANE_LOG,
+    GOLIOTH_REQUEST_LANE_NUM,
+} golioth_request_lane_t;
+
+/// Statistics of a request lane, from @ref golioth_client_get_request_lane_stats
+typedef struct {
+    /// Number of requests currently waiting to be sent
+    uint32_t depth;
+    /// Number of requests the lane can hold, waiting or in flight
+    uint32_t capacity;
+    /// Largest number of requests that were waiting at the same time
+    uint32_t max_depth;
+    /// Number of requests sent from the lane
+    uint32_t num_sent;
+    /// Number of requests rejected because the lane was full
+    uint32_t num_dropped;
+    /// Number of requests replaced by a newer request before they were sent
+    uint32_t num_superseded;
+    /// Number of non-confirmable requests that waited in the lane because they were over
+    /// the NON rate
+    uint32_t num_rate_limited;
+} golioth_request_lane_stats_t;
+
+/// Connection statistics, from @ref golioth_client_get_connection_stats
+typedef struct {
+    /// Number of sessions started, including the ones that failed to connect
+    uint32_t num_sessions;
+    /// Number of DTLS handshakes completed
+    uint32_t num_handshakes;
+    /// Duration of the last DTLS handshake, in milliseconds
+    uint32_t last_handshake_ms;
+    /// Shortest and longest DTLS handshake, in milliseconds
+    uint32_t min_handshake_ms;
+    uint32_t max_handshake_ms;
+    /// Sum of all DTLS handshake durations, in milliseconds
+    uint64_t total_handshake_ms;
+    /// Time from the start of the last session to its first response, in milliseconds
+    uint32_t last_connect_ms;
+    /// Time from the start of the last session with observations to re-establish,
+    /// until all of them were re-established, in milliseconds
+    uint32_t last_observe_restore_ms;
+    /// Number of observations re-established on that session
+    uint32_t num_observations_restored;
+} golioth_client_connection_stats_t;
+
 /// Golioth client configuration, passed into golioth_client_create
 typedef struct {
     golioth_tls_credentials_t credentials;
@@ -151,6 +208,38 @@ typedef void (*golioth_set_cb_fn)(
         const char* path,
         void* arg);
 
+/// Callback function type for reading a request payload a piece at a time
+///
+/// Used for payloads that are too large to copy into a single request. The payload
+/// is read one CoAP block at a time, just before each block is sent, so the payload
+/// (and anything the reader needs to produce it) must remain valid until the
+/// request completes.
+///
+/// Called from the Golioth CoAP task, so it should not block for long.
+///
+/// @param offset Offset, in bytes, of the first payload byte to read
+/// @param buf Buffer to read the payload bytes into
+/// @param len Number of bytes to read. The reader must fill all of buf.
+/// @param arg User argument, copied from the original request. Can be NULL.
+///
+/// @return GOLIOTH_OK - len bytes have been read into buf
+/// @return Otherwise - abort the request. The status is passed to the request callback.
+typedef golioth_status_t (
+        *golioth_payload_reader_fn)(size_t offset, uint8_t* buf, size_t len, void* arg);
+
+/// Callback function type for releasing a payload handed over to the client
+///
+/// Payloads passed to the "owned" set functions (e.g. @ref golioth_lightdb_set_json_owned_async)
+/// are not copied. The client holds on to the payload until the request has been built,
+/// then calls this function so the owner can reuse or free the payload.
+///
+/// Called exactly once per payload, from the Golioth CoAP task, or from the calling task
+/// if the request can't be enqueued.
+///
+/// @param payload The payload that was handed over
+/// @param arg User argument, copied from the original request. Can be NULL.
+typedef void (*golioth_payload_release_fn)(void* payload, void* arg);
+
 /// Create a Golioth client
 ///
 /// Dynamically creates a client and returns an opaque handle to the client.
@@ -178,13 +267,16 @@ golioth_status_t golioth_client_start(golioth_client_t client);
 
 /// Stop the Golioth client
 ///
-/// Client will finish the current request (if there is one), then enter a dormant
+/// Client will finish the requests in flight (if there are any), then enter a dormant
 /// state where no packets will be sent or received with Golioth, and the client task will be in
 /// a blocked state.
 ///
 /// This function returns within 100 milliseconds, but there
 /// may be a further delay before the client task is actually stopped, depending on whether
-/// there is a pending request that needs to complete.
+/// there are pending requests that need to complete.
+///
+/// Requests still queued when the client task stops are not sent. Their callbacks are
+/// called with GOLIOTH_ERR_INVALID_STATE, and sync callers return an error.
 ///
 /// Does nothing if the client is already stopped.
 ///
@@ -221,6 +313,28 @@ bool golioth_client_is_running(golioth_client_t client);
 /// @return false The client is not connected, or the client handle is not valid
 bool golioth_client_is_connected(golioth_client_t client);
 
+/// Get a payload buffer from the client's pool
+///
+/// The buffer is CONFIG_GOLIOTH_PAYLOAD_POOL_BUF_SIZE bytes. Fill it in and hand it over
+/// to an "owned" set function, with @ref golioth_client_payload_release as the release
+/// function and the client as its argument, to send the payload without any heap
+/// allocation or copy.
+///
+/// Safe to call from any task.
+///
+/// @param client The client handle
+///
+/// @return Pointer to the buffer, or NULL if all pool buffers are in use
+void* golioth_client_payload_alloc(golioth_client_t client);
+
+/// Return a payload buffer to the client's pool
+///
+/// Has the signature of @ref golioth_payload_release_fn.
+///
+/// @param payload Buffer from @ref golioth_client_payload_alloc
+/// @param client The client handle the buffer was allocated from
+void golioth_client_payload_release(void* payload, void* client);
+
 /// Register a callback that will be called on client events (e.g. connected, disconnected)
 ///
 /// @param client The client handle
@@ -242,13 +356,80 @@ uint32_t golioth_client_task_stack_min_remaining(golioth_client_t client);
 
 /// The number of items currently in the client task request queue.
 ///
-/// Will be a number between 0 and GOLIOTH_COAP_REQUEST_QUEUE_MAX_ITEMS.
+/// Will be a number between 0 and the sum of the capacities of all request lanes.
 ///
 /// @param client The client handle
 ///
-/// @return The number of items currently in the client task request queue.
+/// @return The number of items currently in the client task request queue, over all lanes.
 uint32_t golioth_client_num_items_in_request_queue(golioth_client_t client);
 
+/// Enable or disable coalescing of LightDB state writes
+///
+/// When enabled, an asynchronous LightDB state set to a path that already has an
+/// asynchronous set waiting to be sent replaces the waiting request in place,
+/// instead of queueing another one. Only the latest value is sent. The callback of
+/// the replaced request is called with status GOLIOTH_ERR_SUPERSEDED, from the task
+/// making the newer request.
+///
+/// Synchronous requests, and values too large to be sent in one request, are never
+/// coalesced. Disabled by default.
+///
+/// @param client The client handle
+/// @param enable True to coalesce state writes, false to queue every write
+void golioth_client_set_coalesce_state_writes(golioth_client_t client, bool enable);
+
+/// Send the requests of the LightDB stream or log lane as non-confirmable (NON) messages
+///
+/// NON messages aren't acknowledged by the server, or retransmitted, so requests don't
+/// wait for a response or take up the window of requests in flight. Their callbacks are
+/// called with GOLIOTH_OK as soon as they are sent. For high-rate telemetry that can
+/// tolerate losses.
+///
+/// NON messages are limited to CONFIG_GOLIOTH_COAP_NON_RATE_PER_S per second, over all
+/// lanes, with bursts of up to CONFIG_GOLIOTH_COAP_NON_BURST. Requests over the rate
+/// wait at the head of their lane until they can be sent, so a sustained burst fills
+/// the lane, and further requests are rejected with GOLIOTH_ERR_QUEUE_FULL.
+///
+/// Synchronous requests, payloads uploaded in blocks, and records sent by an offline
+/// store are always confirmable. Disabled by default.
+///
+/// @param client The client handle
+/// @param lane GOLIOTH_REQUEST_LANE_TELEMETRY or GOLIOTH_REQUEST_LANE_LOG
+/// @param enable True to send NON messages, false for confirmable ones
+///
+/// @return GOLIOTH_OK - mode set
+/// @return GOLIOTH_ERR_NULL - invalid client handle
+/// @return GOLIOTH_ERR_INVALID_FORMAT - lane isn't the stream or log lane
+golioth_status_t golioth_client_set_lane_non_confirmable(
+        golioth_client_t client,
+        golioth_request_lane_t lane,
+        bool enable);
+
+/// Get the statistics of one lane of the client task request queue
+///
+/// @param client The client handle
+/// @param lane The request lane
+/// @param stats Output param, memory allocated by caller, populated with the lane statistics
+///
+/// @return GOLIOTH_OK - stats populated
+/// @return GOLIOTH_ERR_NULL - invalid client handle or stats
+/// @return GOLIOTH_ERR_INVALID_FORMAT - invalid lane
+golioth_status_t golioth_client_get_request_lane_stats(
+        golioth_client_t client,
+        golioth_request_lane_t lane,
+        golioth_request_lane_stats_t* stats);
+
+/// Get the connection statistics of the client, e.g. how long DTLS handshakes take
+///
+/// @param client The client handle
+/// @param stats Output param, memory allocated by caller, populated with the statistics
+///
+/// @return GOLIOTH_OK - stats populated
+/// @return GOLIOTH_ERR_NULL - invalid client handle or stats
+golioth_status_t golioth_client_get_connection_stats(
+        golioth_client_t client,
+        golioth_client_connection_stats_t* stats);
+
 /// Simulate packet loss at a particular percentage (0 to 100).
 ///
 /// Intended for testing and troubleshooting in packet loss scenarios.
@@ -7,6 +7,7 @@
 
 #include "golioth_status.h"
 #include "golioth_client.h"
+#include "golioth_cbor.h"
 
 /// @defgroup golioth_lightdb golioth_lightdb
 /// Functions for interacting with Golioth LightDB state and LightDB Stream services.
@@ -52,12 +53,35 @@ bool golioth_payload_as_bool(const uint8_t* payload, size_t payload_size);
 /// @return false - otherwise
 bool golioth_payload_is_null(const uint8_t* payload, size_t payload_size);
 
+/// Payload encoding of the typed LightDB functions
+typedef enum {
+    /// JSON, the default
+    GOLIOTH_LIGHTDB_ENCODING_JSON,
+    /// CBOR. Values are smaller on the air, and cheaper to encode and decode.
+    GOLIOTH_LIGHTDB_ENCODING_CBOR,
+} golioth_lightdb_encoding_t;
+
+/// Set the payload encoding of a client's typed LightDB functions
+///
+/// Applies to the int, bool, float and string set functions, for both LightDB state
+/// and LightDB Stream, and to the int, bool, float and string get functions.
+/// Functions that take JSON or CBOR directly, and @ref golioth_lightdb_get_async,
+/// aren't affected. Each client has its own encoding, JSON by default.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param encoding The encoding, used for requests made with client after this call
+void golioth_lightdb_set_encoding(golioth_client_t client, golioth_lightdb_encoding_t encoding);
+
 // TODO - block transfers for large post/get
 
 //-------------------------------------------------------------------------------
 // LightDB State
 //-------------------------------------------------------------------------------
 
+// If state write coalescing is enabled with golioth_client_set_coalesce_state_writes(),
+// the callback of an async set may be called with GOLIOTH_ERR_SUPERSEDED, meaning a
+// newer value for the same path replaced it before it was sent.
+
 /// Set an integer in LightDB state at a particular path asynchronously
 ///
 /// This function will enqueue a request and return immediately without
@@ -92,6 +116,11 @@ golioth_status_t golioth_lightdb_set_int_async(
 /// 2. The user-provided timeout_s period expires without receiving a response
 /// 3. The default GOLIOTH_COAP_RESPONSE_TIMEOUT_S period expires without receiving a response
 ///
+/// At most CONFIG_GOLIOTH_COAP_MAX_SYNC_REQUESTS (default 4) synchronous requests can wait
+/// for a response at the same time, across all tasks and all synchronous functions of the
+/// client. Any more fail right away with GOLIOTH_ERR_QUEUE_FULL, e.g. a fifth concurrent
+/// caller with the default.
+///
 /// @param client The client handle from @ref golioth_client_create
 /// @param path The path in LightDB state to set (e.g. "my_integer")
 /// @param value The value to set at path
@@ -101,7 +130,8 @@ golioth_status_t golioth_lightdb_set_int_async(
 /// @return GOLIOTH_ERR_NULL - invalid client handle
 /// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
 /// @return GOLIOTH_ERR_MEM_ALLOC - memory allocation error
-/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, this request is dropped
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, or too many synchronous requests
+///         are waiting, this request is dropped
 /// @return GOLIOTH_ERR_TIMEOUT - response not received from server, timeout occurred
 golioth_status_t golioth_lightdb_set_int_sync(
         golioth_client_t client,
@@ -202,6 +232,123 @@ golioth_status_t golioth_lightdb_set_json_sync(
         size_t json_str_len,
         int32_t timeout_s);
 
+/// Set a CBOR-encoded value in LightDB state at a particular path asynchronously
+///
+/// Similar to @ref golioth_lightdb_set_json_async, but the payload is CBOR (e.g. encoded
+/// with @ref golioth_cbor_encoder_init and friends), which is smaller than JSON and
+/// cheaper to produce.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param path The path in LightDB state to set (e.g. "my_object")
+/// @param cbor CBOR-encoded value
+/// @param cbor_len Size of cbor, in bytes
+/// @param callback Callback to call on response received or timeout. Can be NULL.
+/// @param callback_arg Callback argument, passed directly when callback invoked. Can be NULL.
+///
+/// @return GOLIOTH_OK - request enqueued
+/// @return GOLIOTH_ERR_NULL - invalid client handle
+/// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
+/// @return GOLIOTH_ERR_MEM_ALLOC - memory allocation error
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, this request is dropped
+golioth_status_t golioth_lightdb_set_cbor_async(
+        golioth_client_t client,
+        const char* path,
+        const uint8_t* cbor,
+        size_t cbor_len,
+        golioth_set_cb_fn callback,
+        void* callback_arg);
+
+/// Set a CBOR-encoded value in LightDB state at a particular path synchronously
+///
+/// Similar to @ref golioth_lightdb_set_json_sync, but the payload is CBOR.
+golioth_status_t golioth_lightdb_set_cbor_sync(
+        golioth_client_t client,
+        const char* path,
+        const uint8_t* cbor,
+        size_t cbor_len,
+        int32_t timeout_s);
+
+/// Set a JSON object in LightDB state at a particular path asynchronously, handing
+/// over the JSON instead of copying it
+///
+/// Similar to @ref golioth_lightdb_set_json_async, but the client takes ownership of
+/// json_str. Nothing is allocated or copied when the request is enqueued. Once the
+/// request has been built (or if it's dropped), json_str is handed back by calling
+/// release(json_str, release_arg), after which the caller can reuse or free it.
+///
+/// For the least overhead, use a buffer from @ref golioth_client_payload_alloc, with
+/// @ref golioth_client_payload_release as the release function and the client as
+/// release_arg.
+///
+/// release is called exactly once, even if this function returns an error.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param path The path in LightDB state to set (e.g. "my_object")
+/// @param json_str A JSON object encoded as a string (e.g. "{ \"string_key\": \"value\"}").
+///                 Does not need to be NULL-terminated.
+/// @param json_str_len Length of json_str, excluding NULL terminator
+/// @param release Callback that releases json_str. Can be NULL (e.g. for a static buffer).
+/// @param release_arg Release argument, passed directly when release invoked. Can be NULL.
+/// @param callback Callback to call on response received or timeout. Can be NULL.
+/// @param callback_arg Callback argument, passed directly when callback invoked. Can be NULL.
+///
+/// @return GOLIOTH_OK - request enqueued
+/// @return GOLIOTH_ERR_NULL - invalid client handle
+/// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, this request is dropped
+golioth_status_t golioth_lightdb_set_json_owned_async(
+        golioth_client_t client,
+        const char* path,
+        char* json_str,
+        size_t json_str_len,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        golioth_set_cb_fn callback,
+        void* callback_arg);
+
+/// Set a JSON object in LightDB state at a particular path asynchronously, reading
+/// the JSON with a callback instead of from a string
+///
+/// Similar to @ref golioth_lightdb_set_json_async, but the JSON is never copied as a
+/// whole. It is read one block at a time, just before each block is sent, and
+/// uploaded in blocks (CoAP Block1) if it's larger than one block. Peak heap usage
+/// doesn't depend on the size of the JSON.
+///
+/// The reader and anything it reads from must remain valid until the callback
+/// is invoked.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param path The path in LightDB state to set (e.g. "my_object")
+/// @param reader Callback that reads the JSON, see @ref golioth_payload_reader_fn
+/// @param reader_arg Reader argument, passed directly when reader invoked. Can be NULL.
+/// @param json_size Size of the JSON, in bytes
+/// @param callback Callback to call on response received or timeout. Can be NULL.
+/// @param callback_arg Callback argument, passed directly when callback invoked. Can be NULL.
+///
+/// @return GOLIOTH_OK - request enqueued
+/// @return GOLIOTH_ERR_NULL - invalid client handle or reader
+/// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, this request is dropped
+golioth_status_t golioth_lightdb_set_json_reader_async(
+        golioth_client_t client,
+        const char* path,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t json_size,
+        golioth_set_cb_fn callback,
+        void* callback_arg);
+
+/// Same as @ref golioth_lightdb_set_json_reader_async, but synchronous.
+///
+/// Similar to @ref golioth_lightdb_set_json_sync.
+golioth_status_t golioth_lightdb_set_json_reader_sync(
+        golioth_client_t client,
+        const char* path,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t json_size,
+        int32_t timeout_s);
+
 /// Get data in LightDB state at a particular path asynchronously.
 ///
 /// This function will enqueue a request and return immediately without
@@ -239,7 +386,8 @@ golioth_status_t golioth_lightdb_get_async(
 /// @return GOLIOTH_OK - response received from server, set was successful
 /// @return GOLIOTH_ERR_NULL - invalid client handle
 /// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
-/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, this request is dropped
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, or too many synchronous requests
+///         are waiting (see @ref golioth_lightdb_set_int_sync), this request is dropped
 /// @return GOLIOTH_ERR_TIMEOUT - response not received from server, timeout occurred
 golioth_status_t golioth_lightdb_get_int_sync(
         golioth_client_t client,
@@ -316,7 +464,8 @@ golioth_status_t golioth_lightdb_delete_async(
 /// @return GOLIOTH_OK - response received from server, set was successful
 /// @return GOLIOTH_ERR_NULL - invalid client handle
 /// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
-/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, this request is dropped
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, or too many synchronous requests
+///         are waiting (see @ref golioth_lightdb_set_int_sync), this request is dropped
 /// @return GOLIOTH_ERR_TIMEOUT - response not received from server, timeout occurred
 golioth_status_t golioth_lightdb_delete_sync(
         golioth_client_t client,
@@ -337,6 +486,10 @@ golioth_status_t golioth_lightdb_delete_sync(
 /// type using, e.g. @ref golioth_payload_as_int, or using a JSON parsing library (like cJSON) in
 /// the case of JSON payload.
 ///
+/// The observation is registered again whenever the client reconnects. If the server
+/// sent an ETag with the last value, it is sent back, and the callback is only invoked
+/// if the data changed while the client was disconnected.
+///
 /// @param client The client handle from @ref golioth_client_create
 /// @param path The path in LightDB state to observe (e.g. "my_integer")
 /// @param callback Callback to call on response received or timeout. Can be NULL.
@@ -353,6 +506,43 @@ golioth_status_t golioth_lightdb_observe_async(
         golioth_get_cb_fn callback,
         void* callback_arg);
 
+/// Stop observing a path in LightDB state
+///
+/// Enqueues a request to deregister all observations of path made with
+/// @ref golioth_lightdb_observe_async, and returns immediately. Once the request is
+/// handled, their callbacks are no longer called, and they aren't re-established
+/// when the client reconnects.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param path The path in LightDB state to stop observing (e.g. "my_integer")
+///
+/// @return GOLIOTH_OK - request enqueued
+/// @return GOLIOTH_ERR_NULL - invalid client handle
+/// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, this request is dropped
+golioth_status_t golioth_lightdb_unobserve_async(golioth_client_t client, const char* path);
+
+/// Stop observing a path in LightDB state synchronously
+///
+/// Same as @ref golioth_lightdb_unobserve_async, but blocks until the server has
+/// answered the deregistration, or timeout_s expires. Returns right away if the path
+/// isn't observed.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param path The path in LightDB state to stop observing (e.g. "my_integer")
+/// @param timeout_s The timeout, in seconds, for receiving a server response
+///
+/// @return GOLIOTH_OK - observations deregistered, or there were none
+/// @return GOLIOTH_ERR_NULL - invalid client handle
+/// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, or too many synchronous requests
+///         are waiting (see @ref golioth_lightdb_set_int_sync), this request is dropped
+/// @return GOLIOTH_ERR_TIMEOUT - response not received from server, timeout occurred
+golioth_status_t golioth_lightdb_unobserve_sync(
+        golioth_client_t client,
+        const char* path,
+        int32_t timeout_s);
+
 //-------------------------------------------------------------------------------
 // LightDB Stream
 //-------------------------------------------------------------------------------
@@ -436,4 +626,51 @@ golioth_status_t golioth_lightdb_stream_set_json_sync(
         size_t json_str_len,
         int32_t timeout_s);
 
+/// Similar to @ref golioth_lightdb_set_cbor_async, but for LightDB Stream
+golioth_status_t golioth_lightdb_stream_set_cbor_async(
+        golioth_client_t client,
+        const char* path,
+        const uint8_t* cbor,
+        size_t cbor_len,
+        golioth_set_cb_fn callback,
+        void* callback_arg);
+
+/// Similar to @ref golioth_lightdb_set_cbor_sync, but for LightDB Stream
+golioth_status_t golioth_lightdb_stream_set_cbor_sync(
+        golioth_client_t client,
+        const char* path,
+        const uint8_t* cbor,
+        size_t cbor_len,
+        int32_t timeout_s);
+
+/// Similar to @ref golioth_lightdb_set_json_owned_async, but for LightDB Stream
+golioth_status_t golioth_lightdb_stream_set_json_owned_async(
+        golioth_client_t client,
+        const char* path,
+        char* json_str,
+        size_t json_str_len,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        golioth_set_cb_fn callback,
+        void* callback_arg);
+
+/// Similar to @ref golioth_lightdb_set_json_reader_async, but for LightDB Stream
+golioth_status_t golioth_lightdb_stream_set_json_reader_async(
+        golioth_client_t client,
+        const char* path,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t json_size,
+        golioth_set_cb_fn callback,
+        void* callback_arg);
+
+/// Similar to @ref golioth_lightdb_set_json_reader_sync, but for LightDB Stream
+golioth_status_t golioth_lightdb_stream_set_json_reader_sync(
+        golioth_client_t client,
+        const char* path,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t json_size,
+        int32_t timeout_s);
+
 /// @}
@@ -64,6 +64,9 @@ golioth_status_t golioth_log_debug_async(
 /// 2. The user-provided timeout_s period expires without receiving a response
 /// 3. The default GOLIOTH_COAP_RESPONSE_TIMEOUT_S period expires without receiving a response
 ///
+/// Like all synchronous functions, fails with GOLIOTH_ERR_QUEUE_FULL if too many
+/// synchronous requests are already waiting (see @ref golioth_lightdb_set_int_sync).
+///
 /// @param client The client handle from @ref golioth_client_create
 /// @param tag A free-form string to identify/tag the message
 /// @param log_message String to log. Must be NULL-terminated.
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "golioth_status.h"
+#include "golioth_client.h"
+
+/// @defgroup golioth_offline_store golioth_offline_store
+/// Flash-backed store-and-forward of LightDB Stream and log records
+///
+/// Without a store, stream and log requests made while the client isn't connected
+/// wait in the RAM request queue, where they take up request slots and are lost on
+/// reboot. Once a store is attached to a client, asynchronous stream and log requests
+/// made while the client isn't connected (including while it's stopped) are appended
+/// to the store instead. When the
+/// client connects, the store sends them, several at a time, and removes each record
+/// once the server has acknowledged it.
+///
+/// Callbacks of requests appended to the store aren't called. Payloads too large for
+/// a record (CONFIG_GOLIOTH_OFFLINE_STORE_MAX_RECORD_SIZE) wait in the RAM queue as usual.
+///
+/// The store is an append-only log over flash sectors, used round-robin, so erases
+/// are spread evenly over the storage. It only needs RAM for the records being sent.
+/// @{
+
+/// Flash-like storage for the store
+///
+/// Writes only ever go to erased bytes (or clear bits of already written bytes),
+/// so a file, or any other byte storage, can stand in for flash.
+typedef struct {
+    /// Read len bytes at offset into buf
+    golioth_status_t (*read)(void* ctx, size_t offset, void* buf, size_t len);
+    /// Write len bytes from buf at offset
+    golioth_status_t (*write)(void* ctx, size_t offset, const void* buf, size_t len);
+    /// Erase len bytes at offset, to 0xFF. offset and len are multiples of sector_size.
+    golioth_status_t (*erase)(void* ctx, size_t offset, size_t len);
+    /// Size of the storage, in bytes. A multiple of sector_size, at least two sectors.
+    size_t size;
+    /// Size of an erase sector, in bytes
+    size_t sector_size;
+    /// Argument passed to read, write and erase
+    void* ctx;
+} golioth_offline_storage_t;
+
+/// What to do with a new record when the storage is full
+typedef enum {
+    /// Erase the oldest sector, dropping the records still in it
+    GOLIOTH_OFFLINE_OVERFLOW_DROP_OLDEST,
+    /// Keep the stored records, and drop the new one
+    GOLIOTH_OFFLINE_OVERFLOW_DROP_NEWEST,
+} golioth_offline_overflow_t;
+
+/// Store configuration, passed into @ref golioth_offline_store_create
+typedef struct {
+    /// Storage for the records, e.g. from @ref golioth_offline_storage_partition
+    golioth_offline_storage_t storage;
+    /// What to do with a new record when the storage is full
+    golioth_offline_overflow_t overflow;
+    /// Drop records older than this, in seconds, instead of sending them. 0 to keep
+    /// records regardless of age. Only applies once the system time has been set.
+    uint32_t retention_s;
+} golioth_offline_store_config_t;
+
+/// Store statistics, from @ref golioth_offline_store_get_stats
+typedef struct {
+    /// Number of records in the store, waiting to be sent
+    uint32_t num_stored;
+    /// Number of records appended
+    uint32_t num_appended;
+    /// Number of records sent and acknowledged by the server
+    uint32_t num_sent;
+    /// Number of records dropped, because the storage was full or they were too old
+    uint32_t num_dropped;
+} golioth_offline_store_stats_t;
+
+/// Opaque handle to an offline store
+typedef void* golioth_offline_store_t;
+
+/// Use a flash partition as storage
+///
+/// The partition is found by label, and must be a data partition, e.g. in partitions.csv:
+///
+///     golioth_offline, data, 0x99, , 64K
+///
+/// @param label Partition label
+/// @param storage Output param, memory allocated by caller, populated with the storage
+///
+/// @return GOLIOTH_OK - storage populated
+/// @return GOLIOTH_ERR_NULL - partition not found
+golioth_status_t golioth_offline_storage_partition(
+        const char* label,
+        golioth_offline_storage_t* storage);
+
+/// Use a file as storage. The file is created, and sized, if needed.
+///
+/// Useful for keeping the store on a filesystem instead of a raw partition.
+/// The file stays open until @ref golioth_offline_storage_file_close.
+///
+/// @param path Path of the file
+/// @param size Size of the storage, in bytes. A multiple of sector_size.
+/// @param sector_size Size of an erase sector, in bytes
+/// @param storage Output param, memory allocated by caller, populated with the storage
+///
+/// @return GOLIOTH_OK - storage populated
+/// @return GOLIOTH_ERR_IO - failed to open or size the file
+golioth_status_t golioth_offline_storage_file(
+        const char* path,
+        size_t size,
+        size_t sector_size,
+        golioth_offline_storage_t* storage);
+
+/// Close the file of a storage from @ref golioth_offline_storage_file
+///
+/// Call it once the store using the storage has been destroyed.
+///
+/// @param storage The storage populated by @ref golioth_offline_storage_file
+void golioth_offline_storage_file_close(golioth_offline_storage_t* storage);
+
+/// Create an offline store and attach it to a client
+///
+/// Records already in the storage (e.g. from before a reboot) are kept, and sent
+/// once the client connects.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param config Store configuration. Copied, so it doesn't need to outlive this call.
+///
+/// @return The store handle, or NULL if there was an error
+golioth_offline_store_t golioth_offline_store_create(
+        golioth_client_t client,
+        const golioth_offline_store_config_t* config);
+
+/// Detach a store from its client, and destroy it. Records not yet sent stay in the storage.
+///
+/// Waits for the responses of records in flight. If they don't complete within a few
+/// response timeouts (e.g. the client is disconnected but still running), the store's
+/// memory is left allocated rather than freed under the client.
+///
+/// @param store The store handle from @ref golioth_offline_store_create
+void golioth_offline_store_destroy(golioth_offline_store_t store);
+
+/// Get the statistics of a store
+///
+/// @param store The store handle from @ref golioth_offline_store_create
+/// @param stats Output param, memory allocated by caller, populated with the statistics
+///
+/// @return GOLIOTH_OK - stats populated
+/// @return GOLIOTH_ERR_NULL - invalid store handle or stats
+golioth_status_t golioth_offline_store_get_stats(
+        golioth_offline_store_t store,
+        golioth_offline_store_stats_t* stats);
+
+/// @}
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "golioth_status.h"
 #include "golioth_client.h"
 
@@ -18,6 +19,9 @@
 /// Maximum size of an OTA block, in bytes
 #define GOLIOTH_OTA_BLOCKSIZE 1024
 
+/// Size of an artifact SHA-256 digest, in bytes
+#define GOLIOTH_OTA_COMPONENT_HASH_LEN 32
+
 /// State of OTA update, reported to Golioth server
 typedef enum {
     /// No OTA update in progress
@@ -54,6 +58,25 @@ typedef enum {
     GOLIOTH_OTA_REASON_UNSUPPORTED_PROTOCOL,
 } golioth_ota_reason_t;
 
+/// Kind of artifact
+typedef enum {
+    /// A complete image
+    GOLIOTH_OTA_COMPONENT_TYPE_FULL,
+    /// A binary patch (delta) that turns the running image into the new image,
+    /// created with scripts/ota/golioth_delta.py
+    GOLIOTH_OTA_COMPONENT_TYPE_DELTA,
+} golioth_ota_component_type_t;
+
+/// Compression applied to an artifact
+typedef enum {
+    /// Not compressed
+    GOLIOTH_OTA_COMPRESSION_NONE,
+    /// Compressed with heatshrink, using the window and lookahead sizes from Kconfig
+    GOLIOTH_OTA_COMPRESSION_HEATSHRINK,
+    /// Compressed with an algorithm this SDK doesn't support
+    GOLIOTH_OTA_COMPRESSION_UNKNOWN,
+} golioth_ota_compression_t;
+
 /// A component/artifact within an OTA manifest
 typedef struct {
     /// Artifact package name (e.g. "main")
@@ -62,6 +85,14 @@ typedef struct {
     char version[CONFIG_GOLIOTH_OTA_MAX_VERSION_LEN + 1];
     /// Size of the artifact, in bytes
     int32_t size;
+    /// Kind of artifact, from the optional manifest key "type" ("delta" for a patch)
+    golioth_ota_component_type_t type;
+    /// Compression, from the optional manifest key "compression" ("heatshrink")
+    golioth_ota_compression_t compression;
+    /// SHA-256 of the artifact (as downloaded), from the optional manifest key "hash"
+    uint8_t hash[GOLIOTH_OTA_COMPONENT_HASH_LEN];
+    /// True if the manifest provided a hash
+    bool has_hash;
 } golioth_ota_component_t;
 
 /// An OTA manifest, composed of multiple components/artifacts
@@ -136,7 +167,8 @@ golioth_status_t golioth_ota_observe_manifest_async(
 /// @return GOLIOTH_OK - response received from server, get was successful
 /// @return GOLIOTH_ERR_NULL - invalid client handle
 /// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
-/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, this request is dropped
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, or too many synchronous requests
+///         are waiting (see @ref golioth_lightdb_set_int_sync), this request is dropped
 /// @return GOLIOTH_ERR_TIMEOUT - response not received from server, timeout occurred
 golioth_status_t golioth_ota_get_block_sync(
         golioth_client_t client,
@@ -147,6 +179,83 @@ golioth_status_t golioth_ota_get_block_sync(
         size_t* block_nbytes,
         int32_t timeout_s);
 
+/// Callback function type for blocks of an artifact download
+///
+/// Blocks are handed to the sink in order and without gaps, regardless of
+/// the order in which they arrive from the server. Block sizes vary during a
+/// download, so blocks are identified by their offset in the artifact.
+///
+/// Called from the task that called @ref golioth_ota_download_component,
+/// so it's safe to do slow work (e.g. writing to flash) in this callback.
+///
+/// @param offset Offset of the block in the artifact, in bytes
+/// @param block_buffer Block data
+/// @param block_buffer_len Size of block data, in bytes, 0 to GOLIOTH_OTA_BLOCKSIZE
+/// @param is_last True if this is the last block of the artifact
+/// @param arg User argument, copied from @ref golioth_ota_download_component
+///
+/// @return GOLIOTH_OK - block handled, continue downloading
+/// @return Otherwise - abort the download. This status is returned from
+///         @ref golioth_ota_download_component.
+typedef golioth_status_t (*golioth_ota_block_sink_fn)(
+        size_t offset,
+        const uint8_t* block_buffer,
+        size_t block_buffer_len,
+        bool is_last,
+        void* arg);
+
+/// Download an artifact, handing it to a sink one block at a time
+///
+/// Up to CONFIG_GOLIOTH_OTA_DOWNLOAD_WINDOW block requests are kept in flight
+/// at the same time, so the download isn't limited to one block per round trip.
+/// Blocks that fail or time out are requested again a few times before giving up.
+///
+/// The block size adapts to the link: it starts at the size set with
+/// @ref golioth_ota_set_max_block_size, is halved when a block is lost, and is
+/// doubled again after a run of blocks arrive without loss or unusually slow
+/// round trips. If the server answers with smaller blocks, its size is used
+/// for the rest of the download.
+///
+/// This function will block until the whole artifact has been handed to the sink,
+/// or the download fails.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param component The artifact to download, from the OTA manifest
+/// @param start_offset Offset, in bytes, to start downloading from. Non-zero to resume
+///         a download that was interrupted. Must be a multiple of 1024.
+/// @param sink Callback function that receives the blocks of the artifact
+/// @param sink_arg User argument passed to sink. Can be NULL.
+///
+/// @return GOLIOTH_OK - whole artifact downloaded and handed to the sink
+/// @return GOLIOTH_ERR_NULL - invalid client handle, component, or sink
+/// @return GOLIOTH_ERR_INVALID_FORMAT - start_offset is not a multiple of 1024, or not
+///         within the artifact (e.g. the artifact is empty), or the server sent an
+///         empty block before the end of the artifact
+/// @return GOLIOTH_ERR_MEM_ALLOC - failed to allocate block buffers
+/// @return GOLIOTH_ERR_TIMEOUT - a block could not be downloaded
+/// @return Otherwise - status of a failed block request, or status returned by sink
+golioth_status_t golioth_ota_download_component(
+        golioth_client_t client,
+        const golioth_ota_component_t* component,
+        size_t start_offset,
+        golioth_ota_block_sink_fn sink,
+        void* sink_arg);
+
+/// Set the largest block size used by @ref golioth_ota_download_component, for a client
+///
+/// Smaller blocks mean more round trips, but less data to send again when a
+/// block is lost. Downloads start at this size.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param block_size Block size, in bytes. A power of two, 16 to GOLIOTH_OTA_BLOCKSIZE.
+///         Defaults to GOLIOTH_OTA_BLOCKSIZE.
+///
+/// @return GOLIOTH_OK - block size set, used by the client's downloads started after
+///         this call
+/// @return GOLIOTH_ERR_NULL - invalid client handle
+/// @return GOLIOTH_ERR_INVALID_FORMAT - block_size is not a valid block size
+golioth_status_t golioth_ota_set_max_block_size(golioth_client_t client, size_t block_size);
+
 /// Report the state of OTA update to Golioth server synchronously
 ///
 /// @param client The client handle from @ref golioth_client_create
@@ -160,7 +269,8 @@ golioth_status_t golioth_ota_get_block_sync(
 /// @return GOLIOTH_OK - response received from server, get was successful
 /// @return GOLIOTH_ERR_NULL - invalid client handle
 /// @return GOLIOTH_ERR_INVALID_STATE - client is not running, currently stopped
-/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, this request is dropped
+/// @return GOLIOTH_ERR_QUEUE_FULL - request queue is full, or too many synchronous requests
+///         are waiting (see @ref golioth_lightdb_set_int_sync), this request is dropped
 /// @return GOLIOTH_ERR_TIMEOUT - response not received from server, timeout occurred
 golioth_status_t golioth_ota_report_state_sync(
         golioth_client_t client,
@@ -19,7 +19,8 @@
     STATUS(GOLIOTH_ERR_TIMEOUT) \
     STATUS(GOLIOTH_ERR_QUEUE_FULL) /* 10 */ \
     STATUS(GOLIOTH_ERR_NOT_ALLOWED) \
-    STATUS(GOLIOTH_ERR_INVALID_STATE)
+    STATUS(GOLIOTH_ERR_INVALID_STATE) \
+    STATUS(GOLIOTH_ERR_SUPERSEDED)
 
 #define GENERATE_GOLIOTH_STATUS_ENUM(code) code,
 typedef enum {
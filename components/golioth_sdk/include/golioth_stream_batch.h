@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "golioth_status.h"
+#include "golioth_client.h"
+
+/// @defgroup golioth_stream_batch golioth_stream_batch
+/// Functions for batching LightDB Stream records into fewer requests
+///
+/// Each call to golioth_lightdb_stream_set_*_async() is a request of its own, with
+/// its own CoAP and DTLS overhead and its own round trip. A batch instead collects
+/// records and sends many of them in one request, as a JSON array of objects.
+///
+/// A batch is sent when the next record doesn't fit in the batch buffer, when the
+/// oldest record in the buffer reaches the configured age, or when
+/// @ref golioth_stream_batch_flush is called.
+///
+/// https://docs.golioth.io/reference/protocols/coap/lightdb-stream
+/// @{
+
+/// Opaque handle to a stream batch
+typedef void* golioth_stream_batch_t;
+
+/// Stream batch configuration, passed into @ref golioth_stream_batch_create
+typedef struct {
+    /// Send the batch once its oldest record is this old, in milliseconds.
+    /// 0 to only send when the buffer is full or flushed.
+    uint32_t max_age_ms;
+    /// Add a "ts" (Unix time, in seconds) member to each record, if the system
+    /// time has been set. Otherwise, the server timestamps records when they arrive.
+    bool add_timestamp;
+    /// Callback to call for each batch request, on response received or timeout. Can be NULL.
+    golioth_set_cb_fn callback;
+    /// Callback argument, passed directly when callback invoked. Can be NULL.
+    void* callback_arg;
+} golioth_stream_batch_config_t;
+
+/// Batch statistics, from @ref golioth_stream_batch_get_stats
+typedef struct {
+    /// Number of records added
+    uint32_t num_records;
+    /// Number of records dropped, because all buffers were waiting to be sent, or
+    /// because their batch could not be sent
+    uint32_t num_dropped;
+    /// Number of batch requests sent
+    uint32_t num_batches;
+    /// Total payload size of batch requests sent, in bytes
+    uint32_t num_bytes;
+} golioth_stream_batch_stats_t;
+
+/// Create a stream batch
+///
+/// Allocates CONFIG_GOLIOTH_STREAM_BATCH_NUM_BUFS buffers of
+/// CONFIG_GOLIOTH_STREAM_BATCH_BUF_SIZE bytes. Records are added to one buffer while
+/// the others are waiting to be sent.
+///
+/// @param client The client handle from @ref golioth_client_create
+/// @param config Batch configuration. Copied, so it doesn't need to outlive this call.
+///
+/// @return The batch handle, or NULL if there was an error
+golioth_stream_batch_t golioth_stream_batch_create(
+        golioth_client_t client,
+        const golioth_stream_batch_config_t* config);
+
+/// Send any records still in the batch, and destroy it
+///
+/// Blocks until the client is done with all batch buffers, so it must be called
+/// while the client still exists. If the client still holds buffers after a few
+/// response timeouts (e.g. it's disconnected but still running), the batch's memory
+/// is left allocated rather than freed under the client.
+///
+/// @param batch The batch handle from @ref golioth_stream_batch_create
+void golioth_stream_batch_destroy(golioth_stream_batch_t batch);
+
+/// Add an integer record at a particular path to the batch
+///
+/// @param batch The batch handle from @ref golioth_stream_batch_create
+/// @param path The path in LightDB stream to set (e.g. "sensor/temp")
+/// @param value The value to set at path
+///
+/// @return GOLIOTH_OK - record added
+/// @return GOLIOTH_ERR_NULL - invalid batch handle or path
+/// @return GOLIOTH_ERR_INVALID_FORMAT - path is empty
+/// @return GOLIOTH_ERR_MEM_ALLOC - record is larger than a batch buffer
+/// @return GOLIOTH_ERR_QUEUE_FULL - all buffers are waiting to be sent, record dropped
+golioth_status_t golioth_stream_batch_add_int(
+        golioth_stream_batch_t batch,
+        const char* path,
+        int32_t value);
+
+/// Same as @ref golioth_stream_batch_add_int, but for a bool
+golioth_status_t golioth_stream_batch_add_bool(
+        golioth_stream_batch_t batch,
+        const char* path,
+        bool value);
+
+/// Same as @ref golioth_stream_batch_add_int, but for a float
+golioth_status_t golioth_stream_batch_add_float(
+        golioth_stream_batch_t batch,
+        const char* path,
+        float value);
+
+/// Same as @ref golioth_stream_batch_add_int, but for a string.
+/// The string must not need escaping in JSON.
+golioth_status_t golioth_stream_batch_add_string(
+        golioth_stream_batch_t batch,
+        const char* path,
+        const char* str,
+        size_t str_len);
+
+/// Same as @ref golioth_stream_batch_add_int, but for a JSON value (e.g. an object)
+golioth_status_t golioth_stream_batch_add_json(
+        golioth_stream_batch_t batch,
+        const char* path,
+        const char* json_str,
+        size_t json_str_len);
+
+/// Send the records in the batch now, without waiting for the buffer to fill
+///
+/// @param batch The batch handle from @ref golioth_stream_batch_create
+///
+/// @return GOLIOTH_OK - batch request enqueued, or the batch was empty
+/// @return GOLIOTH_ERR_NULL - invalid batch handle
+/// @return Otherwise - status of the failed batch request. The records are dropped.
+golioth_status_t golioth_stream_batch_flush(golioth_stream_batch_t batch);
+
+/// Get the statistics of a batch
+///
+/// @param batch The batch handle from @ref golioth_stream_batch_create
+/// @param stats Output param, memory allocated by caller, populated with the statistics
+///
+/// @return GOLIOTH_OK - stats populated
+/// @return GOLIOTH_ERR_NULL - invalid batch handle or stats
+golioth_status_t golioth_stream_batch_get_stats(
+        golioth_stream_batch_t batch,
+        golioth_stream_batch_stats_t* stats);
+
+/// @}
@@ -10,29 +10,62 @@
 #include <freertos/task.h>
 #include <freertos/semphr.h>
 #include <freertos/timers.h>
-#include <freertos/event_groups.h>
 #include <coap3/coap.h>  // COAP_MEDIATYPE_*
 #include "golioth_client.h"
 #include "golioth_lightdb.h"
+#include "golioth_offline_store.h"
 
-/// Event group bits for request_complete_event
-#define RESPONSE_RECEIVED_EVENT_BIT (1 << 0)
-#define RESPONSE_TIMEOUT_EVENT_BIT (1 << 1)
+/// Lets a user sync function wait for the CoAP task to complete a request.
+///
+/// These are reused from one request to the next. A user sync function may time out
+/// and return before its request completes, so each use gets a new sequence number,
+/// and completions for older sequence numbers are ignored.
+typedef struct {
+    SemaphoreHandle_t sem;
+    /// Sequence number of the request currently using this object
+    volatile uint32_t seq;
+    /// Sequence number of the last request completed, and whether it got a response
+    volatile uint32_t done_seq;
+    volatile bool got_response;
+} golioth_coap_sync_completion_t;
 
 typedef struct {
     // Must be one of:
     //   COAP_MEDIATYPE_APPLICATION_JSON
     //   COAP_MEDIATYPE_APPLICATION_CBOR
     uint32_t content_type;
-    // CoAP payload assumed to be dynamically allocated before enqueue
-    // and freed after dequeue.
+    // CoAP payload, owned by the request until it's released
     uint8_t* payload;
     // Size of payload, in bytes
     size_t payload_size;
+    // Releases payload once the PDU is built, or if the request is dropped
+    golioth_payload_release_fn release;
+    void* release_arg;
     golioth_set_cb_fn callback;
     void* arg;
+    // Always sent as CON, even from a non-confirmable lane
+    bool require_ack;
 } golioth_coap_post_params_t;
 
+typedef struct {
+    uint32_t content_type;
+    // Reads the payload, one block at a time
+    golioth_payload_reader_fn reader;
+    void* reader_arg;
+    // Payload to release when the request completes. Can be NULL.
+    void* owned_payload;
+    golioth_payload_release_fn release;
+    void* release_arg;
+    // Size of payload, in bytes
+    size_t payload_size;
+    // Size of blocks, a power of two (may be lowered by the server)
+    size_t block_size;
+    // Index of the block currently being sent
+    size_t block_index;
+    golioth_set_cb_fn callback;
+    void* arg;
+} golioth_coap_post_block_params_t;
+
 typedef struct {
     uint32_t content_type;
     golioth_get_cb_fn callback;
@@ -63,9 +96,11 @@ typedef enum {
     GOLIOTH_COAP_REQUEST_GET,
     GOLIOTH_COAP_REQUEST_GET_BLOCK,
     GOLIOTH_COAP_REQUEST_POST,
-    // TODO - support for POST_BLOCK
+    GOLIOTH_COAP_REQUEST_POST_BLOCK,
     GOLIOTH_COAP_REQUEST_DELETE,
     GOLIOTH_COAP_REQUEST_OBSERVE,
+    // Deregister all observations of path
+    GOLIOTH_COAP_REQUEST_UNOBSERVE,
 } golioth_coap_request_type_t;
 
 typedef struct {
@@ -80,6 +115,7 @@ typedef struct {
         golioth_coap_get_params_t get;
         golioth_coap_get_block_params_t get_block;
         golioth_coap_post_params_t post;
+        golioth_coap_post_block_params_t post_block;
         golioth_coap_delete_params_t delete;
         golioth_coap_observe_params_t observe;
     };
@@ -87,29 +123,48 @@ typedef struct {
     /// This is checked when reqeusts are pulled out of the queue and when responses are received.
     /// Primarily intended to be used for synchronous requests, to avoid blocking forever.
     uint64_t ageout_ms;
-    bool got_response;
-
-    /// (sync request only) Notification from coap task to user sync function that
-    /// request is completed.
-    /// Created in user sync function, deleted by coap task.
-    ///
-    /// Bit 0: response received
-    /// Bit 1: timeout
-    EventGroupHandle_t request_complete_event;
-
-    /// (sync request only) Notification from user sync function to coap task, acknowledge it
-    /// received request_complete_event.
-    ///
-    /// Created in user sync function, deleted by coap task.
-    ///
-    /// Used by the coap task to know when it's safe
-    /// to delete request_complete_event and this semaphore.
-    SemaphoreHandle_t request_complete_ack_sem;
+
+    /// (sync request only) Completion object the user sync function is waiting on.
+    /// Owned by the client, so it remains valid even if the user sync function
+    /// has timed out and returned.
+    golioth_coap_sync_completion_t* sync_completion;
+
+    /// (sync request only) Value of sync_completion->seq when this request claimed it
+    uint32_t sync_seq;
+    /// Lane the request was queued in, set by the client when the request is queued
+    golioth_request_lane_t lane;
+    /// True while the request is waiting in its lane, i.e. it can still be superseded
+    bool is_queued;
+    /// (NON request only) True if the request had to wait for the NON rate
+    bool was_rate_limited;
 } golioth_coap_request_msg_t;
 
+typedef enum {
+    /// Registered, or registration sent by the request that added the observation
+    GOLIOTH_COAP_OBSERVE_ACTIVE,
+    /// Waiting to be registered again on a new session
+    GOLIOTH_COAP_OBSERVE_PENDING_REGISTER,
+    /// Registration sent on a new session, waiting for the response
+    GOLIOTH_COAP_OBSERVE_REGISTERING,
+} golioth_coap_observe_state_t;
+
 typedef struct {
-    bool in_use;
     golioth_coap_request_msg_t req;
+    golioth_coap_observe_state_t state;
+    /// (REGISTERING only) Time (since boot) in milliseconds when we stop waiting
+    /// for the response to the registration
+    uint64_t register_timeout_ms;
+    /// True once a notification with an Observe option has been received
+    bool has_seq;
+    /// Observe option of the freshest notification
+    uint32_t last_seq;
+    /// Time (since boot) in milliseconds when the freshest notification was received
+    uint64_t last_seq_ms;
+    /// ETag of the last representation passed to the callback, sent when the
+    /// observation is registered again, so an unchanged resource isn't sent again.
+    /// etag_len is 0 if the server didn't send one.
+    uint8_t etag[8];
+    size_t etag_len;
 } golioth_coap_observe_info_t;
 
 golioth_status_t golioth_coap_client_empty(
@@ -129,6 +184,95 @@ golioth_status_t golioth_coap_client_set(
         bool is_synchronous,
         int32_t timeout_s);
 
+/// Same as golioth_coap_client_set, but the payload is handed over instead of copied.
+///
+/// payload is released with release(payload, release_arg) once the request has been
+/// built, or if the request can't be enqueued (before this function returns).
+golioth_status_t golioth_coap_client_set_owned(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        uint8_t* payload,
+        size_t payload_size,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        golioth_set_cb_fn callback,
+        void* callback_arg,
+        bool is_synchronous,
+        int32_t timeout_s);
+
+/// Same as golioth_coap_client_set_owned (asynchronous), for records sent by an offline
+/// store. These are never appended back to the store.
+golioth_status_t golioth_coap_client_replay(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        uint8_t* payload,
+        size_t payload_size,
+        golioth_payload_release_fn release,
+        void* release_arg,
+        golioth_set_cb_fn callback,
+        void* callback_arg);
+
+/// Attach an offline store to the client, or detach it if store is NULL.
+///
+/// While a store is attached and the session isn't connected, asynchronous LightDB stream
+/// and log requests are appended to the store with golioth_offline_store_divert, and the
+/// store is woken with golioth_offline_store_wake when the session connects.
+void golioth_coap_client_set_offline_store(golioth_client_t client, golioth_offline_store_t store);
+
+/// Detach an offline store from the client, if it's the one attached
+void golioth_coap_client_detach_offline_store(
+        golioth_client_t client,
+        golioth_offline_store_t store);
+
+/// Set the payload encoding of the client's typed LightDB functions
+void golioth_coap_client_set_lightdb_encoding(
+        golioth_client_t client,
+        golioth_lightdb_encoding_t encoding);
+
+/// Payload encoding of the client's typed LightDB functions. JSON if client is NULL.
+golioth_lightdb_encoding_t golioth_coap_client_lightdb_encoding(golioth_client_t client);
+
+/// Set the block size the client's OTA downloads start at
+void golioth_coap_client_set_ota_max_block_size(golioth_client_t client, size_t block_size);
+
+/// Block size the client's OTA downloads start at. GOLIOTH_OTA_BLOCKSIZE if client is NULL.
+size_t golioth_coap_client_ota_max_block_size(golioth_client_t client);
+
+/// Append a request to an offline store, instead of queueing it (golioth_offline_store.c)
+///
+/// @return GOLIOTH_OK - request appended
+/// @return GOLIOTH_ERR_MEM_ALLOC - payload too large for a record, queue the request instead
+/// @return Otherwise - request dropped
+golioth_status_t golioth_offline_store_divert(
+        golioth_offline_store_t store,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        const uint8_t* payload,
+        size_t payload_size);
+
+/// Let an offline store know the session is connected, so it sends its records
+void golioth_offline_store_wake(golioth_offline_store_t store);
+
+/// Same as golioth_coap_client_set, but the payload is read with a reader callback
+/// and uploaded in blocks (Block1) if it's larger than one block.
+golioth_status_t golioth_coap_client_set_from_reader(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        uint32_t content_type,
+        golioth_payload_reader_fn reader,
+        void* reader_arg,
+        size_t payload_size,
+        golioth_set_cb_fn callback,
+        void* callback_arg,
+        bool is_synchronous,
+        int32_t timeout_s);
+
 golioth_status_t golioth_coap_client_delete(
         golioth_client_t client,
         const char* path_prefix,
@@ -167,3 +311,10 @@ golioth_status_t golioth_coap_client_observe_async(
         uint32_t content_type,
         golioth_get_cb_fn callback,
         void* callback_arg);
+
+golioth_status_t golioth_coap_client_unobserve(
+        golioth_client_t client,
+        const char* path_prefix,
+        const char* path,
+        bool is_synchronous,
+        int32_t timeout_s);
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "golioth_status.h"
+
+// Hash table from CoAP token to a pointer, used by the client to find the pending
+// request or observation a received PDU belongs to, without scanning all of them.
+//
+// Open addressing with linear probing. Removal shifts the following entries back,
+// so there are no tombstones and lookups stay short. The table doubles in size when
+// it gets more than half full.
+//
+// Several values can share a token (e.g. all blocks of a Block2 transfer), so lookups
+// iterate over all values with a given token.
+//
+// Plain C with no RTOS dependencies. Not thread-safe, callers serialize access.
+
+/// Maximum length of a CoAP token
+#define GOLIOTH_COAP_TOKEN_MAX_LEN 8
+
+typedef struct {
+    void* value;
+    uint32_t hash;
+    uint8_t token[GOLIOTH_COAP_TOKEN_MAX_LEN];
+    uint8_t token_len;
+    bool in_use;
+} golioth_coap_token_entry_t;
+
+typedef struct {
+    golioth_coap_token_entry_t* entries;
+    /// Number of entries, a power of two
+    size_t capacity;
+    /// Number of entries in use
+    size_t count;
+} golioth_coap_token_index_t;
+
+/// Initialize an empty index, with room for at least num_values values before it grows
+///
+/// @return GOLIOTH_OK - index initialized
+/// @return GOLIOTH_ERR_MEM_ALLOC - failed to allocate the table
+golioth_status_t golioth_coap_token_index_init(
+        golioth_coap_token_index_t* index,
+        size_t num_values);
+
+/// Free the table of an index. Values are not freed.
+void golioth_coap_token_index_deinit(golioth_coap_token_index_t* index);
+
+/// Add a value, growing the table if needed
+///
+/// @return GOLIOTH_OK - value added
+/// @return GOLIOTH_ERR_INVALID_FORMAT - token longer than GOLIOTH_COAP_TOKEN_MAX_LEN
+/// @return GOLIOTH_ERR_MEM_ALLOC - failed to grow the table
+golioth_status_t golioth_coap_token_index_insert(
+        golioth_coap_token_index_t* index,
+        const uint8_t* token,
+        size_t token_len,
+        void* value);
+
+/// Remove a value added with the given token
+///
+/// @return true if the value was found and removed
+bool golioth_coap_token_index_remove(
+        golioth_coap_token_index_t* index,
+        const uint8_t* token,
+        size_t token_len,
+        const void* value);
+
+/// Find the values with a token, one at a time.
+///
+/// @param index The index
+/// @param token Token to look for
+/// @param token_len Length of token
+/// @param cursor In/out param. Set to 0 to find the first value, then pass it back
+///               unchanged to find the next one. Invalid once the index is modified.
+///
+/// @return The next value with the token, or NULL if there are no more
+void* golioth_coap_token_index_find_next(
+        const golioth_coap_token_index_t* index,
+        const uint8_t* token,
+        size_t token_len,
+        size_t* cursor);
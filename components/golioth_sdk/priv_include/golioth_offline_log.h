@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "golioth_status.h"
+#include "golioth_offline_store.h"
+
+// Append-only log of records over flash-like storage, used by the offline store.
+//
+// Plain C with no RTOS dependencies. Not thread-safe, callers serialize access.
+//
+// Sectors are filled in order and wrap around. A record never spans sectors, and the
+// space after the last record of a sector stays erased. Each record is:
+//
+//      header | path | payload
+//
+// Records are removed by clearing their state byte in place, which flash allows
+// without an erase. A sector is only erased when the log wraps around to it.
+// On open, the log is rebuilt by scanning the headers of all sectors.
+
+/// Kinds of records, i.e. what the record's path is relative to
+typedef enum {
+    /// LightDB stream (".s/" prefix)
+    GOLIOTH_OFFLINE_RECORD_STREAM,
+    /// Root of the device's resources (empty prefix), e.g. "logs"
+    GOLIOTH_OFFLINE_RECORD_ROOT,
+} golioth_offline_record_kind_t;
+
+/// A record read from the log
+typedef struct {
+    /// Offset and sequence number of the record, to remove it with golioth_offline_log_consume
+    size_t offset;
+    uint32_t seq;
+    golioth_offline_record_kind_t kind;
+    uint32_t content_type;
+    /// Unix time, in seconds, when the record was appended, or 0 if the time wasn't set
+    uint32_t timestamp_s;
+    char path[CONFIG_GOLIOTH_COAP_MAX_PATH_LEN + 1];
+    size_t payload_size;
+} golioth_offline_record_t;
+
+typedef struct {
+    golioth_offline_storage_t storage;
+    golioth_offline_overflow_t overflow;
+    /// Offset where the next record is written. When the log is full, this is the start
+    /// of the tail's sector, so head == tail doesn't mean the log is empty.
+    size_t head;
+    /// True if the sector of head has been erased for writing
+    bool head_sector_ready;
+    /// Offset of the oldest record not yet consumed, equal to head if there is none
+    size_t tail;
+    /// Offset of the next record for golioth_offline_log_read_next, between tail and head
+    size_t read_pos;
+    uint32_t next_seq;
+    /// Number of records not yet consumed
+    uint32_t num_records;
+    /// Number of records not yet consumed that golioth_offline_log_read_next hasn't
+    /// returned since the log was opened or rewound. Tells apart a read_pos at head with
+    /// the whole log ahead (full) from one with nothing ahead.
+    uint32_t num_unread;
+    /// Number of records lost to a full log, or to corruption
+    uint32_t num_dropped;
+} golioth_offline_log_t;
+
+/// Open the log, keeping the records already in storage
+golioth_status_t golioth_offline_log_open(
+        golioth_offline_log_t* log,
+        const golioth_offline_storage_t* storage,
+        golioth_offline_overflow_t overflow);
+
+/// Append a record
+///
+/// @return GOLIOTH_OK - record appended
+/// @return GOLIOTH_ERR_MEM_ALLOC - record is larger than a sector
+/// @return GOLIOTH_ERR_QUEUE_FULL - log is full, and overflow policy is to drop the new record
+/// @return GOLIOTH_ERR_IO - storage error
+golioth_status_t golioth_offline_log_append(
+        golioth_offline_log_t* log,
+        golioth_offline_record_kind_t kind,
+        uint32_t content_type,
+        uint32_t timestamp_s,
+        const char* path,
+        const uint8_t* payload,
+        size_t payload_size);
+
+/// Read the next record not yet consumed, starting at the oldest one, and move on to the
+/// record after it. Corrupt records are consumed and skipped.
+///
+/// @param log The log
+/// @param record Output param, populated with the record
+/// @param payload Output param, populated with the payload of the record
+/// @param payload_buf_size Size of payload. Larger records are consumed and skipped.
+///
+/// @return GOLIOTH_OK - record read
+/// @return GOLIOTH_ERR_NULL - no more records
+/// @return GOLIOTH_ERR_IO - storage error
+golioth_status_t golioth_offline_log_read_next(
+        golioth_offline_log_t* log,
+        golioth_offline_record_t* record,
+        uint8_t* payload,
+        size_t payload_buf_size);
+
+/// Start reading again from the oldest record not yet consumed
+void golioth_offline_log_rewind(golioth_offline_log_t* log);
+
+/// Remove a record read with golioth_offline_log_read_next. Does nothing if the record has
+/// already been consumed, or was dropped to make room for newer records.
+golioth_status_t golioth_offline_log_consume(
+        golioth_offline_log_t* log,
+        size_t offset,
+        uint32_t seq);
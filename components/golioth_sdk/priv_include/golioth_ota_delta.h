@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "golioth_status.h"
+
+/// Streaming binary patch (delta) applier for OTA updates.
+///
+/// A patch turns an old image (e.g. the running firmware) into a new image. It is
+/// applied in a single pass, as patch bytes arrive, without buffering the patch.
+/// The old image is read at arbitrary offsets through a callback, and the new image
+/// is written sequentially through another callback. RAM usage is fixed, at about
+/// 2 * GOLIOTH_OTA_DELTA_BUF_SIZE bytes.
+///
+/// The patch format is modelled on the detools "sequential" patch type, without
+/// compression. All integers are LEB128 varints, adjust is zigzag encoded:
+///
+///     magic      "GDF1"
+///     to_size    size of the new image, in bytes
+///     records, until to_size bytes have been produced:
+///         diff_len   number of diff bytes
+///         diff       new[i] = old[from_offset + i] + diff[i] (mod 256),
+///                    from_offset is advanced by diff_len
+///         extra_len  number of extra bytes
+///         extra      copied to the new image as-is
+///         adjust     signed value added to from_offset
+
+/// Size of the old image read buffer and the new image write buffer, in bytes.
+/// Also the size of writes to the new image (except the last one).
+#define GOLIOTH_OTA_DELTA_BUF_SIZE 512
+
+/// Read len bytes of the old image, starting at offset, into buf
+typedef golioth_status_t (
+        *golioth_ota_delta_read_fn)(size_t offset, uint8_t* buf, size_t len, void* arg);
+
+/// Write len bytes of the new image, starting at offset. Offsets are sequential.
+typedef golioth_status_t (
+        *golioth_ota_delta_write_fn)(size_t offset, const uint8_t* buf, size_t len, void* arg);
+
+typedef enum {
+    GOLIOTH_OTA_DELTA_STATE_MAGIC,
+    GOLIOTH_OTA_DELTA_STATE_TO_SIZE,
+    GOLIOTH_OTA_DELTA_STATE_DIFF_LEN,
+    GOLIOTH_OTA_DELTA_STATE_DIFF,
+    GOLIOTH_OTA_DELTA_STATE_EXTRA_LEN,
+    GOLIOTH_OTA_DELTA_STATE_EXTRA,
+    GOLIOTH_OTA_DELTA_STATE_ADJUST,
+    GOLIOTH_OTA_DELTA_STATE_DONE,
+} golioth_ota_delta_state_t;
+
+/// State of a patch being applied. Treat as opaque.
+typedef struct {
+    golioth_ota_delta_state_t state;
+    golioth_ota_delta_read_fn read;
+    golioth_ota_delta_write_fn write;
+    void* arg;
+    /// Varint being decoded, and its bit position
+    uint64_t varint;
+    uint32_t varint_shift;
+    /// Bytes of magic received so far
+    size_t magic_len;
+    /// Size of the new image
+    size_t to_size;
+    /// Bytes of the new image written (flushed) so far
+    size_t to_written;
+    /// Offset in the old image for the next diff byte
+    int64_t from_offset;
+    /// Bytes left in the current diff or extra record
+    size_t record_remaining;
+    uint8_t from_buf[GOLIOTH_OTA_DELTA_BUF_SIZE];
+    uint8_t to_buf[GOLIOTH_OTA_DELTA_BUF_SIZE];
+    size_t to_buf_len;
+} golioth_ota_delta_t;
+
+/// Prepare to apply a new patch
+void golioth_ota_delta_init(
+        golioth_ota_delta_t* delta,
+        golioth_ota_delta_read_fn read,
+        golioth_ota_delta_write_fn write,
+        void* arg);
+
+/// Apply the next len bytes of the patch
+///
+/// @return GOLIOTH_OK - patch bytes applied
+/// @return GOLIOTH_ERR_INVALID_FORMAT - malformed patch
+/// @return Otherwise - status returned by the read or write callback
+golioth_status_t golioth_ota_delta_apply(
+        golioth_ota_delta_t* delta,
+        const uint8_t* patch,
+        size_t len);
+
+/// Write out anything still buffered, after the whole patch has been applied
+///
+/// @return GOLIOTH_OK - the new image is complete
+/// @return GOLIOTH_ERR_INVALID_FORMAT - patch ended before the new image was complete
+/// @return Otherwise - status returned by the write callback
+golioth_status_t golioth_ota_delta_finish(golioth_ota_delta_t* delta);
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2022 Golioth, Inc.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "golioth_status.h"
+#include "sdkconfig.h"
+
+/// Streaming heatshrink decoder for compressed OTA artifacts.
+///
+/// Decodes the output of the heatshrink compressor (LZSS, no header), as compressed
+/// bytes arrive, without buffering the compressed artifact. RAM usage is fixed, at
+/// 2^CONFIG_GOLIOTH_OTA_HEATSHRINK_WINDOW_SZ2 bytes of window plus
+/// GOLIOTH_OTA_HEATSHRINK_BUF_SIZE bytes of output buffer.
+///
+/// The bitstream is read MSB first. Each symbol starts with a tag bit:
+///
+///     1, 8 bits         literal byte
+///     0, W bits, L bits backref: copy (L bits + 1) bytes, starting
+///                       (W bits + 1) bytes back in the output
+///
+/// where W and L are the window and lookahead sizes (log2) from Kconfig. As in the
+/// reference decoder, the window starts out zero-filled.
+
+/// Size of the output buffer, in bytes.
+/// Also the size of writes of decompressed data (except the last one).
+#define GOLIOTH_OTA_HEATSHRINK_BUF_SIZE 512
+
+#define GOLIOTH_OTA_HEATSHRINK_WINDOW_SIZE (1 << CONFIG_GOLIOTH_OTA_HEATSHRINK_WINDOW_SZ2)
+
+/// Write len bytes of decompressed data, starting at offset. Offsets are sequential.
+typedef golioth_status_t (
+        *golioth_ota_heatshrink_write_fn)(size_t offset, const uint8_t* buf, size_t len, void* arg);
+
+typedef enum {
+    GOLIOTH_OTA_HEATSHRINK_STATE_TAG,
+    GOLIOTH_OTA_HEATSHRINK_STATE_LITERAL,
+    GOLIOTH_OTA_HEATSHRINK_STATE_INDEX,
+    GOLIOTH_OTA_HEATSHRINK_STATE_COUNT,
+} golioth_ota_heatshrink_state_t;
+
+/// State of a decompression in progress. Treat as opaque.
+typedef struct {
+    golioth_ota_heatshrink_state_t state;
+    golioth_ota_heatshrink_write_fn write;
+    void* arg;
+    /// Bits of the field being decoded, and how many are still needed
+    uint32_t bits;
+    uint32_t bits_needed;
+    /// Backref offset, once its index field has been decoded
+    uint32_t backref_offset;
+    /// Total number of bytes decompressed so far
+    size_t out_total;
+    /// Bytes of decompressed data written (flushed) so far
+    size_t out_written;
+    uint8_t window[GOLIOTH_OTA_HEATSHRINK_WINDOW_SIZE];
+    uint8_t out_buf[GOLIOTH_OTA_HEATSHRINK_BUF_SIZE];
+    size_t out_buf_len;
+} golioth_ota_heatshrink_t;
+
+/// Prepare to decompress a new artifact
+void golioth_ota_heatshrink_init(
+        golioth_ota_heatshrink_t* hs,
+        golioth_ota_heatshrink_write_fn write,
+        void* arg);
+
+/// Decompress the next len bytes of compressed data
+///
+/// @return GOLIOTH_OK - compressed bytes decoded
+/// @return Otherwise - status returned by the write callback
+golioth_status_t golioth_ota_heatshrink_decode(
+        golioth_ota_heatshrink_t* hs,
+        const uint8_t* data,
+        size_t len);
+
+/// Write out anything still buffered, after all compressed data has been decoded
+///
+/// Any bits left over from a partial symbol are treated as padding.
+///
+/// @return GOLIOTH_OK - decompression complete
+/// @return Otherwise - status returned by the write callback
+golioth_status_t golioth_ota_heatshrink_finish(golioth_ota_heatshrink_t* hs);
@@ -5,6 +5,9 @@
  */
 #pragma once
 
+// System time is considered set once it's past this (Unix time, in seconds)
+#define GOLIOTH_MIN_VALID_TIME_S 1600000000
+
 #ifndef min
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #endif
@@ -16,6 +16,8 @@
 #include "shell.h"
 #include "util.h"
 #include "golioth.h"
+#include "golioth_ota_delta.h"
+#include "golioth_ota_heatshrink.h"
 
 #define TAG "test"
 
@@ -28,6 +30,8 @@ static SemaphoreHandle_t _connected_sem;
 static SemaphoreHandle_t _disconnected_sem;
 static golioth_client_t _client;
 static uint32_t _initial_free_heap;
+// Heap taken by golioth_client_create (the client object, its queues and task)
+static int32_t _client_create_heap_usage;
 static bool _wifi_connected;
 
 // Note: Don't put TEST_ASSERT_* statements in client callback functions, as this
@@ -69,7 +73,9 @@ static void test_golioth_client_create(void) {
                                 .psk = psk,
                                 .psk_len = strlen(psk),
                         }}};
+        uint32_t free_heap_before = esp_get_free_heap_size();
         _client = golioth_client_create(&config);
+        _client_create_heap_usage = free_heap_before - esp_get_free_heap_size();
 
         TEST_ASSERT_NOT_NULL(_client);
         golioth_client_register_event_callback(_client, on_client_event, NULL);
@@ -89,6 +95,13 @@ static void test_golioth_client_heap_usage(void) {
     TEST_ASSERT_TRUE(golioth_heap_usage < 50000);
 }
 
+static void test_golioth_client_create_heap_usage(void) {
+    // Measured when the client was created, before any session or request
+    ESP_LOGI(TAG, "Heap usage by golioth_client_create = %d", _client_create_heap_usage);
+    TEST_ASSERT_TRUE(_client_create_heap_usage > 0);
+    TEST_ASSERT_TRUE(_client_create_heap_usage < 50000);
+}
+
 static void test_request_dropped_if_client_not_running(void) {
     TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_client_stop(_client));
     TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(_disconnected_sem, 3000 / portTICK_PERIOD_MS));
@@ -118,6 +131,24 @@ static void test_request_dropped_if_client_not_running(void) {
             xSemaphoreTake(_connected_sem, TEST_RESPONSE_TIMEOUT_S * 1000 / portTICK_PERIOD_MS));
 }
 
+// Runs after the client has reconnected at least once
+static void test_connection_stats(void) {
+    golioth_client_connection_stats_t stats = {};
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_client_get_connection_stats(_client, &stats));
+    TEST_ASSERT_TRUE(stats.num_sessions >= 2);
+    TEST_ASSERT_TRUE(stats.num_handshakes >= 2);
+    TEST_ASSERT_TRUE(stats.min_handshake_ms <= stats.last_handshake_ms);
+    TEST_ASSERT_TRUE(stats.last_handshake_ms <= stats.max_handshake_ms);
+    TEST_ASSERT_TRUE(stats.last_handshake_ms <= stats.last_connect_ms);
+    ESP_LOGI(
+            TAG,
+            "%u handshakes, last %u ms, mean %u ms, max %u ms",
+            stats.num_handshakes,
+            stats.last_handshake_ms,
+            (uint32_t)(stats.total_handshake_ms / stats.num_handshakes),
+            stats.max_handshake_ms);
+}
+
 static void test_lightdb_set_get_sync(void) {
     int randint = esp_random();
     ESP_LOGD(TAG, "randint = %d", randint);
@@ -141,6 +172,37 @@ static void test_lightdb_set_get_sync(void) {
     TEST_ASSERT_EQUAL(randint, get_randint);
 }
 
+static void test_lightdb_set_get_cbor_sync(void) {
+    golioth_lightdb_set_encoding(_client, GOLIOTH_LIGHTDB_ENCODING_CBOR);
+
+    int randint = esp_random();
+    const char* str = "cbor string";
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_set_int_sync(
+                    _client, "test_cbor_int", randint, TEST_RESPONSE_TIMEOUT_S));
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_set_string_sync(
+                    _client, "test_cbor_str", str, strlen(str), TEST_RESPONSE_TIMEOUT_S));
+    golioth_time_delay_ms(200);
+
+    int32_t get_randint = 0;
+    char get_str[32] = {};
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_get_int_sync(
+                    _client, "test_cbor_int", &get_randint, TEST_RESPONSE_TIMEOUT_S));
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_get_string_sync(
+                    _client, "test_cbor_str", get_str, sizeof(get_str), TEST_RESPONSE_TIMEOUT_S));
+    golioth_lightdb_set_encoding(_client, GOLIOTH_LIGHTDB_ENCODING_JSON);
+
+    TEST_ASSERT_EQUAL(randint, get_randint);
+    TEST_ASSERT_EQUAL_STRING(str, get_str);
+}
+
 static bool _on_get_test_int2_called = false;
 static int32_t _test_int2_value = 0;
 static void on_get_test_int2(
@@ -167,6 +229,75 @@ static void on_set_test_int2(
     _on_set_test_int2_called = true;
 }
 
+// Generates {"data":"AAAA...A"}, json_size bytes long, without holding it in memory
+static golioth_status_t read_large_json(size_t offset, uint8_t* buf, size_t len, void* arg) {
+    static const char prefix[] = "{\"data\":\"";
+    static const char suffix[] = "\"}";
+    size_t json_size = *(size_t*)arg;
+    size_t suffix_start = json_size - strlen(suffix);
+    for (size_t i = 0; i < len; i++) {
+        size_t pos = offset + i;
+        if (pos < strlen(prefix)) {
+            buf[i] = prefix[pos];
+        } else if (pos >= suffix_start) {
+            buf[i] = suffix[pos - suffix_start];
+        } else {
+            buf[i] = 'A';
+        }
+    }
+    return GOLIOTH_OK;
+}
+
+static void test_lightdb_set_json_reader_sync(void) {
+    // Several Block1 blocks
+    size_t json_size = 3000;
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_set_json_reader_sync(
+                    _client,
+                    "test_large_json",
+                    read_large_json,
+                    &json_size,
+                    json_size,
+                    TEST_RESPONSE_TIMEOUT_S));
+}
+
+static void test_lightdb_set_json_owned_async(void) {
+    // Hand over every buffer in the pool
+    for (int i = 0; i < CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS; i++) {
+        char* buf = golioth_client_payload_alloc(_client);
+        TEST_ASSERT_NOT_NULL(buf);
+        int len = snprintf(buf, CONFIG_GOLIOTH_PAYLOAD_POOL_BUF_SIZE, "{\"i\":%d}", i);
+        TEST_ASSERT_EQUAL(
+                GOLIOTH_OK,
+                golioth_lightdb_set_json_owned_async(
+                        _client,
+                        "test_owned_json",
+                        buf,
+                        len,
+                        golioth_client_payload_release,
+                        _client,
+                        NULL,
+                        NULL));
+    }
+    TEST_ASSERT_NULL(golioth_client_payload_alloc(_client));
+
+    // Requests are handled in order, so once this one completes, the buffers
+    // of the ones before it have been released back to the pool
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_set_int_sync(_client, "test_int", 1, TEST_RESPONSE_TIMEOUT_S));
+
+    void* bufs[CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS] = {};
+    for (int i = 0; i < CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS; i++) {
+        bufs[i] = golioth_client_payload_alloc(_client);
+        TEST_ASSERT_NOT_NULL(bufs[i]);
+    }
+    for (int i = 0; i < CONFIG_GOLIOTH_PAYLOAD_POOL_NUM_BUFS; i++) {
+        golioth_client_payload_release(bufs[i], _client);
+    }
+}
+
 static void test_lightdb_set_get_async(void) {
     _on_set_test_int2_called = false;
     _on_get_test_int2_called = false;
@@ -218,6 +349,589 @@ static void test_lightdb_set_get_async(void) {
     TEST_ASSERT_EQUAL(randint, _test_int2_value);
 }
 
+static int _num_set_many_ok = 0;
+static void on_set_many(
+        golioth_client_t client,
+        const golioth_response_t* response,
+        const char* path,
+        void* arg) {
+    if (response->status == GOLIOTH_OK) {
+        _num_set_many_ok++;
+    }
+}
+
+static void test_lightdb_set_many_async(void) {
+    // Enqueue more requests than can be in flight at once, to verify
+    // responses are matched to the right requests when pipelined.
+    const int num_requests = CONFIG_GOLIOTH_COAP_MAX_PENDING_REQUESTS + 2;
+    _num_set_many_ok = 0;
+
+    for (int i = 0; i < num_requests; i++) {
+        TEST_ASSERT_EQUAL(
+                GOLIOTH_OK,
+                golioth_lightdb_set_int_async(_client, "test_int4", i, on_set_many, NULL));
+    }
+
+    uint64_t timeout_ms = golioth_time_millis() + TEST_RESPONSE_TIMEOUT_S * 1000;
+    while (golioth_time_millis() < timeout_ms) {
+        if (_num_set_many_ok == num_requests) {
+            break;
+        }
+        golioth_time_delay_ms(100);
+    }
+    TEST_ASSERT_EQUAL(num_requests, _num_set_many_ok);
+}
+
+static int _num_coalesced_ok = 0;
+static int _num_coalesced_superseded = 0;
+static void on_set_coalesced(
+        golioth_client_t client,
+        const golioth_response_t* response,
+        const char* path,
+        void* arg) {
+    if (response->status == GOLIOTH_OK) {
+        _num_coalesced_ok++;
+    } else if (response->status == GOLIOTH_ERR_SUPERSEDED) {
+        _num_coalesced_superseded++;
+    }
+}
+
+static void test_lightdb_set_coalesced_async(void) {
+    const int num_requests = 20;
+    _num_coalesced_ok = 0;
+    _num_coalesced_superseded = 0;
+
+    golioth_client_set_coalesce_state_writes(_client, true);
+    for (int i = 0; i < num_requests; i++) {
+        TEST_ASSERT_EQUAL(
+                GOLIOTH_OK,
+                golioth_lightdb_set_int_async(_client, "test_int6", i, on_set_coalesced, NULL));
+    }
+    golioth_client_set_coalesce_state_writes(_client, false);
+
+    // Every write either completes or is superseded, and the last one always completes
+    uint64_t timeout_ms = golioth_time_millis() + TEST_RESPONSE_TIMEOUT_S * 1000;
+    while (golioth_time_millis() < timeout_ms) {
+        if (_num_coalesced_ok + _num_coalesced_superseded == num_requests) {
+            break;
+        }
+        golioth_time_delay_ms(100);
+    }
+    TEST_ASSERT_EQUAL(num_requests, _num_coalesced_ok + _num_coalesced_superseded);
+    TEST_ASSERT_TRUE(_num_coalesced_superseded > 0);
+
+    golioth_time_delay_ms(200);
+    int32_t value = 0;
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_get_int_sync(_client, "test_int6", &value, TEST_RESPONSE_TIMEOUT_S));
+    TEST_ASSERT_EQUAL(num_requests - 1, value);
+}
+
+static void test_request_lane_stats(void) {
+    golioth_request_lane_stats_t before = {};
+    golioth_request_lane_stats_t after = {};
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_client_get_request_lane_stats(_client, GOLIOTH_REQUEST_LANE_STATE, &before));
+    TEST_ASSERT_EQUAL(CONFIG_GOLIOTH_COAP_REQUEST_QUEUE_MAX_ITEMS, before.capacity);
+
+    // LightDB state requests go in the state lane
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_set_int_sync(_client, "test_int5", 5, TEST_RESPONSE_TIMEOUT_S));
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_client_get_request_lane_stats(_client, GOLIOTH_REQUEST_LANE_STATE, &after));
+    TEST_ASSERT_EQUAL(before.num_sent + 1, after.num_sent);
+    TEST_ASSERT_EQUAL(0, after.depth);
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_ERR_INVALID_FORMAT,
+            golioth_client_get_request_lane_stats(_client, GOLIOTH_REQUEST_LANE_NUM, &after));
+}
+
+static int _num_stream_ok = 0;
+static int _num_stream_responses = 0;
+static void on_stream_set(
+        golioth_client_t client,
+        const golioth_response_t* response,
+        const char* path,
+        void* arg) {
+    if (response->status == GOLIOTH_OK) {
+        _num_stream_ok++;
+    }
+    _num_stream_responses++;
+}
+
+static bool wait_for_stream_responses(int num_responses) {
+    uint64_t timeout_ms = golioth_time_millis() + 3 * TEST_RESPONSE_TIMEOUT_S * 1000;
+    while (golioth_time_millis() < timeout_ms) {
+        if (_num_stream_responses >= num_responses) {
+            return true;
+        }
+        golioth_time_delay_ms(10);
+    }
+    return false;
+}
+
+// Compares sending stream records one per request with sending them in batches
+static void test_lightdb_stream_batch(void) {
+    const int num_records = 32;
+
+    _num_stream_ok = 0;
+    _num_stream_responses = 0;
+    uint64_t start_ms = golioth_time_millis();
+    for (int i = 0; i < num_records; i++) {
+        while (golioth_lightdb_stream_set_int_async(_client, "batch/i", i, on_stream_set, NULL)
+               == GOLIOTH_ERR_QUEUE_FULL) {
+            golioth_time_delay_ms(10);
+        }
+    }
+    TEST_ASSERT_TRUE(wait_for_stream_responses(num_records));
+    TEST_ASSERT_EQUAL(num_records, _num_stream_ok);
+    uint32_t unbatched_ms = golioth_time_millis() - start_ms + 1;
+
+    golioth_stream_batch_config_t config = {
+            .max_age_ms = 1000,
+            .add_timestamp = true,
+            .callback = on_stream_set,
+    };
+    golioth_stream_batch_t batch = golioth_stream_batch_create(_client, &config);
+    TEST_ASSERT_NOT_NULL(batch);
+
+    _num_stream_ok = 0;
+    _num_stream_responses = 0;
+    start_ms = golioth_time_millis();
+    for (int i = 0; i < num_records; i++) {
+        TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_stream_batch_add_int(batch, "batch/i", i));
+    }
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_stream_batch_flush(batch));
+
+    golioth_stream_batch_stats_t stats = {};
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_stream_batch_get_stats(batch, &stats));
+    TEST_ASSERT_EQUAL(num_records, stats.num_records);
+    TEST_ASSERT_EQUAL(0, stats.num_dropped);
+    TEST_ASSERT_TRUE(stats.num_batches < num_records);
+
+    TEST_ASSERT_TRUE(wait_for_stream_responses(stats.num_batches));
+    TEST_ASSERT_EQUAL(stats.num_batches, _num_stream_ok);
+    uint32_t batched_ms = golioth_time_millis() - start_ms + 1;
+    golioth_stream_batch_destroy(batch);
+
+    ESP_LOGI(
+            TAG,
+            "Unbatched: %d requests, %u records/s. Batched: %u requests, %u bytes, %u records/s",
+            num_records,
+            num_records * 1000 / unbatched_ms,
+            stats.num_batches,
+            stats.num_bytes,
+            num_records * 1000 / batched_ms);
+}
+
+// Flash simulated in RAM, for the offline store
+#define TEST_OFFLINE_SECTOR_SIZE 512
+static uint8_t _offline_flash[4 * TEST_OFFLINE_SECTOR_SIZE];
+
+static golioth_status_t offline_flash_read(void* ctx, size_t offset, void* buf, size_t len) {
+    memcpy(buf, &_offline_flash[offset], len);
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t offline_flash_write(
+        void* ctx,
+        size_t offset,
+        const void* buf,
+        size_t len) {
+    // Like flash, writes can only clear bits
+    const uint8_t* src = (const uint8_t*)buf;
+    for (size_t i = 0; i < len; i++) {
+        _offline_flash[offset + i] &= src[i];
+    }
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t offline_flash_erase(void* ctx, size_t offset, size_t len) {
+    memset(&_offline_flash[offset], 0xFF, len);
+    return GOLIOTH_OK;
+}
+
+// RAM stand-ins for the running and update partitions, for OTA tests. The update
+// partition has room for more than a heatshrink window of decompressed data.
+#define TEST_OTA_IMAGE_SIZE 1024
+#define TEST_HEATSHRINK_COUNT_MAX (1 << CONFIG_GOLIOTH_OTA_HEATSHRINK_LOOKAHEAD_SZ2)
+#define TEST_OTA_UPDATE_SIZE \
+    (GOLIOTH_OTA_HEATSHRINK_WINDOW_SIZE + 4 * TEST_HEATSHRINK_COUNT_MAX + TEST_OTA_IMAGE_SIZE)
+static uint8_t _ota_running[TEST_OTA_IMAGE_SIZE];
+static uint8_t _ota_update[TEST_OTA_UPDATE_SIZE];
+static size_t _ota_update_len;
+
+static void ota_update_erase(void) {
+    memset(_ota_update, 0xFF, sizeof(_ota_update));
+    _ota_update_len = 0;
+}
+
+static golioth_status_t ota_running_read(size_t offset, uint8_t* buf, size_t len, void* arg) {
+    if (offset + len > sizeof(_ota_running)) {
+        return GOLIOTH_ERR_FAIL;
+    }
+    memcpy(buf, &_ota_running[offset], len);
+    return GOLIOTH_OK;
+}
+
+static golioth_status_t ota_update_write(
+        size_t offset,
+        const uint8_t* buf,
+        size_t len,
+        void* arg) {
+    // The image is written in order, and like flash, writes can only clear bits
+    if (offset != _ota_update_len || offset + len > sizeof(_ota_update)) {
+        return GOLIOTH_ERR_FAIL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        _ota_update[offset + i] &= buf[i];
+    }
+    _ota_update_len += len;
+    return GOLIOTH_OK;
+}
+
+static size_t patch_add_varint(uint8_t* patch, size_t len, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        patch[len++] = (value ? byte | 0x80 : byte);
+    } while (value);
+    return len;
+}
+
+// Add a diff record of diff_len bytes: diff, diff + step, diff + 2 * step, ...
+static size_t patch_add_diff(
+        uint8_t* patch,
+        size_t len,
+        size_t diff_len,
+        uint8_t diff,
+        uint8_t step) {
+    len = patch_add_varint(patch, len, diff_len);
+    for (size_t i = 0; i < diff_len; i++) {
+        patch[len++] = (uint8_t)(diff + i * step);
+    }
+    return len;
+}
+
+// New image of the patch built by test_ota_delta_apply
+static uint8_t ota_delta_expected(size_t i) {
+    if (i < 300) {
+        return _ota_running[i] + i;
+    }
+    if (i < 305) {
+        return "hello"[i - 300];
+    }
+    if (i < 705) {
+        return _ota_running[600 + i - 305];
+    }
+    return _ota_running[i - 705] - 1;
+}
+
+static void test_ota_delta_apply(void) {
+    static golioth_ota_delta_t delta;
+    static uint8_t patch[TEST_OTA_IMAGE_SIZE + 64];
+
+    for (size_t i = 0; i < sizeof(_ota_running); i++) {
+        _ota_running[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    // A 1000 byte image, in three records. Larger than GOLIOTH_OTA_DELTA_BUF_SIZE,
+    // so it's written in more than one go.
+    size_t len = 0;
+    memcpy(patch, "GDF1", 4);
+    len = patch_add_varint(patch, 4, 1000);
+    // Running image bytes 0-299 plus 0, 1, 2, ..., then "hello", then skip 300 bytes
+    len = patch_add_diff(patch, len, 300, 0, 1);
+    len = patch_add_varint(patch, len, 5);
+    memcpy(&patch[len], "hello", 5);
+    len += 5;
+    len = patch_add_varint(patch, len, 300 << 1);
+    // Running image bytes 600-999 as they are, then back to the start (zigzag -1000)
+    len = patch_add_diff(patch, len, 400, 0, 0);
+    len = patch_add_varint(patch, len, 0);
+    len = patch_add_varint(patch, len, (1000 << 1) - 1);
+    // Running image bytes 0-294 minus 1
+    len = patch_add_diff(patch, len, 295, 0xFF, 0);
+    len = patch_add_varint(patch, len, 0);
+    len = patch_add_varint(patch, len, 0);
+
+    // Applied a few bytes at a time, so varints and records are split across calls
+    ota_update_erase();
+    golioth_ota_delta_init(&delta, ota_running_read, ota_update_write, NULL);
+    for (size_t i = 0; i < len; i += 7) {
+        size_t chunk_len = (len - i < 7 ? len - i : 7);
+        TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_ota_delta_apply(&delta, &patch[i], chunk_len));
+    }
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_ota_delta_finish(&delta));
+    TEST_ASSERT_EQUAL(1000, _ota_update_len);
+    for (size_t i = 0; i < 1000; i++) {
+        TEST_ASSERT_EQUAL_HEX8(ota_delta_expected(i), _ota_update[i]);
+    }
+
+    // A patch that ends early doesn't complete the image
+    ota_update_erase();
+    golioth_ota_delta_init(&delta, ota_running_read, ota_update_write, NULL);
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_ota_delta_apply(&delta, patch, len - 10));
+    TEST_ASSERT_EQUAL(GOLIOTH_ERR_INVALID_FORMAT, golioth_ota_delta_finish(&delta));
+
+    // A record can't produce more than the size of the new image
+    len = patch_add_varint(patch, 4, 10);
+    len = patch_add_varint(patch, len, 20);
+    golioth_ota_delta_init(&delta, ota_running_read, ota_update_write, NULL);
+    TEST_ASSERT_EQUAL(GOLIOTH_ERR_INVALID_FORMAT, golioth_ota_delta_apply(&delta, patch, len));
+}
+
+// A heatshrink stream built by test_ota_heatshrink_decode, and what it decompresses to
+static uint8_t _heatshrink_stream[2 * TEST_OTA_UPDATE_SIZE];
+static size_t _heatshrink_stream_bits;
+static uint8_t _heatshrink_expected[TEST_OTA_UPDATE_SIZE];
+static size_t _heatshrink_expected_len;
+
+static void heatshrink_put_bits(uint32_t value, int num_bits) {
+    for (int i = num_bits - 1; i >= 0; i--) {
+        size_t byte = _heatshrink_stream_bits / 8;
+        uint8_t mask = 0x80 >> (_heatshrink_stream_bits % 8);
+        if ((value >> i) & 1) {
+            _heatshrink_stream[byte] |= mask;
+        } else {
+            _heatshrink_stream[byte] &= ~mask;
+        }
+        _heatshrink_stream_bits++;
+    }
+}
+
+static void heatshrink_put_literal(uint8_t byte) {
+    heatshrink_put_bits(1, 1);
+    heatshrink_put_bits(byte, 8);
+    _heatshrink_expected[_heatshrink_expected_len++] = byte;
+}
+
+// Copy count bytes from offset bytes back. Before the start of the output, the window
+// is zero-filled.
+static void heatshrink_put_backref(size_t offset, size_t count) {
+    heatshrink_put_bits(0, 1);
+    heatshrink_put_bits(offset - 1, CONFIG_GOLIOTH_OTA_HEATSHRINK_WINDOW_SZ2);
+    heatshrink_put_bits(count - 1, CONFIG_GOLIOTH_OTA_HEATSHRINK_LOOKAHEAD_SZ2);
+    for (size_t i = 0; i < count; i++) {
+        size_t n = _heatshrink_expected_len;
+        _heatshrink_expected[n] = (n >= offset ? _heatshrink_expected[n - offset] : 0);
+        _heatshrink_expected_len++;
+    }
+}
+
+static void test_ota_heatshrink_decode(void) {
+    static golioth_ota_heatshrink_t hs;
+
+    // A stream with the window and lookahead sizes from Kconfig
+    _heatshrink_stream_bits = 0;
+    _heatshrink_expected_len = 0;
+    heatshrink_put_backref(1, 4);
+    for (const char* c = "golioth "; *c; c++) {
+        heatshrink_put_literal(*c);
+    }
+    // Longer than its offset, so it copies bytes it produces
+    heatshrink_put_backref(8, TEST_HEATSHRINK_COUNT_MAX);
+    for (int i = 0; i < 600; i++) {
+        heatshrink_put_literal(i * 13 + 1);
+    }
+    while (_heatshrink_expected_len < GOLIOTH_OTA_HEATSHRINK_WINDOW_SIZE + 100) {
+        size_t offset = (GOLIOTH_OTA_HEATSHRINK_WINDOW_SIZE < 300
+                                 ? GOLIOTH_OTA_HEATSHRINK_WINDOW_SIZE
+                                 : 300);
+        heatshrink_put_backref(offset, TEST_HEATSHRINK_COUNT_MAX);
+    }
+    // As far back as the window goes, once it wrapped around
+    heatshrink_put_backref(GOLIOTH_OTA_HEATSHRINK_WINDOW_SIZE, TEST_HEATSHRINK_COUNT_MAX);
+    heatshrink_put_literal(0x00);
+    heatshrink_put_literal(0xFF);
+    // Padding to a whole byte
+    heatshrink_put_bits(0, (8 - _heatshrink_stream_bits % 8) % 8);
+    size_t stream_len = _heatshrink_stream_bits / 8;
+
+    // Decoded a few bytes at a time, so symbols are split across calls
+    ota_update_erase();
+    golioth_ota_heatshrink_init(&hs, ota_update_write, NULL);
+    for (size_t i = 0; i < stream_len; i += 5) {
+        size_t chunk_len = (stream_len - i < 5 ? stream_len - i : 5);
+        TEST_ASSERT_EQUAL(
+                GOLIOTH_OK,
+                golioth_ota_heatshrink_decode(&hs, &_heatshrink_stream[i], chunk_len));
+    }
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_ota_heatshrink_finish(&hs));
+    TEST_ASSERT_EQUAL(_heatshrink_expected_len, _ota_update_len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(_heatshrink_expected, _ota_update, _heatshrink_expected_len);
+}
+
+static void test_lightdb_stream_non_confirmable(void) {
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_ERR_INVALID_FORMAT,
+            golioth_client_set_lane_non_confirmable(_client, GOLIOTH_REQUEST_LANE_STATE, true));
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_client_set_lane_non_confirmable(_client, GOLIOTH_REQUEST_LANE_TELEMETRY, true));
+
+    golioth_request_lane_stats_t before = {};
+    golioth_request_lane_stats_t after = {};
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_client_get_request_lane_stats(
+                    _client, GOLIOTH_REQUEST_LANE_TELEMETRY, &before));
+
+    // A burst of twice the NON burst size: the first half is sent right away, and the
+    // rest is paced at the NON rate instead of being dropped
+    const int num_requests = 2 * CONFIG_GOLIOTH_COAP_NON_BURST;
+    _num_stream_ok = 0;
+    _num_stream_responses = 0;
+    uint64_t start_ms = golioth_time_millis();
+    for (int i = 0; i < num_requests; i++) {
+        while (golioth_lightdb_stream_set_int_async(_client, "non", i, on_stream_set, NULL)
+               == GOLIOTH_ERR_QUEUE_FULL) {
+            golioth_time_delay_ms(10);
+        }
+    }
+    TEST_ASSERT_TRUE(wait_for_stream_responses(num_requests));
+    uint64_t elapsed_ms = golioth_time_millis() - start_ms;
+    TEST_ASSERT_EQUAL(num_requests, _num_stream_ok);
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_client_get_request_lane_stats(
+                    _client, GOLIOTH_REQUEST_LANE_TELEMETRY, &after));
+    TEST_ASSERT_EQUAL(num_requests, after.num_sent - before.num_sent);
+    TEST_ASSERT_TRUE(after.num_rate_limited > before.num_rate_limited);
+    TEST_ASSERT_TRUE(
+            elapsed_ms
+            >= (uint64_t)(CONFIG_GOLIOTH_COAP_NON_BURST - 1) * 1000
+                    / CONFIG_GOLIOTH_COAP_NON_RATE_PER_S);
+
+    // Synchronous requests are still confirmed
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_stream_set_int_sync(_client, "non", 0, TEST_RESPONSE_TIMEOUT_S));
+
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_client_set_lane_non_confirmable(
+                    _client, GOLIOTH_REQUEST_LANE_TELEMETRY, false));
+}
+
+static void test_offline_store(void) {
+    const int num_records = 8;
+
+    memset(_offline_flash, 0xFF, sizeof(_offline_flash));
+    golioth_offline_store_config_t config = {
+            .storage =
+                    {
+                            .read = offline_flash_read,
+                            .write = offline_flash_write,
+                            .erase = offline_flash_erase,
+                            .size = sizeof(_offline_flash),
+                            .sector_size = TEST_OFFLINE_SECTOR_SIZE,
+                    },
+            .overflow = GOLIOTH_OFFLINE_OVERFLOW_DROP_OLDEST,
+    };
+    golioth_offline_store_t store = golioth_offline_store_create(_client, &config);
+    TEST_ASSERT_NOT_NULL(store);
+
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_client_stop(_client));
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(_disconnected_sem, 3000 / portTICK_PERIOD_MS));
+
+    // Records made while offline go to the store
+    for (int i = 0; i < num_records; i++) {
+        TEST_ASSERT_EQUAL(
+                GOLIOTH_OK,
+                golioth_lightdb_stream_set_int_async(_client, "offline/i", i, NULL, NULL));
+    }
+    golioth_offline_store_stats_t stats = {};
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_offline_store_get_stats(store, &stats));
+    TEST_ASSERT_EQUAL(num_records, stats.num_stored);
+    TEST_ASSERT_EQUAL(num_records, stats.num_appended);
+
+    // And are sent once connected
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_client_start(_client));
+    TEST_ASSERT_EQUAL(
+            pdTRUE,
+            xSemaphoreTake(_connected_sem, TEST_RESPONSE_TIMEOUT_S * 1000 / portTICK_PERIOD_MS));
+    uint64_t timeout_ms = golioth_time_millis() + 3 * TEST_RESPONSE_TIMEOUT_S * 1000;
+    while (golioth_time_millis() < timeout_ms) {
+        golioth_offline_store_get_stats(store, &stats);
+        if (stats.num_stored == 0) {
+            break;
+        }
+        golioth_time_delay_ms(100);
+    }
+    TEST_ASSERT_EQUAL(0, stats.num_stored);
+    TEST_ASSERT_EQUAL(num_records, stats.num_sent);
+    TEST_ASSERT_EQUAL(0, stats.num_dropped);
+
+    golioth_offline_store_destroy(store);
+}
+
+// Fill the store well past its capacity while offline, so the log wraps and overflows,
+// then check that everything still stored is sent once connected
+static void check_offline_store_overflow(golioth_offline_overflow_t overflow) {
+    const int num_records = 200;
+
+    memset(_offline_flash, 0xFF, sizeof(_offline_flash));
+    golioth_offline_store_config_t config = {
+            .storage =
+                    {
+                            .read = offline_flash_read,
+                            .write = offline_flash_write,
+                            .erase = offline_flash_erase,
+                            .size = sizeof(_offline_flash),
+                            .sector_size = TEST_OFFLINE_SECTOR_SIZE,
+                    },
+            .overflow = overflow,
+    };
+    golioth_offline_store_t store = golioth_offline_store_create(_client, &config);
+    TEST_ASSERT_NOT_NULL(store);
+
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_client_stop(_client));
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(_disconnected_sem, 3000 / portTICK_PERIOD_MS));
+
+    for (int i = 0; i < num_records; i++) {
+        // Fails once the store is full, with DROP_NEWEST
+        golioth_lightdb_stream_set_int_async(_client, "offline/o", i, NULL, NULL);
+    }
+    golioth_offline_store_stats_t stats = {};
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_offline_store_get_stats(store, &stats));
+    uint32_t num_stored = stats.num_stored;
+    TEST_ASSERT_TRUE(num_stored > 0);
+    TEST_ASSERT_TRUE(num_stored < num_records);
+    TEST_ASSERT_EQUAL(num_records, num_stored + stats.num_dropped);
+    if (overflow == GOLIOTH_OFFLINE_OVERFLOW_DROP_NEWEST) {
+        TEST_ASSERT_EQUAL(num_stored, stats.num_appended);
+    } else {
+        TEST_ASSERT_EQUAL(num_records, stats.num_appended);
+    }
+
+    TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_client_start(_client));
+    TEST_ASSERT_EQUAL(
+            pdTRUE,
+            xSemaphoreTake(_connected_sem, TEST_RESPONSE_TIMEOUT_S * 1000 / portTICK_PERIOD_MS));
+    uint64_t timeout_ms = golioth_time_millis() + 10 * TEST_RESPONSE_TIMEOUT_S * 1000;
+    while (golioth_time_millis() < timeout_ms) {
+        golioth_offline_store_get_stats(store, &stats);
+        if (stats.num_stored == 0) {
+            break;
+        }
+        golioth_time_delay_ms(100);
+    }
+    TEST_ASSERT_EQUAL(0, stats.num_stored);
+    TEST_ASSERT_EQUAL(num_stored, stats.num_sent);
+
+    golioth_offline_store_destroy(store);
+}
+
+static void test_offline_store_overflow(void) {
+    check_offline_store_overflow(GOLIOTH_OFFLINE_OVERFLOW_DROP_NEWEST);
+    check_offline_store_overflow(GOLIOTH_OFFLINE_OVERFLOW_DROP_OLDEST);
+}
+
 static bool _on_test_timeout_called = false;
 static void on_test_timeout(
         golioth_client_t client,
@@ -278,6 +992,36 @@ static void test_request_timeout_if_packets_dropped(void) {
             xSemaphoreTake(_connected_sem, TEST_RESPONSE_TIMEOUT_S * 1000 / portTICK_PERIOD_MS));
 }
 
+static golioth_status_t ota_sink_unused(
+        size_t offset,
+        const uint8_t* block_buffer,
+        size_t block_buffer_len,
+        bool is_last,
+        void* arg) {
+    return GOLIOTH_ERR_FAIL;
+}
+
+static void test_ota_download_invalid_offset(void) {
+    // Rejected before any block is requested, since the sink would never get
+    // its last block
+    golioth_ota_component_t component = {
+            .package = "main",
+            .version = "1.2.3",
+            .size = 4 * GOLIOTH_OTA_BLOCKSIZE,
+    };
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_ERR_INVALID_FORMAT,
+            golioth_ota_download_component(
+                    _client, &component, component.size, ota_sink_unused, NULL));
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_ERR_INVALID_FORMAT,
+            golioth_ota_download_component(_client, &component, 100, ota_sink_unused, NULL));
+    component.size = 0;
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_ERR_INVALID_FORMAT,
+            golioth_ota_download_component(_client, &component, 0, ota_sink_unused, NULL));
+}
+
 static void test_lightdb_error_if_path_not_found(void) {
     // Issue a sync GET request to an invalid path.
     // Verify a non-success response is received.
@@ -379,6 +1123,120 @@ static void test_lightdb_observation(void) {
     TEST_ASSERT_EQUAL(randint, _test_int3_value);
 }
 
+#define TEST_NUM_OBSERVED_PATHS 12
+static int32_t _observed_values[TEST_NUM_OBSERVED_PATHS];
+static void on_observed_path(
+        golioth_client_t client,
+        const golioth_response_t* response,
+        const char* path,
+        const uint8_t* payload,
+        size_t payload_size,
+        void* arg) {
+    if (golioth_payload_is_null(payload, payload_size)) {
+        return;
+    }
+    _observed_values[(intptr_t)arg] = golioth_payload_as_int(payload, payload_size);
+}
+
+static void test_lightdb_observe_many(void) {
+    // Observe several paths at once, each with its own token
+    char path[16];
+    for (intptr_t i = 0; i < TEST_NUM_OBSERVED_PATHS; i++) {
+        _observed_values[i] = 0;
+        snprintf(path, sizeof(path), "test_obs_%d", (int)i);
+        TEST_ASSERT_EQUAL(
+                GOLIOTH_OK,
+                golioth_lightdb_observe_async(_client, path, on_observed_path, (void*)i));
+    }
+
+    // Set a random number on the last path, only its observer should see it
+    int randint = esp_random();
+    snprintf(path, sizeof(path), "test_obs_%d", TEST_NUM_OBSERVED_PATHS - 1);
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_set_int_sync(_client, path, randint, TEST_RESPONSE_TIMEOUT_S));
+
+    uint64_t timeout_ms = golioth_time_millis() + TEST_RESPONSE_TIMEOUT_S * 1000;
+    while (golioth_time_millis() < timeout_ms) {
+        if (_observed_values[TEST_NUM_OBSERVED_PATHS - 1] == randint) {
+            break;
+        }
+        golioth_time_delay_ms(100);
+    }
+
+    TEST_ASSERT_EQUAL(randint, _observed_values[TEST_NUM_OBSERVED_PATHS - 1]);
+    for (int i = 0; i < TEST_NUM_OBSERVED_PATHS - 1; i++) {
+        TEST_ASSERT_NOT_EQUAL(randint, _observed_values[i]);
+    }
+}
+
+static void test_lightdb_unobserve(void) {
+    // Make sure test_int3 has a value, so observing it gets an initial notification
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_set_int_sync(
+                    _client, "test_int3", esp_random(), TEST_RESPONSE_TIMEOUT_S));
+
+    _on_get_test_int3_called = false;
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK, golioth_lightdb_observe_async(_client, "test_int3", on_test_int3, NULL));
+    uint64_t timeout_ms = golioth_time_millis() + TEST_RESPONSE_TIMEOUT_S * 1000;
+    while (golioth_time_millis() < timeout_ms) {
+        if (_on_get_test_int3_called) {
+            break;
+        }
+        golioth_time_delay_ms(100);
+    }
+    TEST_ASSERT_TRUE(_on_get_test_int3_called);
+
+    // Wait for the server to answer the deregistration before changing the value
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_unobserve_sync(_client, "test_int3", TEST_RESPONSE_TIMEOUT_S));
+
+    // The new value must not be observed
+    _on_get_test_int3_called = false;
+    int randint = esp_random();
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_set_int_sync(_client, "test_int3", randint, TEST_RESPONSE_TIMEOUT_S));
+    golioth_time_delay_ms(TEST_RESPONSE_TIMEOUT_S * 1000);
+    TEST_ASSERT_FALSE(_on_get_test_int3_called);
+}
+
+// Runs after the client has reconnected with the observations of test_lightdb_observe_many
+static void test_observations_restored(void) {
+    golioth_client_connection_stats_t stats = {};
+    uint64_t timeout_ms = golioth_time_millis() + TEST_RESPONSE_TIMEOUT_S * 1000;
+    while (golioth_time_millis() < timeout_ms) {
+        TEST_ASSERT_EQUAL(GOLIOTH_OK, golioth_client_get_connection_stats(_client, &stats));
+        if (stats.num_observations_restored > 0) {
+            break;
+        }
+        golioth_time_delay_ms(100);
+    }
+    TEST_ASSERT_TRUE(stats.num_observations_restored >= TEST_NUM_OBSERVED_PATHS);
+    ESP_LOGI(
+            TAG,
+            "%u observations restored in %u ms",
+            stats.num_observations_restored,
+            stats.last_observe_restore_ms);
+
+    // The re-established observations still deliver notifications
+    int randint = esp_random();
+    TEST_ASSERT_EQUAL(
+            GOLIOTH_OK,
+            golioth_lightdb_set_int_sync(_client, "test_obs_0", randint, TEST_RESPONSE_TIMEOUT_S));
+    timeout_ms = golioth_time_millis() + TEST_RESPONSE_TIMEOUT_S * 1000;
+    while (golioth_time_millis() < timeout_ms) {
+        if (_observed_values[0] == randint) {
+            break;
+        }
+        golioth_time_delay_ms(100);
+    }
+    TEST_ASSERT_EQUAL(randint, _observed_values[0]);
+}
+
 static int built_in_test(int argc, char** argv) {
     UNITY_BEGIN();
     RUN_TEST(test_connects_to_wifi);
@@ -392,11 +1250,29 @@ static int built_in_test(int argc, char** argv) {
         RUN_TEST(test_connects_to_golioth);
     }
     RUN_TEST(test_lightdb_set_get_sync);
+    RUN_TEST(test_lightdb_set_get_cbor_sync);
     RUN_TEST(test_lightdb_set_get_async);
+    RUN_TEST(test_lightdb_set_many_async);
+    RUN_TEST(test_request_lane_stats);
+    RUN_TEST(test_lightdb_set_coalesced_async);
+    RUN_TEST(test_lightdb_stream_batch);
+    RUN_TEST(test_lightdb_stream_non_confirmable);
+    RUN_TEST(test_offline_store);
+    RUN_TEST(test_offline_store_overflow);
+    RUN_TEST(test_lightdb_set_json_reader_sync);
+    RUN_TEST(test_lightdb_set_json_owned_async);
     RUN_TEST(test_lightdb_observation);
+    RUN_TEST(test_lightdb_observe_many);
+    RUN_TEST(test_lightdb_unobserve);
     RUN_TEST(test_golioth_client_heap_usage);
+    RUN_TEST(test_golioth_client_create_heap_usage);
     RUN_TEST(test_request_dropped_if_client_not_running);
+    RUN_TEST(test_connection_stats);
+    RUN_TEST(test_observations_restored);
     RUN_TEST(test_lightdb_error_if_path_not_found);
+    RUN_TEST(test_ota_download_invalid_offset);
+    RUN_TEST(test_ota_delta_apply);
+    RUN_TEST(test_ota_heatshrink_decode);
     RUN_TEST(test_request_timeout_if_packets_dropped);
     RUN_TEST(test_client_task_stack_min_remaining);
     RUN_TEST(test_client_destroy_and_no_memory_leaks);
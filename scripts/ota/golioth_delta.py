@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Golioth, Inc.
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Create and apply binary patches (deltas) for OTA updates, in the format applied
+# by the SDK (see golioth_ota_delta.h). Upload the patch as an artifact with
+# "type": "delta", built against the firmware the devices are running.
+#
+#   golioth_delta.py create old.bin new.bin patch.bin
+#   golioth_delta.py apply old.bin patch.bin new.bin
+#
+# The patch is checked by applying it before it is written. It isn't compressed,
+# and parts of the new image found in the old image are sent as diff bytes, which
+# are mostly zeros, so the patch is about as large as the new image. Compress it
+# with heatshrink (using the window and lookahead sizes from Kconfig), and set
+# "compression": "heatshrink", to get it down to the size of the changes.
+
+import argparse
+import sys
+
+MAGIC = b"GDF1"
+
+# Bytes of the new image that must match the old image to start a diff record
+BLOCK_SIZE = 16
+# Only old image offsets that are a multiple of this are indexed
+INDEX_STRIDE = 4
+# Longest run of old image offsets tried for each block
+MAX_CANDIDATES = 16
+# A gap this short between two matches at the same alignment is covered by the diff
+# of the first one, rather than starting a new record
+MERGE_GAP = 64
+
+
+def varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def zigzag(value):
+    return varint((value << 1) if value >= 0 else ((-value << 1) - 1))
+
+
+def build_index(old):
+    index = {}
+    for offset in range(0, len(old) - BLOCK_SIZE + 1, INDEX_STRIDE):
+        candidates = index.setdefault(old[offset : offset + BLOCK_SIZE], [])
+        if len(candidates) < MAX_CANDIDATES:
+            candidates.append(offset)
+    return index
+
+
+def find_match(old, new, index, pos):
+    """Longest match of new[pos:] in old, as (old_offset, length), or None"""
+    best = None
+    for offset in index.get(new[pos : pos + BLOCK_SIZE], ()):
+        length = BLOCK_SIZE
+        while (
+            offset + length < len(old)
+            and pos + length < len(new)
+            and old[offset + length] == new[pos + length]
+        ):
+            length += 1
+        if not best or length > best[1]:
+            best = (offset, length)
+    return best
+
+
+def find_copies(old, new):
+    """Ranges of the new image diffed against the old image, as
+    (new_offset, old_offset, length), in order. Everything else is extra data."""
+    index = build_index(old)
+    copies = []
+    pos = 0
+    while pos + BLOCK_SIZE <= len(new):
+        match = find_match(old, new, index, pos)
+        if not match:
+            pos += 1
+            continue
+        old_offset, length = match
+
+        prev_end = copies[-1][0] + copies[-1][2] if copies else 0
+        while pos > prev_end and old_offset > 0 and new[pos - 1] == old[old_offset - 1]:
+            pos -= 1
+            old_offset -= 1
+            length += 1
+
+        if (
+            copies
+            and old_offset - pos == copies[-1][1] - copies[-1][0]
+            and pos - prev_end <= MERGE_GAP
+        ):
+            new_start, old_start, _ = copies[-1]
+            copies[-1] = (new_start, old_start, pos + length - new_start)
+        else:
+            copies.append((pos, old_offset, length))
+        pos += length
+    return copies
+
+
+def create_patch(old, new):
+    patch = bytearray(MAGIC)
+    patch += varint(len(new))
+    if not new:
+        return bytes(patch)
+
+    copies = find_copies(old, new)
+    # Records start with a diff at old image offset 0
+    if not copies or copies[0][:2] != (0, 0):
+        copies.insert(0, (0, 0, 0))
+
+    for i, (new_offset, old_offset, length) in enumerate(copies):
+        last = i + 1 == len(copies)
+        diff = bytes((new[new_offset + j] - old[old_offset + j]) & 0xFF for j in range(length))
+        extra_end = len(new) if last else copies[i + 1][0]
+        extra = new[new_offset + length : extra_end]
+        next_old_offset = old_offset + length if last else copies[i + 1][1]
+
+        patch += varint(len(diff)) + diff
+        patch += varint(len(extra)) + extra
+        patch += zigzag(next_old_offset - (old_offset + length))
+    return bytes(patch)
+
+
+class PatchReader:
+    def __init__(self, patch):
+        self.patch = patch
+        self.pos = 0
+
+    def bytes(self, length):
+        if self.pos + length > len(self.patch):
+            raise ValueError("patch ended early")
+        data = self.patch[self.pos : self.pos + length]
+        self.pos += length
+        return data
+
+    def varint(self):
+        value = 0
+        shift = 0
+        while True:
+            byte = self.bytes(1)[0]
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    def zigzag(self):
+        value = self.varint()
+        return (value >> 1) ^ -(value & 1)
+
+
+def apply_patch(old, patch):
+    reader = PatchReader(patch)
+    if reader.bytes(len(MAGIC)) != MAGIC:
+        raise ValueError("invalid patch magic")
+    to_size = reader.varint()
+    new = bytearray()
+    from_offset = 0
+    while len(new) < to_size:
+        diff_len = reader.varint()
+        if from_offset < 0 or from_offset + diff_len > len(old):
+            raise ValueError("diff reads past the old image")
+        diff = reader.bytes(diff_len)
+        new += bytes((old[from_offset + j] + diff[j]) & 0xFF for j in range(diff_len))
+        from_offset += diff_len
+        new += reader.bytes(reader.varint())
+        from_offset += reader.zigzag()
+        if len(new) > to_size:
+            raise ValueError("record overruns new image")
+    if reader.pos != len(patch):
+        raise ValueError("unexpected data after end of patch")
+    return bytes(new)
+
+
+def read_file(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def write_file(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Create or apply OTA binary patches")
+    subparsers = parser.add_subparsers(dest="command", required=True)
+
+    create = subparsers.add_parser("create", help="create a patch from old to new")
+    create.add_argument("old", help="image the devices are running")
+    create.add_argument("new", help="image to update to")
+    create.add_argument("patch", help="patch to write")
+
+    apply_parser = subparsers.add_parser("apply", help="apply a patch to old")
+    apply_parser.add_argument("old", help="image the patch was created against")
+    apply_parser.add_argument("patch", help="patch to apply")
+    apply_parser.add_argument("new", help="image to write")
+
+    args = parser.parse_args()
+    old = read_file(args.old)
+    if args.command == "create":
+        new = read_file(args.new)
+        patch = create_patch(old, new)
+        if apply_patch(old, patch) != new:
+            sys.exit("error: patch does not reproduce the new image")
+        write_file(args.patch, patch)
+        print(f"{args.patch}: {len(patch)} bytes, {len(new)} byte image")
+    else:
+        try:
+            new = apply_patch(old, read_file(args.patch))
+        except ValueError as e:
+            sys.exit(f"error: {e}")
+        write_file(args.new, new)
+
+
+if __name__ == "__main__":
+    main()